@@ -0,0 +1,60 @@
+/*
+ * Simulated LED strip backend
+ *
+ * Implements the led_strip interface without any hardware. Every
+ * refreshed frame is timestamped and can be recorded to a capture
+ * file (see led_strip_sim_capture.h) and/or printed to the console
+ * as ANSI colors. Useful for running the display code without a
+ * physical pyramid, e.g. on the linux target.
+ */
+#pragma once
+
+#include "led_strip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Simulated LED strip backend configuration
+ */
+typedef struct {
+  const char *capture_path; /**<! File to record frames to, NULL to disable */
+  bool ansi_preview;        /**<! Print each frame to stdout as ANSI colors */
+} led_strip_sim_config_t;
+
+/**
+ * @brief Simulated LED strip statistics
+ */
+typedef struct {
+  uint32_t frames;    /**<! Number of refreshes */
+  int64_t refresh_us; /**<! Total time spent in refresh (incl. capture) */
+  int64_t last_us;    /**<! Timestamp of the last refresh */
+} led_strip_sim_stats_t;
+
+/**
+ * @brief Create a simulated LED strip
+ *
+ * @param led_config LED strip configuration (gpio is ignored)
+ * @param sim_config Simulated backend configuration
+ * @param ret_strip Returned LED strip handle
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM otherwise
+ *
+ * @note If the capture file can't be created, a warning is logged and the
+ * strip is still created without recording.
+ */
+esp_err_t led_strip_new_sim_device(const led_strip_config_t *led_config,
+                                   const led_strip_sim_config_t *sim_config,
+                                   led_strip_handle_t *ret_strip);
+
+/**
+ * @brief Get the statistics of a simulated LED strip
+ *
+ * @note Only pass handles created with led_strip_new_sim_device()
+ */
+esp_err_t led_strip_sim_get_stats(led_strip_handle_t strip,
+                                  led_strip_sim_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Frame capture files for the simulated LED strip
+ *
+ * A capture file starts with a header followed by one record per
+ * refreshed frame. All values are little endian.
+ *
+ *   header: "LSC1" | u16 led count | u16 reserved
+ *   record: i64 timestamp (us) | led count * {r, g, b, w}
+ *
+ * This file only uses stdio so it can be built on the host as well.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LED_STRIP_SIM_CAPTURE_MAGIC "LSC1"
+#define LED_STRIP_SIM_CAPTURE_HEADER_LEN 8
+// Bytes per pixel in a capture record (r, g, b, w)
+#define LED_STRIP_SIM_CAPTURE_PIXEL_LEN 4
+
+/**
+ * @brief Open capture file (either for writing or reading)
+ */
+typedef struct {
+  FILE *file;         /**<! Underlying file */
+  uint16_t led_count; /**<! Number of pixels in each record */
+} led_strip_sim_capture_t;
+
+/**
+ * @brief Create a capture file and write its header
+ * @return 0 on success, -1 on failure
+ */
+int led_strip_sim_capture_create(led_strip_sim_capture_t *capture,
+                                 const char *path, uint16_t led_count);
+
+/**
+ * @brief Open an existing capture file and read its header
+ * @return 0 on success, -1 on failure
+ */
+int led_strip_sim_capture_open(led_strip_sim_capture_t *capture,
+                               const char *path);
+
+/**
+ * @brief Append a frame record
+ * @param pixels led_count * 4 bytes (r, g, b, w)
+ * @return 0 on success, -1 on failure
+ */
+int led_strip_sim_capture_write(led_strip_sim_capture_t *capture,
+                                int64_t timestamp_us, const uint8_t *pixels);
+
+/**
+ * @brief Read the next frame record
+ * @return 1 if a frame was read, 0 at end of file, -1 on failure
+ */
+int led_strip_sim_capture_read(led_strip_sim_capture_t *capture,
+                               int64_t *timestamp_us, uint8_t *pixels);
+
+/**
+ * @brief Close a capture file
+ */
+void led_strip_sim_capture_close(led_strip_sim_capture_t *capture);
+
+/**
+ * @brief Print a frame as a row of ANSI true color blocks
+ */
+void led_strip_sim_ansi_preview(FILE *out, int64_t timestamp_us,
+                                const uint8_t *pixels, uint16_t led_count);
+
+#ifdef __cplusplus
+}
+#endif
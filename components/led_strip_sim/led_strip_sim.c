@@ -0,0 +1,142 @@
+/*
+ * Simulated LED strip backend
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_check.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "led_strip_interface.h"
+#include "led_strip_sim.h"
+#include "led_strip_sim_capture.h"
+
+static const char *TAG = "led_strip_sim";
+
+typedef struct {
+  led_strip_t base; // must be first, the handle points here
+  uint32_t led_count;
+  uint8_t num_components;
+  bool ansi_preview;
+  led_strip_sim_capture_t capture;
+  led_strip_sim_stats_t stats;
+  uint8_t pixels[]; // led_count * {r, g, b, w}
+} led_strip_sim_obj;
+
+static esp_err_t led_strip_sim_set_pixel(led_strip_t *strip, uint32_t index,
+                                         uint32_t red, uint32_t green,
+                                         uint32_t blue) {
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  ESP_RETURN_ON_FALSE(index < sim->led_count, ESP_ERR_INVALID_ARG, TAG,
+                      "index out of maximum number of LEDs");
+  uint8_t *p = &sim->pixels[index * LED_STRIP_SIM_CAPTURE_PIXEL_LEN];
+  p[0] = red & 0xFF;
+  p[1] = green & 0xFF;
+  p[2] = blue & 0xFF;
+  p[3] = 0;
+  return ESP_OK;
+}
+
+static esp_err_t led_strip_sim_set_pixel_rgbw(led_strip_t *strip,
+                                              uint32_t index, uint32_t red,
+                                              uint32_t green, uint32_t blue,
+                                              uint32_t white) {
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  ESP_RETURN_ON_FALSE(index < sim->led_count, ESP_ERR_INVALID_ARG, TAG,
+                      "index out of maximum number of LEDs");
+  ESP_RETURN_ON_FALSE(sim->num_components == 4, ESP_ERR_INVALID_ARG, TAG,
+                      "led doesn't have 4 components");
+  uint8_t *p = &sim->pixels[index * LED_STRIP_SIM_CAPTURE_PIXEL_LEN];
+  p[0] = red & 0xFF;
+  p[1] = green & 0xFF;
+  p[2] = blue & 0xFF;
+  p[3] = white & 0xFF;
+  return ESP_OK;
+}
+
+static esp_err_t led_strip_sim_refresh(led_strip_t *strip) {
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  int64_t start = esp_timer_get_time();
+
+  if (sim->capture.file &&
+      led_strip_sim_capture_write(&sim->capture, start, sim->pixels) != 0) {
+    ESP_LOGW(TAG, "Failed to write frame, capture stopped");
+    led_strip_sim_capture_close(&sim->capture);
+  }
+  if (sim->ansi_preview) {
+    led_strip_sim_ansi_preview(stdout, start, sim->pixels, sim->led_count);
+  }
+
+  sim->stats.frames++;
+  sim->stats.last_us = start;
+  sim->stats.refresh_us += esp_timer_get_time() - start;
+  return ESP_OK;
+}
+
+static esp_err_t led_strip_sim_clear(led_strip_t *strip) {
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  memset(sim->pixels, 0, sim->led_count * LED_STRIP_SIM_CAPTURE_PIXEL_LEN);
+  return led_strip_sim_refresh(strip);
+}
+
+static esp_err_t led_strip_sim_del(led_strip_t *strip) {
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  led_strip_sim_capture_close(&sim->capture);
+  free(sim);
+  return ESP_OK;
+}
+
+esp_err_t led_strip_new_sim_device(const led_strip_config_t *led_config,
+                                   const led_strip_sim_config_t *sim_config,
+                                   led_strip_handle_t *ret_strip) {
+  ESP_RETURN_ON_FALSE(led_config && sim_config && ret_strip,
+                      ESP_ERR_INVALID_ARG, TAG, "invalid argument");
+  ESP_RETURN_ON_FALSE(led_config->max_leds > 0 &&
+                          led_config->max_leds <= UINT16_MAX,
+                      ESP_ERR_INVALID_ARG, TAG, "invalid number of LEDs");
+
+  uint8_t num_components =
+      led_config->color_component_format.format.num_components;
+  if (num_components == 0) {
+    // same default as the hardware backends
+    num_components = led_config->led_model == LED_MODEL_SK6812 ? 4 : 3;
+  }
+  ESP_RETURN_ON_FALSE(num_components == 3 || num_components == 4,
+                      ESP_ERR_INVALID_ARG, TAG, "invalid number of components");
+
+  size_t pixels_size = led_config->max_leds * LED_STRIP_SIM_CAPTURE_PIXEL_LEN;
+  led_strip_sim_obj *sim = calloc(1, sizeof(led_strip_sim_obj) + pixels_size);
+  ESP_RETURN_ON_FALSE(sim, ESP_ERR_NO_MEM, TAG, "no mem for sim strip");
+
+  sim->led_count = led_config->max_leds;
+  sim->num_components = num_components;
+  sim->ansi_preview = sim_config->ansi_preview;
+  if (sim_config->capture_path && strlen(sim_config->capture_path) > 0) {
+    if (led_strip_sim_capture_create(&sim->capture, sim_config->capture_path,
+                                     sim->led_count) != 0) {
+      ESP_LOGW(TAG, "Failed to create capture file %s",
+               sim_config->capture_path);
+    } else {
+      ESP_LOGI(TAG, "Recording frames to %s", sim_config->capture_path);
+    }
+  }
+
+  sim->base.set_pixel = led_strip_sim_set_pixel;
+  sim->base.set_pixel_rgbw = led_strip_sim_set_pixel_rgbw;
+  sim->base.refresh = led_strip_sim_refresh;
+  sim->base.clear = led_strip_sim_clear;
+  sim->base.del = led_strip_sim_del;
+
+  *ret_strip = &sim->base;
+  return ESP_OK;
+}
+
+esp_err_t led_strip_sim_get_stats(led_strip_handle_t strip,
+                                  led_strip_sim_stats_t *stats) {
+  ESP_RETURN_ON_FALSE(strip && stats, ESP_ERR_INVALID_ARG, TAG,
+                      "invalid argument");
+  led_strip_sim_obj *sim = (led_strip_sim_obj *)strip;
+  *stats = sim->stats;
+  return ESP_OK;
+}
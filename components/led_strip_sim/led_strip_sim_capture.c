@@ -0,0 +1,115 @@
+/*
+ * Frame capture files for the simulated LED strip
+ */
+#include "led_strip_sim_capture.h"
+#include <string.h>
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+static uint16_t get_le16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+int led_strip_sim_capture_create(led_strip_sim_capture_t *capture,
+                                 const char *path, uint16_t led_count) {
+  if (!capture || !path || led_count == 0) {
+    return -1;
+  }
+  capture->file = fopen(path, "wb");
+  if (!capture->file) {
+    return -1;
+  }
+  capture->led_count = led_count;
+
+  uint8_t header[LED_STRIP_SIM_CAPTURE_HEADER_LEN] = {0};
+  memcpy(header, LED_STRIP_SIM_CAPTURE_MAGIC, 4);
+  put_le16(&header[4], led_count);
+  if (fwrite(header, sizeof(header), 1, capture->file) != 1) {
+    led_strip_sim_capture_close(capture);
+    return -1;
+  }
+  return 0;
+}
+
+int led_strip_sim_capture_open(led_strip_sim_capture_t *capture,
+                               const char *path) {
+  if (!capture || !path) {
+    return -1;
+  }
+  capture->file = fopen(path, "rb");
+  if (!capture->file) {
+    return -1;
+  }
+  uint8_t header[LED_STRIP_SIM_CAPTURE_HEADER_LEN];
+  if (fread(header, sizeof(header), 1, capture->file) != 1 ||
+      memcmp(header, LED_STRIP_SIM_CAPTURE_MAGIC, 4) != 0) {
+    led_strip_sim_capture_close(capture);
+    return -1;
+  }
+  capture->led_count = get_le16(&header[4]);
+  return 0;
+}
+
+int led_strip_sim_capture_write(led_strip_sim_capture_t *capture,
+                                int64_t timestamp_us, const uint8_t *pixels) {
+  if (!capture || !capture->file) {
+    return -1;
+  }
+  uint8_t ts[8];
+  for (int i = 0; i < 8; i++) {
+    ts[i] = ((uint64_t)timestamp_us >> (8 * i)) & 0xFF;
+  }
+  size_t len = (size_t)capture->led_count * LED_STRIP_SIM_CAPTURE_PIXEL_LEN;
+  if (fwrite(ts, sizeof(ts), 1, capture->file) != 1 ||
+      fwrite(pixels, len, 1, capture->file) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+int led_strip_sim_capture_read(led_strip_sim_capture_t *capture,
+                               int64_t *timestamp_us, uint8_t *pixels) {
+  if (!capture || !capture->file) {
+    return -1;
+  }
+  uint8_t ts[8];
+  size_t n = fread(ts, 1, sizeof(ts), capture->file);
+  if (n == 0) {
+    return 0; // end of file
+  }
+  size_t len = (size_t)capture->led_count * LED_STRIP_SIM_CAPTURE_PIXEL_LEN;
+  if (n != sizeof(ts) || fread(pixels, len, 1, capture->file) != 1) {
+    return -1; // truncated record
+  }
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t)ts[i] << (8 * i);
+  }
+  *timestamp_us = (int64_t)v;
+  return 1;
+}
+
+void led_strip_sim_capture_close(led_strip_sim_capture_t *capture) {
+  if (capture && capture->file) {
+    fclose(capture->file);
+    capture->file = NULL;
+  }
+}
+
+void led_strip_sim_ansi_preview(FILE *out, int64_t timestamp_us,
+                                const uint8_t *pixels, uint16_t led_count) {
+  fprintf(out, "%10lld.%03lld ", (long long)(timestamp_us / 1000000),
+          (long long)((timestamp_us / 1000) % 1000));
+  for (int i = 0; i < led_count; i++) {
+    const uint8_t *p = &pixels[i * LED_STRIP_SIM_CAPTURE_PIXEL_LEN];
+    // blend the white channel into the preview so RGBW pixels are visible
+    unsigned r = p[0] + p[3] > 255 ? 255 : p[0] + p[3];
+    unsigned g = p[1] + p[3] > 255 ? 255 : p[1] + p[3];
+    unsigned b = p[2] + p[3] > 255 ? 255 : p[2] + p[3];
+    fprintf(out, "\x1b[48;2;%u;%u;%um  \x1b[0m", r, g, b);
+  }
+  fputc('\n', out);
+}
@@ -0,0 +1,88 @@
+/*
+ * SNTP server
+ *
+ * Answers NTP client requests (RFC 5905, mode 3) from the local clock,
+ * so that clocks on the LAN can sync to this one instead of each of them
+ * querying an internet server. Requests are received into a buffer that
+ * is allocated when the server starts and answered in place, so serving
+ * a request doesn't allocate.
+ *
+ * The stratum, reference ID and root delay/dispersion of the answers are
+ * those of the reference set with sntp_server_set_reference(). Until it
+ * is set, requests are answered with the "unsynchronized" leap indicator
+ * (clients ignore these answers). The root dispersion grows with the
+ * age of the reference, so clients stop using a server that hasn't
+ * synced in a long time.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNTP_SERVER_CONFIG_DEFAULT()                                           \
+  { .port = 123, .task_priority = 5 }
+
+/**
+ * @brief SNTP server configuration
+ */
+typedef struct {
+  uint16_t port;          /**<! UDP port to listen on */
+  unsigned task_priority; /**<! Priority of the server task */
+} sntp_server_config_t;
+
+/**
+ * @brief Reference the local clock is synced to
+ */
+typedef struct {
+  uint8_t stratum; /**<! Stratum of this server (the upstream's + 1) */
+  uint32_t refid;  /**<! IPv4 address of the upstream (network order) */
+  int64_t ref_time_us;        /**<! Time of the last sync (unix, us) */
+  int64_t root_delay_us;      /**<! Round trip to the reference clock */
+  int64_t root_dispersion_us; /**<! Error to the reference at ref_time_us */
+} sntp_server_reference_t;
+
+/**
+ * @brief SNTP server statistics
+ */
+typedef struct {
+  uint32_t requests; /**<! Packets received */
+  uint32_t replies;  /**<! Answers sent */
+  uint32_t ignored;  /**<! Packets that weren't client requests */
+} sntp_server_stats_t;
+
+/**
+ * @brief SNTP server handle
+ */
+typedef struct sntp_server_handle *sntp_server_handle_t;
+
+/**
+ * @brief Start the SNTP server task
+ * @return the server's handle on success, NULL on failure
+ */
+sntp_server_handle_t start_sntp_server(const sntp_server_config_t *config);
+
+/**
+ * @brief Stop the SNTP server task and free the handle
+ */
+void stop_sntp_server(sntp_server_handle_t handle);
+
+/**
+ * @brief Set the reference of the answers, after each sync
+ * @param reference Reference, or NULL to answer as unsynchronized
+ */
+void sntp_server_set_reference(sntp_server_handle_t handle,
+                               const sntp_server_reference_t *reference);
+
+/**
+ * @brief Get the statistics of the server
+ */
+void sntp_server_get_stats(sntp_server_handle_t handle,
+                           sntp_server_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
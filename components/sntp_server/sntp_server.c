@@ -0,0 +1,204 @@
+/*
+ * SNTP server
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "esp_check.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#include "sntp_server.h"
+
+#define NTP_PACKET_LEN 48
+// Requests may carry extension fields and a MAC, which are ignored
+#define RX_BUFFER_LEN 128
+// Seconds from 1900 (NTP era 0) to 1970
+#define NTP_UNIX_OFFSET 2208988800LL
+// log2 of the clock precision in seconds (gettimeofday has 1 us)
+#define PRECISION (-20)
+// Growth of the dispersion with the age of the reference (NTP's PHI)
+#define DISPERSION_PPM 15
+
+#define LEAP_NONE 0
+#define LEAP_ALARM 3 // unsynchronized
+#define MODE_CLIENT 3
+#define MODE_SERVER 4
+
+static const char *TAG = "sntp_server";
+
+struct sntp_server_handle {
+  TaskHandle_t task;
+  int sock;
+  portMUX_TYPE lock; // protects the fields below
+  bool synced;
+  sntp_server_reference_t reference;
+  sntp_server_stats_t stats;
+  uint8_t buffer[RX_BUFFER_LEN]; // request, answered in place
+};
+
+static int64_t local_time_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/* Unix time in us to NTP timestamp (seconds since 1900 and fraction) */
+static void put_timestamp(uint8_t *p, int64_t us) {
+  put_u32(p, (uint32_t)(us / 1000000 + NTP_UNIX_OFFSET));
+  put_u32(p + 4, (uint32_t)(((uint64_t)(us % 1000000) << 32) / 1000000));
+}
+
+/* us to NTP short format (16.16 seconds), saturated */
+static void put_short(uint8_t *p, int64_t us) {
+  uint64_t value = us > 0 ? ((uint64_t)us << 16) / 1000000 : 0;
+  put_u32(p, value > UINT32_MAX ? UINT32_MAX : (uint32_t)value);
+}
+
+/* Turn a client request into the answer, in place. The transmit
+ * timestamp is set just before sending.
+ * Returns the length of the answer, or 0 to ignore the request */
+static int build_reply(sntp_server_handle_t handle, uint8_t *packet, int len,
+                       int64_t receive_us) {
+  uint8_t version = (packet[0] >> 3) & 0x07;
+  uint8_t mode = packet[0] & 0x07;
+  if (len < NTP_PACKET_LEN || mode != MODE_CLIENT || version < 1 ||
+      version > 4) {
+    return 0;
+  }
+
+  bool synced;
+  sntp_server_reference_t reference;
+  portENTER_CRITICAL(&handle->lock);
+  synced = handle->synced;
+  reference = handle->reference;
+  portEXIT_CRITICAL(&handle->lock);
+
+  // the client's transmit timestamp is echoed as the origin
+  memcpy(&packet[24], &packet[40], 8);
+  packet[0] = (synced ? LEAP_NONE : LEAP_ALARM) << 6 | version << 3 |
+              MODE_SERVER;
+  packet[3] = (uint8_t)PRECISION; // packet[2], the poll, is echoed
+  if (synced) {
+    int64_t age_us = receive_us - reference.ref_time_us;
+    packet[1] = reference.stratum;
+    put_short(&packet[4], reference.root_delay_us);
+    put_short(&packet[8], reference.root_dispersion_us +
+                              (age_us > 0 ? age_us : 0) * DISPERSION_PPM /
+                                  1000000);
+    memcpy(&packet[12], &reference.refid, 4);
+    put_timestamp(&packet[16], reference.ref_time_us);
+  } else {
+    packet[1] = 0;
+    memset(&packet[4], 0, 8);
+    memcpy(&packet[12], "INIT", 4);
+    memset(&packet[16], 0, 8);
+  }
+  put_timestamp(&packet[32], receive_us);
+  return NTP_PACKET_LEN;
+}
+
+static void count(sntp_server_handle_t handle, uint32_t *counter) {
+  portENTER_CRITICAL(&handle->lock);
+  (*counter)++;
+  portEXIT_CRITICAL(&handle->lock);
+}
+
+/*
+    Listens for NTP requests and answers them with the local time
+*/
+static void sntp_server_task(void *pvParameters) {
+  sntp_server_handle_t handle = pvParameters;
+
+  for (;;) {
+    struct sockaddr_in source_addr;
+    socklen_t socklen = sizeof(source_addr);
+    int len = recvfrom(handle->sock, handle->buffer, sizeof(handle->buffer),
+                       0, (struct sockaddr *)&source_addr, &socklen);
+    int64_t receive_us = local_time_us();
+    if (len < 0) {
+      ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
+      vTaskDelay(pdMS_TO_TICKS(1000));
+      continue;
+    }
+    count(handle, &handle->stats.requests);
+
+    int reply_len = build_reply(handle, handle->buffer, len, receive_us);
+    if (reply_len == 0) {
+      count(handle, &handle->stats.ignored);
+      continue;
+    }
+    put_timestamp(&handle->buffer[40], local_time_us());
+    if (sendto(handle->sock, handle->buffer, reply_len, 0,
+               (struct sockaddr *)&source_addr, socklen) == reply_len) {
+      count(handle, &handle->stats.replies);
+    }
+  }
+}
+
+sntp_server_handle_t start_sntp_server(const sntp_server_config_t *config) {
+  sntp_server_handle_t handle = calloc(1, sizeof(struct sntp_server_handle));
+  ESP_RETURN_ON_FALSE(handle, NULL, TAG, "no mem for sntp server");
+  portMUX_INITIALIZE(&handle->lock);
+
+  handle->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (handle->sock < 0) {
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+    free(handle);
+    return NULL;
+  }
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(config->port),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(handle->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+    close(handle->sock);
+    free(handle);
+    return NULL;
+  }
+  if (xTaskCreate(sntp_server_task, "sntp_server", 3072, handle,
+                  config->task_priority, &handle->task) != pdPASS) {
+    close(handle->sock);
+    free(handle);
+    return NULL;
+  }
+  ESP_LOGI(TAG, "Serving time on port %u", config->port);
+  return handle;
+}
+
+void stop_sntp_server(sntp_server_handle_t handle) {
+  if (handle) {
+    vTaskDelete(handle->task);
+    close(handle->sock);
+    free(handle);
+  }
+}
+
+void sntp_server_set_reference(sntp_server_handle_t handle,
+                               const sntp_server_reference_t *reference) {
+  portENTER_CRITICAL(&handle->lock);
+  handle->synced = reference != NULL;
+  if (reference) {
+    handle->reference = *reference;
+  }
+  portEXIT_CRITICAL(&handle->lock);
+}
+
+void sntp_server_get_stats(sntp_server_handle_t handle,
+                           sntp_server_stats_t *stats) {
+  portENTER_CRITICAL(&handle->lock);
+  *stats = handle->stats;
+  portEXIT_CRITICAL(&handle->lock);
+}
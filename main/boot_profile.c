@@ -0,0 +1,136 @@
+/*
+ * Boot profile
+ */
+#include "boot_profile.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+
+#define HISTORY_MAGIC 0x42505231 // "BPR1"
+
+static const char *TAG = "boot_profile";
+
+#define BOOT_PHASE_NAME(id, name) name,
+static const char *const phase_names[] = {BOOT_PHASES(BOOT_PHASE_NAME)};
+#define BOOT_MILESTONE_NAME(id, name, desc) name,
+static const char *const milestone_names[] = {
+    BOOT_MILESTONES(BOOT_MILESTONE_NAME)};
+#define BOOT_MILESTONE_DESC(id, name, desc) desc,
+static const char *const milestone_descs[] = {
+    BOOT_MILESTONES(BOOT_MILESTONE_DESC)};
+
+// esp_timer times in us, 0 until recorded
+static int64_t s_phase_start[BOOT_PHASE_COUNT];
+static int64_t s_phase_end[BOOT_PHASE_COUNT];
+static int64_t s_milestones[BOOT_MILESTONE_COUNT];
+static bool s_warm;
+
+/* Time to the first frame of the previous boots, in RTC memory */
+typedef struct {
+  uint32_t magic;
+  int64_t cold_first_frame_us; // 0 if unknown
+  int64_t warm_first_frame_us;
+} history_t;
+static RTC_NOINIT_ATTR history_t s_history;
+
+void boot_profile_init(void) {
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT ||
+      s_history.magic != HISTORY_MAGIC) {
+    // RTC memory was lost
+    memset(&s_history, 0, sizeof(s_history));
+    s_history.magic = HISTORY_MAGIC;
+  }
+}
+
+void boot_profile_begin(boot_phase_t phase) {
+  s_phase_start[phase] = esp_timer_get_time();
+}
+
+void boot_profile_end(boot_phase_t phase) {
+  s_phase_end[phase] = esp_timer_get_time();
+}
+
+void boot_profile_set_warm(bool warm) { s_warm = warm; }
+
+bool boot_profile_milestone(boot_milestone_t milestone) {
+  if (s_milestones[milestone] != 0) {
+    return false;
+  }
+  int64_t now_us = esp_timer_get_time();
+  s_milestones[milestone] = now_us;
+  if (milestone == BOOT_MILESTONE_FIRST_FRAME) {
+    if (s_warm) {
+      s_history.warm_first_frame_us = now_us;
+    } else {
+      s_history.cold_first_frame_us = now_us;
+    }
+  }
+  ESP_LOGI(TAG, "Time to %s: %lld ms", milestone_descs[milestone],
+           (long long)(now_us / 1000));
+  return true;
+}
+
+void boot_profile_log(void) {
+  ESP_LOGI(TAG, "%s boot, reset reason %d", s_warm ? "Warm" : "Cold",
+           esp_reset_reason());
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    if (s_phase_start[i] != 0) {
+      ESP_LOGI(TAG, "  %-14s %7lld ms  %7lld ms", phase_names[i],
+               (long long)(s_phase_start[i] / 1000),
+               s_phase_end[i]
+                   ? (long long)((s_phase_end[i] - s_phase_start[i]) / 1000)
+                   : -1LL);
+    }
+  }
+  for (int i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+    if (s_milestones[i] != 0) {
+      ESP_LOGI(TAG, "  %-14s %7lld ms", milestone_names[i],
+               (long long)(s_milestones[i] / 1000));
+    }
+  }
+}
+
+int boot_profile_to_json(char *buf, size_t size) {
+  int len = snprintf(buf, size,
+                     "{\"boot\":\"%s\",\"reset_reason\":%d,"
+                     "\"last_cold_first_frame_us\":%lld,"
+                     "\"last_warm_first_frame_us\":%lld,\"phases\":{",
+                     s_warm ? "warm" : "cold", esp_reset_reason(),
+                     (long long)s_history.cold_first_frame_us,
+                     (long long)s_history.warm_first_frame_us);
+  bool first = true;
+  for (int i = 0; i < BOOT_PHASE_COUNT && len >= 0 && (size_t)len < size; i++) {
+    if (s_phase_start[i] == 0) {
+      continue; // not run in this boot
+    }
+    // -1 if it didn't end yet
+    int64_t duration_us =
+        s_phase_end[i] ? s_phase_end[i] - s_phase_start[i] : -1;
+    len += snprintf(buf + len, size - len,
+                    "%s\"%s\":{\"start_us\":%lld,\"us\":%lld}",
+                    first ? "" : ",", phase_names[i],
+                    (long long)s_phase_start[i], (long long)duration_us);
+    first = false;
+  }
+  if (len >= 0 && (size_t)len < size) {
+    len += snprintf(buf + len, size - len, "},\"milestones\":{");
+  }
+  for (int i = 0;
+       i < BOOT_MILESTONE_COUNT && len >= 0 && (size_t)len < size; i++) {
+    // 0 if not reached yet
+    len += snprintf(buf + len, size - len, "%s\"%s_us\":%lld",
+                    i == 0 ? "" : ",", milestone_names[i],
+                    (long long)s_milestones[i]);
+  }
+  if (len >= 0 && (size_t)len < size) {
+    len += snprintf(buf + len, size - len, "}}");
+  }
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+  return len;
+}
@@ -0,0 +1,79 @@
+/*
+ * Boot profile
+ *
+ * Timestamps of the phases of the boot (app_main and the tasks it
+ * starts) and of its milestones (first frame shown, first NTP sync,
+ * first HTTP response), in esp_timer time, so from the start of the app
+ * (the ROM and second stage bootloaders aren't counted). Some phases run
+ * at the same time in different tasks, so a milestone can come sooner
+ * than the sum of the phases before it.
+ *
+ * The time to the first frame of the last cold boot and of the last warm
+ * boot (time restored from the checkpoint, see time_checkpoint.h) are
+ * kept in RTC memory, so both can be read after a warm boot.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Phases as P(id, name), in the order they start */
+#define BOOT_PHASES(P)                                                         \
+  P(LED, "led")                   /* LED strip driver */                       \
+  P(NVS, "nvs")                   /* NVS flash init */                         \
+  P(NETIF, "netif")               /* netif and default event loop */           \
+  P(WIFI_INIT, "wifi_init")       /* Wi-Fi driver init, in its own task */     \
+  P(CONFIG, "config")             /* preset library and config load */         \
+  P(CHECKPOINT, "checkpoint")     /* time restored from the checkpoint */      \
+  P(WIFI_CONNECT, "wifi_connect") /* Wi-Fi start to IP address */              \
+  P(TZ_INDEX, "tz_index")         /* time zone list index */                   \
+  P(WEBSERVER, "webserver")       /* HTTP server start */                      \
+  P(SNTP, "sntp")                 /* SNTP and NTP probes start */              \
+  P(TOUCH, "touch")               /* touch input start */
+
+/* Milestones as M(id, name, description) */
+#define BOOT_MILESTONES(M)                                                     \
+  M(FIRST_FRAME, "first_frame", "first frame")                                 \
+  M(FIRST_SYNC, "first_sync", "first sync")                                    \
+  M(FIRST_RESPONSE, "first_response", "first HTTP response")
+
+#define BOOT_PHASE_ID(id, name) BOOT_PHASE_##id,
+typedef enum { BOOT_PHASES(BOOT_PHASE_ID) BOOT_PHASE_COUNT } boot_phase_t;
+
+#define BOOT_MILESTONE_ID(id, name, desc) BOOT_MILESTONE_##id,
+typedef enum {
+  BOOT_MILESTONES(BOOT_MILESTONE_ID) BOOT_MILESTONE_COUNT
+} boot_milestone_t;
+
+/* Load the first frame times of the previous boots from RTC memory, call
+ * first in app_main */
+void boot_profile_init(void);
+
+/* Record the start or the end of a phase (each phase is recorded by a
+ * single task) */
+void boot_profile_begin(boot_phase_t phase);
+void boot_profile_end(boot_phase_t phase);
+
+/* Set whether this is a warm boot (the time was restored), call before
+ * the first frame */
+void boot_profile_set_warm(bool warm);
+
+/* Record a milestone and log the time to it, the first time only.
+ * Returns true that first time */
+bool boot_profile_milestone(boot_milestone_t milestone);
+
+/* Log the profile (each phase and milestone) */
+void boot_profile_log(void);
+
+/* Serialize the profile as a JSON object into buf. Returns the length
+ * written, or -1 if it doesn't fit */
+int boot_profile_to_json(char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,38 +10,64 @@
  * multiple presets and a clock password to prevent
  * unauthorized access.
  *
- * This code also implements a wifi station and fallback
+ * This code also implements a wifi station and a setup
  * AP mode with captive portal to configure the wifi
- * station login credentials. If the device is unable to
- *
- * connect to wifi after multiple tries, it will fall back
- * to AP mode and flash the leds to indicate this mode.
+ * station login credentials. A failed or lost connection
+ * is retried in the background with a growing delay
+ * while the clock keeps running. It only switches to AP
+ * mode (and flashes the leds to indicate this mode) when
+ * it has no credentials, when the AP rejects credentials
+ * that never connected, or with a long press while not
+ * connected.
  *
  * It also implements use of the ESP ADC for touch input.
  * When the user touches the clock (some metal part connected
  * to the configured GPIO), the clock will display the last
  * quad of its IP address allowing the user to identify the
  * device IP to access the web interface.
+ * It goes back to the time after 20 s; tap
+ * again to go back sooner, or hold the touch to show the
+ * full address for another 20 s.
  *
  * This codes has been tested on the ESP32-C3, but should
  * work on other ESP32 variants as well.
  * Last build on ESP-IDF 6.1
  */
+#include "boot_profile.h"
+#include "clock_discipline.h"
+#include "config_schema.h"
+#include "config_store.h"
+#include "display.h"
 #include "dns_server.h"
-#include "esp_adc/adc_continuous.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
 #include "esp_http_server.h"
+#include "esp_random.h"
 #include "esp_netif_sntp.h"
 #include "esp_sntp.h"
+#include "esp_timer.h"
+#include "fleet_sync.h"
 #include "freertos/semphr.h"
+#include "latency_hist.h"
 #include "led_strip.h"
+#include "led_strip_sim.h"
 #include "lwip/err.h"
 #include "lwip/inet.h"
 #include "lwip/ip_addr.h"
 #include "lwip/netdb.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
+#include "ntp_probe.h"
 #include "nvs_flash.h"
+#include "preset_schedule.h"
+#include "preset_store.h"
 #include "sdkconfig.h"
+#include "sntp_server.h"
+#include "time_checkpoint.h"
+#include "touch_input.h"
+#include "tz_cache.h"
+#include "tz_index.h"
+#include "wifi_link.h"
 #include <ctype.h>
 #include <esp_event.h>
 #include <esp_log.h>
@@ -52,6 +78,7 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/FreeRTOSConfig.h>
 #include <freertos/event_groups.h>
+#include <freertos/queue.h>
 #include <freertos/task.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -59,25 +86,26 @@
 #include <sys/time.h>
 #include <time.h>
 
-// GPIO assignment for touch input
-#define TOUCH_ADC_CHANNEL 4
-// GPIO assignment for touch input comparator
-#define TOUCH_COMP_CHANNEL 3
 // GPIO assignment for LED strip
 #define LED_STRIP_GPIO_PIN 2
-// Numbers of the LED in the strip
-#define LED_STRIP_LED_COUNT 11
+// Numbers of the LED in the strip (depends on the layout in menuconfig)
+#define LED_STRIP_LED_COUNT DISPLAY_PIXEL_COUNT
+// LED strip type (selected in menuconfig)
+// options: LED_MODEL_WS2812, LED_MODEL_SK6812
+#if DISPLAY_RGBW
+#define LED_STRIP_MODEL LED_MODEL_SK6812
+#else
+#define LED_STRIP_MODEL LED_MODEL_WS2812
+#endif
 // Timeout for identify mode
 #define IDENTIFY_TIMEOUT 20000
-// Touch delta threshold
-// (difference between touch and non-touch readings)
-#define TOUCH_DELTA_THRESHOLD 320
-// Touch jitter threshold
-// (difference between consecutive readings while touching)
-#define TOUCH_JITTER_THRESHOLD 150
-// Touch count threshold
-// (number of readings while touching to trigger identify mode)
-#define TOUCH_COUNT_THRESHOLD 3
+// Time each quad of the full IP address is shown for in identify mode
+#define IDENTIFY_QUAD_MS 1500
+// Time the boot waits for the AP before starting the clock without it
+// (it keeps reconnecting in the background)
+#define WIFI_BOOT_WAIT_MS 10000
+// Brightness of the dim mode (scale / 256 of the preset colors)
+#define DIM_SCALE 48
 
 /* WiFi configuration that you can set via project configuration menu.
 
@@ -117,9 +145,12 @@
 /* The event group allows multiple bits for each event, but we only care about
  * two events:
  * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
+ * - the setup mode must open: the AP rejected credentials that never
+ *   connected, or the user asked for it (see identify_gesture_cb) */
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
+#define WIFI_SETUP_BIT BIT1
+// The Wi-Fi driver is initialized (see wifi_init_task)
+#define WIFI_DRIVER_READY_BIT BIT2
 
 /*DHCP server option*/
 #define DHCPS_OFFER_DNS 0x02
@@ -128,10 +159,6 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
-/* csv tools modes */
-#define CSV_TOOL_MODE_OPTIONS 0
-#define CSV_TOOL_MODE_GET_CODE 1
-
 /* The following Google APIs are included here for
  * reference only. They are not used as of yet, and
  * they are not required for the clock to function.
@@ -185,29 +212,33 @@ location=39.6034810%2C-119.6822510&timestamp=1733428634
 }
 */
 
-/* ADC defines for touch detection */
-#define EXAMPLE_ADC_UNIT ADC_UNIT_1
-#define _EXAMPLE_ADC_UNIT_STR(unit) #unit
-#define EXAMPLE_ADC_UNIT_STR(unit) _EXAMPLE_ADC_UNIT_STR(unit)
-#define EXAMPLE_ADC_CONV_MODE ADC_CONV_SINGLE_UNIT_1
-#define EXAMPLE_ADC_ATTEN ADC_ATTEN_DB_0
-#define EXAMPLE_ADC_BIT_WIDTH SOC_ADC_DIGI_MAX_BITWIDTH
-#define EXAMPLE_ADC_OUTPUT_TYPE ADC_DIGI_OUTPUT_FORMAT_TYPE2
-#define EXAMPLE_ADC_GET_CHANNEL(p_data) ((p_data)->type2.channel)
-#define EXAMPLE_ADC_GET_DATA(p_data) ((p_data)->type2.data)
-#define EXAMPLE_READ_LEN 256
-
 /* Root page form fields validation status */
 #define FORM_VAL_STATUS_OK 0
 #define FORM_VAL_STATUS_RESTART 1
 #define FORM_VAL_STATUS_ERROR -1
 #define FORM_VAL_STATUS_AUTH_INVALID -2
 #define FORM_VAL_STATUS_FIELD_INVALID -3
+#define FORM_VAL_STATUS_BUSY -4
+
+// Config changes waiting for the config writer task
+#define CONFIG_QUEUE_LEN 4
+// Longest an HTTP POST waits for room in the queue before answering 503
+#define CONFIG_POST_WAIT_MS 200
+// Time for the response to go out before a restart by the writer (ms)
+#define CONFIG_RESTART_DELAY_MS 1000
 
 /* Timezone data fields from csv file */
 #define MAX_TIMEZONE_LEN 32
 #define MAX_TIMECODE_LEN 64
-#define MAX_TIMEZONES 461
+// Default and maximum number of zones returned by /api/tz
+#define TZ_API_DEFAULT_LIMIT 20
+#define TZ_API_MAX_LIMIT 50
+// Presets per page of /api/presets
+#define PRESET_API_DEFAULT_LIMIT 10
+#define PRESET_API_MAX_LIMIT 20
+// Default and maximum length of a touch capture (s)
+#define TOUCH_CAPTURE_DEFAULT_S 60
+#define TOUCH_CAPTURE_MAX_S 600
 
 /* HTML templates (copied from source files to flash) */
 
@@ -232,44 +263,8 @@ extern const char response_template_end[] asm("_binary_response_html_end");
 extern const char timezone_data_start[] asm("_binary_timezones_csv_start");
 extern const char timezone_data_end[] asm("_binary_timezones_csv_end");
 
-// timezone data
-struct TzData {
-  char timezone[MAX_TIMEZONE_LEN];
-  char code[MAX_TIMECODE_LEN];
-};
-
-/* Data structures */
-
-typedef struct {
-  uint8_t r;
-  uint8_t g;
-  uint8_t b;
-  uint8_t w;
-} color_t; // 4 bytes
-
-typedef struct {
-  char name[16];
-  color_t am_color;
-  color_t pm_color;
-  color_t hr0_color;
-  color_t hr1_color;
-  color_t min0_color;
-  color_t min1_color;
-} preset_t; // 46 bytes
-
-typedef struct {
-  char ntp_server_1[32];
-  char ntp_server_2[32];
-  char time_zone[32];
-  char time_zone_code[64];
-  char wifi_ssid[32];
-  char wifi_password[32];
-  char clock_password[32];
-  uint8_t active_preset; // 1, 2 or 3
-  preset_t preset_1;
-  preset_t preset_2;
-  preset_t preset_3;
-} config_t; // 268 bytes
+/* Data structures (config_t is in config_schema.h, color_t and preset_t
+ * in display.h) */
 
 /* HTTPd route types */
 typedef enum {
@@ -277,7 +272,19 @@ typedef enum {
   ROUTE_SETUP_ROOT,
   ROUTE_CONFIG,
   ROUTE_WIFI,
-  ROUTE_CSS
+  ROUTE_CSS,
+  ROUTE_DEBUG_DISPLAY,
+  ROUTE_DEBUG_TIME,
+  ROUTE_DEBUG_NTP,
+  ROUTE_DEBUG_TOUCH,
+  ROUTE_DEBUG_TOUCH_CAPTURE,
+  ROUTE_DEBUG_CONFIG,
+  ROUTE_DEBUG_BOOT,
+  ROUTE_DEBUG_WIFI,
+  ROUTE_API_TZ,
+  ROUTE_API_CONFIG,
+  ROUTE_API_PRESETS,
+  ROUTE_API_PRESETS_POST
 } route_t;
 
 /* App modes for app state and app event group */
@@ -288,26 +295,56 @@ typedef enum {
   APP_MODE_SETUP = 0b00001000
 } app_mode_t;
 
+/* Other bits of the app event group */
+#define APP_TIME_SYNCED_BIT BIT4    // system time has been set by SNTP
+#define APP_ANIMATION_DONE_BIT BIT5 // startup animation has stopped
+#define APP_TIME_PROVISIONAL_BIT BIT6 // time restored after a warm boot
+
 /* Tags */
 static const char *TAG = "pyramid_clock";
 static const char *TAG_AP = "wifi_ap";
 static const char *TAG_STA = "wifi_sta";
 
-/* Rety counter for wifi connection */
-static int s_retry_num = 0;
-
-// LED strip type
-// options: LED_MODEL_WS2812, LED_MODEL_SK6812
-int led_type = LED_MODEL_SK6812;
+// Connection to the AP, with the AP and lease of the last one (see
+// wifi_link.h), which is also kept in RTC memory to skip the NVS read
+// after a restart
+#define WIFI_CACHE_NVS_KEY "wifi_cache"
+static wifi_link_t s_wifi_link;
+static RTC_NOINIT_ATTR wifi_link_cache_t s_wifi_cache;
+static portMUX_TYPE s_wifi_lock = portMUX_INITIALIZER_UNLOCKED;
+// Makes the next connection attempt after the backoff delay
+static esp_timer_handle_t s_reconnect_timer;
+_Static_assert(WIFI_LINK_REASON_4WAY_HANDSHAKE_TIMEOUT ==
+                       WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT &&
+                   WIFI_LINK_REASON_AUTH_FAIL == WIFI_REASON_AUTH_FAIL &&
+                   WIFI_LINK_REASON_HANDSHAKE_TIMEOUT ==
+                       WIFI_REASON_HANDSHAKE_TIMEOUT,
+               "wifi_link.h reasons must be the driver's");
 
 // LED strip handle
 led_strip_handle_t *led_strip;
 
-// NVS handle
-nvs_handle_t storage_handle;
-
-// App configuration (stored in NVS)
+// App configuration (stored in NVS, see config_store.h), only changed by
+// config_writer_task and read under s_config_lock by the other tasks
 config_t *app_config;
+static portMUX_TYPE s_config_lock = portMUX_INITIALIZER_UNLOCKED;
+// Changes of the config for the writer (config_update_t pointers)
+static QueueHandle_t s_config_queue;
+// Palette of the active preset (the only one kept in RAM), set by the
+// config writer under s_config_lock
+static display_palette_t s_palette;
+// Fires on the next switch of the preset schedule, armed by the config
+// writer (see schedule_arm)
+static esp_timer_handle_t s_schedule_timer;
+// Time and preset of the next switch (0 if none), read under
+// s_config_lock
+static time_t s_schedule_at;
+static uint8_t s_schedule_preset;
+// UTC offsets for the schedule, and whether the preset in effect was
+// activated after boot (both used by the config writer only)
+static tz_cache_t s_schedule_tz = TZ_CACHE_INIT;
+static bool s_schedule_caught_up;
+static void schedule_time_set(void);
 
 // App mode
 app_mode_t app_mode = APP_MODE_STARTUP;
@@ -315,10 +352,26 @@ app_mode_t app_mode = APP_MODE_STARTUP;
 // Device IP address
 esp_ip4_addr_t device_ip;
 
-// ADC channels and task handle
-// Using GPIO 2; if more touch inputs are needed, add to this array
-static adc_channel_t channel[2] = {TOUCH_ADC_CHANNEL, TOUCH_COMP_CHANNEL};
-static TaskHandle_t s_task_handle;
+// Ends the identify mode, restarted when it is extended
+static esp_timer_handle_t s_identify_timer;
+// Identify mode shows the full IP address (from s_identify_full_us)
+static volatile bool s_identify_full;
+static int64_t s_identify_full_us;
+// Dim mode, switched by long presses (not saved)
+static volatile bool s_dim;
+// For the switches between the normal and identify modes
+static portMUX_TYPE s_identify_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Display task handle (notified when the display needs to be refreshed)
+static TaskHandle_t s_display_task_handle;
+
+// Web server of the clock (started while connecting to the AP)
+static httpd_handle_t s_clock_server;
+
+#if CONFIG_ELEVEN_BIT_CLOCK_SNTP_SERVER
+// Serves the synced time to the LAN
+static sntp_server_handle_t s_sntp_server;
+#endif
 
 /* FreeRTOS event groups */
 static EventGroupHandle_t s_wifi_event_group;
@@ -344,119 +397,6 @@ void print_mem_stats() {
   ESP_LOGI(TAG, "-----------------------------------");
 }
 
-/**
- * The input format is expected to be pairs of values, with each value in double
- * quotes, separated by a comma. Each pair is separated by a newline ('\n') or
- * carriage return ('\r'). Example:
- * "\"value1a\",\"value1b\"\n\"value2a\",\"value2b\"\r\n"
- */
-int csv_tool(const int mode, const char *match_str, const char *input,
-             char *output, const int max_pairs, const int output_size) {
-  if (!input || !output) {
-    return -1;
-  }
-  const char *p = input;
-  int pair_count = 0;
-  char option_str[100] = "";
-  bool found = false;
-
-  while (*p != '\0' && pair_count < max_pairs) {
-    // --- Skip leading whitespace and newlines ---
-    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
-      if (*p == '\0')
-        break;
-      p++;
-    }
-    if (*p == '\0')
-      break;
-
-    // --- Parse first value (timezone) ---
-    if (*p != '"')
-      goto line_error; // Expect opening quote
-    p++;               // Move past quote
-    const char *value_start = p;
-    while (*p != '"' && *p != '\0') {
-      p++;
-    }
-    if (*p != '"')
-      goto line_error; // Expect closing quote
-
-    size_t len = p - value_start;
-    if (len >= MAX_TIMEZONE_LEN) {
-      ESP_LOGI(TAG, "Error: timezone value exceeds buffer size on pair %d.\n",
-               pair_count);
-      len = MAX_TIMEZONE_LEN - 1; // Truncate
-    }
-
-    // process first value: if in mode 0, then append an option tag
-    if (mode == CSV_TOOL_MODE_OPTIONS) {
-      if (memcmp(match_str, value_start, len) == 0) {
-        sprintf(option_str, "<option selected>%.*s</option>\n", len,
-                value_start);
-        ESP_LOGI(TAG, "%.*s", len, value_start);
-      } else {
-        sprintf(option_str, "<option>%.*s</option>\n", len, value_start);
-      }
-      strcat(output, option_str);
-    }
-    if (memcmp(match_str, value_start, len) == 0) {
-      found = true;
-    }
-
-    p++; // Move past quote
-
-    // --- Find comma ---
-    while (*p == ' ' || *p == '\t')
-      p++; // Skip space before comma
-    if (*p != ',')
-      goto line_error;
-    p++; // Move past comma
-    while (*p == ' ' || *p == '\t')
-      p++; // Skip space after comma
-
-    // --- Parse second value (code) ---
-    if (*p != '"')
-      goto line_error; // Expect opening quote
-    p++;               // Move past quote
-    value_start = p;
-    while (*p != '"' && *p != '\0') {
-      p++;
-    }
-    if (*p != '"')
-      goto line_error; // Expect closing quote
-
-    len = p - value_start;
-    if (len >= MAX_TIMECODE_LEN) {
-      ESP_LOGI(TAG, "Error: code value exceeds buffer size on pair %d.\n",
-               pair_count);
-      len = MAX_TIMECODE_LEN - 1; // Truncate
-    }
-
-    // process second value: if in mode 1 and a match is found, then set the
-    // time code as the output
-    if (found && mode == CSV_TOOL_MODE_GET_CODE) {
-      memcpy(output, value_start, len);
-      ESP_LOGI(TAG, "%.*s", len, value_start);
-      return 1;
-    }
-    p++; // Move past quote
-
-    pair_count++;
-
-  // --- Consume rest of the line ---
-  line_error:
-    while (*p != '\n' && *p != '\r' && *p != '\0') {
-      p++;
-    }
-  }
-  // return pair count unless in mode 1 where return 0 indicates not found
-  if (mode == CSV_TOOL_MODE_OPTIONS) {
-    return pair_count;
-  } else {
-    return 0;
-  }
-}
-
 // Function to replace substrings in a string (used for html templates)
 // You can limit the use of memory by setting low maxChunkSize
 void replace_in_chunks(char *orig, size_t origMaxSize,
@@ -598,26 +538,6 @@ void url_decode(char *dst, const char *src) {
   *dst = '\0';
 }
 
-color_t hex_to_color(const char *hex) {
-  color_t color = {0, 0, 0, 0}; // Initialize with default values
-
-  if (hex[0] == '#') {
-    hex++; // Skip the '#' character
-  }
-
-  if (strlen(hex) == 6) {
-    char r_str[3] = {hex[0], hex[1], '\0'};
-    char g_str[3] = {hex[2], hex[3], '\0'};
-    char b_str[3] = {hex[4], hex[5], '\0'};
-
-    color.r = (unsigned char)strtol(r_str, NULL, 16);
-    color.g = (unsigned char)strtol(g_str, NULL, 16);
-    color.b = (unsigned char)strtol(b_str, NULL, 16);
-  }
-
-  return color;
-}
-
 /* Function to extract 's' and 'p' parameters from a URL-encoded string */
 void extract_wifi_params(const char *query, char *s_value, char *p_value,
                          size_t size) {
@@ -719,151 +639,20 @@ int set_config_from_params(const char *query, config_t *config) {
             return FORM_VAL_STATUS_FIELD_INVALID;
           }
         }
-        // ntp server 1
-      } else if (strcmp(key, "ntp_server_1") == 0) {
-        strncpy(config->ntp_server_1, decoded_value,
-                sizeof(config->ntp_server_1) - 1);
-        // ntp server 2
-      } else if (strcmp(key, "ntp_server_2") == 0) {
-        strncpy(config->ntp_server_2, decoded_value,
-                sizeof(config->ntp_server_2) - 1);
-        // time zone
-      } else if (strcmp(key, "time_zone") == 0) {
-        strncpy(config->time_zone, decoded_value,
-                sizeof(config->time_zone) - 1);
-        // time zone code
-      } else if (strcmp(key, "time_zone_code") == 0) {
-        strncpy(config->time_zone_code, decoded_value,
-                sizeof(config->time_zone_code) - 1);
-        // active preset
-      } else if (strcmp(key, "active_preset") == 0) {
-        config->active_preset = atoi(decoded_value);
-        // preset 1 name
-      } else if (strcmp(key, "p1_name") == 0) {
-        strncpy(config->preset_1.name, decoded_value,
-                sizeof(config->preset_1.name) - 1);
-        // preset 1 AM color
-      } else if (strcmp(key, "p1_am_color") == 0) {
-        config->preset_1.am_color = hex_to_color(decoded_value);
-        // preset 1 AM white
-      } else if (strcmp(key, "p1_am_white") == 0) {
-        config->preset_1.am_color.w = atoi(decoded_value);
-        // preset 1 PM color
-      } else if (strcmp(key, "p1_pm_color") == 0) {
-        config->preset_1.pm_color = hex_to_color(decoded_value);
-        // preset 1 PM white
-      } else if (strcmp(key, "p1_pm_white") == 0) {
-        config->preset_1.pm_color.w = atoi(decoded_value);
-        // preset 1 hour color 0
-      } else if (strcmp(key, "p1_hr0_color") == 0) {
-        config->preset_1.hr0_color = hex_to_color(decoded_value);
-        // preset 1 hour color 0 white
-      } else if (strcmp(key, "p1_hr0_white") == 0) {
-        config->preset_1.hr0_color.w = atoi(decoded_value);
-        // preset 1 hour color 1
-      } else if (strcmp(key, "p1_hr1_color") == 0) {
-        config->preset_1.hr1_color = hex_to_color(decoded_value);
-        // preset 1 hour color 1 white
-      } else if (strcmp(key, "p1_hr1_white") == 0) {
-        config->preset_1.hr1_color.w = atoi(decoded_value);
-        // preset 1 min color 0
-      } else if (strcmp(key, "p1_min0_color") == 0) {
-        config->preset_1.min0_color = hex_to_color(decoded_value);
-        // preset 1 min color 0 white
-      } else if (strcmp(key, "p1_min0_white") == 0) {
-        config->preset_1.min0_color.w = atoi(decoded_value);
-        // preset 1 min color 1
-      } else if (strcmp(key, "p1_min1_color") == 0) {
-        config->preset_1.min1_color = hex_to_color(decoded_value);
-        // preset 1 min color 1 white
-      } else if (strcmp(key, "p1_min1_white") == 0) {
-        config->preset_1.min1_color.w = atoi(decoded_value);
-        // preset 2 name
-      } else if (strcmp(key, "p2_name") == 0) {
-        strncpy(config->preset_2.name, decoded_value,
-                sizeof(config->preset_2.name) - 1);
-        // preset 2 AM color
-      } else if (strcmp(key, "p2_am_color") == 0) {
-        config->preset_2.am_color = hex_to_color(decoded_value);
-        // preset 2 AM white
-      } else if (strcmp(key, "p2_am_white") == 0) {
-        config->preset_2.am_color.w = atoi(decoded_value);
-        // preset 2 PM color
-      } else if (strcmp(key, "p2_pm_color") == 0) {
-        config->preset_2.pm_color = hex_to_color(decoded_value);
-        // preset 2 PM white
-      } else if (strcmp(key, "p2_pm_white") == 0) {
-        config->preset_2.pm_color.w = atoi(decoded_value);
-        // preset 2 hour color 0
-      } else if (strcmp(key, "p2_hr0_color") == 0) {
-        config->preset_2.hr0_color = hex_to_color(decoded_value);
-        // preset 2 hour color 0 white
-      } else if (strcmp(key, "p2_hr0_white") == 0) {
-        config->preset_2.hr0_color.w = atoi(decoded_value);
-        // preset 2 hour color 1
-      } else if (strcmp(key, "p2_hr1_color") == 0) {
-        config->preset_2.hr1_color = hex_to_color(decoded_value);
-        // preset 2 hour color 1 white
-      } else if (strcmp(key, "p2_hr1_white") == 0) {
-        config->preset_2.hr1_color.w = atoi(decoded_value);
-        // preset 2 min color 0
-      } else if (strcmp(key, "p2_min0_color") == 0) {
-        config->preset_2.min0_color = hex_to_color(decoded_value);
-        // preset 2 min color 0 white
-      } else if (strcmp(key, "p2_min0_white") == 0) {
-        config->preset_2.min0_color.w = atoi(decoded_value);
-        // preset 2 min color 1
-      } else if (strcmp(key, "p2_min1_color") == 0) {
-        config->preset_2.min1_color = hex_to_color(decoded_value);
-        // preset 2 min color 1 white
-      } else if (strcmp(key, "p2_min1_white") == 0) {
-        config->preset_2.min1_color.w = atoi(decoded_value);
-        // preset 3 name
-      } else if (strcmp(key, "p3_name") == 0) {
-        strncpy(config->preset_3.name, decoded_value,
-                sizeof(config->preset_3.name) - 1);
-        // preset 3 AM color
-      } else if (strcmp(key, "p3_am_color") == 0) {
-        config->preset_3.am_color = hex_to_color(decoded_value);
-        // preset 3 AM white
-      } else if (strcmp(key, "p3_am_white") == 0) {
-        config->preset_3.am_color.w = atoi(decoded_value);
-        // preset 3 PM color
-      } else if (strcmp(key, "p3_pm_color") == 0) {
-        config->preset_3.pm_color = hex_to_color(decoded_value);
-        // preset 3 PM white
-      } else if (strcmp(key, "p3_pm_white") == 0) {
-        config->preset_3.pm_color.w = atoi(decoded_value);
-        // preset 3 hour color 0
-      } else if (strcmp(key, "p3_hr0_color") == 0) {
-        config->preset_3.hr0_color = hex_to_color(decoded_value);
-        // preset 3 hour color 0 white
-      } else if (strcmp(key, "p3_hr0_white") == 0) {
-        config->preset_3.hr0_color.w = atoi(decoded_value);
-        // preset 3 hour color 1
-      } else if (strcmp(key, "p3_hr1_color") == 0) {
-        config->preset_3.hr1_color = hex_to_color(decoded_value);
-        // preset 3 hour color 1 white
-      } else if (strcmp(key, "p3_hr1_white") == 0) {
-        config->preset_3.hr1_color.w = atoi(decoded_value);
-        // preset 3 min color 0
-      } else if (strcmp(key, "p3_min0_color") == 0) {
-        config->preset_3.min0_color = hex_to_color(decoded_value);
-        // preset 3 min color 0 white
-      } else if (strcmp(key, "p3_min0_white") == 0) {
-        config->preset_3.min0_color.w = atoi(decoded_value);
-        // preset 3 min color 1
-      } else if (strcmp(key, "p3_min1_color") == 0) {
-        config->preset_3.min1_color = hex_to_color(decoded_value);
-        // preset 3 min color 1 white
-      } else if (strcmp(key, "p3_min1_white") == 0) {
-        config->preset_3.min1_color.w = atoi(decoded_value);
-      } else if (strcmp(key, "clear_wifi") == 0 &&
-                 strcmp(decoded_value, "on") == 0) {
-        strncpy(config->wifi_ssid, "", sizeof(config->wifi_ssid) - 1);
-        strncpy(config->wifi_password, "", sizeof(config->wifi_password) - 1);
-        ESP_LOGI(TAG, "clearing wifi");
-        ret = FORM_VAL_STATUS_RESTART;
+      } else if (strcmp(key, "clear_wifi") == 0) {
+        if (strcmp(decoded_value, "on") == 0) {
+          strncpy(config->wifi_ssid, "", sizeof(config->wifi_ssid) - 1);
+          strncpy(config->wifi_password, "",
+                  sizeof(config->wifi_password) - 1);
+          ESP_LOGI(TAG, "clearing wifi");
+          ret = FORM_VAL_STATUS_RESTART;
+        }
+      } else if (!config_schema_set(config, key, decoded_value) &&
+                 strcmp(key, "p") != 0) {
+        // the settings (see config_schema.h)
+        ESP_LOGE(TAG, "Invalid field: %s", key);
+        free(query_copy);
+        return FORM_VAL_STATUS_FIELD_INVALID;
       }
     }
     token = strtok(NULL, "&");
@@ -874,6 +663,97 @@ int set_config_from_params(const char *query, config_t *config) {
   return ret;
 }
 
+/* Load the cache of the last connection, from RTC memory if it survived
+ * the restart, else from NVS. Returns false if there is none */
+static bool wifi_cache_load(wifi_link_cache_t *cache) {
+  if (wifi_link_cache_valid(&s_wifi_cache)) {
+    *cache = s_wifi_cache;
+    return true;
+  }
+  nvs_handle_t handle;
+  if (nvs_open("storage", NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+  size_t len = sizeof(*cache);
+  esp_err_t err = nvs_get_blob(handle, WIFI_CACHE_NVS_KEY, cache, &len);
+  nvs_close(handle);
+  if (err != ESP_OK || len != sizeof(*cache) ||
+      !wifi_link_cache_valid(cache)) {
+    return false;
+  }
+  s_wifi_cache = *cache; // for the next restart
+  return true;
+}
+
+/* Store the cache of the last connection (only written when it changed,
+ * so NVS isn't written on every connection) */
+static void wifi_cache_save(const wifi_link_cache_t *cache) {
+  s_wifi_cache = *cache;
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(handle, WIFI_CACHE_NVS_KEY, cache, sizeof(*cache));
+    if (err == ESP_OK) {
+      err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG_STA, "Failed to save the connection cache (%s)",
+             esp_err_to_name(err));
+  }
+}
+
+/* Set the station config for a connection attempt: a fast connect to the
+ * cached AP on its channel, or a scan of all the channels for the SSID */
+static void wifi_sta_set_config(const wifi_link_attempt_t *attempt) {
+  wifi_config_t wifi_sta_config = {
+      .sta =
+          {
+              .scan_method = WIFI_ALL_CHANNEL_SCAN,
+              .failure_retry_cnt = EXAMPLE_ESP_MAXIMUM_RETRY,
+              /* Authmode threshold resets to WPA2 as default if password
+               * matches WPA2 standards (password len => 8). If you want to
+               * connect the device to deprecated WEP/WPA networks, Please set
+               * the threshold value to WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK and set
+               * the password with length and format matching to
+               * WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK standards.
+               */
+              .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
+              .sae_pwe_h2e = WPA3_SAE_PWE_BOTH,
+          },
+  };
+  memcpy(wifi_sta_config.sta.ssid, app_config->wifi_ssid,
+         strlen(app_config->wifi_ssid));
+  memcpy(wifi_sta_config.sta.password, app_config->wifi_password,
+         strlen(app_config->wifi_password));
+  if (attempt->fast) {
+    // scan only the channel, stop at the AP
+    wifi_sta_config.sta.scan_method = WIFI_FAST_SCAN;
+    wifi_sta_config.sta.channel = attempt->channel;
+    wifi_sta_config.sta.bssid_set = true;
+    memcpy(wifi_sta_config.sta.bssid, attempt->bssid, WIFI_LINK_BSSID_LEN);
+    wifi_sta_config.sta.failure_retry_cnt = 1;
+  }
+  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config));
+}
+
+/* Make the connection attempt delayed by the backoff */
+static void reconnect_timer_cb(void *arg) {
+  wifi_link_attempt_t attempt;
+  portENTER_CRITICAL(&s_wifi_lock);
+  bool retry =
+      wifi_link_retry(&s_wifi_link, app_mode == APP_MODE_SETUP, &attempt);
+  portEXIT_CRITICAL(&s_wifi_lock);
+  if (!retry) {
+    return;
+  }
+  ESP_LOGI(TAG_STA, "Retrying the connection (%s)",
+           attempt.fast ? "fast connect" : "full scan");
+  wifi_sta_set_config(&attempt);
+  esp_wifi_connect();
+}
+
 static void wifi_event_handler(void *arg, esp_event_base_t event_base,
                                int32_t event_id, void *event_data) {
   if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_STACONNECTED) {
@@ -889,21 +769,64 @@ static void wifi_event_handler(void *arg, esp_event_base_t event_base,
              MAC2STR(event->mac), event->aid, event->reason);
   } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
     esp_wifi_connect();
+  } else if (event_base == WIFI_EVENT &&
+             event_id == WIFI_EVENT_STA_CONNECTED) {
+    wifi_event_sta_connected_t *event =
+        (wifi_event_sta_connected_t *)event_data;
+    portENTER_CRITICAL(&s_wifi_lock);
+    wifi_link_associated(&s_wifi_link, event->bssid, event->channel,
+                         esp_timer_get_time());
+    portEXIT_CRITICAL(&s_wifi_lock);
   } else if (event_base == WIFI_EVENT &&
              event_id == WIFI_EVENT_STA_DISCONNECTED) {
-    if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
+    wifi_event_sta_disconnected_t *event =
+        (wifi_event_sta_disconnected_t *)event_data;
+    ESP_LOGI(TAG_STA, "Disconnected from the AP (reason %d)", event->reason);
+    xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    wifi_link_attempt_t attempt;
+    int64_t delay_us;
+    portENTER_CRITICAL(&s_wifi_lock);
+    wifi_link_action_t action = wifi_link_disconnected(
+        &s_wifi_link, event->reason, app_mode == APP_MODE_SETUP,
+        esp_timer_get_time(), esp_random(), &attempt, &delay_us);
+    portEXIT_CRITICAL(&s_wifi_lock);
+    if (action == WIFI_LINK_CONNECT) {
+      ESP_LOGI(TAG_STA, "%s", attempt.fast ? "Reconnecting to the AP"
+                                           : "Scanning all channels");
+      wifi_sta_set_config(&attempt);
       esp_wifi_connect();
-      s_retry_num++;
-      ESP_LOGI(TAG, "retry to connect to the AP");
-    } else {
-      xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    } else if (action == WIFI_LINK_WAIT) {
+      ESP_LOGI(TAG_STA, "Retrying in %lld ms", delay_us / 1000);
+      esp_timer_start_once(s_reconnect_timer, delay_us);
+    } else if (action == WIFI_LINK_REJECTED) {
+      ESP_LOGE(TAG_STA, "The AP rejected the new credentials, opening setup");
+      xEventGroupSetBits(s_wifi_event_group, WIFI_SETUP_BIT);
     }
-    ESP_LOGI(TAG, "connect to the AP fail");
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
     ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
     memcpy(&device_ip, &event->ip_info.ip, sizeof(esp_ip4_addr_t));
-    s_retry_num = 0;
+    wifi_link_cache_t cache;
+    wifi_link_stats_t stats;
+    portENTER_CRITICAL(&s_wifi_lock);
+    bool connection = !s_wifi_link.connected; // not a new lease
+    bool changed = wifi_link_got_ip(
+        &s_wifi_link, event->ip_info.ip.addr, event->ip_info.netmask.addr,
+        event->ip_info.gw.addr, esp_timer_get_time());
+    cache = s_wifi_link.cache;
+    stats = s_wifi_link.stats;
+    portEXIT_CRITICAL(&s_wifi_lock);
+    if (connection) {
+      ESP_LOGI(TAG_STA, "%s in %lld ms (%s, DHCP %lld ms, %s address)",
+               stats.last_reconnect ? "Reconnected" : "Connected",
+               stats.last_connect_us / 1000,
+               stats.last_fast ? "fast connect" : "full scan",
+               stats.last_dhcp_us / 1000,
+               stats.last_ip_reused ? "same" : "new");
+    }
+    if (changed) {
+      wifi_cache_save(&cache);
+    }
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
@@ -943,29 +866,30 @@ esp_netif_t *wifi_init_softap(void) {
 /* Initialize wifi station */
 esp_netif_t *wifi_init_sta(void) {
   esp_netif_t *esp_netif_sta = esp_netif_create_default_wifi_sta();
-  wifi_config_t wifi_sta_config = {
-      .sta =
-          {
-              .scan_method = WIFI_ALL_CHANNEL_SCAN,
-              .failure_retry_cnt = EXAMPLE_ESP_MAXIMUM_RETRY,
-              /* Authmode threshold resets to WPA2 as default if password
-               * matches WPA2 standards (password len => 8). If you want to
-               * connect the device to deprecated WEP/WPA networks, Please set
-               * the threshold value to WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK and set
-               * the password with length and format matching to
-               * WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK standards.
-               */
-              .threshold.authmode = ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD,
-              .sae_pwe_h2e = WPA3_SAE_PWE_BOTH,
-          },
+  const esp_timer_create_args_t reconnect_timer_args = {
+      .callback = reconnect_timer_cb,
+      .name = "reconnect_timer",
   };
-  memcpy(wifi_sta_config.sta.ssid, app_config->wifi_ssid,
-         strlen(app_config->wifi_ssid));
-  memcpy(wifi_sta_config.sta.password, app_config->wifi_password,
-         strlen(app_config->wifi_password));
-
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config));
-
+  ESP_ERROR_CHECK(esp_timer_create(&reconnect_timer_args, &s_reconnect_timer));
+
+  // fast connect to the AP of the last connection, if it was made with
+  // the same credentials
+  wifi_link_cache_t cache;
+  bool cached = wifi_cache_load(&cache);
+  wifi_link_attempt_t attempt;
+  portENTER_CRITICAL(&s_wifi_lock);
+  wifi_link_init(&s_wifi_link,
+                 wifi_link_key(app_config->wifi_ssid,
+                               app_config->wifi_password),
+                 cached ? &cache : NULL);
+  wifi_link_start(&s_wifi_link, esp_timer_get_time(), &attempt);
+  portEXIT_CRITICAL(&s_wifi_lock);
+  wifi_sta_set_config(&attempt);
+
+  if (attempt.fast) {
+    ESP_LOGI(TAG_STA, "Fast connect to " MACSTR " on channel %d",
+             MAC2STR(attempt.bssid), attempt.channel);
+  }
   ESP_LOGI(TAG_STA, "wifi_init_sta finished. SSID:%s password:%s",
            app_config->wifi_ssid, app_config->wifi_password);
 
@@ -986,67 +910,171 @@ void softap_set_dns_addr(esp_netif_t *esp_netif_ap,
   ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcps_start(esp_netif_ap));
 }
 
-void time_sync_notification_cb(struct timeval *tv) {
-  ESP_LOGI(TAG, "NTP time synchronized");
-  // ESP_LOGI(TAG, "NTP time synchronized, time: %s", ctime((const time_t
-  // *)tv->tv_sec));
-}
+// Interval of the boundaries where the displayed time changes (the
+// minutes of all the time zones start on UTC minutes)
+#if DISPLAY_HAS_SECONDS
+#define BOUNDARY_US 1000000LL
+#else
+#define BOUNDARY_US 60000000LL
+#endif
 
-/* Save config to NVS */
-static int save_config(void) {
+// Timer waking the display task on each boundary
+static esp_timer_handle_t s_boundary_timer;
 
-  // open NVS
-  printf("Opening Non-Volatile Storage (NVS) handle... ");
-  int ret = nvs_open("storage", NVS_READWRITE, &storage_handle);
-  if (ret != ESP_OK) {
-    printf("Error (%s) opening NVS handle!\n", esp_err_to_name(ret));
-    ESP_ERROR_CHECK(ret);
+/* Returns true if the display shows the time of a fleet leader */
+static bool following_leader(void) {
+#if CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_FOLLOWER
+  return fleet_sync_locked();
+#else
+  return false;
+#endif
+}
+
+/* Get the displayed time: the fleet leader's when following one,
+ * otherwise the system time */
+static void display_now(struct timeval *tv) {
+#if CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_FOLLOWER
+  if (fleet_sync_now(tv)) {
+    return;
   }
+#endif
+  gettimeofday(tv, NULL);
+}
 
-  size_t size = sizeof(config_t);
-  ESP_LOGI(TAG_STA, "Saving config: %s %s, size: %d", app_config->wifi_ssid,
-           app_config->wifi_password, size);
-  esp_err_t err = nvs_set_blob(storage_handle, "app_config", app_config, size);
-  printf((err != ESP_OK) ? "Failed!\n" : "Done\n");
+/* Time until the next boundary of the displayed time (us) */
+static int64_t until_boundary_us(void) {
+  struct timeval tv;
+  display_now(&tv);
+  int64_t now_us = (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+  return BOUNDARY_US - now_us % BOUNDARY_US;
+}
 
-  // Commit written value.
-  // After setting any values, nvs_commit() must be called to ensure changes are
-  // written to flash storage. Implementations may write to storage at other
-  // times, but this is not guaranteed.
-  printf("Committing updates in NVS ... ");
-  err = nvs_commit(storage_handle);
-  printf((err != ESP_OK) ? "NVS write failed!\n" : "NVS write done.\n");
+/* Arm the boundary timer for the next boundary of the displayed time */
+static void boundary_timer_arm(void) {
+  // the timer may be running or firing right now, in which case it is
+  // re-armed by its callback and start_once fails harmlessly
+  esp_timer_stop(s_boundary_timer);
+  esp_timer_start_once(s_boundary_timer, until_boundary_us());
+}
 
-  nvs_close(storage_handle);
-  return err;
+/* Boundary timer callback: wake the display task on the boundary */
+static void boundary_timer_cb(void *arg) {
+  int64_t remaining_us = until_boundary_us();
+  // esp_timer and the displayed time drift apart (e.g. when SNTP adjusts
+  // the clock), so if we woke up before the boundary just wait for it
+  if (remaining_us > BOUNDARY_US / 2) {
+    xTaskNotifyGive(s_display_task_handle);
+  }
+  esp_timer_start_once(s_boundary_timer, remaining_us);
 }
 
-/* Get config from NVS */
-static int load_config(void) {
+#if CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_FOLLOWER
+/* Fleet sync callback: the displayed time switched between the leader's
+ * and the system time, align the timer and refresh */
+static void fleet_lock_changed(bool locked) {
+  if (s_boundary_timer) {
+    boundary_timer_arm();
+  }
+  if (s_display_task_handle) {
+    xTaskNotifyGive(s_display_task_handle);
+  }
+}
+#endif
 
-  // open NVS
-  printf("Opening Non-Volatile Storage (NVS) handle... ");
-  int ret = nvs_open("storage", NVS_READWRITE, &storage_handle);
-  if (ret != ESP_OK) {
-    printf("Error (%s) opening NVS handle!\n", esp_err_to_name(ret));
-    ESP_ERROR_CHECK(ret);
+/* Latency of each stage of the display pipeline, for every frame that
+ * shows a new time (boundary is the second or minute the frame shows) */
+typedef struct {
+  latency_hist_t wake;     // boundary to start of frame computation (us)
+  latency_hist_t compute;  // frame computation to SPI transfer (cycles)
+  latency_hist_t transfer; // SPI transfer to refresh completion (us)
+  latency_hist_t total;    // boundary to refresh completion (us)
+} display_stats_t;
+static display_stats_t s_display_stats;
+static portMUX_TYPE s_display_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Timestamps of one frame going through the display pipeline */
+typedef struct {
+  int64_t boundary_offset_us; // system time since the boundary, at compute
+  int64_t compute_us;         // start of frame computation
+  uint32_t compute_cycles;
+  int64_t transfer_us; // start of the SPI transfer
+  uint32_t transfer_cycles;
+  int64_t done_us; // refresh completion
+} frame_timing_t;
+
+/* Add the timestamps of a frame to the display stats */
+static void record_frame_timing(const frame_timing_t *t) {
+  int64_t total_us = t->boundary_offset_us + (t->done_us - t->compute_us);
+
+  portENTER_CRITICAL(&s_display_stats_lock);
+  latency_hist_add(&s_display_stats.wake, t->boundary_offset_us);
+  latency_hist_add(&s_display_stats.compute,
+                   (uint32_t)(t->transfer_cycles - t->compute_cycles));
+  latency_hist_add(&s_display_stats.transfer, t->done_us - t->transfer_us);
+  latency_hist_add(&s_display_stats.total, total_us);
+  latency_hist_t total = s_display_stats.total;
+  portEXIT_CRITICAL(&s_display_stats_lock);
+
+  if (total.count % 60 == 0) {
+    ESP_LOGI(TAG, "Display latency: p50 %lld us, p99 %lld us, max %lld us",
+             latency_hist_percentile(&total, 50),
+             latency_hist_percentile(&total, 99), total.max);
   }
-  // get the config blob from NVS
-  size_t size = sizeof(config_t);
-  ret = nvs_get_blob(storage_handle, "app_config", app_config, &size);
-  switch (ret) {
-  case ESP_OK:
-    // memcpy(&app_config, config_str, size);
-    printf("READ config ssid = %s\n", app_config->wifi_ssid);
-    break;
-  case ESP_ERR_NVS_NOT_FOUND:
-    printf("app_config is not found in NVS!\n");
-    break;
-  default:
-    printf("Error (%s) reading!\n", esp_err_to_name(ret));
+}
+
+#if CONFIG_ELEVEN_BIT_CLOCK_SNTP_SERVER
+/* Set the reference of the SNTP server to the NTP server that was used to
+ * sync at tv (the one selected by the probes). Runs on the tcpip task, so
+ * only the selected server is copied */
+static void update_sntp_server_reference(const struct timeval *tv) {
+  ntp_sample_t best;
+  int64_t jitter_us;
+  if (!ntp_probe_get_selected(&best, &jitter_us) || best.stratum < 1 ||
+      best.stratum >= 15) {
+    // until the probes select a server the upstream is unknown, the next
+    // sync (SNTP is restarted once a server is selected) sets it
+    return;
   }
-  nvs_close(storage_handle);
-  return ret;
+  sntp_server_reference_t reference = {
+      .stratum = best.stratum + 1,
+      .refid = best.address,
+      .ref_time_us = (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec,
+      .root_delay_us = best.root_delay_us + best.delay_us,
+      .root_dispersion_us = best.root_dispersion_us + jitter_us,
+  };
+  sntp_server_set_reference(s_sntp_server, &reference);
+}
+#endif
+
+void time_sync_notification_cb(struct timeval *tv) {
+  ESP_LOGI(TAG, "NTP time synchronized");
+  if (boot_profile_milestone(BOOT_MILESTONE_FIRST_SYNC)) {
+    // the last milestone of the boot
+    boot_profile_log();
+  }
+  time_checkpoint_synced(tv);
+  // save the drift measured at the sync from the config store writer, NVS
+  // writes block on flash too long for the tcpip task
+  config_store_save();
+#if CONFIG_ELEVEN_BIT_CLOCK_SNTP_SERVER
+  if (s_sntp_server) {
+    update_sntp_server_reference(tv);
+  }
+#endif
+  // switch the display from the unsynced pattern to the time
+  xEventGroupSetBits(s_app_event_group, APP_TIME_SYNCED_BIT);
+  xEventGroupClearBits(s_app_event_group, APP_TIME_PROVISIONAL_BIT);
+  if (s_display_task_handle) {
+    xTaskNotifyGive(s_display_task_handle);
+  }
+  // the clock may have been stepped, align the timer to the new time
+  if (s_boundary_timer) {
+    boundary_timer_arm();
+  }
+  // and find the next switch of the preset schedule from the new time
+  schedule_time_set();
+  // ESP_LOGI(TAG, "NTP time synchronized, time: %s", ctime((const time_t
+  // *)tv->tv_sec));
 }
 
 /* Set the captive portal URL */
@@ -1077,6 +1105,11 @@ static void dhcp_set_captiveportal_url(void) {
   ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcps_start(netif));
 }
 
+/* Log the time from boot to the first HTTP response */
+static void note_http_response(void) {
+  boot_profile_milestone(BOOT_MILESTONE_FIRST_RESPONSE);
+}
+
 /* HTTP GET setup root Handler
  * Loads the setup_root.html template, replaces all handlebar tokens
  * with the current config values and sends the result to the client */
@@ -1110,6 +1143,7 @@ static esp_err_t setup_root_get_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
   info_lwm("httpd", "Served setup root");
+  note_http_response();
 
   // free the page
   free(page);
@@ -1117,281 +1151,610 @@ static esp_err_t setup_root_get_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
-/* HTTP GET root Handler
- * Loads the root.html template, replaces all handlebar tokens
- * with the current config values and sends the result to the client */
-static esp_err_t root_get_handler(httpd_req_t *req) {
-
-  // ESP_LOGI("httpd", "boop!");
-  // info_lwm("httpd", "going to allocate time zone string1");
+/* Changes of the preset library, made by config_writer_task */
+typedef enum {
+  PRESET_OP_NONE,
+  PRESET_OP_SET,    // write preset (or add it if preset_id is 0)
+  PRESET_OP_DELETE, // remove preset_id
+} preset_op_t;
 
-  // as this is a lengthy operation, we'll copy the app_config
-  // in case it may be accessed by another task
+/* Reasons for the config writer to go over the preset schedule */
+typedef enum {
+  SCHEDULE_OP_NONE,
+  SCHEDULE_OP_ARM,  // the time was set (or stepped), arm the timer again
+  SCHEDULE_OP_FIRE, // the timer fired, activate the preset of the switch
+} schedule_op_t;
+
+/* A change of the config, made on a snapshot (base) and applied by
+ * config_writer_task: the fields that differ between base and config are
+ * copied to app_config, so changes made at the same time (e.g. from the
+ * web page and a gesture) don't undo each other */
+typedef struct {
+  config_t base;
   config_t config;
-  memcpy(&config, app_config, sizeof(config_t));
-
-  // info_lwm("httpd", "going to allocate time zone string2");
-
-  // setup array of match strings
-  const size_t max_size_match_string = 20;
-  const char *match_strings[] = {
-      "{{ntp_server_1}}",  "{{ntp_server_2}}",  "{{time_zone}}",
-      "{{active_preset}}", "{{p1_name}}",       "{{p1_am_color}}",
-      "{{p1_am_white}}",   "{{p1_pm_color}}",   "{{p1_pm_white}}",
-      "{{p1_hr0_color}}",  "{{p1_hr0_white}}",  "{{p1_hr1_color}}",
-      "{{p1_hr1_white}}",  "{{p1_min0_color}}", "{{p1_min0_white}}",
-      "{{p1_min1_color}}", "{{p1_min1_white}}", "{{p2_name}}",
-      "{{p2_am_color}}",   "{{p2_am_white}}",   "{{p2_pm_color}}",
-      "{{p2_pm_white}}",   "{{p2_hr0_color}}",  "{{p2_hr0_white}}",
-      "{{p2_hr1_color}}",  "{{p2_hr1_white}}",  "{{p2_min0_color}}",
-      "{{p2_min0_white}}", "{{p2_min1_color}}", "{{p2_min1_white}}",
-      "{{p3_name}}",       "{{p3_am_color}}",   "{{p3_am_white}}",
-      "{{p3_pm_color}}",   "{{p3_pm_white}}",   "{{p3_hr0_color}}",
-      "{{p3_hr0_white}}",  "{{p3_hr1_color}}",  "{{p3_hr1_white}}",
-      "{{p3_min0_color}}", "{{p3_min0_white}}", "{{p3_min1_color}}",
-      "{{p3_min1_white}}",
-  };
-  const size_t num_match_strings =
-      sizeof(match_strings) / sizeof(match_strings[0]);
-
-  // build the replacement string for time zone
-  size_t tz_str_size =
-      23060; // 461 * (32 for name + 19 for html) + 9 for selected
-  char *time_zone_str = (char *)malloc(tz_str_size);
-  csv_tool(CSV_TOOL_MODE_OPTIONS, config.time_zone, timezone_data_start,
-           time_zone_str, MAX_TIMEZONES, tz_str_size);
-
-  // build the replacement string for the active preset
-  size_t num_presets = 3;
-  char active_preset_str[160] = ""; // 50 * 3 + 10
-  for (int i = 0; i < num_presets; i++) {
-    int preset_num = i + 1;
-    char option_str[50];
-    if (preset_num == config.active_preset) {
-      sprintf(option_str, "<option value=\"%d\" selected>%d</option>\n",
-              preset_num, preset_num);
-    } else {
-      sprintf(option_str, "<option value=\"%d\">%d</option>\n", preset_num,
-              preset_num);
-    }
-    strcat(active_preset_str, option_str);
-  }
-
-  // build the replacement string for the preset colors
-  char preset_1_am_color_str[8] = "";
-  sprintf(preset_1_am_color_str, "#%02X%02X%02X", config.preset_1.am_color.r,
-          config.preset_1.am_color.g, config.preset_1.am_color.b);
-  char preset_1_pm_color_str[8] = "";
-  sprintf(preset_1_pm_color_str, "#%02X%02X%02X", config.preset_1.pm_color.r,
-          config.preset_1.pm_color.g, config.preset_1.pm_color.b);
-  char preset_1_hr0_color_str[8] = "";
-  sprintf(preset_1_hr0_color_str, "#%02X%02X%02X", config.preset_1.hr0_color.r,
-          config.preset_1.hr0_color.g, config.preset_1.hr0_color.b);
-  char preset_1_hr1_color_str[8] = "";
-  sprintf(preset_1_hr1_color_str, "#%02X%02X%02X", config.preset_1.hr1_color.r,
-          config.preset_1.hr1_color.g, config.preset_1.hr1_color.b);
-  char preset_1_min0_color_str[8] = "";
-  sprintf(preset_1_min0_color_str, "#%02X%02X%02X",
-          config.preset_1.min0_color.r, config.preset_1.min0_color.g,
-          config.preset_1.min0_color.b);
-  char preset_1_min1_color_str[8] = "";
-  sprintf(preset_1_min1_color_str, "#%02X%02X%02X",
-          config.preset_1.min1_color.r, config.preset_1.min1_color.g,
-          config.preset_1.min1_color.b);
-  char preset_2_am_color_str[8] = "";
-  sprintf(preset_2_am_color_str, "#%02X%02X%02X", config.preset_2.am_color.r,
-          config.preset_2.am_color.g, config.preset_2.am_color.b);
-  char preset_2_pm_color_str[8] = "";
-  sprintf(preset_2_pm_color_str, "#%02X%02X%02X", config.preset_2.pm_color.r,
-          config.preset_2.pm_color.g, config.preset_2.pm_color.b);
-  char preset_2_hr0_color_str[8] = "";
-  sprintf(preset_2_hr0_color_str, "#%02X%02X%02X", config.preset_2.hr0_color.r,
-          config.preset_2.hr0_color.g, config.preset_2.hr0_color.b);
-  char preset_2_hr1_color_str[8] = "";
-  sprintf(preset_2_hr1_color_str, "#%02X%02X%02X", config.preset_2.hr1_color.r,
-          config.preset_2.hr1_color.g, config.preset_2.hr1_color.b);
-  char preset_2_min0_color_str[8] = "";
-  sprintf(preset_2_min0_color_str, "#%02X%02X%02X",
-          config.preset_2.min0_color.r, config.preset_2.min0_color.g,
-          config.preset_2.min0_color.b);
-  char preset_2_min1_color_str[8] = "";
-  sprintf(preset_2_min1_color_str, "#%02X%02X%02X",
-          config.preset_2.min1_color.r, config.preset_2.min1_color.g,
-          config.preset_2.min1_color.b);
-  char preset_3_am_color_str[8] = "";
-  sprintf(preset_3_am_color_str, "#%02X%02X%02X", config.preset_3.am_color.r,
-          config.preset_3.am_color.g, config.preset_3.am_color.b);
-  char preset_3_pm_color_str[8] = "";
-  sprintf(preset_3_pm_color_str, "#%02X%02X%02X", config.preset_3.pm_color.r,
-          config.preset_3.pm_color.g, config.preset_3.pm_color.b);
-  char preset_3_hr0_color_str[8] = "";
-  sprintf(preset_3_hr0_color_str, "#%02X%02X%02X", config.preset_3.hr0_color.r,
-          config.preset_3.hr0_color.g, config.preset_3.hr0_color.b);
-  char preset_3_hr1_color_str[8] = "";
-  sprintf(preset_3_hr1_color_str, "#%02X%02X%02X", config.preset_3.hr1_color.r,
-          config.preset_3.hr1_color.g, config.preset_3.hr1_color.b);
-  char preset_3_min0_color_str[8] = "";
-  sprintf(preset_3_min0_color_str, "#%02X%02X%02X",
-          config.preset_3.min0_color.r, config.preset_3.min0_color.g,
-          config.preset_3.min0_color.b);
-  char preset_3_min1_color_str[8] = "";
-  sprintf(preset_3_min1_color_str, "#%02X%02X%02X",
-          config.preset_3.min1_color.r, config.preset_3.min1_color.g,
-          config.preset_3.min1_color.b);
-
-  // build the replacement strings for white leds
-  char preset_1_am_white_str[4] = "";
-  sprintf(preset_1_am_white_str, "%u", config.preset_1.am_color.w);
-  char preset_1_pm_white_str[4] = "";
-  sprintf(preset_1_pm_white_str, "%u", config.preset_1.pm_color.w);
-  char preset_1_hr0_white_str[4] = "";
-  sprintf(preset_1_hr0_white_str, "%u", config.preset_1.hr0_color.w);
-  char preset_1_hr1_white_str[4] = "";
-  sprintf(preset_1_hr1_white_str, "%u", config.preset_1.hr1_color.w);
-  char preset_1_min0_white_str[4] = "";
-  sprintf(preset_1_min0_white_str, "%u", config.preset_1.min0_color.w);
-  char preset_1_min1_white_str[4] = "";
-  sprintf(preset_1_min1_white_str, "%u", config.preset_1.min1_color.w);
-  char preset_2_am_white_str[4] = "";
-  sprintf(preset_2_am_white_str, "%u", config.preset_2.am_color.w);
-  char preset_2_pm_white_str[4] = "";
-  sprintf(preset_2_pm_white_str, "%u", config.preset_2.pm_color.w);
-  char preset_2_hr0_white_str[4] = "";
-  sprintf(preset_2_hr0_white_str, "%u", config.preset_2.hr0_color.w);
-  char preset_2_hr1_white_str[4] = "";
-  sprintf(preset_2_hr1_white_str, "%u", config.preset_2.hr1_color.w);
-  char preset_2_min0_white_str[4] = "";
-  sprintf(preset_2_min0_white_str, "%u", config.preset_2.min0_color.w);
-  char preset_2_min1_white_str[4] = "";
-  sprintf(preset_2_min1_white_str, "%u", config.preset_2.min1_color.w);
-  char preset_3_am_white_str[4] = "";
-  sprintf(preset_3_am_white_str, "%u", config.preset_3.am_color.w);
-  char preset_3_pm_white_str[4] = "";
-  sprintf(preset_3_pm_white_str, "%u", config.preset_3.pm_color.w);
-  char preset_3_hr0_white_str[4] = "";
-  sprintf(preset_3_hr0_white_str, "%u", config.preset_3.hr0_color.w);
-  char preset_3_hr1_white_str[4] = "";
-  sprintf(preset_3_hr1_white_str, "%u", config.preset_3.hr1_color.w);
-  char preset_3_min0_white_str[4] = "";
-  sprintf(preset_3_min0_white_str, "%u", config.preset_3.min0_color.w);
-  char preset_3_min1_white_str[4] = "";
-  sprintf(preset_3_min1_white_str, "%u", config.preset_3.min1_color.w);
-
-  // setup replacement strings
-  size_t max_size_replacement_string =
-      32; // not including the time_zone_str and active_preset_str
-  const char *replacement_strings[] = {
-      config.ntp_server_1,     config.ntp_server_2,     time_zone_str,
-      active_preset_str,       config.preset_1.name,    preset_1_am_color_str,
-      preset_1_am_white_str,   preset_1_pm_color_str,   preset_1_pm_white_str,
-      preset_1_hr0_color_str,  preset_1_hr0_white_str,  preset_1_hr1_color_str,
-      preset_1_hr1_white_str,  preset_1_min0_color_str, preset_1_min0_white_str,
-      preset_1_min1_color_str, preset_1_min1_white_str, config.preset_2.name,
-      preset_2_am_color_str,   preset_2_am_white_str,   preset_2_pm_color_str,
-      preset_2_pm_white_str,   preset_2_hr0_color_str,  preset_2_hr0_white_str,
-      preset_2_hr1_color_str,  preset_2_hr1_white_str,  preset_2_min0_color_str,
-      preset_2_min0_white_str, preset_2_min1_color_str, preset_2_min1_white_str,
-      config.preset_3.name,    preset_3_am_color_str,   preset_3_am_white_str,
-      preset_3_pm_color_str,   preset_3_pm_white_str,   preset_3_hr0_color_str,
-      preset_3_hr0_white_str,  preset_3_hr1_color_str,  preset_3_hr1_white_str,
-      preset_3_min0_color_str, preset_3_min0_white_str, preset_3_min1_color_str,
-      preset_3_min1_white_str,
-  };
-
-  info_lwm("httpd", "allocating page");
-
-  // copy the page to a new buffer in order to modify it
-  const uint32_t page_size = root_template_end - root_template_start;
-  ESP_LOGI(TAG, "unfilled page size = %lu", page_size);
-  const uint32_t size =
-      page_size +
-      (uint32_t)(num_match_strings *
-                     (max_size_replacement_string - max_size_match_string) *
-                     1.1 +
-                 strlen(time_zone_str) +
-                 strlen(active_preset_str)); // assume match strings are
-                                             // used 1.1 times on avg
-  ESP_LOGI(TAG, "filled page size = %lu", size);
-
-  char *page = (char *)malloc(size);
-  assert(page && "Failed to allocate page");
-  memset(page, 0, size);
-  memcpy(page, root_template_start, page_size);
-
-  // limit the chunk size to 64 bytes to reduce memory usage
-  size_t max_chunk_size = 64;
+  bool restart; // restart once the config is written
+  int64_t posted_us;
+  uint8_t preset_op; // preset_op_t
+  uint8_t preset_id;
+  preset_t preset;
+  uint8_t schedule_op; // schedule_op_t
+} config_update_t;
+
+/* Timing of the config changes, from the web page to the live config */
+typedef struct {
+  uint32_t updates;        // applied by the writer
+  uint32_t dropped;        // not posted, the queue was full
+  latency_hist_t post_us;  // config POST handler, request to response
+  latency_hist_t queue_us; // posted to applied
+  latency_hist_t apply_us; // applying, with the updates it triggers
+} config_update_stats_t;
+static config_update_stats_t s_config_stats;
+
+/* Copy the config (consistent with the changes of the writer) */
+static void config_snapshot(config_t *config) {
+  portENTER_CRITICAL(&s_config_lock);
+  memcpy(config, app_config, sizeof(config_t));
+  portEXIT_CRITICAL(&s_config_lock);
+}
 
-  // replace substrings in the page
-  replace_in_chunks(page, size, match_strings, replacement_strings,
-                    num_match_strings, max_chunk_size);
-  // send the page
-  httpd_resp_set_type(req, "text/html");
-  int ret = httpd_resp_send(req, page, strlen(page));
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to send response");
-    return ESP_FAIL;
+/* Start a change of the config. Returns NULL if out of memory */
+static config_update_t *config_update_begin(void) {
+  config_update_t *update = malloc(sizeof(config_update_t));
+  if (update) {
+    config_snapshot(&update->base);
+    memcpy(&update->config, &update->base, sizeof(config_t));
+    update->restart = false;
+    update->preset_op = PRESET_OP_NONE;
+    update->schedule_op = SCHEDULE_OP_NONE;
   }
-  info_lwm("httpd", "Served root");
-
-  // free heap memory
-  free(time_zone_str);
-  free(page);
+  return update;
+}
 
-  return ESP_OK;
+/* Post a change to the writer, waiting up to wait ticks for room in the
+ * queue. Returns false (and frees the change) if it stayed full */
+static bool config_update_post(config_update_t *update, TickType_t wait) {
+  update->posted_us = esp_timer_get_time();
+  if (xQueueSend(s_config_queue, &update, wait) != pdTRUE) {
+    free(update);
+    portENTER_CRITICAL(&s_config_lock);
+    s_config_stats.dropped++;
+    portEXIT_CRITICAL(&s_config_lock);
+    ESP_LOGE(TAG, "Config queue full, change dropped");
+    return false;
+  }
+  return true;
 }
 
-/* HTTP POST Handler */
-static esp_err_t wifi_post_handler(httpd_req_t *req) {
+/* Load the palette of the active preset (a blank one if it is missing) */
+static void palette_load(uint8_t id) {
+  preset_t preset;
+  if (preset_store_get(id, &preset) != ESP_OK) {
+    ESP_LOGE(TAG, "Preset %u not found", id);
+    memset(&preset, 0, sizeof(preset));
+  }
+  display_palette_t palette;
+  display_palette_init(&palette, &preset);
+  portENTER_CRITICAL(&s_config_lock);
+  s_palette = palette;
+  portEXIT_CRITICAL(&s_config_lock);
+}
 
-  ESP_LOGI(TAG, "Process wifi post");
+/* Make a change of the preset library, returns true if it changed the
+ * active preset */
+static bool preset_update_apply(const config_update_t *update) {
+  uint8_t id = update->preset_id;
+  if (update->preset_op == PRESET_OP_SET) {
+    return preset_store_set(&id, &update->preset) == ESP_OK &&
+           id == app_config->active_preset;
+  }
+  if (update->preset_op == PRESET_OP_DELETE) {
+    if (id == app_config->active_preset) {
+      ESP_LOGE(TAG, "Preset %u is active, not deleted", id);
+    } else if (preset_store_delete(id) == ESP_OK) {
+      ESP_LOGI(TAG, "Deleted preset %u", id);
+    }
+  }
+  return false;
+}
 
-  /* Destination buffer for content of HTTP POST request.
-   * httpd_req_recv() accepts char* only, but content could
-   * as well be any binary data (needs type casting).
-   * In case of string data, null termination will be absent, and
-   * content length would give length of string */
-  size_t max_content_length = 70;
-  char content[max_content_length];
+/* Returns true once the time is set (synced or restored) */
+static bool time_is_set(void) {
+  return xEventGroupGetBits(s_app_event_group) &
+         (APP_TIME_SYNCED_BIT | APP_TIME_PROVISIONAL_BIT);
+}
 
-  /* Truncate if content length is larger than the buffer */
-  size_t recv_size = req->content_len;
-  if (recv_size > max_content_length) {
-    recv_size = max_content_length;
+/* Set the active preset of a change to the one the schedule switched to:
+ * the preset of the switch the timer fired for or, the first time the
+ * time is set after boot, the preset in effect (its switch may have been
+ * missed while the clock was off). Returns true if the switch was due */
+static bool schedule_due(config_update_t *update) {
+  uint8_t id = 0;
+  bool due = false;
+  if (update->schedule_op == SCHEDULE_OP_FIRE) {
+    // the timer may have been re-armed for a later switch since
+    due = s_schedule_at != 0 && time(NULL) + 1 >= s_schedule_at;
+    id = due ? s_schedule_preset : 0;
+  } else if (update->schedule_op == SCHEDULE_OP_ARM && !s_schedule_caught_up) {
+    s_schedule_caught_up = true;
+    id = preset_schedule_current(app_config->schedule, &s_schedule_tz,
+                                 time(NULL));
   }
-  ESP_LOGI(TAG, "req->content_len = %d", req->content_len);
-  ESP_LOGI(TAG, "recv_size = %d", recv_size);
+  preset_t preset;
+  if (id == 0) {
+    return due;
+  }
+  if (preset_store_get(id, &preset) != ESP_OK) {
+    ESP_LOGE(TAG, "Scheduled preset %u not found", id);
+    return due;
+  }
+  ESP_LOGI(TAG, "Scheduled preset: %u", id);
+  update->config.active_preset = id;
+  return due;
+}
 
-  int ret = httpd_req_recv(req, content, recv_size);
-  if (ret <= 0) { /* 0 return value indicates connection closed */
-    /* Check if timeout occurred */
-    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
-      /* In case of timeout one can choose to retry calling
-       * httpd_req_recv(), but to keep it simple, here we
-       * respond with an HTTP 408 (Request Timeout) error */
-      httpd_resp_send_408(req);
-    }
-    /* In case of error, returning ESP_FAIL will
-     * ensure that the underlying socket is closed */
-    return ESP_FAIL;
+/* Arm the schedule timer for the next switch, after the one that was due
+ * if any (the timer can fire a little early, esp_timer and the system
+ * time drift apart) */
+static void schedule_arm(bool due) {
+  esp_timer_stop(s_schedule_timer);
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  time_t from = due && s_schedule_at > tv.tv_sec ? s_schedule_at : tv.tv_sec;
+  uint8_t preset = 0;
+  time_t at = time_is_set() ? preset_schedule_next(app_config->schedule,
+                                                   &s_schedule_tz, from,
+                                                   &preset)
+                            : 0;
+  portENTER_CRITICAL(&s_config_lock);
+  s_schedule_at = at;
+  s_schedule_preset = preset;
+  portEXIT_CRITICAL(&s_config_lock);
+  if (at == 0) {
+    return;
   }
-  // make the last byte a null terminator
-  content[recv_size] = '\0';
-  ESP_LOGI(TAG, "Posted setup = %s", content);
+  int64_t delay_us = (int64_t)(at - tv.tv_sec) * 1000000LL - tv.tv_usec;
+  esp_timer_start_once(s_schedule_timer, delay_us > 0 ? delay_us : 0);
+  ESP_LOGI(TAG, "Next scheduled preset: %u in %lld s", preset,
+           delay_us / 1000000);
+}
 
-  // extract wifi params and update config
-  extract_wifi_params(content, app_config->wifi_ssid, app_config->wifi_password,
-                      32);
-  ret = save_config();
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to save config");
-    return ESP_FAIL;
+/* Post a change for the writer to go over the schedule */
+static bool schedule_post(schedule_op_t op) {
+  config_update_t *update = config_update_begin();
+  if (!update) {
+    return false;
   }
+  update->schedule_op = op;
+  return config_update_post(update, 0);
+}
 
-  // Build the response message
-  char response_message[100] = "Clock is restarting...";
+/* The time was set or stepped, arm the schedule for the new time */
+static void schedule_time_set(void) { schedule_post(SCHEDULE_OP_ARM); }
 
-  // copy the page to a new buffer in order to modify it
-  const uint32_t page_size = response_template_end - response_template_start;
+static void schedule_timer_cb(void *arg) {
+  // try again in a second if the writer is busy
+  if (!schedule_post(SCHEDULE_OP_FIRE)) {
+    esp_timer_start_once(s_schedule_timer, 1000000);
+  }
+}
+
+/*
+    Applies the changes of the config in order: copies the changed fields
+    to app_config, then updates the time zone, the NTP servers and the
+    display as needed and saves the config (written to NVS in the
+    background, see config_store.h). Changes of the preset library are
+    written here too, and the timer of the preset schedule is armed here.
+    The HTTP handlers only validate and post the changes, so they don't
+    wait for any of this
+*/
+static void config_writer_task(void *pvParameters) {
+  config_update_t *update;
+  for (;;) {
+    xQueueReceive(s_config_queue, &update, portMAX_DELAY);
+    int64_t start_us = esp_timer_get_time();
+    const config_t *base = &update->base;
+    const config_t *config = &update->config;
+    bool schedule_was_due = schedule_due(update);
+
+    bool changed = false;
+    portENTER_CRITICAL(&s_config_lock);
+    for (int i = 0; i < config_schema_num_nvs_fields; i++) {
+      const config_field_t *field = &config_schema_nvs_fields[i];
+      const uint8_t *value = (const uint8_t *)config + field->offset;
+      if (memcmp((const uint8_t *)base + field->offset, value, field->size)) {
+        memcpy((uint8_t *)app_config + field->offset, value, field->size);
+        changed = true;
+      }
+    }
+    portEXIT_CRITICAL(&s_config_lock);
+
+#define CONFIG_CHANGED(name)                                                   \
+  memcmp(&base->name, &config->name, sizeof(base->name))
+    if (CONFIG_CHANGED(time_zone_code)) {
+      ESP_LOGI(TAG, "Updated time zone code to %s", config->time_zone_code);
+      setenv("TZ", config->time_zone_code, 1);
+      tzset();
+      tz_cache_invalidate();
+    }
+    if (CONFIG_CHANGED(ntp_server_1) || CONFIG_CHANGED(ntp_server_2) ||
+        CONFIG_CHANGED(ntp_server_3) || CONFIG_CHANGED(ntp_server_4)) {
+      // probe the new NTP servers (app_config only changes in this task)
+      const char *ntp_servers[] = {
+          app_config->ntp_server_1, app_config->ntp_server_2,
+          app_config->ntp_server_3, app_config->ntp_server_4};
+      ntp_probe_set_servers(ntp_servers, 4);
+    }
+    if (update->schedule_op != SCHEDULE_OP_NONE || CONFIG_CHANGED(schedule) ||
+        CONFIG_CHANGED(time_zone_code)) {
+      schedule_arm(schedule_was_due);
+    }
+    if (preset_update_apply(update) || CONFIG_CHANGED(active_preset)) {
+      palette_load(app_config->active_preset);
+      if (s_display_task_handle) {
+        xTaskNotifyGive(s_display_task_handle);
+      }
+    }
+#undef CONFIG_CHANGED
+    if (changed) {
+      config_store_save();
+    }
+
+    int64_t end_us = esp_timer_get_time();
+    portENTER_CRITICAL(&s_config_lock);
+    s_config_stats.updates++;
+    latency_hist_add(&s_config_stats.queue_us, start_us - update->posted_us);
+    latency_hist_add(&s_config_stats.apply_us, end_us - start_us);
+    portEXIT_CRITICAL(&s_config_lock);
+
+    if (update->restart) {
+      config_store_flush();
+      vTaskDelay(pdMS_TO_TICKS(CONFIG_RESTART_DELAY_MS));
+      esp_restart();
+    }
+    free(update);
+  }
+}
+
+/* Response sent in chunks as a template is rendered */
+typedef struct {
+  httpd_req_t *req;
+  size_t len;
+  char buf[512];
+} chunked_response_t;
+
+static bool chunked_response_flush(chunked_response_t *resp) {
+  bool ok = resp->len == 0 ||
+            httpd_resp_send_chunk(resp->req, resp->buf, resp->len) == ESP_OK;
+  resp->len = 0;
+  return ok;
+}
+
+/* Write function of config_schema_render(), small pieces are buffered */
+static bool chunked_response_write(void *ctx, const char *data, size_t len) {
+  chunked_response_t *resp = (chunked_response_t *)ctx;
+  if (resp->len + len > sizeof(resp->buf)) {
+    if (!chunked_response_flush(resp)) {
+      return false;
+    }
+    if (len > sizeof(resp->buf)) {
+      return httpd_resp_send_chunk(resp->req, data, len) == ESP_OK;
+    }
+  }
+  memcpy(resp->buf + resp->len, data, len);
+  resp->len += len;
+  return true;
+}
+
+/* HTTP GET root Handler
+ * Renders the root.html template with the current config values in its
+ * handlebar slots (see config_schema.h) and sends it in chunks */
+static esp_err_t root_get_handler(httpd_req_t *req) {
+  // as this is a lengthy operation, we'll copy the app_config
+  // in case it may be changed by the config writer
+  config_t config;
+  config_snapshot(&config);
+
+  // only the current time zone is sent, the page looks up the others
+  // with /api/tz as the user types
+  chunked_response_t *resp = malloc(sizeof(chunked_response_t));
+  if (!resp) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  resp->req = req;
+  resp->len = 0;
+  httpd_resp_set_type(req, "text/html");
+  bool ok = config_schema_render(&config, root_template_start,
+                                 root_template_end - root_template_start,
+                                 chunked_response_write, resp) &&
+            chunked_response_flush(resp) &&
+            httpd_resp_send_chunk(req, NULL, 0) == ESP_OK;
+  free(resp);
+  if (!ok) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  info_lwm("httpd", "Served root");
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP config API GET Handler - the config (but the passwords) as JSON */
+static esp_err_t api_config_get_handler(httpd_req_t *req) {
+  const size_t size = 2048;
+  char *json = malloc(size);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  config_t config;
+  config_snapshot(&config);
+  int len = config_schema_to_json(&config, json, size);
+  if (len < 0) {
+    ESP_LOGE(TAG, "Config doesn't fit in the response");
+    free(json);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  free(json);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP preset API GET Handler - a page of the preset library as JSON,
+ * e.g. /api/presets?offset=10&limit=10 returns
+ * {"total":42,"active":3,"offset":10,"presets":[{"id":11,"preset":{...}},
+ * ...]}. The presets are read from NVS one at a time as they are sent */
+static esp_err_t api_presets_get_handler(httpd_req_t *req) {
+  char query[48];
+  char value[8];
+  int offset = 0;
+  int limit = PRESET_API_DEFAULT_LIMIT;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "offset", value, sizeof(value)) ==
+        ESP_OK) {
+      offset = atoi(value);
+    }
+    if (httpd_query_key_value(query, "limit", value, sizeof(value)) ==
+        ESP_OK) {
+      limit = atoi(value);
+    }
+  }
+  if (limit < 1 || limit > PRESET_API_MAX_LIMIT) {
+    limit = PRESET_API_MAX_LIMIT;
+  }
+  if (offset < 0) {
+    offset = 0;
+  }
+
+  uint8_t ids[PRESET_API_MAX_LIMIT];
+  int count = preset_store_list(offset, ids, limit);
+  int total = preset_store_count();
+  portENTER_CRITICAL(&s_config_lock);
+  uint8_t active = app_config->active_preset;
+  portEXIT_CRITICAL(&s_config_lock);
+
+  chunked_response_t *resp = malloc(sizeof(chunked_response_t));
+  if (!resp) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  resp->req = req;
+  resp->len = 0;
+  httpd_resp_set_type(req, "application/json");
+  char json[384];
+  int len = snprintf(json, sizeof(json),
+                     "{\"total\":%d,\"active\":%u,\"offset\":%d,"
+                     "\"presets\":[",
+                     total, active, offset);
+  bool ok = chunked_response_write(resp, json, len);
+  for (int i = 0; i < count && ok; i++) {
+    preset_t preset;
+    if (preset_store_get(ids[i], &preset) != ESP_OK) {
+      memset(&preset, 0, sizeof(preset));
+    }
+    len = snprintf(json, sizeof(json), "%s{\"id\":%u,\"preset\":",
+                   i ? "," : "", ids[i]);
+    ok = chunked_response_write(resp, json, len);
+    len = config_schema_preset_to_json(&preset, json, sizeof(json));
+    ok = ok && len >= 0 && chunked_response_write(resp, json, len) &&
+         chunked_response_write(resp, "}", 1);
+  }
+  ok = ok && chunked_response_write(resp, "]}", 2) &&
+       chunked_response_flush(resp) &&
+       httpd_resp_send_chunk(req, NULL, 0) == ESP_OK;
+  free(resp);
+  if (!ok) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* Set the fields of a preset from the posted form (other keys are
+ * ignored) */
+static void set_preset_from_params(char *query, preset_t *preset) {
+  char decoded_value[256];
+  for (char *token = strtok(query, "&"); token; token = strtok(NULL, "&")) {
+    char *value = strchr(token, '=');
+    if (value && strlen(value + 1) < sizeof(decoded_value)) {
+      *value++ = '\0';
+      url_decode(decoded_value, value);
+      config_schema_set_preset(preset, token, decoded_value);
+    }
+  }
+}
+
+/* HTTP preset API POST Handler - changes the preset library with a form
+ * of the clock password (p), a preset id (0 for a new preset), an action
+ * (save, activate or delete) and for save the fields to set (see
+ * config_schema_set_preset()). The config writer makes the change, the
+ * response is {"ok":true} once it is posted, or {"error":"..."} */
+static esp_err_t api_presets_post_handler(httpd_req_t *req) {
+  int64_t start_us = esp_timer_get_time();
+
+  char content[600];
+  size_t recv_size = MIN(req->content_len, sizeof(content) - 1);
+  int ret = httpd_req_recv(req, content, recv_size);
+  if (ret <= 0) {
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      httpd_resp_send_408(req);
+    }
+    return ESP_FAIL;
+  }
+  content[ret] = '\0';
+
+  config_update_t *update = config_update_begin();
+  if (!update) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  char value[96] = ""; // url encoded
+  char password[96] = "";
+  char action[16] = "save";
+  int id = 0;
+  if (httpd_query_key_value(content, "p", value, sizeof(value)) == ESP_OK) {
+    url_decode(password, value);
+  }
+  if (httpd_query_key_value(content, "id", value, sizeof(value)) == ESP_OK) {
+    id = atoi(value);
+  }
+  httpd_query_key_value(content, "action", action, sizeof(action));
+
+  const char *error = NULL;
+  const char *status = "400 Bad Request";
+  if (strcmp(password, update->base.clock_password) != 0) {
+    error = "Invalid password";
+    status = "403 Forbidden";
+  } else if (id < 0 || id > PRESET_STORE_MAX) {
+    error = "Invalid id";
+  } else if (strcmp(action, "save") == 0) {
+    memset(&update->preset, 0, sizeof(preset_t));
+    if (id == 0 && preset_store_count() >= PRESET_STORE_MAX) {
+      error = "The preset library is full";
+    } else if (id != 0 && preset_store_get(id, &update->preset) != ESP_OK) {
+      error = "No such preset";
+      status = "404 Not Found";
+    } else {
+      set_preset_from_params(content, &update->preset);
+      update->preset_op = PRESET_OP_SET;
+      update->preset_id = id;
+    }
+  } else if (strcmp(action, "activate") == 0) {
+    if (preset_store_get(id, &update->preset) != ESP_OK) {
+      error = "No such preset";
+      status = "404 Not Found";
+    } else {
+      update->config.active_preset = id;
+    }
+  } else if (strcmp(action, "delete") == 0) {
+    if (id == update->base.active_preset) {
+      error = "The active preset can't be deleted";
+    } else {
+      update->preset_op = PRESET_OP_DELETE;
+      update->preset_id = id;
+    }
+  } else {
+    error = "Unknown action";
+  }
+
+  if (error) {
+    free(update);
+  } else if (!config_update_post(update,
+                                 pdMS_TO_TICKS(CONFIG_POST_WAIT_MS))) {
+    error = "Clock busy, try again";
+    status = "503 Service Unavailable";
+  }
+
+  char json[64];
+  int len = error ? snprintf(json, sizeof(json), "{\"error\":\"%s\"}", error)
+                  : snprintf(json, sizeof(json), "{\"ok\":true}");
+  if (error) {
+    ESP_LOGE(TAG, "Preset %s: %s", action, error);
+    httpd_resp_set_status(req, status);
+  }
+  httpd_resp_set_type(req, "application/json");
+  ret = httpd_resp_send(req, json, len);
+
+  portENTER_CRITICAL(&s_config_lock);
+  latency_hist_add(&s_config_stats.post_us, esp_timer_get_time() - start_us);
+  portEXIT_CRITICAL(&s_config_lock);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP POST Handler */
+static esp_err_t wifi_post_handler(httpd_req_t *req) {
+
+  ESP_LOGI(TAG, "Process wifi post");
+
+  /* Destination buffer for content of HTTP POST request.
+   * httpd_req_recv() accepts char* only, but content could
+   * as well be any binary data (needs type casting).
+   * In case of string data, null termination will be absent, and
+   * content length would give length of string */
+  size_t max_content_length = 70;
+  char content[max_content_length];
+
+  /* Truncate if content length is larger than the buffer */
+  size_t recv_size = req->content_len;
+  if (recv_size > max_content_length) {
+    recv_size = max_content_length;
+  }
+  ESP_LOGI(TAG, "req->content_len = %d", req->content_len);
+  ESP_LOGI(TAG, "recv_size = %d", recv_size);
+
+  int ret = httpd_req_recv(req, content, recv_size);
+  if (ret <= 0) { /* 0 return value indicates connection closed */
+    /* Check if timeout occurred */
+    if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+      /* In case of timeout one can choose to retry calling
+       * httpd_req_recv(), but to keep it simple, here we
+       * respond with an HTTP 408 (Request Timeout) error */
+      httpd_resp_send_408(req);
+    }
+    /* In case of error, returning ESP_FAIL will
+     * ensure that the underlying socket is closed */
+    return ESP_FAIL;
+  }
+  // make the last byte a null terminator
+  content[recv_size] = '\0';
+  ESP_LOGI(TAG, "Posted setup = %s", content);
+
+  // extract wifi params into a change of the config
+  config_update_t *update = config_update_begin();
+  if (!update) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  extract_wifi_params(content, update->config.wifi_ssid,
+                      update->config.wifi_password, 32);
+  update->restart = true;
+
+  // the writer saves the credentials and restarts (after the response
+  // goes out)
+  bool posted = config_update_post(update, pdMS_TO_TICKS(CONFIG_POST_WAIT_MS));
+
+  // Build the response message
+  char response_message[100] = "Clock is restarting...";
+  if (!posted) {
+    strcpy(response_message, "Clock busy, try again.");
+    httpd_resp_set_status(req, "503 Service Unavailable");
+  }
+
+  // copy the page to a new buffer in order to modify it
+  const uint32_t page_size = response_template_end - response_template_start;
   // ESP_LOGI(TAG, "page_size = %lu", page_size);
   size_t size = page_size + strlen(response_message);
   char *page = (char *)malloc(size);
@@ -1416,15 +1779,27 @@ static esp_err_t wifi_post_handler(httpd_req_t *req) {
   }
   // free heap memory
   free(page);
-
-  vTaskDelay(100);
-  esp_restart();
+  return ESP_OK;
 }
 
 /* HTTP config POST Handler */
-static esp_err_t config_post_handler(httpd_req_t *req) {
+/* Set the time zone code of a config from its time zone name
+ * Returns false if the time zone isn't in the list */
+static bool set_time_zone_code(config_t *config) {
+  int pos = tz_index_find(config->time_zone);
+  if (pos < 0) {
+    return false;
+  }
+  size_t len;
+  const char *code = tz_index_code(pos, &len);
+  len = MIN(len, sizeof(config->time_zone_code) - 1);
+  memcpy(config->time_zone_code, code, len);
+  config->time_zone_code[len] = '\0';
+  return true;
+}
 
-  bool restart = false;
+static esp_err_t config_post_handler(httpd_req_t *req) {
+  int64_t start_us = esp_timer_get_time();
 
   ESP_LOGI(TAG, "Process config post");
 
@@ -1464,34 +1839,32 @@ static esp_err_t config_post_handler(httpd_req_t *req) {
   content[recv_size] = '\0';
   ESP_LOGI(TAG, "Posted config: %s", content);
 
-  // create a new temporary config
-  config_t *new_config = (config_t *)malloc(sizeof(config_t));
-  assert(new_config && "Failed to allocate new config");
-  memcpy(new_config, app_config, sizeof(config_t));
-
-  // remember old timezone for comparison
-  char old_time_zone[MAX_TIMECODE_LEN];
-  memcpy(old_time_zone, new_config->time_zone, MAX_TIMEZONE_LEN);
-
-  // update the temporary config using the posted params
-  ret = set_config_from_params(content, new_config);
-  if (ret == FORM_VAL_STATUS_RESTART) {
-    restart = true;
+  // make the change on a snapshot of the config
+  config_update_t *update = config_update_begin();
+  if (!update) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
   }
+  config_t *new_config = &update->config;
+  ret = set_config_from_params(content, new_config);
 
-  // Set the timezone if changed
-  if (strcmp(old_time_zone, new_config->time_zone) != 0) {
-    csv_tool(CSV_TOOL_MODE_GET_CODE, new_config->time_zone, timezone_data_start,
-             new_config->time_zone_code, MAX_TIMEZONES, MAX_TIMECODE_LEN);
-    ESP_LOGI(TAG, "Updated time zone code to %s", new_config->time_zone_code);
-    setenv("TZ", new_config->time_zone_code, 1);
-    tzset();
+  // Look up the code of the timezone if changed
+  if ((ret == FORM_VAL_STATUS_OK || ret == FORM_VAL_STATUS_RESTART) &&
+      strcmp(update->base.time_zone, new_config->time_zone) != 0 &&
+      !set_time_zone_code(new_config)) {
+    ESP_LOGE(TAG, "Unknown time zone: %s", new_config->time_zone);
+    ret = FORM_VAL_STATUS_FIELD_INVALID;
   }
 
-  // save the new config
+  // once valid, the writer task applies and saves it (and restarts if
+  // needed) while the response is sent
   if (ret == FORM_VAL_STATUS_OK || ret == FORM_VAL_STATUS_RESTART) {
-    memcpy(app_config, new_config, sizeof(config_t));
-    ret = save_config();
+    update->restart = ret == FORM_VAL_STATUS_RESTART;
+    if (!config_update_post(update, pdMS_TO_TICKS(CONFIG_POST_WAIT_MS))) {
+      ret = FORM_VAL_STATUS_BUSY;
+    }
+  } else {
+    free(update);
   }
 
   // Set the response message
@@ -1506,6 +1879,10 @@ static esp_err_t config_post_handler(httpd_req_t *req) {
   case FORM_VAL_STATUS_FIELD_INVALID:
     strcat(response_message, "Invalid field.<br/>Config not updated.");
     break;
+  case FORM_VAL_STATUS_BUSY:
+    strcat(response_message, "Clock busy, try again.<br/>Config not updated.");
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    break;
   case FORM_VAL_STATUS_RESTART:
     strcat(response_message, "Config updated.<br/>Restarting...");
     break;
@@ -1541,10 +1918,9 @@ static esp_err_t config_post_handler(httpd_req_t *req) {
   // free heap memory
   free(page);
 
-  // restart if needed
-  if (restart) {
-    esp_restart();
-  }
+  portENTER_CRITICAL(&s_config_lock);
+  latency_hist_add(&s_config_stats.post_us, esp_timer_get_time() - start_us);
+  portEXIT_CRITICAL(&s_config_lock);
   return ret;
 }
 
@@ -1569,6 +1945,7 @@ static esp_err_t css_get_handler(httpd_req_t *req) {
     return ESP_FAIL;
   }
   info_lwm("httpd", "Served css");
+  note_http_response();
 
   // free heap memory
   free(page);
@@ -1576,6 +1953,559 @@ static esp_err_t css_get_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
+/* HTTP display debug GET Handler - display latency stats as JSON,
+ * ?reset=1 clears them as they are read */
+static esp_err_t debug_display_get_handler(httpd_req_t *req) {
+  char query[32];
+  char value[8];
+  bool reset = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                   ESP_OK &&
+               httpd_query_key_value(query, "reset", value, sizeof(value)) ==
+                   ESP_OK &&
+               strcmp(value, "1") == 0;
+
+  // take a snapshot so the display task isn't held up while sending, and
+  // clear in the same section so no sample falls between the two
+  display_stats_t stats;
+  portENTER_CRITICAL(&s_display_stats_lock);
+  stats = s_display_stats;
+  if (reset) {
+    memset(&s_display_stats, 0, sizeof(s_display_stats));
+  }
+  portEXIT_CRITICAL(&s_display_stats_lock);
+
+  const size_t size = 4096;
+  char *json = (char *)malloc(size);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  const struct {
+    const char *name;
+    const char *unit;
+    const latency_hist_t *hist;
+  } stages[] = {{"wake", "us", &stats.wake},
+                {"compute", "cycles", &stats.compute},
+                {"transfer", "us", &stats.transfer},
+                {"total", "us", &stats.total}};
+
+  EventBits_t bits = xEventGroupGetBits(s_app_event_group);
+  const char *time_state = (bits & APP_TIME_SYNCED_BIT) ? "synced"
+                           : (bits & APP_TIME_PROVISIONAL_BIT) ? "provisional"
+                                                               : "unsynced";
+  int len = snprintf(json, size,
+                     "{\"uptime_us\":%lld,\"time\":\"%s\","
+                     "\"rtc_drift_ppb\":%ld",
+                     esp_timer_get_time(), time_state,
+                     (long)time_checkpoint_drift_ppb());
+  for (int i = 0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+    int n = snprintf(json + len, size - len, ",\"%s\":", stages[i].name);
+    if (n < 0 || len + n >= size) {
+      len = -1;
+      break;
+    }
+    len += n;
+    n = latency_hist_to_json(stages[i].hist, stages[i].unit, json + len,
+                             size - len);
+    if (n < 0) {
+      len = -1;
+      break;
+    }
+    len += n;
+  }
+  if (len < 0 || len + 2 > size) {
+    ESP_LOGE(TAG, "Display stats don't fit in the response");
+    free(json);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  json[len++] = '}';
+  json[len] = '\0';
+
+  if (reset) {
+    ESP_LOGI(TAG, "Display stats reset");
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  free(json);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP time debug GET Handler - clock discipline state as JSON */
+static esp_err_t debug_time_get_handler(httpd_req_t *req) {
+  clock_discipline_stats_t stats;
+  clock_discipline_get_stats(&stats);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t since_sync_us =
+      stats.last_sync_us ? esp_timer_get_time() - stats.last_sync_us : -1;
+
+  char json[512];
+  int len = snprintf(
+      json, sizeof(json),
+      "{\"time\":%lld.%06ld,\"offset_us\":%lld,\"drift_ppm\":%.3f,"
+      "\"poll_interval_s\":%lu,\"syncs\":%lu,\"steps\":%lu,"
+      "\"since_sync_us\":%lld",
+      (long long)now.tv_sec, (long)now.tv_usec, stats.offset_us,
+      stats.drift_ppb / 1000.0, (unsigned long)stats.poll_interval,
+      (unsigned long)stats.syncs, (unsigned long)stats.steps, since_sync_us);
+#if !CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_NONE
+  // the displayed time (the leader's when following it) and the fleet
+  // sync state
+  fleet_sync_stats_t fleet;
+  fleet_sync_get_stats(&fleet);
+  struct timeval shown;
+  display_now(&shown);
+  struct in_addr leader = {.s_addr = fleet.leader_address};
+  len += snprintf(
+      json + len, sizeof(json) - len,
+      ",\"display_time\":%lld.%06ld,\"fleet\":{\"role\":\"%s\","
+      "\"locked\":%s,\"leader\":\"%s\",\"offset_us\":%lld,"
+      "\"delay_us\":%lld,\"beacons\":%lu,\"delay_requests\":%lu,"
+      "\"delay_responses\":%lu}",
+      (long long)shown.tv_sec, (long)shown.tv_usec,
+      fleet.leader ? "leader" : "follower", fleet.locked ? "true" : "false",
+      fleet.leader_address ? inet_ntoa(leader) : "", fleet.offset_us,
+      fleet.delay_us, (unsigned long)fleet.beacons,
+      (unsigned long)fleet.delay_requests,
+      (unsigned long)fleet.delay_responses);
+#endif
+  len += snprintf(json + len, sizeof(json) - len, "}");
+
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP NTP debug GET Handler - state of the NTP servers as JSON */
+static esp_err_t debug_ntp_get_handler(httpd_req_t *req) {
+  ntp_probe_stats_t stats[NTP_SELECT_MAX_SERVERS];
+  int count = ntp_probe_get_stats(stats, NTP_SELECT_MAX_SERVERS);
+
+  char json[1536];
+  size_t len = snprintf(json, sizeof(json), "{\"servers\":[");
+  for (int i = 0; i < count && len < sizeof(json); i++) {
+    const ntp_server_t *server = &stats[i].server;
+    len += snprintf(
+        json + len, sizeof(json) - len,
+        "%s{\"host\":\"%s\",\"selected\":%s,\"truechimer\":%s,"
+        "\"reach\":%u,\"sent\":%lu,\"received\":%lu,\"stratum\":%u,"
+        "\"offset_us\":%lld,\"delay_us\":%lld,\"jitter_us\":%lld,"
+        "\"root_distance_us\":%lld}",
+        i ? "," : "", stats[i].host, stats[i].selected ? "true" : "false",
+        server->truechimer ? "true" : "false", server->reach,
+        (unsigned long)server->sent, (unsigned long)server->received,
+        server->best.stratum, server->best.offset_us, server->best.delay_us,
+        server->jitter_us, stats[i].root_distance_us);
+  }
+  if (len < sizeof(json)) {
+    len += snprintf(json + len, sizeof(json) - len, "]");
+  }
+#if CONFIG_ELEVEN_BIT_CLOCK_SNTP_SERVER
+  // requests served to the LAN
+  if (s_sntp_server && len < sizeof(json)) {
+    sntp_server_stats_t server_stats;
+    sntp_server_get_stats(s_sntp_server, &server_stats);
+    len += snprintf(json + len, sizeof(json) - len,
+                    ",\"server\":{\"requests\":%lu,\"replies\":%lu,"
+                    "\"ignored\":%lu}",
+                    (unsigned long)server_stats.requests,
+                    (unsigned long)server_stats.replies,
+                    (unsigned long)server_stats.ignored);
+  }
+#endif
+  if (len < sizeof(json)) {
+    len += snprintf(json + len, sizeof(json) - len, "}");
+  }
+  if (len >= sizeof(json)) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP touch debug GET Handler - touch detector state, false positive
+ * rate, detection latency, processing cost, wakeups and gestures as JSON,
+ * /debug/touch?reset=1 clears the counters */
+static esp_err_t debug_touch_get_handler(httpd_req_t *req) {
+  char query[32];
+  char value[8];
+  bool reset = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                   ESP_OK &&
+               httpd_query_key_value(query, "reset", value, sizeof(value)) ==
+                   ESP_OK &&
+               strcmp(value, "1") == 0;
+  // copied and cleared at once, so nothing counted in between is lost
+  touch_input_stats_t stats;
+  touch_input_get_stats(&stats, reset);
+  if (reset) {
+    ESP_LOGI(TAG, "Touch stats reset");
+  }
+
+  const size_t size = 3072;
+  char *json = (char *)malloc(size);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  // rejected crossings of the press threshold per hour, the touches that
+  // would have been false positives without the filters
+  const touch_detector_stats_t *detector = &stats.detector;
+  int64_t elapsed_us = esp_timer_get_time() - stats.since_us;
+  double hours = elapsed_us / 3600e6;
+  // wakeups of the touch task per minute and the share of the time it
+  // slept, to compare with and without CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+  double minutes = elapsed_us / 60e6;
+  int len = snprintf(
+      json, size,
+      "{\"elapsed_s\":%lld,\"frames\":%lu,\"wakeups\":%lu,"
+      "\"wakeups_per_min\":%.1f,\"idle_percent\":%.1f,"
+      "\"monitor_wakeups\":%lu,\"false_wakeups\":%lu,\"refreshes\":%lu,"
+      "\"invalid\":%lu,\"presses\":%lu,\"rejected\":%lu,"
+      "\"rejected_per_hour\":%.1f,\"recalibrations\":%lu,"
+      "\"baseline\":%ld,\"deviation\":%ld,\"noise\":%ld,"
+      "\"taps\":%lu,\"double_taps\":%lu,\"long_presses\":%lu,"
+      "\"gestures_dropped\":%lu",
+      elapsed_us / 1000000, (unsigned long)detector->frames,
+      (unsigned long)stats.wakeups,
+      minutes > 0 ? stats.wakeups / minutes : 0.0,
+      elapsed_us > 0 ? 100.0 * stats.idle_us / elapsed_us : 0.0,
+      (unsigned long)stats.monitor_wakeups,
+      (unsigned long)stats.false_wakeups, (unsigned long)stats.refreshes,
+      (unsigned long)stats.invalid, (unsigned long)detector->presses,
+      (unsigned long)detector->rejected,
+      hours > 0 ? detector->rejected / hours : 0.0,
+      (unsigned long)detector->recalibrations, (long)detector->baseline,
+      (long)detector->deviation, (long)detector->noise,
+      (unsigned long)stats.gestures[TOUCH_GESTURE_TAP],
+      (unsigned long)stats.gestures[TOUCH_GESTURE_DOUBLE_TAP],
+      (unsigned long)stats.gestures[TOUCH_GESTURE_LONG_PRESS],
+      (unsigned long)stats.gestures_dropped);
+
+  const struct {
+    const char *name;
+    const char *unit;
+    const latency_hist_t *hist;
+  } hists[] = {{"latency", "us", &detector->latency},
+               {"cycles", "cycles", &stats.cycles},
+               {"dispatch", "us", &stats.dispatch}};
+  for (int i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+    int n = snprintf(json + len, size - len, ",\"%s\":", hists[i].name);
+    if (n < 0 || len + n >= size) {
+      len = -1;
+      break;
+    }
+    len += n;
+    n = latency_hist_to_json(hists[i].hist, hists[i].unit, json + len,
+                             size - len);
+    if (n < 0) {
+      len = -1;
+      break;
+    }
+    len += n;
+  }
+  if (len < 0 || len + 2 > size) {
+    ESP_LOGE(TAG, "Touch stats don't fit in the response");
+    free(json);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  json[len++] = '}';
+  json[len] = '\0';
+
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  free(json);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP touch capture GET Handler - the raw ADC frames of the touch input
+ * for /debug/touch/capture?seconds=60 (see touch_input.h for the format),
+ * to replay with tools/touch_replay. With &serial=1 they are printed to
+ * the console instead. The server is busy until the capture is sent */
+static esp_err_t debug_touch_capture_get_handler(httpd_req_t *req) {
+  char query[48];
+  char value[8];
+  int seconds = TOUCH_CAPTURE_DEFAULT_S;
+  bool serial = false;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "seconds", value, sizeof(value)) ==
+        ESP_OK) {
+      seconds = atoi(value);
+    }
+    serial = httpd_query_key_value(query, "serial", value, sizeof(value)) ==
+                 ESP_OK &&
+             strcmp(value, "1") == 0;
+  }
+  if (seconds < 1 || seconds > TOUCH_CAPTURE_MAX_S) {
+    seconds = TOUCH_CAPTURE_MAX_S;
+  }
+
+  bool started = serial ? touch_input_capture_serial(seconds)
+                        : touch_input_capture_start(seconds);
+  if (!started) {
+    httpd_resp_set_status(req, "409 Conflict");
+    httpd_resp_sendstr(req, "A capture is already running\n");
+    return ESP_OK;
+  }
+  if (serial) {
+    httpd_resp_sendstr(req, "Capturing to the console\n");
+    note_http_response();
+    return ESP_OK;
+  }
+
+  httpd_resp_set_type(req, "application/octet-stream");
+  httpd_resp_set_hdr(req, "Content-Disposition",
+                     "attachment; filename=\"touch.tcap\"");
+  const size_t size = 1024;
+  char *buf = (char *)malloc(size);
+  if (!buf) {
+    touch_input_capture_stop();
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  int len;
+  while ((len = touch_input_capture_read(buf, size, 1000)) >= 0) {
+    if (len > 0 && httpd_resp_send_chunk(req, buf, len) != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to send the capture");
+      touch_input_capture_stop();
+      free(buf);
+      return ESP_FAIL;
+    }
+  }
+  free(buf);
+  httpd_resp_send_chunk(req, NULL, 0);
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP config debug GET Handler - the config changes and their writes
+ * to NVS as JSON: changes applied and dropped (queue full), the time of
+ * the config POST handler (post), from posted to applied (queue) and to
+ * apply (apply), then the saves requested, the flushes they were
+ * coalesced into, sections and bytes written (flash wear) and the time to
+ * write them (flush). ?reset=1 clears the change stats as they are
+ * read */
+static esp_err_t debug_config_get_handler(httpd_req_t *req) {
+  char query[32];
+  char value[8];
+  bool reset = httpd_req_get_url_query_str(req, query, sizeof(query)) ==
+                   ESP_OK &&
+               httpd_query_key_value(query, "reset", value, sizeof(value)) ==
+                   ESP_OK &&
+               strcmp(value, "1") == 0;
+
+  config_store_stats_t stats;
+  config_store_get_stats(&stats);
+  // copied and cleared in the same section, so no change is lost between
+  config_update_stats_t updates;
+  portENTER_CRITICAL(&s_config_lock);
+  updates = s_config_stats;
+  if (reset) {
+    memset(&s_config_stats, 0, sizeof(s_config_stats));
+  }
+  time_t schedule_at = s_schedule_at;
+  uint8_t schedule_preset = s_schedule_preset;
+  portEXIT_CRITICAL(&s_config_lock);
+
+  const size_t size = 4096;
+  char *json = (char *)malloc(size);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  int len = snprintf(json, size,
+                     "{\"presets\":%d,\"schedule_next\":%lld,"
+                     "\"schedule_preset\":%u,\"updates\":%lu,"
+                     "\"dropped\":%lu,\"saves\":%lu,\"flushes\":%lu,"
+                     "\"sections_written\":%lu,\"bytes_written\":%lu,"
+                     "\"migrations\":%lu",
+                     preset_store_count(), (long long)schedule_at,
+                     schedule_preset, (unsigned long)updates.updates,
+                     (unsigned long)updates.dropped, (unsigned long)stats.saves,
+                     (unsigned long)stats.flushes,
+                     (unsigned long)stats.sections_written,
+                     (unsigned long)stats.bytes_written,
+                     (unsigned long)stats.migrations);
+
+  const struct {
+    const char *name;
+    const latency_hist_t *hist;
+  } hists[] = {{"post", &updates.post_us},
+               {"queue", &updates.queue_us},
+               {"apply", &updates.apply_us},
+               {"flush", &stats.flush_us}};
+  for (int i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+    int n = snprintf(json + len, size - len, ",\"%s\":", hists[i].name);
+    if (n < 0 || len + n >= size) {
+      len = -1;
+      break;
+    }
+    len += n;
+    n = latency_hist_to_json(hists[i].hist, "us", json + len, size - len);
+    if (n < 0) {
+      len = -1;
+      break;
+    }
+    len += n;
+  }
+  if (len < 0 || len + 2 > size) {
+    ESP_LOGE(TAG, "Config stats don't fit in the response");
+    free(json);
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  json[len++] = '}';
+  json[len] = '\0';
+
+  if (reset) {
+    ESP_LOGI(TAG, "Config stats reset");
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  int ret = httpd_resp_send(req, json, len);
+  free(json);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP boot debug GET Handler - the boot profile as JSON: the start and
+ * duration of each boot phase and the time to each milestone (us since
+ * the app started), and the time to the first frame of the last cold
+ * and warm boots */
+static esp_err_t debug_boot_get_handler(httpd_req_t *req) {
+  char json[1024];
+  int len = boot_profile_to_json(json, sizeof(json));
+  if (len < 0) {
+    ESP_LOGE(TAG, "Boot profile doesn't fit in the response");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  if (httpd_resp_send(req, json, len) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP Wi-Fi debug GET Handler - the connections to the AP as JSON: the
+ * connections made, how many with a fast connect to the cached AP, fast
+ * connects fallen back to a full scan, connections given the cached
+ * address again, and the time of the last connection to the address
+ * (connect), to the association (assoc) and from there to the address
+ * (dhcp), in us */
+static esp_err_t debug_wifi_get_handler(httpd_req_t *req) {
+  portENTER_CRITICAL(&s_wifi_lock);
+  wifi_link_stats_t stats = s_wifi_link.stats;
+  portEXIT_CRITICAL(&s_wifi_lock);
+
+  char json[256];
+  int len = wifi_link_stats_to_json(&stats, json, sizeof(json));
+  if (len < 0) {
+    ESP_LOGE(TAG, "Wi-Fi stats don't fit in the response");
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+
+  httpd_resp_set_type(req, "application/json");
+  if (httpd_resp_send(req, json, len) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  note_http_response();
+  return ESP_OK;
+}
+
+/* HTTP time zone API GET Handler - names of the time zones starting with
+ * a prefix (region or city) as JSON, e.g. /api/tz?prefix=amer&limit=20
+ * returns {"total":149,"zones":["America/Adak",...]} */
+static esp_err_t api_tz_get_handler(httpd_req_t *req) {
+  char query[96] = "";
+  char value[MAX_TIMEZONE_LEN * 3] = ""; // url encoded
+  char prefix[MAX_TIMEZONE_LEN] = "";
+  int limit = TZ_API_DEFAULT_LIMIT;
+
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK) {
+    if (httpd_query_key_value(query, "prefix", value, sizeof(value)) ==
+            ESP_OK &&
+        strlen(value) < sizeof(prefix)) {
+      url_decode(prefix, value);
+    }
+    if (httpd_query_key_value(query, "limit", value, sizeof(value)) ==
+        ESP_OK) {
+      limit = atoi(value);
+    }
+  }
+  if (limit < 1 || limit > TZ_API_MAX_LIMIT) {
+    limit = TZ_API_MAX_LIMIT;
+  }
+
+  int positions[TZ_API_MAX_LIMIT];
+  int total = tz_index_search(prefix, positions, limit);
+  int count = MIN(total, limit);
+
+  // names are at most 31 chars and don't need escaping
+  const size_t size = 32 + TZ_API_MAX_LIMIT * (MAX_TIMEZONE_LEN + 3);
+  char *json = (char *)malloc(size);
+  if (!json) {
+    httpd_resp_send_500(req);
+    return ESP_FAIL;
+  }
+  int len = snprintf(json, size, "{\"total\":%d,\"zones\":[", total);
+  for (int i = 0; i < count; i++) {
+    size_t name_len;
+    const char *name = tz_index_name(positions[i], &name_len);
+    len += snprintf(json + len, size - len, "%s\"%.*s\"", i ? "," : "",
+                    (int)MIN(name_len, MAX_TIMEZONE_LEN - 1), name);
+  }
+  len += snprintf(json + len, size - len, "]}");
+
+  httpd_resp_set_type(req, "application/json");
+  // the list only changes with the firmware
+  httpd_resp_set_hdr(req, "Cache-Control", "max-age=86400");
+  int ret = httpd_resp_send(req, json, len);
+  free(json);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send response");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
 /* HTTP Error (404) Handler */
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err) {
   // Set status
@@ -1633,7 +2563,39 @@ static const httpd_uri_t routes[] = {
     {.uri = "/", .method = HTTP_GET, .handler = setup_root_get_handler},
     {.uri = "/", .method = HTTP_POST, .handler = config_post_handler},
     {.uri = "/", .method = HTTP_POST, .handler = wifi_post_handler},
-    {.uri = "/css", .method = HTTP_GET, .handler = css_get_handler}};
+    {.uri = "/css", .method = HTTP_GET, .handler = css_get_handler},
+    {.uri = "/debug/display",
+     .method = HTTP_GET,
+     .handler = debug_display_get_handler},
+    {.uri = "/debug/time",
+     .method = HTTP_GET,
+     .handler = debug_time_get_handler},
+    {.uri = "/debug/ntp", .method = HTTP_GET, .handler = debug_ntp_get_handler},
+    {.uri = "/debug/touch",
+     .method = HTTP_GET,
+     .handler = debug_touch_get_handler},
+    {.uri = "/debug/touch/capture",
+     .method = HTTP_GET,
+     .handler = debug_touch_capture_get_handler},
+    {.uri = "/debug/config",
+     .method = HTTP_GET,
+     .handler = debug_config_get_handler},
+    {.uri = "/debug/boot",
+     .method = HTTP_GET,
+     .handler = debug_boot_get_handler},
+    {.uri = "/debug/wifi",
+     .method = HTTP_GET,
+     .handler = debug_wifi_get_handler},
+    {.uri = "/api/tz", .method = HTTP_GET, .handler = api_tz_get_handler},
+    {.uri = "/api/config",
+     .method = HTTP_GET,
+     .handler = api_config_get_handler},
+    {.uri = "/api/presets",
+     .method = HTTP_GET,
+     .handler = api_presets_get_handler},
+    {.uri = "/api/presets",
+     .method = HTTP_POST,
+     .handler = api_presets_post_handler}};
 
 static httpd_handle_t start_webserver(bool captive_portal) {
   httpd_handle_t server = NULL;
@@ -1641,6 +2603,7 @@ static httpd_handle_t start_webserver(bool captive_portal) {
   config.stack_size = 8192;
   config.max_open_sockets = 7;
   config.lru_purge_enable = true;
+  config.max_uri_handlers = 16; // default is 8
 
   // Start the httpd server
   ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -1656,6 +2619,18 @@ static httpd_handle_t start_webserver(bool captive_portal) {
       ESP_LOGI(TAG, "Registering URI handlers for clock");
       httpd_register_uri_handler(server, &routes[ROUTE_ROOT]);
       httpd_register_uri_handler(server, &routes[ROUTE_CONFIG]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_DISPLAY]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_TIME]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_NTP]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_TOUCH]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_TOUCH_CAPTURE]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_CONFIG]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_BOOT]);
+      httpd_register_uri_handler(server, &routes[ROUTE_DEBUG_WIFI]);
+      httpd_register_uri_handler(server, &routes[ROUTE_API_TZ]);
+      httpd_register_uri_handler(server, &routes[ROUTE_API_CONFIG]);
+      httpd_register_uri_handler(server, &routes[ROUTE_API_PRESETS]);
+      httpd_register_uri_handler(server, &routes[ROUTE_API_PRESETS_POST]);
       httpd_register_err_handler(server, HTTPD_404_NOT_FOUND,
                                  http_404_error_handler);
     }
@@ -1696,18 +2671,18 @@ led_strip_handle_t configure_led(void) {
       .b_pos = 2,          // blue is the third byte in the color data
       .num_components = 3, // total 3 color components
   };
+#if DISPLAY_RGBW
   // Set change format for SK6812
-  if (led_type == LED_MODEL_SK6812) {
-    color_format.w_pos = 3;
-    color_format.num_components = 4;
-  }
+  color_format.w_pos = 3;
+  color_format.num_components = 4;
+#endif
 
   // LED strip general initialization, according to your led board design
   led_strip_config_t strip_config = {
       .strip_gpio_num = LED_STRIP_GPIO_PIN, // The GPIO that connected to the
                                             // LED strip's data line
       .max_leds = LED_STRIP_LED_COUNT,      // The number of LEDs in the strip,
-      .led_model = led_type,                // LED type: WS2812 or SK6812
+      .led_model = LED_STRIP_MODEL,         // LED type: WS2812 or SK6812
       // set the color order of the strip
       .color_component_format =
           {
@@ -1717,6 +2692,21 @@ led_strip_handle_t configure_led(void) {
           .invert_out = false, // don't invert the output signal
       }};
 
+  // LED Strip object handle
+  led_strip_handle_t led_strip;
+
+#if CONFIG_ELEVEN_BIT_CLOCK_LED_BACKEND_SIM
+  // LED strip backend configuration: simulated (no hardware)
+  led_strip_sim_config_t sim_config = {
+      .capture_path = CONFIG_ELEVEN_BIT_CLOCK_LED_SIM_CAPTURE_PATH,
+#if CONFIG_ELEVEN_BIT_CLOCK_LED_SIM_ANSI_PREVIEW
+      .ansi_preview = true,
+#endif
+  };
+  ESP_ERROR_CHECK(
+      led_strip_new_sim_device(&strip_config, &sim_config, &led_strip));
+  ESP_LOGI(TAG, "Created LED strip object with simulated backend");
+#else
   // LED strip backend configuration: SPI
   led_strip_spi_config_t spi_config = {
       .clk_src = SPI_CLK_SRC_DEFAULT, // different clock source can lead to
@@ -1727,27 +2717,47 @@ led_strip_handle_t configure_led(void) {
                             // more LEDs
       }};
 
-  // LED Strip object handle
-  led_strip_handle_t led_strip;
   ESP_ERROR_CHECK(
       led_strip_new_spi_device(&strip_config, &spi_config, &led_strip));
   ESP_LOGI(TAG, "Created LED strip object with SPI backend");
+#endif
   return led_strip;
 }
 
-void print_display_bits(uint16_t time_bits) {
-  char bit_str[17]; // 16 bits + null terminator
-  bit_str[16] = '\0';
+/* Send a frame to the led strip, recording when the SPI transfer starts
+ * and the refresh completes in timing (if not NULL) */
+static void show_frame(const color_t *frame, frame_timing_t *timing) {
+  for (int i = 0; i < LED_STRIP_LED_COUNT; i++) {
+    // If SK6812, set pixel with RGBW, otherwise set pixel with RGB
+#if DISPLAY_RGBW
+    ESP_ERROR_CHECK(led_strip_set_pixel_rgbw(
+        *led_strip, i, frame[i].r, frame[i].g, frame[i].b, frame[i].w));
+#else
+    ESP_ERROR_CHECK(
+        led_strip_set_pixel(*led_strip, i, frame[i].r, frame[i].g, frame[i].b));
+#endif
+  }
+  if (timing) {
+    timing->transfer_cycles = esp_cpu_get_cycle_count();
+    timing->transfer_us = esp_timer_get_time();
+  }
+  /* Refresh the strip to send data */
+  ESP_ERROR_CHECK(led_strip_refresh(*led_strip));
+  if (timing) {
+    timing->done_us = esp_timer_get_time();
+  }
+}
+
+void print_display_bits(uint32_t time_bits) {
+  char bit_str[LED_STRIP_LED_COUNT + 1]; // 1 char per pixel + null terminator
+  bit_str[LED_STRIP_LED_COUNT] = '\0';
 
-  for (int i = 0; i < 16; i++) {
-    bit_str[15 - i] = (time_bits & (1 << i)) ? '1' : '0';
+  for (int i = 0; i < LED_STRIP_LED_COUNT; i++) {
+    bit_str[LED_STRIP_LED_COUNT - 1 - i] = (time_bits & (1 << i)) ? '1' : '0';
   }
 
-  // Format: [5 unused][1 AM/PM][4 Hours][6 Minutes]
-  ESP_LOGI(TAG, "Display: |%c|%.*s|%.*s|",
-           bit_str[5],       // AM/PM bit
-           4, &bit_str[6],   // hour bits
-           6, &bit_str[10]); // minute bits
+  // Format: one bit per pixel, first pixel on the left
+  ESP_LOGI(TAG, "Display: |%s|", bit_str);
 }
 
 /* Display time (normal mode) or end of IP address (identify mode) */
@@ -1757,136 +2767,168 @@ void display_time_task(void *pvParameters) {
   // config_t *config = (config_t *)pvParameters;
   (void)pvParameters; // Suppress unused parameter warning
 
-  time_t now = 0;
+  struct timeval tv;
   struct tm timeinfo = {0};
+  tz_cache_t tz = TZ_CACHE_INIT; // offset until the next DST transition
+  frame_timing_t timing;
+
+  // Last frame sent to the strip, only changed frames are sent again
+  color_t frame[LED_STRIP_LED_COUNT];
+  color_t last_frame[LED_STRIP_LED_COUNT];
+  bool have_last_frame = false;
+  // Boundary of the time last shown (0 if showing something else)
+  time_t last_boundary = 0;
+  int last_logged_min = -1;
+
+  // Refresh on each second (or minute) boundary
+  const esp_timer_create_args_t timer_args = {
+      .callback = boundary_timer_cb,
+      .name = "boundary_timer",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_boundary_timer));
+  boundary_timer_arm();
 
   while (true) {
 
+    // Wait for the next boundary or a mode change, but check the time at
+    // least every 500 ms
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(500));
+
+    // The strip is used to flash the lights in setup mode
+    if (app_mode == APP_MODE_SETUP) {
+      have_last_frame = false;
+      continue;
+    }
+
     // Check if we are in identify mode
-    EventBits_t bits =
-        xEventGroupWaitBits(s_app_event_group, APP_MODE_IDENTIFY, pdFALSE,
-                            pdFALSE, pdMS_TO_TICKS(500));
+    EventBits_t bits = xEventGroupGetBits(s_app_event_group);
     if (bits & APP_MODE_IDENTIFY) {
 
-      // We are in identify mode, show the end of the IP address
-      uint16_t ip_bits = 0;
-      uint8_t last_quad = (uint8_t)((device_ip.addr >> 24) & 0xFF);
-      ESP_LOGI(TAG, "IP last quad: %d", last_quad);
-      ip_bits |= (last_quad >> 4) << 6;   // most significant nibble
-      ip_bits |= (last_quad & 0x0F) << 1; // least significant nibble
-      // print_display_bits(ip_bits);
-
-      // Setup mac address bits array for led strip api
-      bool ip_bits_array[11];
-      size_t count = 0;
-      for (int i = 10; i >= 0; i--) {
-        ip_bits_array[count] = (ip_bits & (1 << i)) ? true : false;
-        count++;
+      // We are in identify mode, show the end of the IP address, or each
+      // quad in turn with a blank step between them (two at the end)
+      int quad = 3;
+      if (s_identify_full) {
+        int step = (esp_timer_get_time() - s_identify_full_us) /
+                   (IDENTIFY_QUAD_MS * 1000LL) % 9;
+        quad = step % 2 == 0 && step < 8 ? step / 2 : -1;
       }
-
-      // Set pixel color for each led
-      for (int i = 0; i < 11; i++) {
-        uint8_t r = 0;
-        uint8_t g = 0;
-        uint8_t b = 0;
-        uint8_t w = 0;
-        // last quad of the mac address will be displayed
-        // on the 8 pixels in the middle of the pyramid
-        if (i != 0 && i != 5 && i != 10) {
-          if (led_type == LED_MODEL_SK6812) {
-            g = ip_bits_array[i] ? 50 : 0;
-            w = ip_bits_array[i] ? 0 : 3;
-          } else {
-            g = ip_bits_array[i] ? 50 : 1;
-          }
-        }
-        // If SK6812, set pixel with RGBW, otherwise set pixel with RGB
-        if (led_type == LED_MODEL_SK6812) {
-          ESP_ERROR_CHECK(led_strip_set_pixel_rgbw(*led_strip, i, r, g, b, w));
-        } else {
-          ESP_ERROR_CHECK(led_strip_set_pixel(*led_strip, i, r, g, b));
-        }
+      uint8_t value = quad >= 0 ? (device_ip.addr >> (8 * quad)) & 0xFF : 0;
+      if (quad >= 0) {
+        display_render_ip(value, frame);
+      } else {
+        memset(frame, 0, sizeof(frame));
       }
-      /* Refresh the strip to send data */
-      ESP_ERROR_CHECK(led_strip_refresh(*led_strip));
+      if (s_dim) {
+        display_scale(frame, DIM_SCALE);
+      }
+      if (have_last_frame && display_frame_equal(frame, last_frame)) {
+        continue;
+      }
+      show_frame(frame, NULL);
+      last_boundary = 0;
+      if (quad >= 0) {
+        ESP_LOGI(TAG, "IP quad %d: %d", quad + 1, value);
+      }
+    } else if (!(bits & (APP_TIME_SYNCED_BIT | APP_TIME_PROVISIONAL_BIT)) &&
+               !following_leader()) {
+
+      // The time isn't known yet, show the unsynced pattern (one step per
+      // wake up) until time_sync_notification_cb sets the time
+      display_render_unsynced(esp_timer_get_time() / 500000, frame);
+      if (s_dim) {
+        display_scale(frame, DIM_SCALE);
+      }
+      if (have_last_frame && display_frame_equal(frame, last_frame)) {
+        continue;
+      }
+      show_frame(frame, NULL);
+      last_boundary = 0;
     } else {
 
       // We are in normal mode, show the time
-      time(&now);
-      localtime_r(&now, &timeinfo);
-      ESP_LOGI(TAG, "Time: %d:%d", timeinfo.tm_hour, timeinfo.tm_min);
-
-      // Setup time bits for led display
-      uint16_t time_bits = 0;
-      time_bits |= (timeinfo.tm_hour > 11) << 10; // AM/PM (1 bit)
-      uint8_t hour = timeinfo.tm_hour == 12 ? 12 : timeinfo.tm_hour % 12;
-      if (hour == 0)
-        hour = 12;                    // midnight should display as 12
-      time_bits |= (hour) << 6;       // hours (in 4 bits)
-      time_bits |= (timeinfo.tm_min); // minutes (in 6 bits)
-      print_display_bits(time_bits);
-
-      // Setup time bits array for led strip api
-      bool time_bits_array[11];
-      size_t count = 0;
-      for (int i = 10; i >= 0; i--) {
-        time_bits_array[count] = (time_bits & (1 << i)) ? true : false;
-        count++;
+      timing.compute_cycles = esp_cpu_get_cycle_count();
+      timing.compute_us = esp_timer_get_time();
+      display_now(&tv);
+      tz_cache_localtime(&tz, tv.tv_sec, &timeinfo);
+
+      // copy the palette, the config writer may be changing it
+      display_palette_t palette;
+      portENTER_CRITICAL(&s_config_lock);
+      uint8_t active_preset = app_config->active_preset;
+      palette = s_palette;
+      portEXIT_CRITICAL(&s_config_lock);
+
+      display_render_time(&timeinfo, &palette, frame);
+      if (s_dim) {
+        display_scale(frame, DIM_SCALE);
       }
-
-      config_t *config = app_config;
-      ESP_LOGI(TAG, "Active preset: %d", config->active_preset);
-
-      preset_t *preset = &config->preset_1;
-      if (config->active_preset == 2) {
-        preset = &config->preset_2;
-      } else if (config->active_preset == 3) {
-        preset = &config->preset_3;
+      if (have_last_frame && display_frame_equal(frame, last_frame)) {
+        continue;
       }
+      show_frame(frame, &timing);
 
-      // Set pixel color for each led
-      for (int i = 0; i < 11; i++) {
-        uint8_t r = 0;
-        uint8_t g = 0;
-        uint8_t b = 0;
-        uint8_t w = 0;
-        // AM/PM LED
-        if (i == 0) {
-          r = time_bits_array[i] ? preset->pm_color.r : preset->am_color.r;
-          g = time_bits_array[i] ? preset->pm_color.g : preset->am_color.g;
-          b = time_bits_array[i] ? preset->pm_color.b : preset->am_color.b;
-          w = time_bits_array[i] ? preset->pm_color.w : preset->am_color.w;
-          // Hour LEDs
-        } else if (i > 0 && i < 5) {
-          r = time_bits_array[i] ? preset->hr1_color.r : preset->hr0_color.r;
-          g = time_bits_array[i] ? preset->hr1_color.g : preset->hr0_color.g;
-          b = time_bits_array[i] ? preset->hr1_color.b : preset->hr0_color.b;
-          w = time_bits_array[i] ? preset->hr1_color.w : preset->hr0_color.w;
-          // Minute LEDs
-        } else if (i > 4 && i < 11) {
-          r = time_bits_array[i] ? preset->min1_color.r : preset->min0_color.r;
-          g = time_bits_array[i] ? preset->min1_color.g : preset->min0_color.g;
-          b = time_bits_array[i] ? preset->min1_color.b : preset->min0_color.b;
-          w = time_bits_array[i] ? preset->min1_color.w : preset->min0_color.w;
-        }
-        // If SK6812, set pixel with RGBW, otherwise set pixel with RGB
-        if (led_type == LED_MODEL_SK6812) {
-          ESP_ERROR_CHECK(led_strip_set_pixel_rgbw(*led_strip, i, r, g, b, w));
-        } else {
-          ESP_ERROR_CHECK(led_strip_set_pixel(*led_strip, i, r, g, b));
-        }
+      // the frame shows a new second (or minute), record how late it is
+      // unless it is the first one shown
+#if DISPLAY_HAS_SECONDS
+      time_t boundary = tv.tv_sec;
+#else
+      time_t boundary = tv.tv_sec - timeinfo.tm_sec;
+#endif
+      if (last_boundary != 0 && boundary != last_boundary) {
+        timing.boundary_offset_us =
+            (int64_t)(tv.tv_sec - boundary) * 1000000LL + tv.tv_usec;
+        record_frame_timing(&timing);
+      }
+      last_boundary = boundary;
+
+      // log after the refresh (and once a minute) to keep it off the
+      // display path
+      if (timeinfo.tm_min != last_logged_min) {
+        last_logged_min = timeinfo.tm_min;
+        ESP_LOGI(TAG, "Time: %d:%d", timeinfo.tm_hour, timeinfo.tm_min);
+        print_display_bits(display_time_bits(&timeinfo));
+        ESP_LOGI(TAG, "Active preset: %d", active_preset);
+        time_checkpoint_save();
+        info_lwm("display_time", "Shown the time");
       }
-      /* Refresh the strip to send data */
-      ESP_ERROR_CHECK(led_strip_refresh(*led_strip));
     }
-    // vTaskDelay(pdMS_TO_TICKS(500));
+
+    if (!have_last_frame) {
+      boot_profile_milestone(BOOT_MILESTONE_FIRST_FRAME);
+    }
+    memcpy(last_frame, frame, sizeof(frame));
+    have_last_frame = true;
   }
   vTaskDelete(NULL);
 }
 
+/* Start the display task (if not started yet) */
+static void start_display(void) {
+  if (s_display_task_handle) {
+    return;
+  }
+
+  // Copy config to a copy to avoid other tasks from modifying the config
+  config_t *config_copy = malloc(sizeof(config_t));
+  memset(config_copy, 0, sizeof(config_t));
+  memcpy(config_copy, app_config, sizeof(config_t));
+
+  // Stop the startup animation before the display task takes over the strip
+  app_mode = APP_MODE_NORMAL;
+  xEventGroupWaitBits(s_app_event_group, APP_ANIMATION_DONE_BIT, pdFALSE,
+                      pdFALSE, pdMS_TO_TICKS(100));
+
+  // Priority above the web and DNS servers so the refresh stays on time.
+  // The stack holds two frames, the tz cache and the logging of every
+  // minute, where its low water mark is logged too
+  xTaskCreate(&display_time_task, "display_time", 3072, config_copy, 6,
+              &s_display_task_handle);
+}
+
 static void start_clock(void) {
 
   ESP_LOGI(TAG, "Starting clock");
+  boot_profile_begin(BOOT_PHASE_SNTP);
 
 #if LWIP_DHCP_GET_NTP_SRV
   /**
@@ -1922,32 +2964,42 @@ static void start_clock(void) {
   esp_sntp_config_t ntp_config =
       ESP_NETIF_SNTP_DEFAULT_CONFIG(app_config->ntp_server_1);
 #endif
-  ntp_config.sync_cb = time_sync_notification_cb;
+  // the clock discipline updates the time and calls the sync callback,
+  // so ntp_config.sync_cb isn't used
+  clock_discipline_init(time_sync_notification_cb);
   esp_netif_sntp_init(&ntp_config);
 
+  // probe all the servers and make the best one the primary SNTP server
+  const char *ntp_servers[] = {app_config->ntp_server_1,
+                               app_config->ntp_server_2,
+                               app_config->ntp_server_3,
+                               app_config->ntp_server_4};
+  ntp_probe_start(ntp_servers, 4);
+
+#if CONFIG_ELEVEN_BIT_CLOCK_SNTP_SERVER
+  // answered as unsynchronized until the first sync
+  sntp_server_config_t sntp_server_config = SNTP_SERVER_CONFIG_DEFAULT();
+  s_sntp_server = start_sntp_server(&sntp_server_config);
+#endif
+
+#if CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_LEADER
+  // beacons are sent once the time is synced
+  fleet_sync_start_leader();
+#elif CONFIG_ELEVEN_BIT_CLOCK_FLEET_ROLE_FOLLOWER
+  // the display follows the leader's time once locked to it
+  fleet_sync_start_follower(fleet_lock_changed);
+#endif
+
 #if LWIP_DHCP_GET_NTP_SRV
   // This is needed in the case of getting NTP server address via DHCP
   esp_netif_sntp_start();
 #endif
 
-  // wait for time to be set
-  int retry = 0;
-  const int retry_count = 15;
-  while (esp_netif_sntp_sync_wait(2000 / portTICK_PERIOD_MS) ==
-             ESP_ERR_TIMEOUT &&
-         ++retry < retry_count) {
-    ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry,
-             retry_count);
-  }
-
-  // Copy config to a copy to avoid other tasks from modifying the config
-  config_t *config_copy = malloc(sizeof(config_t));
-  memset(config_copy, 0, sizeof(config_t));
-  memcpy(config_copy, app_config, sizeof(config_t));
-
-  app_mode = APP_MODE_NORMAL;
+  // Don't wait for the time to be set, the display shows the unsynced
+  // pattern until time_sync_notification_cb is called
+  boot_profile_end(BOOT_PHASE_SNTP);
 
-  xTaskCreate(&display_time_task, "display_time", 2048, config_copy, 5, NULL);
+  start_display();
 }
 
 /* play the startup animation */
@@ -1957,14 +3009,14 @@ void startup_animation(void *pvParameters) {
 
   ESP_LOGI(TAG, "Playing startup animation");
 
-  const uint8_t NUM_LEDS = 11;    /* The amount of pixels/leds you have */
+  const uint8_t NUM_LEDS = LED_STRIP_LED_COUNT; /* The amount of pixels/leds */
   const uint8_t BRIGHTNESS = 20;  /* Control the brightness of your leds */
   const uint8_t SATURATION = 255; /* Control the saturation of your leds */
 
   while (app_mode == APP_MODE_STARTUP) {
-    for (int j = 0; j < 361; j++) {
+    for (int j = 0; j < 361 && app_mode == APP_MODE_STARTUP; j++) {
       for (int i = 0; i < NUM_LEDS; i++) {
-        uint16_t hue = j + i * 32 < 360 ? j + i * 32 : j + i * 32 - 360;
+        uint16_t hue = (j + i * 32) % 360; // layouts may have > 11 pixels
         if (i == 5) {
           // ESP_LOGI(TAG, "%d + %d * 32 = %d", j, i, hue);
         }
@@ -1979,6 +3031,7 @@ void startup_animation(void *pvParameters) {
     }
     // }
   }
+  xEventGroupSetBits(s_app_event_group, APP_ANIMATION_DONE_BIT);
   vTaskDelete(NULL);
 }
 
@@ -2001,12 +3054,12 @@ void flash_lights(void *pvParameters) {
     }
     if (led_on_off) {
       // Set pixel color for each led
-      for (int i = 0; i < 11; i++) {
-        if (led_type == LED_MODEL_SK6812) {
-          ESP_ERROR_CHECK(led_strip_set_pixel_rgbw(*led_strip, i, 0, 0, 0, 50));
-        } else {
-          ESP_ERROR_CHECK(led_strip_set_pixel(*led_strip, i, 50, 50, 50));
-        }
+      for (int i = 0; i < LED_STRIP_LED_COUNT; i++) {
+#if DISPLAY_RGBW
+        ESP_ERROR_CHECK(led_strip_set_pixel_rgbw(*led_strip, i, 0, 0, 0, 50));
+#else
+        ESP_ERROR_CHECK(led_strip_set_pixel(*led_strip, i, 50, 50, 50));
+#endif
       }
       ESP_ERROR_CHECK(led_strip_refresh(*led_strip));
     } else {
@@ -2018,63 +3071,132 @@ void flash_lights(void *pvParameters) {
   vTaskDelete(NULL);
 }
 
-static bool IRAM_ATTR s_conv_done_cb(adc_continuous_handle_t handle,
-                                     const adc_continuous_evt_data_t *edata,
-                                     void *user_data) {
-  BaseType_t mustYield = pdFALSE;
-  // Notify that ADC continuous driver has done enough number of conversions
-  vTaskNotifyGiveFromISR(s_task_handle, &mustYield);
+/* Switch between the normal and identify modes (no change in other
+ * modes) and refresh the display */
+static void identify_set(bool on) {
+  static int identify_count = 0; // count of activations of identify mode
 
-  return (mustYield == pdTRUE);
+  portENTER_CRITICAL(&s_identify_lock);
+  bool change = app_mode == (on ? APP_MODE_NORMAL : APP_MODE_IDENTIFY);
+  if (change) {
+    app_mode = on ? APP_MODE_IDENTIFY : APP_MODE_NORMAL;
+  }
+  portEXIT_CRITICAL(&s_identify_lock);
+  if (!change) {
+    return;
+  }
+
+  if (on) {
+    s_identify_full = false;
+    xEventGroupSetBits(s_app_event_group, APP_MODE_IDENTIFY);
+    identify_count++;
+    ESP_LOGI(TAG, "Identify mode activated, count: %d", identify_count);
+  } else {
+    xEventGroupClearBits(s_app_event_group, APP_MODE_IDENTIFY);
+    ESP_LOGI(TAG, "Identify mode ended");
+  }
+  xTaskNotifyGive(s_display_task_handle);
 }
 
-static void continuous_adc_init(adc_channel_t *channel, uint8_t channel_num,
-                                adc_continuous_handle_t *out_handle) {
-  adc_continuous_handle_t handle = NULL;
+/* (Re)start the identify mode timeout */
+static void identify_timer_arm(void) {
+  esp_timer_stop(s_identify_timer);
+  esp_timer_start_once(s_identify_timer, IDENTIFY_TIMEOUT * 1000LL);
+}
 
-  adc_continuous_handle_cfg_t adc_config = {
-      .max_store_buf_size = 1024,
-      .conv_frame_size = EXAMPLE_READ_LEN,
-  };
-  ESP_ERROR_CHECK(adc_continuous_new_handle(&adc_config, &handle));
+static void identify_timer_cb(void *arg) {
+  // extended while this callback was pending
+  if (esp_timer_is_active(s_identify_timer)) {
+    return;
+  }
+  identify_set(false);
+}
 
-  adc_continuous_config_t dig_cfg = {
-      .sample_freq_hz = 620, // minimum for ESP32C3 is 611
-      .conv_mode = EXAMPLE_ADC_CONV_MODE,
-      // .format = EXAMPLE_ADC_OUTPUT_TYPE,
-  };
+/* Gesture subscriber of the identify mode: a tap starts it and a tap
+ * ends it, a long press while identifying shows the full IP address and
+ * restarts the timeout, or opens the setup mode if the clock isn't
+ * connected */
+static void identify_gesture_cb(const touch_gesture_event_t *event,
+                                void *arg) {
+  if (event->gesture == TOUCH_GESTURE_TAP) {
+    if (app_mode == APP_MODE_NORMAL) {
+      identify_timer_arm();
+      identify_set(true);
+    } else {
+      esp_timer_stop(s_identify_timer);
+      identify_set(false);
+    }
+  } else if (app_mode == APP_MODE_IDENTIFY &&
+             !(xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT)) {
+    // no address to show, the clock can't reach the AP: open the setup
+    // mode (e.g. to join another network)
+    ESP_LOGI(TAG, "Setup mode requested");
+    xEventGroupSetBits(s_wifi_event_group, WIFI_SETUP_BIT);
+  } else if (app_mode == APP_MODE_IDENTIFY) {
+    identify_timer_arm();
+    s_identify_full_us = esp_timer_get_time();
+    s_identify_full = true;
+    ESP_LOGI(TAG, "Identify mode extended, showing the full IP address");
+    xTaskNotifyGive(s_display_task_handle);
+  }
+}
 
-  adc_digi_pattern_config_t adc_pattern[SOC_ADC_PATT_LEN_MAX] = {0};
-  dig_cfg.pattern_num = channel_num;
-  for (int i = 0; i < channel_num; i++) {
-    adc_pattern[i].atten = EXAMPLE_ADC_ATTEN;
-    adc_pattern[i].channel = channel[i] & 0x7;
-    adc_pattern[i].unit = EXAMPLE_ADC_UNIT;
-    adc_pattern[i].bit_width = EXAMPLE_ADC_BIT_WIDTH;
+/* Gesture subscriber of the presets: a double tap shows the next one */
+static void preset_gesture_cb(const touch_gesture_event_t *event,
+                              void *arg) {
+  if (app_mode != APP_MODE_NORMAL) {
+    return;
+  }
+  config_update_t *update = config_update_begin();
+  if (!update) {
+    return;
+  }
+  update->config.active_preset =
+      preset_store_next(update->base.active_preset);
+  if (update->config.active_preset == 0) {
+    free(update);
+    return;
+  }
+  ESP_LOGI(TAG, "Active preset: %d", update->config.active_preset);
+  config_update_post(update, 0);
+}
 
-    ESP_LOGI(TAG, "adc_pattern[%d].atten is :%" PRIx8, i, adc_pattern[i].atten);
-    ESP_LOGI(TAG, "adc_pattern[%d].channel is :%" PRIx8, i,
-             adc_pattern[i].channel);
-    ESP_LOGI(TAG, "adc_pattern[%d].unit is :%" PRIx8, i, adc_pattern[i].unit);
+/* Gesture subscriber of the dim mode: a long press (outside the identify
+ * mode) switches it */
+static void dim_gesture_cb(const touch_gesture_event_t *event, void *arg) {
+  if (app_mode != APP_MODE_NORMAL) {
+    return;
   }
-  dig_cfg.adc_pattern = adc_pattern;
-  ESP_ERROR_CHECK(adc_continuous_config(handle, &dig_cfg));
+  s_dim = !s_dim;
+  ESP_LOGI(TAG, "Dim mode %s", s_dim ? "on" : "off");
+  xTaskNotifyGive(s_display_task_handle);
+}
 
-  *out_handle = handle;
+/* Initialize the Wi-Fi driver. It only needs NVS (for its calibration
+ * data), so it runs in its own task while app_main loads the config */
+static void wifi_init_task(void *pvParameters) {
+  boot_profile_begin(BOOT_PHASE_WIFI_INIT);
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  boot_profile_end(BOOT_PHASE_WIFI_INIT);
+  xEventGroupSetBits(s_wifi_event_group, WIFI_DRIVER_READY_BIT);
+  vTaskDelete(NULL);
 }
 
 void app_main(void) {
+  // Timestamps of the boot phases, see /debug/boot
+  boot_profile_init();
+
   // Setup led strip
+  boot_profile_begin(BOOT_PHASE_LED);
   led_strip = calloc(1, sizeof(led_strip_handle_t));
   *led_strip = configure_led();
+  boot_profile_end(BOOT_PHASE_LED);
 
   /* Initialize event groups */
   s_wifi_event_group = xEventGroupCreate();
   s_app_event_group = xEventGroupCreate();
 
-  // Startup animation
-  xTaskCreate(&startup_animation, "startup_animation", 2048, NULL, 5, NULL);
-
   // Allocate memory for app config
   app_config = calloc(1, sizeof(config_t));
 
@@ -2087,6 +3209,7 @@ void app_main(void) {
   esp_log_level_set("httpd_parse", ESP_LOG_ERROR);
 
   // Initialize NVS
+  boot_profile_begin(BOOT_PHASE_NVS);
   esp_err_t ret = nvs_flash_init();
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES ||
       ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -2094,30 +3217,46 @@ void app_main(void) {
     ret = nvs_flash_init();
   }
   ESP_ERROR_CHECK(ret);
+  boot_profile_end(BOOT_PHASE_NVS);
 
+  boot_profile_begin(BOOT_PHASE_NETIF);
   ESP_ERROR_CHECK(esp_netif_init());
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+  boot_profile_end(BOOT_PHASE_NETIF);
+
+  // Initialize the Wi-Fi driver while the config is loaded
+  xTaskCreate(&wifi_init_task, "wifi_init", 3072, NULL, 1, NULL);
 
   // Set config defaults
-  memcpy(app_config->clock_password, CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_PASSWORD,
-         strlen(CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_PASSWORD));
-  memcpy(app_config->wifi_ssid, CONFIG_ESP_WIFI_REMOTE_AP_SSID,
-         strlen(CONFIG_ESP_WIFI_REMOTE_AP_SSID));
-  memcpy(app_config->wifi_password, CONFIG_ESP_WIFI_REMOTE_AP_PASSWORD,
-         strlen(CONFIG_ESP_WIFI_REMOTE_AP_PASSWORD));
-  memcpy(app_config->ntp_server_1, CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_1,
-         strlen(CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_1));
-  memcpy(app_config->ntp_server_2, CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_2,
-         strlen(CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_2));
-  memcpy(app_config->time_zone, CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_TIME_ZONE,
-         strlen(CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_TIME_ZONE));
-
-  // load config
-  ret = load_config();
+  boot_profile_begin(BOOT_PHASE_CONFIG);
+  config_schema_defaults(app_config);
+
+  // open the preset library (created from the presets of the config blob
+  // of older versions, so before the config store removes it)
+  preset_store_init();
+
+  // load config (and migrate the blob of older versions)
+  ret = config_store_init(app_config, &s_config_lock, config_schema_sections,
+                          CONFIG_SECTION_COUNT, config_schema_nvs_fields,
+                          config_schema_num_nvs_fields, "app_config",
+                          config_schema_load_legacy);
   if (ret != ESP_OK) {
     printf("Failed to read config from NVS. Using defaults.\n");
   }
+  // the RTC drift measured at the syncs is saved by the config store
+  config_store_set_hook(time_checkpoint_save_drift);
   ESP_LOGI(TAG, "Loaded config.");
+  palette_load(app_config->active_preset);
+
+  // Start the config writer, the only task changing the config from now
+  const esp_timer_create_args_t schedule_timer_args = {
+      .callback = schedule_timer_cb,
+      .name = "schedule_timer",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&schedule_timer_args, &s_schedule_timer));
+  s_config_queue = xQueueCreate(CONFIG_QUEUE_LEN, sizeof(config_update_t *));
+  xTaskCreate(&config_writer_task, "config_writer", 3072, NULL, 3, NULL);
+  boot_profile_end(BOOT_PHASE_CONFIG);
 
   // Set the timezone, default to UTC if missing
   if (strlen(app_config->time_zone_code) == 0) {
@@ -2126,6 +3265,23 @@ void app_main(void) {
   ESP_LOGI(TAG_STA, "Config tz code: %s", app_config->time_zone_code);
   setenv("TZ", app_config->time_zone_code, 1);
   tzset();
+  tz_cache_invalidate();
+
+  // On a warm boot (e.g. after a config change) show the time restored
+  // from the checkpoint right away, otherwise play the startup animation
+  // until the clock starts
+  boot_profile_begin(BOOT_PHASE_CHECKPOINT);
+  bool warm = time_checkpoint_restore();
+  boot_profile_end(BOOT_PHASE_CHECKPOINT);
+  boot_profile_set_warm(warm);
+  if (warm) {
+    xEventGroupSetBits(s_app_event_group,
+                       APP_TIME_PROVISIONAL_BIT | APP_ANIMATION_DONE_BIT);
+    schedule_time_set();
+    start_display();
+  } else {
+    xTaskCreate(&startup_animation, "startup_animation", 2048, NULL, 5, NULL);
+  }
 
   ESP_LOGI(TAG_STA, "Config ssid: %s", app_config->wifi_ssid);
 
@@ -2135,9 +3291,9 @@ void app_main(void) {
   ESP_ERROR_CHECK(esp_event_handler_instance_register(
       IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, NULL));
 
-  /* Initialize WiFi */
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+  /* Wait for the WiFi driver */
+  xEventGroupWaitBits(s_wifi_event_group, WIFI_DRIVER_READY_BIT, pdFALSE,
+                      pdFALSE, portMAX_DELAY);
 
   /* Initialize STA */
   esp_netif_t *esp_netif_sta = NULL;
@@ -2157,243 +3313,94 @@ void app_main(void) {
   }
 
   /* Start WiFi */
+  boot_profile_begin(BOOT_PHASE_WIFI_CONNECT);
   ESP_ERROR_CHECK(esp_wifi_start());
 
+  // Index the time zone list (it isn't sorted) and start the web server
+  // while connecting, neither needs the connection
+  boot_profile_begin(BOOT_PHASE_TZ_INDEX);
+  int num_time_zones = tz_index_init(
+      timezone_data_start, timezone_data_end - timezone_data_start);
+  boot_profile_end(BOOT_PHASE_TZ_INDEX);
+  ESP_LOGI(TAG, "Indexed %d time zones", num_time_zones);
+  if (app_mode != APP_MODE_SETUP) {
+    boot_profile_begin(BOOT_PHASE_WEBSERVER);
+    s_clock_server = start_webserver(false); // config web interface
+    boot_profile_end(BOOT_PHASE_WEBSERVER);
+  }
+
+  // If we are in setup mode, don't do anything more
+  if (app_mode == APP_MODE_SETUP) {
+    return;
+  }
+
   /*
    * Wait until either the connection is established (WIFI_CONNECTED_BIT) or
-   * connection failed for the maximum number of re-tries (WIFI_FAIL_BIT).
+   * the AP rejected the credentials (WIFI_SETUP_BIT). If the AP can't be
+   * reached (e.g. the router is rebooting too), start the clock without
+   * it: the time restored from the checkpoint is shown (or the unsynced
+   * pattern) and the connection is retried in the background.
    * The bits are set by event_handler() (see above)
    */
-  EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-                                         WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-                                         pdFALSE, pdFALSE, portMAX_DELAY);
+  EventBits_t bits = xEventGroupWaitBits(
+      s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_SETUP_BIT, pdFALSE,
+      pdFALSE, pdMS_TO_TICKS(WIFI_BOOT_WAIT_MS));
+  boot_profile_end(BOOT_PHASE_WIFI_CONNECT);
 
   /* xEventGroupWaitBits() returns the bits before the call returned,
    * hence we can test which event actually happened. */
-  if (bits & WIFI_CONNECTED_BIT) {
-    ESP_LOGI(TAG_STA, "connected to ap SSID:%s password:%s",
-             app_config->wifi_ssid, app_config->wifi_password);
+  if (!(bits & WIFI_SETUP_BIT)) {
+    if (bits & WIFI_CONNECTED_BIT) {
+      ESP_LOGI(TAG_STA, "connected to ap SSID:%s password:%s",
+               app_config->wifi_ssid, app_config->wifi_password);
+    } else {
+      ESP_LOGI(TAG_STA, "Not connected to SSID:%s yet, retrying",
+               app_config->wifi_ssid);
+    }
 
-    start_clock();
     /* Set sta as the default interface */
     esp_netif_set_default_netif(esp_netif_sta);
-    start_webserver(false); // config web interface
+    start_clock(); // doesn't wait for the time to be synced
     ESP_LOGI(TAG, "Started all services");
-  } else if (bits & WIFI_FAIL_BIT) {
-    ESP_LOGI(TAG_STA, "Failed to connect to SSID:%s, password:%s",
-             app_config->wifi_ssid, app_config->wifi_password);
-    app_mode = APP_MODE_SETUP;
-    xTaskCreate(&flash_lights, "flash_lights", 2048, NULL, 5, NULL);
-    start_captiveportal();
-  } else {
-    ESP_LOGE(TAG_STA, "UNEXPECTED EVENT, terminating.");
-    return;
-  }
 
-  // If we are in setup mode, don't do anything more
-  if (app_mode == APP_MODE_SETUP) {
-    return;
+    // Touch detection runs in its own task and publishes the gestures to
+    // these subscribers, the identify mode ends with a timer
+    boot_profile_begin(BOOT_PHASE_TOUCH);
+    const esp_timer_create_args_t identify_timer_args = {
+        .callback = identify_timer_cb,
+        .name = "identify_timer",
+    };
+    ESP_ERROR_CHECK(
+        esp_timer_create(&identify_timer_args, &s_identify_timer));
+    touch_input_subscribe(1 << TOUCH_GESTURE_TAP |
+                              1 << TOUCH_GESTURE_LONG_PRESS,
+                          identify_gesture_cb, NULL);
+    touch_input_subscribe(1 << TOUCH_GESTURE_DOUBLE_TAP, preset_gesture_cb,
+                          NULL);
+    touch_input_subscribe(1 << TOUCH_GESTURE_LONG_PRESS, dim_gesture_cb,
+                          NULL);
+    touch_input_start(NULL);
+    boot_profile_end(BOOT_PHASE_TOUCH);
+
+    // The clock runs (and reconnects when it loses the AP) until the
+    // credentials are rejected or the user asks for the setup mode
+    xEventGroupWaitBits(s_wifi_event_group, WIFI_SETUP_BIT, pdFALSE,
+                        pdFALSE, portMAX_DELAY);
   }
 
-  // ADC setup and loop for touch detection
-
-  uint32_t ret_num = 0;
-  uint8_t result[EXAMPLE_READ_LEN] = {0};
-  memset(result, 0xcc, EXAMPLE_READ_LEN);
-
-  s_task_handle = xTaskGetCurrentTaskHandle();
-
-  adc_continuous_handle_t handle = NULL;
-  continuous_adc_init(channel, sizeof(channel) / sizeof(adc_channel_t),
-                      &handle);
-
-  adc_continuous_evt_cbs_t cbs = {
-      .on_conv_done = s_conv_done_cb,
-  };
-  ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &cbs, NULL));
-  ESP_ERROR_CHECK(adc_continuous_start(handle));
-
-  int identify_count = 0; // count of activations of identify mode
-  int touch_count = 0;    // count of readings while touching
-  int avg_data_prev = 0;  // previous average of the touch readings
-  // int avg_data_prev_comp = 0; // previous average of the comparator
-  // readings
-  int delta_prev = 0;       // previous delta
-  bool valley_prev = false; // true when the previous reading dipped an amount
-                            // >= 80% of the threshold
-  bool first_read = true;   // true when the first reading is taken
-
-  // ADC loop to try reading data again after timeout (no data available)
-  while (1) {
-    /**
-     * This is to show you the way to use the ADC continuous mode driver event
-     * callback. This `ulTaskNotifyTake` will block when the data processing
-     * in the task is fast. However in this example, the data processing
-     * (print) is slow, so you barely block here.
-     *
-     * Without using this event callback (to notify this task), you can still
-     * just call `adc_continuous_read()` here in a loop, with/without a
-     * certain block timeout.
-     */
-    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
-
-    char unit[] = EXAMPLE_ADC_UNIT_STR(EXAMPLE_ADC_UNIT);
-
-    // ADC loop to read data until timeout (no data available)
-    while (1) {
-      if (app_mode == APP_MODE_NORMAL) {
-        // ESP_LOGI(TAG, "App mode: %d", app_mode);
-        ret =
-            adc_continuous_read(handle, result, EXAMPLE_READ_LEN, &ret_num, 0);
-        if (ret == ESP_ERR_TIMEOUT) {
-          // ESP_LOGI(TAG, "Timeout reading ADC");
-          // We try to read `EXAMPLE_READ_LEN` until API returns timeout,
-          // which means there's no available data
-          break;
-        }
-        // The code below is not my proudest moment, but it works
-        // Lots of shenanigans to improve the touch detection robustness,
-        // but still gets occassional false positives due to wild swings in
-        // the ADC readings
-        if (ret == ESP_OK) {
-          // ESP_LOGI("TASK", "ret is %x, ret_num is %"PRIu32" bytes", ret,
-          // ret_num);
-          int avg_data = 0;        // average of the touch readings
-          int avg_data_comp = 0;   // average of the comparator readings
-          int data_count = 0;      // count of readings for the touch
-          int data_count_comp = 0; // count of readings for the comparator
-          int delta = 0; // difference between current and previous reading
-
-          // calculate the average of the readings for the touch and
-          // comparator
-          for (int i = 0; i < ret_num; i += SOC_ADC_DIGI_RESULT_BYTES) {
-            adc_digi_output_data_t *p = (adc_digi_output_data_t *)&result[i];
-            uint32_t chan_num = EXAMPLE_ADC_GET_CHANNEL(p);
-            uint32_t data = EXAMPLE_ADC_GET_DATA(p);
-            /* Check the channel number validation, the data is invalid if the
-             * channel num exceed the maximum channel */
-            if (chan_num < SOC_ADC_CHANNEL_NUM(EXAMPLE_ADC_UNIT)) {
-              // handle cases here for each channel if you have more than one
-              // channel
-              if (chan_num == TOUCH_ADC_CHANNEL) {
-                // ESP_LOGI(TAG, "Unit: %s, Channel: %"PRIu32", Value:
-                // %"PRIu32, unit, chan_num, data);
-                avg_data += data;
-                data_count++;
-              }
-              if (chan_num == TOUCH_COMP_CHANNEL) {
-                // ESP_LOGI(TAG, "Unit: %s, Channel: %"PRIu32", Value:
-                // %"PRIu32, unit, chan_num, data);
-                avg_data_comp += data;
-                data_count_comp++;
-              }
-            } else {
-              ESP_LOGW(TAG, "Invalid data [%s_%" PRIu32 "_%" PRIx32 "]", unit,
-                       chan_num, data);
-            }
-          }
-          avg_data /= data_count;
-          avg_data_comp /= data_count_comp;
-          avg_data = avg_data - avg_data_comp; // diff between touch and
-                                               // comparator to reduce noise
-          if (avg_data < 0) {
-            avg_data += -2 * avg_data; // make sure avg_data is positive
-          }
-          delta = avg_data - avg_data_prev;
-          if (delta > TOUCH_DELTA_THRESHOLD * 0.6) {
-            ESP_LOGI(TAG, "Delta: %d, Prev: %d", delta, delta_prev);
-          }
-          if (delta_prev < TOUCH_DELTA_THRESHOLD * -0.8) {
-            valley_prev = true;
-            ESP_LOGI(TAG, "Prev was valley: %d", delta_prev);
-          }
-
-          // check if touch has initiated
-          if (touch_count == 0) {
-            if (delta >
-                TOUCH_DELTA_THRESHOLD) { // sufficient change on one reading
-              touch_count++;
-              if (first_read) { // if first reading, then ignore this reading
-                touch_count = 0;
-              } else if (valley_prev) { // if previous delta was a big drop,
-                                        // then ignore this reading
-                touch_count = 0;
-                valley_prev = false; // no need to check for valley again
-              }
-              ESP_LOGI(TAG,
-                       "Initiated touch, count: %d, first: %d, valley: %d, "
-                       "delta: %d, prev: %d",
-                       touch_count, first_read, valley_prev, delta, delta_prev);
-            } else if ((delta + delta_prev) >
-                       TOUCH_DELTA_THRESHOLD) { // sufficient change over two
-                                                // readings
-              touch_count++;
-              if (first_read &&
-                  delta_prev != 0) { // if second reading, ignore as well
-                touch_count = 0;
-                first_read = false; // no need to check for first read again
-              } else if (valley_prev &&
-                         delta_prev >= TOUCH_DELTA_THRESHOLD *
-                                           -0.8) { // there was a valley
-                                                   // before delta_prev
-                touch_count = 0;
-                valley_prev = false; // no need to check for valley again
-              }
-              ESP_LOGI(TAG,
-                       "Initiated touch, count: %d, first: %d, valley: %d, "
-                       "delta: %d, prev: %d",
-                       touch_count, first_read, valley_prev, delta, delta_prev);
-            } else if (valley_prev && delta < TOUCH_DELTA_THRESHOLD * 0.5) {
-              valley_prev = false; // no need to check for valley again
-            }
-          }
-          // check if touch is sustained
-          else if (touch_count > 0 && touch_count < TOUCH_COUNT_THRESHOLD) {
-            // increase touch count if sustained within delta threshold range
-            if (delta > TOUCH_JITTER_THRESHOLD - TOUCH_DELTA_THRESHOLD) {
-              touch_count++;
-              ESP_LOGI(TAG, "Sustained touch, count: %d (delta: %d)",
-                       touch_count, delta);
-              // ESP_LOGI(TAG, "Touch jitter, count: %d", touch_count);
-            }
-            // reset touch count if not sustained within jitter threshold
-            else {
-              touch_count = 0;
-              ESP_LOGI(TAG, "Too much jitter, touch count reset (delta: %d)",
-                       delta);
-            }
-          }
-          // if the touch count is at or above the threshold, set the app mode
-          // to identify
-          else if (touch_count >= TOUCH_COUNT_THRESHOLD) {
-            app_mode = APP_MODE_IDENTIFY;
-            xEventGroupSetBits(s_app_event_group, APP_MODE_IDENTIFY);
-            identify_count++;
-            ESP_LOGI(TAG, "Identify mode activated, count: %d", identify_count);
-            touch_count = 0;
-          }
-          // update previous data
-          avg_data_prev = avg_data; // update previous data
-          delta_prev = delta;
-          /**
-           * Because printing is slow, so every time you call
-           * `ulTaskNotifyTake`, it will immediately return. To avoid a task
-           * watchdog timeout, add a delay here. When you replace the way you
-           * process the data, usually you don't need this delay (as this task
-           * will block for a while).
-           */
-          vTaskDelay(pdMS_TO_TICKS(10)); // avoid watchdog timeout
-        }
-      } else if (app_mode == APP_MODE_IDENTIFY) {
-        vTaskDelay(pdMS_TO_TICKS(
-            IDENTIFY_TIMEOUT)); // keep the identify mode for 10 seconds
-        app_mode = APP_MODE_NORMAL;
-        xEventGroupClearBits(s_app_event_group, APP_MODE_IDENTIFY);
-      } else {
-        break;
-      }
-    }
+  ESP_LOGI(TAG_STA, "Opening setup for SSID:%s, password:%s",
+           app_config->wifi_ssid, app_config->wifi_password);
+  esp_timer_stop(s_reconnect_timer);
+  // the captive portal has its own web server
+  if (s_clock_server) {
+    httpd_stop(s_clock_server);
+    s_clock_server = NULL;
+  }
+  if (s_identify_timer) {
+    esp_timer_stop(s_identify_timer);
+    identify_set(false);
   }
-  ESP_ERROR_CHECK(adc_continuous_stop(handle));
-  ESP_ERROR_CHECK(adc_continuous_deinit(handle));
+  app_mode = APP_MODE_SETUP;
+  xTaskCreate(&flash_lights, "flash_lights", 2048, NULL, 5, NULL);
+  start_captiveportal();
 }
@@ -0,0 +1,165 @@
+/*
+ * Clock discipline on top of SNTP
+ */
+#include "clock_discipline.h"
+#include "esp_log.h"
+#include "esp_sntp.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+
+// Offsets larger than this step the clock, smaller ones are slewed
+// (adjtime slews at 1/64, so 128 ms takes about 8 s)
+#define STEP_THRESHOLD_US 128000
+// Offsets below this count as converged
+#define CONVERGED_OFFSET_US 4000
+// Converged syncs in a row before the poll interval is doubled
+#define CONVERGED_SYNCS 2
+// Minimum time between syncs to update the drift estimate, shorter
+// intervals are dominated by the network jitter of the offsets
+#define DRIFT_MIN_INTERVAL_US (256LL * 1000000LL)
+// Limit of the drift estimate
+#define DRIFT_MAX_PPB 500000
+// Period of the drift compensation
+#define COMPENSATION_PERIOD_US (16LL * 1000000LL)
+
+#define MIN_POLL CONFIG_ELEVEN_BIT_CLOCK_NTP_MIN_POLL
+#define MAX_POLL CONFIG_ELEVEN_BIT_CLOCK_NTP_MAX_POLL
+
+static const char *TAG = "clock_discipline";
+
+static SemaphoreHandle_t s_lock;
+static esp_timer_handle_t s_compensation_timer;
+static clock_discipline_sync_cb_t s_sync_cb;
+static clock_discipline_stats_t s_stats = {.poll_interval = MIN_POLL};
+static int64_t s_compensation_remainder; // in 1e-9 us
+static int s_converged_syncs;
+
+static int64_t timeval_us(const struct timeval *tv) {
+  return (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static struct timeval us_timeval(int64_t us) {
+  struct timeval tv = {.tv_sec = us / 1000000LL, .tv_usec = us % 1000000LL};
+  return tv;
+}
+
+/* Slew the clock by the drift accumulated over one period, on top of
+ * any correction still in progress */
+static void compensation_cb(void *arg) {
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  s_compensation_remainder +=
+      (int64_t)s_stats.drift_ppb * COMPENSATION_PERIOD_US;
+  int64_t correction_us = s_compensation_remainder / 1000000000LL;
+  s_compensation_remainder -= correction_us * 1000000000LL;
+  if (correction_us != 0 && s_stats.syncs > 0) {
+    struct timeval pending;
+    adjtime(NULL, &pending);
+    struct timeval delta = us_timeval(timeval_us(&pending) + correction_us);
+    adjtime(&delta, NULL);
+  }
+  xSemaphoreGive(s_lock);
+}
+
+/* Double the poll interval after a few converged syncs in a row, halve
+ * it when the offsets get large */
+static void update_poll_interval(int64_t offset_us) {
+  if (llabs(offset_us) < CONVERGED_OFFSET_US) {
+    if (++s_converged_syncs >= CONVERGED_SYNCS &&
+        s_stats.poll_interval < MAX_POLL) {
+      s_stats.poll_interval *= 2;
+      s_converged_syncs = 0;
+    }
+  } else {
+    s_converged_syncs = 0;
+    if (llabs(offset_us) > 4 * CONVERGED_OFFSET_US &&
+        s_stats.poll_interval > MIN_POLL) {
+      s_stats.poll_interval /= 2;
+    }
+  }
+  if (s_stats.poll_interval > MAX_POLL) {
+    s_stats.poll_interval = MAX_POLL;
+  } else if (s_stats.poll_interval < MIN_POLL) {
+    s_stats.poll_interval = MIN_POLL;
+  }
+}
+
+/* Replaces the weak SNTP time update of esp_sntp, called from the lwIP
+ * task with the time received from the server */
+void sntp_sync_time(struct timeval *tv) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t offset_us = timeval_us(tv) - timeval_us(&now);
+  int64_t uptime_us = esp_timer_get_time();
+  bool stepped = llabs(offset_us) > STEP_THRESHOLD_US;
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  if (stepped) {
+    settimeofday(tv, NULL);
+    struct timeval zero = {0};
+    adjtime(&zero, NULL); // cancel any slew in progress
+    s_stats.steps++;
+    s_stats.poll_interval = MIN_POLL;
+    s_converged_syncs = 0;
+  } else {
+    // the clock was on time after the last sync (the slew of the last
+    // offset is done by now), so the offset is the residual drift
+    int64_t interval_us = uptime_us - s_stats.last_sync_us;
+    if (s_stats.last_sync_us != 0 && interval_us >= DRIFT_MIN_INTERVAL_US) {
+      int64_t residual_ppb = offset_us * 1000000000LL / interval_us;
+      int64_t drift_ppb = s_stats.drift_ppb + residual_ppb / 2;
+      if (drift_ppb > DRIFT_MAX_PPB) {
+        drift_ppb = DRIFT_MAX_PPB;
+      } else if (drift_ppb < -DRIFT_MAX_PPB) {
+        drift_ppb = -DRIFT_MAX_PPB;
+      }
+      s_stats.drift_ppb = (int32_t)drift_ppb;
+    }
+    struct timeval delta = us_timeval(offset_us);
+    adjtime(&delta, NULL); // replaces the compensation in progress
+    update_poll_interval(offset_us);
+  }
+  s_stats.offset_us = offset_us;
+  s_stats.last_sync_us = uptime_us;
+  s_stats.syncs++;
+  // the next request is scheduled with this interval once we return
+  sntp_set_sync_interval(s_stats.poll_interval * 1000);
+  clock_discipline_stats_t stats = s_stats;
+  xSemaphoreGive(s_lock);
+
+  sntp_set_sync_status(SNTP_SYNC_STATUS_COMPLETED);
+  ESP_LOGI(TAG, "%s offset %lld us, drift %ld ppb, next poll in %lu s",
+           stepped ? "Stepped" : "Slewed", stats.offset_us,
+           (long)stats.drift_ppb, (unsigned long)stats.poll_interval);
+
+  if (s_sync_cb) {
+    s_sync_cb(tv);
+  }
+}
+
+void clock_discipline_init(clock_discipline_sync_cb_t sync_cb) {
+  s_sync_cb = sync_cb;
+  s_lock = xSemaphoreCreateMutex();
+  assert(s_lock && "Failed to create clock discipline lock");
+  sntp_set_sync_interval(MIN_POLL * 1000);
+
+  const esp_timer_create_args_t timer_args = {
+      .callback = compensation_cb,
+      .name = "drift_comp",
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_compensation_timer));
+  ESP_ERROR_CHECK(
+      esp_timer_start_periodic(s_compensation_timer, COMPENSATION_PERIOD_US));
+}
+
+void clock_discipline_get_stats(clock_discipline_stats_t *stats) {
+  if (!s_lock) {
+    *stats = s_stats;
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  *stats = s_stats;
+  xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,41 @@
+/*
+ * Clock discipline on top of SNTP
+ *
+ * Replaces the SNTP time update (sntp_sync_time) so that large offsets
+ * step the clock while small ones are slewed with adjtime. The drift of
+ * the oscillator is estimated from the offsets of successive syncs and
+ * compensated between syncs, and the poll interval is doubled as the
+ * offsets stay small, up to a maximum. After a step (and on boot) it
+ * goes back to the minimum.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called after each sync with the time received from the server */
+typedef void (*clock_discipline_sync_cb_t)(struct timeval *tv);
+
+typedef struct {
+  int64_t offset_us;      // offset measured at the last sync
+  int32_t drift_ppb;      // drift compensated between syncs
+  uint32_t poll_interval; // current poll interval (seconds)
+  uint32_t syncs;         // number of syncs
+  uint32_t steps;         // number of syncs that stepped the clock
+  int64_t last_sync_us;   // esp_timer time of the last sync (0 if none)
+} clock_discipline_stats_t;
+
+/* Start the drift compensation and set the SNTP poll interval to the
+ * minimum, call before starting SNTP */
+void clock_discipline_init(clock_discipline_sync_cb_t sync_cb);
+
+/* Get the current state of the discipline */
+void clock_discipline_get_stats(clock_discipline_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,410 @@
+/*
+ * Config schema
+ */
+#include "config_schema.h"
+#include "sdkconfig.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defaults of the settings (from menuconfig)
+#define DEFAULT_NTP_SERVER_1 CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_1
+#define DEFAULT_NTP_SERVER_2 CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_2
+#define DEFAULT_NTP_SERVER_3 CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_3
+#define DEFAULT_NTP_SERVER_4 CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_NTP_SERVER_4
+#define DEFAULT_TIME_ZONE CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_TIME_ZONE
+#define DEFAULT_WIFI_SSID CONFIG_ESP_WIFI_REMOTE_AP_SSID
+#define DEFAULT_WIFI_PASSWORD CONFIG_ESP_WIFI_REMOTE_AP_PASSWORD
+#define DEFAULT_CLOCK_PASSWORD CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_PASSWORD
+#define DEFAULT_SCHEDULE CONFIG_ELEVEN_BIT_CLOCK_DEFAULT_SCHEDULE
+
+typedef enum {
+  TYPE_STR,
+  TYPE_NUM,
+  TYPE_SCHEDULE,
+  TYPE_COLOR, // of a preset
+} field_type_t;
+
+#define FLAG_NONE 0
+#define FLAG_FORM (1 << 0)
+#define FLAG_SECRET (1 << 1)
+
+/* Descriptor of a field of config_t or preset_t */
+typedef struct {
+  const char *key;
+  uint8_t key_len;
+  uint8_t type; // field_type_t
+  uint8_t arg;  // see CONFIG_SCHEMA
+  uint8_t flags;
+  uint16_t offset;
+  uint16_t size;
+} field_t;
+
+#define CONFIG_FIELD_DESC(name, type, arg, section, flags, def)               \
+  {#name,                                                                      \
+   sizeof(#name) - 1,                                                          \
+   TYPE_##type,                                                                \
+   arg,                                                                        \
+   FLAG_##flags,                                                               \
+   offsetof(config_t, name),                                                   \
+   sizeof(((config_t *)0)->name)},
+static const field_t config_fields[] = {CONFIG_SCHEMA(CONFIG_FIELD_DESC)};
+#define NUM_CONFIG_FIELDS (sizeof(config_fields) / sizeof(config_fields[0]))
+
+#define PRESET_MEMBER_STR(name) name
+#define PRESET_MEMBER_COLOR(name) name##_color
+#define PRESET_FIELD_DESC(name, type, len)                                     \
+  {#name,                                                                      \
+   sizeof(#name) - 1,                                                          \
+   TYPE_##type,                                                                \
+   len,                                                                        \
+   FLAG_FORM,                                                                  \
+   offsetof(preset_t, PRESET_MEMBER_##type(name)),                             \
+   sizeof(((preset_t *)0)->PRESET_MEMBER_##type(name))},
+static const field_t preset_fields[] = {PRESET_SCHEMA(PRESET_FIELD_DESC)};
+#define NUM_PRESET_FIELDS (sizeof(preset_fields) / sizeof(preset_fields[0]))
+
+#define CONFIG_SECTION_DESC(id, key, version) {key, version},
+const config_section_t config_schema_sections[CONFIG_SECTION_COUNT] = {
+    CONFIG_SECTIONS(CONFIG_SECTION_DESC)};
+
+#define CONFIG_NVS_FIELD(name, type, arg, section, flags, def)                \
+  {offsetof(config_t, name), sizeof(((config_t *)0)->name),                    \
+   CONFIG_SECTION_##section},
+const config_field_t config_schema_nvs_fields[] = {
+    CONFIG_SCHEMA(CONFIG_NVS_FIELD)};
+const int config_schema_num_nvs_fields =
+    sizeof(config_schema_nvs_fields) / sizeof(config_schema_nvs_fields[0]);
+
+#define CONFIG_DEFAULT_STR(name, def)                                          \
+  snprintf(config->name, sizeof(config->name), "%s", def);
+#define CONFIG_DEFAULT_NUM(name, def) config->name = def;
+#define CONFIG_DEFAULT_SCHEDULE(name, def)                                     \
+  preset_schedule_parse(config->name, def);
+#define CONFIG_DEFAULT(name, type, arg, section, flags, def)                   \
+  CONFIG_DEFAULT_##type(name, def)
+
+void config_schema_defaults(config_t *config) {
+  memset(config, 0, sizeof(*config));
+  CONFIG_SCHEMA(CONFIG_DEFAULT)
+}
+
+/* The config as stored in a single blob before the sections, with the
+ * presets now in the preset library (see preset_store.c) */
+typedef struct {
+  char ntp_server_1[32];
+  char ntp_server_2[32];
+  char time_zone[32];
+  char time_zone_code[64];
+  char wifi_ssid[32];
+  char wifi_password[32];
+  char clock_password[32];
+  uint8_t active_preset;
+  uint8_t presets[3][40];
+  char ntp_server_3[32];
+  char ntp_server_4[32];
+} legacy_config_t;
+_Static_assert(offsetof(legacy_config_t, presets) == 257,
+               "the preset store imports the presets from byte 257");
+
+#define LEGACY_FIELD(name)                                                     \
+  if (offsetof(legacy_config_t, name) + sizeof(legacy->name) <= len) {         \
+    memcpy(&config->name, &legacy->name, sizeof(config->name));                \
+  }
+
+void config_schema_load_legacy(void *config_ptr, const void *blob,
+                               size_t len) {
+  config_t *config = (config_t *)config_ptr;
+  const legacy_config_t *legacy = (const legacy_config_t *)blob;
+  LEGACY_FIELD(ntp_server_1)
+  LEGACY_FIELD(ntp_server_2)
+  LEGACY_FIELD(time_zone)
+  LEGACY_FIELD(time_zone_code)
+  LEGACY_FIELD(wifi_ssid)
+  LEGACY_FIELD(wifi_password)
+  LEGACY_FIELD(clock_password)
+  LEGACY_FIELD(active_preset)
+  LEGACY_FIELD(ntp_server_3)
+  LEGACY_FIELD(ntp_server_4)
+}
+
+/* A form key resolved to the value it sets */
+typedef enum {
+  SLOT_STR,
+  SLOT_NUM,
+  SLOT_SCHEDULE,
+  SLOT_RGB,
+  SLOT_WHITE
+} slot_kind_t;
+
+typedef struct {
+  slot_kind_t kind;
+  uint8_t *value;
+  size_t size;
+  uint8_t arg;
+} slot_t;
+
+/* Returns true if a key of len chars (not terminated) is the key of a
+ * field followed by a suffix of suffix_len chars */
+static bool key_equals(const char *key, size_t len, const field_t *field,
+                       const char *suffix, size_t suffix_len) {
+  return len == field->key_len + suffix_len &&
+         memcmp(key, field->key, field->key_len) == 0 &&
+         memcmp(key + field->key_len, suffix, suffix_len) == 0;
+}
+
+/* Find the field of a form key (of len chars) in a config or preset */
+static bool slot_find(const void *base_ptr, const field_t *fields,
+                      size_t num_fields, const char *key, size_t len,
+                      slot_t *slot) {
+  uint8_t *base = (uint8_t *)base_ptr;
+  for (size_t i = 0; i < num_fields; i++) {
+    const field_t *field = &fields[i];
+    if (!(field->flags & FLAG_FORM)) {
+      continue;
+    }
+    slot->value = base + field->offset;
+    slot->size = field->size;
+    slot->arg = field->arg;
+    switch (field->type) {
+    case TYPE_STR:
+      slot->kind = SLOT_STR;
+      if (key_equals(key, len, field, "", 0)) {
+        return true;
+      }
+      break;
+    case TYPE_NUM:
+      slot->kind = SLOT_NUM;
+      if (key_equals(key, len, field, "", 0)) {
+        return true;
+      }
+      break;
+    case TYPE_SCHEDULE:
+      slot->kind = SLOT_SCHEDULE;
+      if (key_equals(key, len, field, "", 0)) {
+        return true;
+      }
+      break;
+    case TYPE_COLOR:
+      slot->kind = SLOT_RGB;
+      if (key_equals(key, len, field, "_color", 6)) {
+        return true;
+      }
+      slot->kind = SLOT_WHITE;
+      if (key_equals(key, len, field, "_white", 6)) {
+        return true;
+      }
+      break;
+    }
+  }
+  return false;
+}
+
+/* Set the value of a slot from a form value, returns false if it is
+ * invalid */
+static bool slot_set(const slot_t *slot, const char *value) {
+  color_t *color = (color_t *)slot->value;
+  switch (slot->kind) {
+  case SLOT_STR:
+    strncpy((char *)slot->value, value, slot->size - 1);
+    slot->value[slot->size - 1] = '\0';
+    break;
+  case SLOT_NUM: {
+    int num = atoi(value);
+    if (num < 1 || num > slot->arg) {
+      return false;
+    }
+    *slot->value = num;
+    break;
+  }
+  case SLOT_SCHEDULE:
+    return preset_schedule_parse((preset_schedule_entry_t *)slot->value,
+                                 value);
+  case SLOT_RGB:
+    // #RRGGBB, the white is set by its own key
+    if (value[0] == '#') {
+      value++;
+    }
+    if (strlen(value) != 6) {
+      return false;
+    }
+    uint32_t rgb = strtoul(value, NULL, 16);
+    color->r = rgb >> 16;
+    color->g = rgb >> 8;
+    color->b = rgb;
+    break;
+  case SLOT_WHITE:
+    color->w = atoi(value);
+    break;
+  }
+  return true;
+}
+
+bool config_schema_set(config_t *config, const char *key, const char *value) {
+  slot_t slot;
+  return slot_find(config, config_fields, NUM_CONFIG_FIELDS, key,
+                   strlen(key), &slot) &&
+         slot_set(&slot, value);
+}
+
+bool config_schema_set_preset(preset_t *preset, const char *key,
+                              const char *value) {
+  slot_t slot;
+  return slot_find(preset, preset_fields, NUM_PRESET_FIELDS, key,
+                   strlen(key), &slot) &&
+         slot_set(&slot, value);
+}
+
+/* Write the value of a slot as it is shown in the page */
+static bool slot_render(const slot_t *slot, config_schema_write_t write,
+                        void *ctx) {
+  char buf[48];
+  const color_t *color = (const color_t *)slot->value;
+  int len = 0;
+  switch (slot->kind) {
+  case SLOT_STR:
+    return write(ctx, (const char *)slot->value,
+                 strnlen((const char *)slot->value, slot->size));
+  case SLOT_NUM:
+    len = snprintf(buf, sizeof(buf), "%u", *slot->value);
+    break;
+  case SLOT_SCHEDULE: {
+    char text[PRESET_SCHEDULE_TEXT_LEN];
+    len = preset_schedule_format(
+        (const preset_schedule_entry_t *)slot->value, text, sizeof(text));
+    return write(ctx, text, len);
+  }
+  case SLOT_RGB:
+    len = snprintf(buf, sizeof(buf), "#%02X%02X%02X", color->r, color->g,
+                   color->b);
+    break;
+  case SLOT_WHITE:
+    len = snprintf(buf, sizeof(buf), "%u", color->w);
+    break;
+  }
+  return write(ctx, buf, len);
+}
+
+bool config_schema_render(const config_t *config, const char *tmpl,
+                          size_t len, config_schema_write_t write, void *ctx) {
+  const char *end = tmpl + len;
+  const char *pos = tmpl;
+  const char *open = pos;
+  while ((open = memchr(open, '{', end - open)) && open + 1 < end) {
+    if (open[1] != '{') {
+      open++;
+      continue;
+    }
+    // the key ends at the first "}}", unless the slot isn't a field
+    const char *key = open + 2;
+    const char *close = key;
+    while (close + 1 < end && !(close[0] == '}' && close[1] == '}')) {
+      close++;
+    }
+    slot_t slot;
+    if (close + 1 >= end || !slot_find(config, config_fields,
+                                       NUM_CONFIG_FIELDS, key, close - key,
+                                       &slot)) {
+      open = key;
+      continue;
+    }
+    if (!write(ctx, pos, open - pos) || !slot_render(&slot, write, ctx)) {
+      return false;
+    }
+    pos = open = close + 2;
+  }
+  return write(ctx, pos, end - pos);
+}
+
+/* JSON being written into a buffer, len is -1 once it doesn't fit */
+typedef struct {
+  char *buf;
+  size_t size;
+  int len;
+} json_t;
+
+static void json_printf(json_t *json, const char *format, ...) {
+  if (json->len < 0) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(json->buf + json->len, json->size - json->len, format,
+                    args);
+  va_end(args);
+  json->len = n < 0 || json->len + n >= json->size ? -1 : json->len + n;
+}
+
+/* Write a string (of at most size chars) quoted and escaped */
+static void json_string(json_t *json, const char *str, size_t size) {
+  json_printf(json, "\"");
+  for (size_t i = 0; i < size && str[i]; i++) {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') {
+      json_printf(json, "\\%c", c);
+    } else if (c < 0x20) {
+      json_printf(json, "\\u%04x", c);
+    } else {
+      json_printf(json, "%c", c);
+    }
+  }
+  json_printf(json, "\"");
+}
+
+/* Write the fields of a config or preset (but the secrets) as members */
+static void json_fields(json_t *json, const uint8_t *base,
+                        const field_t *fields, size_t num_fields) {
+  bool first = true;
+  for (size_t i = 0; i < num_fields; i++) {
+    const field_t *field = &fields[i];
+    const uint8_t *value = base + field->offset;
+    const color_t *color = (const color_t *)value;
+    if (field->flags & FLAG_SECRET) {
+      continue;
+    }
+    json_printf(json, first ? "" : ",");
+    first = false;
+    switch (field->type) {
+    case TYPE_STR:
+      json_printf(json, "\"%s\":", field->key);
+      json_string(json, (const char *)value, field->size);
+      break;
+    case TYPE_NUM:
+      json_printf(json, "\"%s\":%u", field->key, *value);
+      break;
+    case TYPE_SCHEDULE: {
+      char text[PRESET_SCHEDULE_TEXT_LEN];
+      int len = preset_schedule_format(
+          (const preset_schedule_entry_t *)value, text, sizeof(text));
+      json_printf(json, "\"%s\":", field->key);
+      json_string(json, text, len);
+      break;
+    }
+    case TYPE_COLOR:
+      json_printf(json, "\"%s_color\":\"#%02X%02X%02X\",\"%s_white\":%u",
+                  field->key, color->r, color->g, color->b, field->key,
+                  color->w);
+      break;
+    }
+  }
+}
+
+int config_schema_to_json(const config_t *config, char *buf, size_t size) {
+  json_t json = {.buf = buf, .size = size, .len = 0};
+  json_printf(&json, "{");
+  json_fields(&json, (const uint8_t *)config, config_fields,
+              NUM_CONFIG_FIELDS);
+  json_printf(&json, "}");
+  return json.len;
+}
+
+int config_schema_preset_to_json(const preset_t *preset, char *buf,
+                                 size_t size) {
+  json_t json = {.buf = buf, .size = size, .len = 0};
+  json_printf(&json, "{");
+  json_fields(&json, (const uint8_t *)preset, preset_fields,
+              NUM_PRESET_FIELDS);
+  json_printf(&json, "}");
+  return json.len;
+}
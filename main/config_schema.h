@@ -0,0 +1,126 @@
+/*
+ * Config schema
+ *
+ * Every setting of the clock is declared once, in CONFIG_SCHEMA below
+ * (and the fields of a preset in PRESET_SCHEMA, see display.h). The
+ * X-macros generate config_t, its defaults and a table of field
+ * descriptors, which everything reading or writing the settings goes
+ * through:
+ *   - config_schema_set() sets a field from the posted settings form
+ *   - config_schema_render() fills the {{key}} slots of a page template
+ *   - config_schema_to_json() serializes the config
+ *   - the NVS sections of config_store.h are laid out from it
+ * so a new setting is a line here (and its input in root.html). The
+ * presets are in the preset library (see preset_store.h), their fields
+ * are set and serialized with config_schema_set_preset() and
+ * config_schema_preset_to_json().
+ *
+ * The form and template keys are the field names, with <field>_color
+ * (#RRGGBB) and <field>_white (0-255) for a color of a preset. A
+ * section's fields are stored in the order of the schema, so fields are
+ * only appended.
+ */
+#pragma once
+
+#include "config_store.h"
+#include "display.h"
+#include "preset_schedule.h"
+#include "preset_store.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* NVS sections as S(id, key, version) */
+#define CONFIG_SECTIONS(S)                                                     \
+  S(NET, "cfg_net", 1)                                                         \
+  S(TIME, "cfg_time", 1)                                                       \
+  S(DISPLAY, "cfg_display", 1)                                                 \
+  S(SCHEDULE, "cfg_schedule", 1)
+
+/* Settings as X(name, type, arg, section, flags, default), with the types
+ *   STR       a string of arg bytes (with the terminator)
+ *   NUM       a number from 1 to arg
+ *   SCHEDULE  a preset schedule of arg switches (see preset_schedule.h),
+ *             set and shown as its text
+ * and the flags FORM (set by the settings form, has a template slot),
+ * SECRET (left out of the JSON) or NONE. The defaults are in
+ * config_schema.c. The active preset is the id of a preset of the
+ * library, set with the preset API */
+#define CONFIG_SCHEMA(X)                                                       \
+  X(ntp_server_1, STR, 32, TIME, FORM, DEFAULT_NTP_SERVER_1)                   \
+  X(ntp_server_2, STR, 32, TIME, FORM, DEFAULT_NTP_SERVER_2)                   \
+  X(time_zone, STR, 32, TIME, FORM, DEFAULT_TIME_ZONE)                         \
+  X(time_zone_code, STR, 64, TIME, NONE, "")                                   \
+  X(wifi_ssid, STR, 32, NET, NONE, DEFAULT_WIFI_SSID)                          \
+  X(wifi_password, STR, 32, NET, SECRET, DEFAULT_WIFI_PASSWORD)                \
+  X(clock_password, STR, 32, NET, SECRET, DEFAULT_CLOCK_PASSWORD)              \
+  X(active_preset, NUM, PRESET_STORE_MAX, DISPLAY, NONE, 1)                    \
+  X(ntp_server_3, STR, 32, TIME, FORM, DEFAULT_NTP_SERVER_3)                   \
+  X(ntp_server_4, STR, 32, TIME, FORM, DEFAULT_NTP_SERVER_4)                   \
+  X(schedule, SCHEDULE, PRESET_SCHEDULE_LEN, SCHEDULE, FORM, DEFAULT_SCHEDULE)
+
+#define CONFIG_FIELD_DECL_STR(name, arg) char name[arg];
+#define CONFIG_FIELD_DECL_NUM(name, arg) uint8_t name;
+#define CONFIG_FIELD_DECL_SCHEDULE(name, arg)                                  \
+  preset_schedule_entry_t name[arg];
+#define CONFIG_FIELD_DECL(name, type, arg, section, flags, def)               \
+  CONFIG_FIELD_DECL_##type(name, arg)
+
+typedef struct {
+  CONFIG_SCHEMA(CONFIG_FIELD_DECL)
+} config_t;
+
+#define CONFIG_SECTION_ID(id, key, version) CONFIG_SECTION_##id,
+typedef enum {
+  CONFIG_SECTIONS(CONFIG_SECTION_ID) CONFIG_SECTION_COUNT
+} config_section_id_t;
+
+/* NVS layout of config_t, for config_store_init() */
+extern const config_section_t config_schema_sections[CONFIG_SECTION_COUNT];
+extern const config_field_t config_schema_nvs_fields[];
+extern const int config_schema_num_nvs_fields;
+
+/* Load the fields of the config blob of older versions, for
+ * config_store_init() */
+void config_schema_load_legacy(void *config, const void *blob, size_t len);
+
+/* Writes a piece of a rendered template, returns false to stop */
+typedef bool (*config_schema_write_t)(void *ctx, const char *data,
+                                      size_t len);
+
+/* Set a config to the defaults (from menuconfig) */
+void config_schema_defaults(config_t *config);
+
+/* Set the field of a form key from its (decoded) value. Returns false if
+ * the key isn't a field of the form, or if the value is invalid (the
+ * field is left as it is) */
+bool config_schema_set(config_t *config, const char *key, const char *value);
+
+/* Set the field of a preset from a form key (the field name) and its
+ * (decoded) value. Returns false if the key isn't a field of a preset, or
+ * if the value is invalid */
+bool config_schema_set_preset(preset_t *preset, const char *key,
+                              const char *value);
+
+/* Render a template, with the {{key}} slots of the form fields replaced
+ * by their values (other slots are left as they are), in one pass.
+ * Returns false if write did */
+bool config_schema_render(const config_t *config, const char *tmpl,
+                          size_t len, config_schema_write_t write, void *ctx);
+
+/* Serialize the config (but the secrets) as a JSON object into buf.
+ * Returns the length written, or -1 if it doesn't fit */
+int config_schema_to_json(const config_t *config, char *buf, size_t size);
+
+/* Serialize a preset as a JSON object into buf. Returns the length
+ * written, or -1 if it doesn't fit */
+int config_schema_preset_to_json(const preset_t *preset, char *buf,
+                                 size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,291 @@
+/*
+ * Config persistence in NVS
+ */
+#include "config_store.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NVS_NAMESPACE "storage"
+// Saves closer together than this are written at once
+#define DEBOUNCE_MS 500
+// Longest a save waits when saves keep coming
+#define MAX_DELAY_MS 3000
+// Bytes before the fields of a section blob
+#define SECTION_HEADER_LEN 1
+
+static const char *TAG = "config_store";
+
+typedef struct {
+  uint8_t *written; // blob last written (or loaded)
+  size_t written_len;
+} section_state_t;
+
+static uint8_t *s_config;
+static portMUX_TYPE *s_config_lock; // held by the writers of s_config
+static const config_section_t *s_sections;
+static int s_num_sections;
+static const config_field_t *s_fields;
+static int s_num_fields;
+static section_state_t *s_state;
+static size_t s_max_len; // of a section blob
+static uint8_t *s_blob;  // packing buffer, used under s_mutex
+static nvs_handle_t s_handle;
+static SemaphoreHandle_t s_mutex; // for NVS and the section states
+static TaskHandle_t s_task;
+static void (*s_hook)(void); // run after each flush
+static config_store_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED; // for s_stats
+
+static size_t section_len(int index) {
+  size_t len = SECTION_HEADER_LEN;
+  for (int i = 0; i < s_num_fields; i++) {
+    if (s_fields[i].section == index) {
+      len += s_fields[i].size;
+    }
+  }
+  return len;
+}
+
+/* Pack the fields of a section from the config into a blob */
+static size_t section_pack(int index, uint8_t *blob) {
+  size_t len = SECTION_HEADER_LEN;
+  blob[0] = s_sections[index].version;
+  portENTER_CRITICAL(s_config_lock);
+  for (int i = 0; i < s_num_fields; i++) {
+    const config_field_t *field = &s_fields[i];
+    if (field->section == index) {
+      memcpy(&blob[len], &s_config[field->offset], field->size);
+      len += field->size;
+    }
+  }
+  portEXIT_CRITICAL(s_config_lock);
+  return len;
+}
+
+/* Unpack the fields of a blob (the ones it has) into the config */
+static void section_unpack(int index, const uint8_t *blob, size_t len) {
+  size_t pos = SECTION_HEADER_LEN;
+  for (int i = 0; i < s_num_fields; i++) {
+    const config_field_t *field = &s_fields[i];
+    if (field->section != index) {
+      continue;
+    }
+    if (pos + field->size > len) {
+      break;
+    }
+    memcpy(&s_config[field->offset], &blob[pos], field->size);
+    pos += field->size;
+  }
+}
+
+/* Remember a blob as the one in NVS */
+static void section_set_written(int index, const uint8_t *blob,
+                                size_t len) {
+  memcpy(s_state[index].written, blob, len);
+  s_state[index].written_len = len;
+}
+
+/* Write the sections that changed since last written, under s_mutex */
+static esp_err_t flush_locked(void) {
+  int64_t start_us = esp_timer_get_time();
+  int sections = 0;
+  size_t bytes = 0;
+  esp_err_t err = ESP_OK;
+
+  for (int i = 0; i < s_num_sections && err == ESP_OK; i++) {
+    size_t len = section_pack(i, s_blob);
+    section_state_t *state = &s_state[i];
+    if (len == state->written_len &&
+        memcmp(s_blob, state->written, len) == 0) {
+      continue;
+    }
+    err = nvs_set_blob(s_handle, s_sections[i].key, s_blob, len);
+    if (err == ESP_OK) {
+      section_set_written(i, s_blob, len);
+      sections++;
+      bytes += len;
+    }
+  }
+  if (sections > 0 && err == ESP_OK) {
+    err = nvs_commit(s_handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write the config (%s)", esp_err_to_name(err));
+  }
+
+  int64_t elapsed_us = esp_timer_get_time() - start_us;
+  portENTER_CRITICAL(&s_lock);
+  s_stats.flushes++;
+  s_stats.sections_written += sections;
+  s_stats.bytes_written += bytes;
+  latency_hist_add(&s_stats.flush_us, elapsed_us);
+  portEXIT_CRITICAL(&s_lock);
+  if (sections > 0) {
+    ESP_LOGI(TAG, "Wrote %d sections (%u bytes) in %lld us", sections,
+             (unsigned)bytes, elapsed_us);
+  }
+  return err;
+}
+
+esp_err_t config_store_flush(void) {
+  if (!s_mutex) {
+    return ESP_ERR_INVALID_STATE; // NVS didn't open, nothing to write to
+  }
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  esp_err_t err = flush_locked();
+  xSemaphoreGive(s_mutex);
+  if (s_hook) {
+    s_hook();
+  }
+  return err;
+}
+
+void config_store_set_hook(void (*hook)(void)) { s_hook = hook; }
+
+/*
+    Writes the config once the saves stop coming (or MAX_DELAY_MS after
+    the first one)
+*/
+static void writer_task(void *pvParameters) {
+  (void)pvParameters;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int64_t first_us = esp_timer_get_time();
+    while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DEBOUNCE_MS)) > 0 &&
+           esp_timer_get_time() - first_us < MAX_DELAY_MS * 1000LL) {
+    }
+    config_store_flush();
+  }
+}
+
+void config_store_save(void) {
+  if (!s_task) {
+    return; // NVS didn't open, the config is only kept in memory
+  }
+  portENTER_CRITICAL(&s_lock);
+  s_stats.saves++;
+  portEXIT_CRITICAL(&s_lock);
+  xTaskNotifyGive(s_task);
+}
+
+/* Load the legacy blob of the whole config, returns true if there was
+ * one */
+static bool load_legacy(const char *key, config_store_legacy_t load) {
+  size_t len = 0;
+  if (nvs_get_blob(s_handle, key, NULL, &len) != ESP_OK || len == 0) {
+    return false;
+  }
+  uint8_t *blob = malloc(len);
+  if (blob && nvs_get_blob(s_handle, key, blob, &len) == ESP_OK) {
+    load(s_config, blob, len);
+    ESP_LOGI(TAG, "Migrating the legacy config (%u bytes)", (unsigned)len);
+  }
+  free(blob);
+  return true;
+}
+
+esp_err_t config_store_init(void *config, portMUX_TYPE *lock,
+                            const config_section_t *sections,
+                            int num_sections, const config_field_t *fields,
+                            int num_fields, const char *legacy_key,
+                            config_store_legacy_t legacy_load) {
+  s_config = config;
+  s_config_lock = lock;
+  s_sections = sections;
+  s_num_sections = num_sections;
+  s_fields = fields;
+  s_num_fields = num_fields;
+  latency_hist_reset(&s_stats.flush_us);
+
+  esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to open NVS (%s)", esp_err_to_name(err));
+    return err;
+  }
+  s_max_len = 0;
+  for (int i = 0; i < num_sections; i++) {
+    size_t len = section_len(i);
+    s_max_len = len > s_max_len ? len : s_max_len;
+  }
+  s_state = calloc(num_sections, sizeof(section_state_t));
+  s_blob = malloc(s_max_len);
+  assert(s_state && s_blob && "Failed to allocate the config store");
+  for (int i = 0; i < num_sections; i++) {
+    s_state[i].written = malloc(section_len(i));
+    assert(s_state[i].written && "Failed to allocate the config store");
+  }
+
+  // the legacy blob goes first, the sections (if any) are newer
+  bool legacy = legacy_key && load_legacy(legacy_key, legacy_load);
+  int migrations = 0;
+  for (int i = 0; i < num_sections; i++) {
+    const config_section_t *section = &sections[i];
+    size_t len = 0;
+    err = nvs_get_blob(s_handle, section->key, NULL, &len);
+    uint8_t *blob = s_blob;
+    if (err == ESP_OK && len > s_max_len) {
+      // a newer firmware appended fields
+      blob = malloc(len);
+      err = blob ? ESP_OK : ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK) {
+      err = nvs_get_blob(s_handle, section->key, blob, &len);
+    }
+    uint8_t version = err == ESP_OK && len >= SECTION_HEADER_LEN ? blob[0] : 0;
+    if (version > 0) {
+      section_unpack(i, blob, len);
+    }
+    if (blob != s_blob) {
+      free(blob);
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+      ESP_LOGE(TAG, "Failed to read %s (%s)", section->key,
+               esp_err_to_name(err));
+    }
+
+    if (version >= section->version || (version == 0 && !legacy)) {
+      // up to date (or from a newer version, its extra fields are kept
+      // until the section changes), or not saved yet and only written
+      // once changed
+      section_set_written(i, s_blob, section_pack(i, s_blob));
+    } else {
+      // older version, or from the legacy blob: rewrite it (nothing
+      // counts as written so it is seen as changed)
+      migrations++;
+    }
+  }
+
+  s_mutex = xSemaphoreCreateMutex();
+  xTaskCreate(&writer_task, "config_store", 3072, NULL, 3, &s_task);
+  if (migrations > 0) {
+    portENTER_CRITICAL(&s_lock);
+    s_stats.migrations += migrations;
+    portEXIT_CRITICAL(&s_lock);
+    err = config_store_flush();
+    if (err == ESP_OK && legacy) {
+      nvs_erase_key(s_handle, legacy_key);
+      err = nvs_commit(s_handle);
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to migrate the config (%s)",
+               esp_err_to_name(err));
+      return err;
+    }
+    ESP_LOGI(TAG, "Migrated %d sections", migrations);
+  }
+  return ESP_OK;
+}
+
+void config_store_get_stats(config_store_stats_t *stats) {
+  portENTER_CRITICAL(&s_lock);
+  *stats = s_stats;
+  portEXIT_CRITICAL(&s_lock);
+}
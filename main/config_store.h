@@ -0,0 +1,82 @@
+/*
+ * Config persistence in NVS
+ *
+ * The config struct is stored in sections (e.g. network, time, each
+ * preset), each an NVS blob of its fields packed one after the other,
+ * after a version byte. Fields are only ever appended to a section (its
+ * version is bumped), so a section saved by an older firmware loads its
+ * fields, keeps the defaults of the new ones and is rewritten at the new
+ * version. A blob of the whole struct saved under a legacy key is loaded
+ * by a function of the caller and split into the sections.
+ *
+ * Saves are coalesced: config_store_save() only wakes the writer task,
+ * which waits until no save was requested for a short while, then
+ * writes the sections whose fields changed since they were last written
+ * and commits once.
+ */
+#pragma once
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "latency_hist.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint16_t offset; // in the config struct
+  uint16_t size;
+  uint8_t section; // index in the sections, stored in their order
+} config_field_t;
+
+typedef struct {
+  const char *key; // NVS key (up to 15 chars)
+  uint8_t version; // bumped when fields are appended
+} config_section_t;
+
+typedef struct {
+  uint32_t saves;            // config_store_save() calls
+  uint32_t flushes;          // writes to NVS they were coalesced into
+  uint32_t sections_written; // sections that had changed
+  uint32_t bytes_written;    // in the written sections
+  uint32_t migrations;       // sections rewritten at a newer version
+  latency_hist_t flush_us;   // time to write and commit
+} config_store_stats_t;
+
+/* Loads the fields of a legacy blob of len bytes into the config */
+typedef void (*config_store_legacy_t)(void *config, const void *blob,
+                                      size_t len);
+
+/* Load the config from NVS (fields not stored keep their value), migrate
+ * older versions and the legacy blob (if legacy_key isn't NULL) and start
+ * the writer task. The config is read under lock, which its writers must
+ * hold while they change it. The tables, the config and the lock must
+ * outlive the store. If NVS can't be opened the config keeps its
+ * defaults, saves do nothing and flushes return ESP_ERR_INVALID_STATE */
+esp_err_t config_store_init(void *config, portMUX_TYPE *lock,
+                            const config_section_t *sections,
+                            int num_sections, const config_field_t *fields,
+                            int num_fields, const char *legacy_key,
+                            config_store_legacy_t legacy_load);
+
+/* Write the changed sections soon (after the debounce time) */
+void config_store_save(void);
+
+/* Write the changed sections now, e.g. before a restart */
+esp_err_t config_store_flush(void);
+
+/* Run hook after each write of the config, on the writer task for
+ * config_store_save(), so other NVS data (e.g. measured at a sync on the
+ * tcpip task) is written off the task that changed it. Wake the writer
+ * with config_store_save() */
+void config_store_set_hook(void (*hook)(void));
+
+/* Get the stats */
+void config_store_get_stats(config_store_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
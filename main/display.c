@@ -0,0 +1,156 @@
+/*
+ * Display rendering for the 11-bit clock
+ *
+ * Each layout is a table mapping physical pixels to a bit of a logical
+ * field (AM/PM, hours, minutes, seconds), most significant bit first.
+ * The table and pixel count are compile time constants, so rendering
+ * is a branch free lookup per pixel.
+ */
+#include "display.h"
+#include <string.h>
+
+_Static_assert(DISPLAY_PIXEL_COUNT <= 32, "display bits must fit in 32 bits");
+#ifdef DISPLAY_PULSE_PIXEL
+_Static_assert(DISPLAY_PULSE_PIXEL < DISPLAY_PIXEL_COUNT,
+               "pulse pixel must be in the layout");
+#endif
+
+// Pixels of the 11-bit pyramid: AM/PM, hours (1-12) and minutes
+#define PYRAMID_12H                                                            \
+  {DISPLAY_FIELD_AMPM, 0, -1},       /* AM/PM */                               \
+      {DISPLAY_FIELD_HOUR12, 3, 7},  /* hours */                               \
+      {DISPLAY_FIELD_HOUR12, 2, 6},                                            \
+      {DISPLAY_FIELD_HOUR12, 1, 5},                                            \
+      {DISPLAY_FIELD_HOUR12, 0, 4},                                            \
+      {DISPLAY_FIELD_MINUTE, 5, -1}, /* minutes */                             \
+      {DISPLAY_FIELD_MINUTE, 4, 3},                                            \
+      {DISPLAY_FIELD_MINUTE, 3, 2},                                            \
+      {DISPLAY_FIELD_MINUTE, 2, 1},                                            \
+      {DISPLAY_FIELD_MINUTE, 1, 0},                                            \
+      {DISPLAY_FIELD_MINUTE, 0, -1}
+
+static const display_pixel_t layout[DISPLAY_PIXEL_COUNT] = {
+#if CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_24H
+    {DISPLAY_FIELD_HOUR24, 4, -1}, {DISPLAY_FIELD_HOUR24, 3, 7},
+    {DISPLAY_FIELD_HOUR24, 2, 6},  {DISPLAY_FIELD_HOUR24, 1, 5},
+    {DISPLAY_FIELD_HOUR24, 0, 4},  {DISPLAY_FIELD_MINUTE, 5, -1},
+    {DISPLAY_FIELD_MINUTE, 4, 3},  {DISPLAY_FIELD_MINUTE, 3, 2},
+    {DISPLAY_FIELD_MINUTE, 2, 1},  {DISPLAY_FIELD_MINUTE, 1, 0},
+    {DISPLAY_FIELD_MINUTE, 0, -1},
+#elif CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_SECONDS
+    PYRAMID_12H,
+    {DISPLAY_FIELD_SECOND, 5, -1},
+    {DISPLAY_FIELD_SECOND, 4, -1},
+    {DISPLAY_FIELD_SECOND, 3, -1},
+    {DISPLAY_FIELD_SECOND, 2, -1},
+    {DISPLAY_FIELD_SECOND, 1, -1},
+    {DISPLAY_FIELD_SECOND, 0, -1},
+#elif CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_DUAL
+    PYRAMID_12H,
+    PYRAMID_12H,
+#else
+    PYRAMID_12H,
+#endif
+};
+
+/* Get the value of each field for a time */
+static void get_field_values(const struct tm *timeinfo,
+                             uint8_t values[DISPLAY_FIELD_COUNT]) {
+  uint8_t hour = timeinfo->tm_hour % 12;
+  if (hour == 0)
+    hour = 12; // midnight and noon should display as 12
+  values[DISPLAY_FIELD_AMPM] = timeinfo->tm_hour > 11;
+  values[DISPLAY_FIELD_HOUR12] = hour;
+  values[DISPLAY_FIELD_HOUR24] = timeinfo->tm_hour;
+  values[DISPLAY_FIELD_MINUTE] = timeinfo->tm_min;
+  values[DISPLAY_FIELD_SECOND] = timeinfo->tm_sec > 59 ? 59 : timeinfo->tm_sec;
+}
+
+uint32_t display_time_bits(const struct tm *timeinfo) {
+  uint8_t values[DISPLAY_FIELD_COUNT];
+  get_field_values(timeinfo, values);
+
+  uint32_t time_bits = 0;
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    uint32_t bit = (values[layout[i].field] >> layout[i].bit) & 1;
+    time_bits |= bit << (DISPLAY_PIXEL_COUNT - 1 - i);
+  }
+  return time_bits;
+}
+
+void display_palette_init(display_palette_t *palette, const preset_t *preset) {
+  // colors of each field for a 0 and a 1 bit
+  const color_t colors[DISPLAY_FIELD_COUNT][2] = {
+      [DISPLAY_FIELD_AMPM] = {preset->am_color, preset->pm_color},
+      [DISPLAY_FIELD_HOUR12] = {preset->hr0_color, preset->hr1_color},
+      [DISPLAY_FIELD_HOUR24] = {preset->hr0_color, preset->hr1_color},
+      [DISPLAY_FIELD_MINUTE] = {preset->min0_color, preset->min1_color},
+      [DISPLAY_FIELD_SECOND] = {preset->min0_color, preset->min1_color},
+  };
+
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    palette->pixels[i][0] = colors[layout[i].field][0];
+    palette->pixels[i][1] = colors[layout[i].field][1];
+  }
+}
+
+void display_render_time(const struct tm *timeinfo,
+                         const display_palette_t *palette, color_t *frame) {
+  uint8_t values[DISPLAY_FIELD_COUNT];
+  get_field_values(timeinfo, values);
+
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    uint8_t value = values[layout[i].field];
+    frame[i] = palette->pixels[i][(value >> layout[i].bit) & 1];
+  }
+
+#ifdef DISPLAY_PULSE_PIXEL
+  // dim the pulse pixel to a quarter on odd seconds
+  if (values[DISPLAY_FIELD_SECOND] & 1) {
+    color_t *pulse = &frame[DISPLAY_PULSE_PIXEL];
+    pulse->r >>= 2;
+    pulse->g >>= 2;
+    pulse->b >>= 2;
+    pulse->w >>= 2;
+  }
+#endif
+}
+
+void display_render_ip(uint8_t last_quad, color_t *frame) {
+#if DISPLAY_RGBW
+  const color_t colors[3] = {{0, 0, 0, 0}, {0, 0, 0, 3}, {0, 50, 0, 0}};
+#else
+  const color_t colors[3] = {{0, 0, 0, 0}, {0, 1, 0, 0}, {0, 50, 0, 0}};
+#endif
+
+  // last quad of the ip address is displayed on the pixels with an
+  // ident bit (the 8 pixels in the middle of the pyramid), others are off
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    int8_t bit = layout[i].ident_bit;
+    frame[i] = bit < 0 ? colors[0] : colors[1 + ((last_quad >> bit) & 1)];
+  }
+}
+
+void display_render_unsynced(uint32_t step, color_t *frame) {
+  // dim amber, which no preset or other mode uses by default
+  const color_t off = {0, 0, 0, 0};
+  const color_t on = {12, 4, 0, 0};
+
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    frame[i] = off;
+  }
+  frame[step % DISPLAY_PIXEL_COUNT] = on;
+}
+
+bool display_frame_equal(const color_t *a, const color_t *b) {
+  return memcmp(a, b, DISPLAY_PIXEL_COUNT * sizeof(color_t)) == 0;
+}
+
+void display_scale(color_t *frame, uint8_t scale) {
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    frame[i].r = frame[i].r * scale / 256;
+    frame[i].g = frame[i].g * scale / 256;
+    frame[i].b = frame[i].b * scale / 256;
+    frame[i].w = frame[i].w * scale / 256;
+  }
+}
@@ -0,0 +1,129 @@
+/*
+ * Display rendering for the 11-bit clock
+ *
+ * Turns the local time (or the last quad of the device IP address)
+ * into a frame of pixel colors. Nothing in here talks to the LED
+ * strip or to ESP-IDF, so the same code can be built on the host
+ * (see tools/render_bench).
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pixel layout (selected in menuconfig, defaults to the 11-bit pyramid
+ * when built on the host without a CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_* define)
+ * The layout tables are in display.c */
+#if CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_24H
+#define DISPLAY_PIXEL_COUNT 11 // 5 bit hours (0-23), 6 bit minutes
+#elif CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_SECONDS
+#define DISPLAY_PIXEL_COUNT 17 // 11-bit pyramid followed by 6 bit seconds
+#elif CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_DUAL
+#define DISPLAY_PIXEL_COUNT 22 // two 11-bit pyramids on one strip
+#else
+#define DISPLAY_PIXEL_COUNT 11 // AM/PM, 4 bit hours (1-12), 6 bit minutes
+#endif
+
+// Seconds are shown either on their own pixels or as a pulse on one pixel
+#if CONFIG_ELEVEN_BIT_CLOCK_SECONDS_PULSE
+#define DISPLAY_PULSE_PIXEL CONFIG_ELEVEN_BIT_CLOCK_SECONDS_PULSE_PIXEL
+#endif
+#if CONFIG_ELEVEN_BIT_CLOCK_LAYOUT_SECONDS || defined(DISPLAY_PULSE_PIXEL)
+#define DISPLAY_HAS_SECONDS 1 // the frame changes every second
+#else
+#define DISPLAY_HAS_SECONDS 0 // the frame changes every minute
+#endif
+
+// LED model, only strips with a white channel use RGBW pixels
+#if CONFIG_ELEVEN_BIT_CLOCK_LED_MODEL_WS2812
+#define DISPLAY_RGBW 0
+#else
+#define DISPLAY_RGBW 1
+#endif
+
+/* Logical fields a pixel can show */
+typedef enum {
+  DISPLAY_FIELD_AMPM,   // 0 = AM, 1 = PM (am/pm colors)
+  DISPLAY_FIELD_HOUR12, // 1-12 (hr colors)
+  DISPLAY_FIELD_HOUR24, // 0-23 (hr colors)
+  DISPLAY_FIELD_MINUTE, // 0-59 (min colors)
+  DISPLAY_FIELD_SECOND, // 0-59 (min colors)
+  DISPLAY_FIELD_COUNT
+} display_field_t;
+
+/* Role of one physical pixel in a layout */
+typedef struct {
+  uint8_t field;    // display_field_t shown by the pixel
+  uint8_t bit;      // bit of the field value shown by the pixel
+  int8_t ident_bit; // bit of the IP last quad shown in identify mode (or -1)
+} display_pixel_t;
+
+typedef struct {
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint8_t w;
+} color_t; // 4 bytes
+
+/* Fields of a preset as X(name, type, length), which generates preset_t
+ * and its settings (see config_schema.h). A COLOR field is a color_t
+ * named <name>_color. Fields are only appended, presets are stored as is */
+#define PRESET_SCHEMA(X)                                                       \
+  X(name, STR, 16)                                                             \
+  X(am, COLOR, 0)                                                              \
+  X(pm, COLOR, 0)                                                              \
+  X(hr0, COLOR, 0)                                                             \
+  X(hr1, COLOR, 0)                                                             \
+  X(min0, COLOR, 0)                                                            \
+  X(min1, COLOR, 0)
+
+#define PRESET_FIELD_DECL_STR(name, len) char name[len];
+#define PRESET_FIELD_DECL_COLOR(name, len) color_t name##_color;
+#define PRESET_FIELD_DECL(name, type, len) PRESET_FIELD_DECL_##type(name, len)
+
+typedef struct {
+  PRESET_SCHEMA(PRESET_FIELD_DECL)
+} preset_t; // 40 bytes
+
+/* Colors of each pixel for a 0 and a 1 bit, from the colors of a preset
+ * and the layout, so a preset doesn't need to be kept to render with it */
+typedef struct {
+  color_t pixels[DISPLAY_PIXEL_COUNT][2];
+} display_palette_t;
+
+/* Get the on/off state of each pixel for a time
+ * (pixel 0 is the most significant of DISPLAY_PIXEL_COUNT bits) */
+uint32_t display_time_bits(const struct tm *timeinfo);
+
+/* Fill the palette of a preset */
+void display_palette_init(display_palette_t *palette, const preset_t *preset);
+
+/* Render a time into a frame using the palette of a preset */
+void display_render_time(const struct tm *timeinfo,
+                         const display_palette_t *palette, color_t *frame);
+
+/* Render the last quad of the IP address into a frame */
+void display_render_ip(uint8_t last_quad, color_t *frame);
+
+/* Render the "waiting for time" pattern shown until the time is known:
+ * a single dim pixel moving one position per step */
+void display_render_unsynced(uint32_t step, color_t *frame);
+
+/* Returns true if both frames have the same pixel colors */
+bool display_frame_equal(const color_t *a, const color_t *b);
+
+/* Scale the colors of a frame by scale / 256 (e.g. 64 for a quarter) */
+void display_scale(color_t *frame, uint8_t scale);
+
+#ifdef __cplusplus
+}
+#endif
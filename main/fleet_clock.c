@@ -0,0 +1,89 @@
+/*
+ * Offset of the local clock to a fleet leader
+ */
+#include "fleet_clock.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Round trips longer than this are dropped (stale or reordered answers)
+#define MAX_ROUND_TRIP_US 1000000LL
+// Changes of the estimate larger than this are applied at once
+#define JUMP_US 20000LL
+// Smoothing of smaller changes (1/4 of the difference per beacon)
+#define SMOOTHING 4
+
+void fleet_clock_reset(fleet_clock_t *clock) {
+  memset(clock, 0, sizeof(*clock));
+}
+
+void fleet_clock_add_round_trip(fleet_clock_t *clock, int64_t t1, int64_t t2,
+                                int64_t t3, int64_t t4) {
+  fleet_round_trip_t sample = {
+      .round_trip_us = (t4 - t1) - (t3 - t2),
+      .offset_us = ((t2 - t1) + (t3 - t4)) / 2,
+  };
+  if (sample.round_trip_us < 0 || sample.round_trip_us > MAX_ROUND_TRIP_US) {
+    return;
+  }
+  clock->round_trips[clock->next_round_trip] = sample;
+  clock->next_round_trip =
+      (clock->next_round_trip + 1) % FLEET_CLOCK_ROUND_TRIPS;
+  if (clock->num_round_trips < FLEET_CLOCK_ROUND_TRIPS) {
+    clock->num_round_trips++;
+  }
+
+  clock->shortest = clock->round_trips[0];
+  for (int i = 1; i < clock->num_round_trips; i++) {
+    if (clock->round_trips[i].round_trip_us < clock->shortest.round_trip_us) {
+      clock->shortest = clock->round_trips[i];
+    }
+  }
+  clock->delay_us = clock->shortest.round_trip_us / 2;
+}
+
+void fleet_clock_add_beacon(fleet_clock_t *clock, int64_t leader_us,
+                            int64_t local_us, uint8_t steps) {
+  if (clock->num_samples > 0 && steps != clock->leader_steps) {
+    // the leader's time jumped, the offsets measured before are off
+    fleet_clock_reset(clock);
+  }
+  clock->leader_steps = steps;
+  clock->samples[clock->next_sample] = leader_us - local_us;
+  clock->next_sample = (clock->next_sample + 1) % FLEET_CLOCK_WINDOW;
+  if (clock->num_samples < FLEET_CLOCK_WINDOW) {
+    clock->num_samples++;
+  }
+  clock->last_beacon_us = local_us;
+  if (clock->num_round_trips == 0 ||
+      clock->num_samples < FLEET_CLOCK_LOCK_BEACONS) {
+    return;
+  }
+
+  int64_t latest = clock->samples[0];
+  for (int i = 1; i < clock->num_samples; i++) {
+    if (clock->samples[i] > latest) {
+      latest = clock->samples[i];
+    }
+  }
+  // a beacon sample is never later than the leader's time, neither is
+  // the round trip offset by more than its (small) asymmetry
+  int64_t estimate = latest + clock->delay_us;
+  if (clock->shortest.offset_us > estimate) {
+    estimate = clock->shortest.offset_us;
+  }
+  if (!clock->locked || llabs(estimate - clock->offset_us) > JUMP_US) {
+    clock->offset_us = estimate;
+    clock->locked = true;
+  } else {
+    clock->offset_us += (estimate - clock->offset_us) / SMOOTHING;
+  }
+}
+
+bool fleet_clock_update(fleet_clock_t *clock, int64_t now_us) {
+  if (clock->num_samples > 0 &&
+      now_us - clock->last_beacon_us > FLEET_CLOCK_TIMEOUT_US) {
+    // the leader is gone, start over when it (or another one) is back
+    fleet_clock_reset(clock);
+  }
+  return clock->locked;
+}
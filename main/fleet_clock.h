@@ -0,0 +1,80 @@
+/*
+ * Offset of the local clock to a fleet leader
+ *
+ * The leader multicasts beacons with its time. The network (and the
+ * Wi-Fi power save, which holds multicast frames until the next DTIM
+ * beacon) can only delay them, so the offset sample of the least delayed
+ * beacon is the most accurate one: the beacon estimate is the largest
+ * sample of the last FLEET_CLOCK_WINDOW beacons, plus the one-way delay.
+ * That delay is half the shortest round trip of the delay requests sent
+ * to the leader. The unicast answers aren't held like multicast frames,
+ * so the round trip with the shortest delay also gives an offset (as in
+ * NTP), which is used when all the recent beacons were held. Small
+ * changes of the estimate are smoothed so the displayed time doesn't
+ * jitter, large ones are applied at once.
+ *
+ * Local times are from a monotonic clock (esp_timer on the device), so
+ * the estimate doesn't depend on the local NTP sync. The beacons carry
+ * the number of times the leader's clock was stepped: when it changes,
+ * the samples and round trips from before the step are dropped (a step
+ * back would otherwise be hidden by the larger samples from before it).
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Beacons the estimate is the maximum of
+#define FLEET_CLOCK_WINDOW 8
+// Round trips the delay is the minimum of
+#define FLEET_CLOCK_ROUND_TRIPS 8
+// Beacons needed before the estimate is used
+#define FLEET_CLOCK_LOCK_BEACONS 4
+// Without beacons for this long the leader is considered gone
+#define FLEET_CLOCK_TIMEOUT_US 5000000LL
+
+typedef struct {
+  int64_t round_trip_us; // without the leader processing
+  int64_t offset_us;     // leader time - local time
+} fleet_round_trip_t;
+
+typedef struct {
+  int64_t samples[FLEET_CLOCK_WINDOW]; // leader time - local time (us)
+  uint8_t num_samples;
+  uint8_t next_sample;
+  fleet_round_trip_t round_trips[FLEET_CLOCK_ROUND_TRIPS];
+  uint8_t num_round_trips;
+  uint8_t next_round_trip;
+  fleet_round_trip_t shortest; // of the round trips
+  int64_t delay_us;             // one-way delay from the leader
+  int64_t offset_us;            // leader time - local time, when locked
+  int64_t last_beacon_us;       // local time of the last beacon
+  uint8_t leader_steps;         // of the leader's clock, in the beacons
+  bool locked;
+} fleet_clock_t;
+
+/* Forget the leader (e.g. when another one takes over) */
+void fleet_clock_reset(fleet_clock_t *clock);
+
+/* Add a delay request sent at local time t1, received by the leader at
+ * its time t2 and answered at t3, with the answer received at local t4 */
+void fleet_clock_add_round_trip(fleet_clock_t *clock, int64_t t1, int64_t t2,
+                                int64_t t3, int64_t t4);
+
+/* Add a beacon sent at leader time leader_us and received at local time
+ * local_us, after the leader's clock was stepped steps times (modulo
+ * 256). Starts over (fleet_clock_reset) when steps changes */
+void fleet_clock_add_beacon(fleet_clock_t *clock, int64_t leader_us,
+                            int64_t local_us, uint8_t steps);
+
+/* Check the leader is still there at local time now_us.
+ * Returns true if the offset can be used */
+bool fleet_clock_update(fleet_clock_t *clock, int64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
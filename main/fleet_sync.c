@@ -0,0 +1,353 @@
+/*
+ * Fleet sync
+ */
+#include "fleet_sync.h"
+#include "clock_discipline.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "fleet_clock.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "sdkconfig.h"
+#include <string.h>
+
+// Packets: magic, type, the leader's clock steps (modulo 256, beacons
+// only), 2 bytes of padding, sequence number and three times in us, all
+// big endian
+#define PACKET_MAGIC "EBS1"
+#define PACKET_LEN 36
+// times[0]: leader time
+#define TYPE_BEACON 1
+// times[0]: follower (esp_timer) time when sent
+#define TYPE_DELAY_REQUEST 2
+// times[0]: echoed, times[1]/[2]: leader time when received/answered
+#define TYPE_DELAY_RESPONSE 3
+
+// Interval of the beacons
+#define BEACON_INTERVAL_US 1000000LL
+// Delay requests are sent after each beacon until there are this many
+// round trips, then every DELAY_REQUEST_PERIOD beacons. The round trips
+// also give the offset when the beacons are held by the access point, so
+// they are frequent enough for the drift between them to stay small.
+#define DELAY_REQUEST_BURST 4
+#define DELAY_REQUEST_PERIOD 4
+// Receive timeouts: the leader checks if a beacon is due, the follower if
+// the leader is gone
+#define LEADER_TIMEOUT_MS 100
+#define FOLLOWER_TIMEOUT_MS 1000
+
+static const char *TAG = "fleet_sync";
+
+typedef struct {
+  uint8_t type;
+  uint8_t steps; // clock_discipline steps of the leader
+  uint32_t seq;
+  int64_t times[3];
+} packet_t;
+
+static int s_sock = -1;
+static fleet_sync_lock_cb_t s_lock_cb;
+static fleet_sync_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED; // for s_stats
+
+static int64_t wall_time_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void encode(const packet_t *packet, uint8_t *buffer) {
+  memcpy(buffer, PACKET_MAGIC, 4);
+  buffer[4] = packet->type;
+  buffer[5] = packet->steps;
+  memset(&buffer[6], 0, 2);
+  put_u32(&buffer[8], packet->seq);
+  for (int i = 0; i < 3; i++) {
+    uint64_t time = (uint64_t)packet->times[i];
+    put_u32(&buffer[12 + 8 * i], (uint32_t)(time >> 32));
+    put_u32(&buffer[16 + 8 * i], (uint32_t)time);
+  }
+}
+
+/* Returns false if the buffer isn't a fleet sync packet */
+static bool decode(const uint8_t *buffer, int len, packet_t *packet) {
+  if (len != PACKET_LEN || memcmp(buffer, PACKET_MAGIC, 4) != 0) {
+    return false;
+  }
+  packet->type = buffer[4];
+  packet->steps = buffer[5];
+  packet->seq = get_u32(&buffer[8]);
+  for (int i = 0; i < 3; i++) {
+    packet->times[i] = (int64_t)((uint64_t)get_u32(&buffer[12 + 8 * i]) << 32 |
+                                 get_u32(&buffer[16 + 8 * i]));
+  }
+  return true;
+}
+
+static void count(uint32_t *counter) {
+  portENTER_CRITICAL(&s_lock);
+  (*counter)++;
+  portEXIT_CRITICAL(&s_lock);
+}
+
+/* Open the socket on the fleet port, joining the group for a follower */
+static int open_socket(bool leader) {
+  int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (sock < 0) {
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+    return -1;
+  }
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons(CONFIG_ELEVEN_BIT_CLOCK_FLEET_PORT),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+    close(sock);
+    return -1;
+  }
+  int timeout_ms = leader ? LEADER_TIMEOUT_MS : FOLLOWER_TIMEOUT_MS;
+  struct timeval timeout = {
+      .tv_sec = timeout_ms / 1000,
+      .tv_usec = (timeout_ms % 1000) * 1000,
+  };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  int err;
+  if (leader) {
+    // beacons stay on the LAN and aren't looped back
+    uint8_t ttl = 1;
+    uint8_t loop = 0;
+    err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (err == 0) {
+      err = setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                       sizeof(loop));
+    }
+  } else {
+    struct ip_mreq mreq = {.imr_interface.s_addr = htonl(INADDR_ANY)};
+    inet_aton(CONFIG_ELEVEN_BIT_CLOCK_FLEET_GROUP, &mreq.imr_multiaddr);
+    err = setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                     sizeof(mreq));
+  }
+  if (err < 0) {
+    ESP_LOGE(TAG, "Failed to set multicast options: errno %d", errno);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/*
+    Sends a beacon every second once the time is synced and answers the
+    delay requests of the followers
+*/
+static void leader_task(void *pvParameters) {
+  (void)pvParameters;
+  struct sockaddr_in group = {
+      .sin_family = AF_INET,
+      .sin_port = htons(CONFIG_ELEVEN_BIT_CLOCK_FLEET_PORT),
+  };
+  inet_aton(CONFIG_ELEVEN_BIT_CLOCK_FLEET_GROUP, &group.sin_addr);
+  uint8_t buffer[PACKET_LEN];
+  uint32_t seq = 0;
+  int64_t next_beacon_us = esp_timer_get_time();
+
+  for (;;) {
+    int64_t now_us = esp_timer_get_time();
+    if (now_us >= next_beacon_us) {
+      next_beacon_us += BEACON_INTERVAL_US;
+      if (next_beacon_us <= now_us) {
+        next_beacon_us = now_us + BEACON_INTERVAL_US;
+      }
+      // an unsynced (or only restored) time isn't worth following
+      clock_discipline_stats_t discipline;
+      clock_discipline_get_stats(&discipline);
+      if (discipline.syncs > 0) {
+        // the followers start over when the leader's clock is stepped
+        packet_t beacon = {.type = TYPE_BEACON,
+                           .steps = (uint8_t)discipline.steps,
+                           .seq = seq++};
+        beacon.times[0] = wall_time_us();
+        encode(&beacon, buffer);
+        if (sendto(s_sock, buffer, PACKET_LEN, 0, (struct sockaddr *)&group,
+                   sizeof(group)) == PACKET_LEN) {
+          count(&s_stats.beacons);
+        }
+      }
+    }
+
+    struct sockaddr_in source_addr;
+    socklen_t socklen = sizeof(source_addr);
+    int len = recvfrom(s_sock, buffer, sizeof(buffer), 0,
+                       (struct sockaddr *)&source_addr, &socklen);
+    int64_t receive_us = wall_time_us();
+    packet_t request;
+    if (len < 0 || !decode(buffer, len, &request) ||
+        request.type != TYPE_DELAY_REQUEST) {
+      continue; // timeout, or not for us
+    }
+    count(&s_stats.delay_requests);
+
+    request.type = TYPE_DELAY_RESPONSE;
+    request.times[1] = receive_us;
+    request.times[2] = wall_time_us();
+    encode(&request, buffer);
+    if (sendto(s_sock, buffer, PACKET_LEN, 0, (struct sockaddr *)&source_addr,
+               socklen) == PACKET_LEN) {
+      count(&s_stats.delay_responses);
+    }
+  }
+}
+
+/* Publish the estimate of the follower task */
+static void publish(const fleet_clock_t *clock, bool locked,
+                    uint32_t leader_address) {
+  portENTER_CRITICAL(&s_lock);
+  s_stats.locked = locked;
+  s_stats.leader_address = leader_address;
+  s_stats.offset_us = clock->offset_us;
+  s_stats.delay_us = clock->delay_us;
+  portEXIT_CRITICAL(&s_lock);
+}
+
+/*
+    Follows the beacons of the leader (the first one heard, until it is
+    gone) and sends it delay requests
+*/
+static void follower_task(void *pvParameters) {
+  (void)pvParameters;
+  static fleet_clock_t clock;
+  fleet_clock_reset(&clock);
+  uint8_t buffer[PACKET_LEN];
+  uint32_t leader_address = 0;
+  uint32_t beacons = 0;
+  bool locked = false;
+  // last delay request, the answers to older ones are ignored
+  uint32_t request_seq = 0;
+  int64_t request_us = 0;
+
+  for (;;) {
+    struct sockaddr_in source_addr;
+    socklen_t socklen = sizeof(source_addr);
+    int len = recvfrom(s_sock, buffer, sizeof(buffer), 0,
+                       (struct sockaddr *)&source_addr, &socklen);
+    int64_t receive_us = esp_timer_get_time();
+    packet_t packet;
+    if (len >= 0 && decode(buffer, len, &packet) &&
+        (leader_address == 0 ||
+         source_addr.sin_addr.s_addr == leader_address)) {
+      if (packet.type == TYPE_BEACON) {
+        if (leader_address == 0) {
+          leader_address = source_addr.sin_addr.s_addr;
+          ESP_LOGI(TAG, "Leader: %s", inet_ntoa(source_addr.sin_addr));
+        }
+        fleet_clock_add_beacon(&clock, packet.times[0], receive_us,
+                               packet.steps);
+        count(&s_stats.beacons);
+
+        if (clock.num_round_trips < DELAY_REQUEST_BURST ||
+            ++beacons % DELAY_REQUEST_PERIOD == 0) {
+          packet_t request = {.type = TYPE_DELAY_REQUEST,
+                              .seq = ++request_seq};
+          request_us = esp_timer_get_time();
+          request.times[0] = request_us;
+          encode(&request, buffer);
+          if (sendto(s_sock, buffer, PACKET_LEN, 0,
+                     (struct sockaddr *)&source_addr,
+                     socklen) == PACKET_LEN) {
+            count(&s_stats.delay_requests);
+          }
+        }
+      } else if (packet.type == TYPE_DELAY_RESPONSE &&
+                 packet.seq == request_seq &&
+                 packet.times[0] == request_us) {
+        fleet_clock_add_round_trip(&clock, request_us, packet.times[1],
+                                   packet.times[2], receive_us);
+        count(&s_stats.delay_responses);
+      }
+    }
+
+    bool now_locked = fleet_clock_update(&clock, esp_timer_get_time());
+    if (clock.num_samples == 0 && leader_address != 0) {
+      // timed out, follow the next leader heard
+      ESP_LOGW(TAG, "Leader lost");
+      leader_address = 0;
+    }
+    publish(&clock, now_locked, leader_address);
+    if (now_locked != locked) {
+      locked = now_locked;
+      ESP_LOGI(TAG, "%s", locked ? "Following the leader's time"
+                                 : "Using the NTP time");
+      if (s_lock_cb) {
+        s_lock_cb(locked);
+      }
+    }
+  }
+}
+
+bool fleet_sync_start_leader(void) {
+  s_sock = open_socket(true);
+  if (s_sock < 0) {
+    return false;
+  }
+  s_stats.leader = true;
+  xTaskCreate(&leader_task, "fleet_leader", 3072, NULL, 5, NULL);
+  ESP_LOGI(TAG, "Sending beacons to %s:%d",
+           CONFIG_ELEVEN_BIT_CLOCK_FLEET_GROUP,
+           CONFIG_ELEVEN_BIT_CLOCK_FLEET_PORT);
+  return true;
+}
+
+bool fleet_sync_start_follower(fleet_sync_lock_cb_t lock_cb) {
+  s_sock = open_socket(false);
+  if (s_sock < 0) {
+    return false;
+  }
+  s_lock_cb = lock_cb;
+  xTaskCreate(&follower_task, "fleet_follower", 3072, NULL, 5, NULL);
+  ESP_LOGI(TAG, "Listening for beacons on %s:%d",
+           CONFIG_ELEVEN_BIT_CLOCK_FLEET_GROUP,
+           CONFIG_ELEVEN_BIT_CLOCK_FLEET_PORT);
+  return true;
+}
+
+bool fleet_sync_now(struct timeval *tv) {
+  portENTER_CRITICAL(&s_lock);
+  bool locked = s_stats.locked;
+  int64_t offset_us = s_stats.offset_us;
+  portEXIT_CRITICAL(&s_lock);
+  if (!locked) {
+    return false;
+  }
+  int64_t now_us = esp_timer_get_time() + offset_us;
+  tv->tv_sec = now_us / 1000000;
+  tv->tv_usec = now_us % 1000000;
+  return true;
+}
+
+bool fleet_sync_locked(void) {
+  portENTER_CRITICAL(&s_lock);
+  bool locked = s_stats.locked;
+  portEXIT_CRITICAL(&s_lock);
+  return locked;
+}
+
+void fleet_sync_get_stats(fleet_sync_stats_t *stats) {
+  portENTER_CRITICAL(&s_lock);
+  *stats = s_stats;
+  portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * Fleet sync: clocks on a LAN flipping their minutes in step
+ *
+ * Each clock syncs to NTP on its own, with an error of tens of ms, so the
+ * clocks in a room flip visibly apart. With fleet sync one clock, the
+ * leader, multicasts a beacon with its time every second once it is
+ * synced. The followers estimate their offset to the leader from the
+ * beacons and from delay requests they send it (see fleet_clock.h), and
+ * show the leader's time instead of their own. When the leader stops
+ * sending, the followers go back to their own NTP time.
+ *
+ * Only the displayed time follows the leader, the system time of the
+ * followers is still disciplined by NTP.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  bool leader;
+  bool locked;              // follower: the leader's time is used
+  uint32_t leader_address;  // follower: IPv4 address (network order)
+  int64_t offset_us;        // follower: leader time - esp_timer time
+  int64_t delay_us;         // follower: one-way delay from the leader
+  uint32_t beacons;         // sent (leader) or received (follower)
+  uint32_t delay_requests;  // received (leader) or sent (follower)
+  uint32_t delay_responses; // sent (leader) or received (follower)
+} fleet_sync_stats_t;
+
+/* Called by the follower task when it starts or stops following the
+ * leader */
+typedef void (*fleet_sync_lock_cb_t)(bool locked);
+
+/* Start sending beacons (once the time is synced) and answering delay
+ * requests. Returns false if the socket can't be set up */
+bool fleet_sync_start_leader(void);
+
+/* Start listening to the beacons of a leader. Returns false if the socket
+ * can't be set up */
+bool fleet_sync_start_follower(fleet_sync_lock_cb_t lock_cb);
+
+/* Get the leader's time (follower). Returns false, and leaves tv alone, if
+ * not following a leader */
+bool fleet_sync_now(struct timeval *tv);
+
+/* Returns true if following a leader */
+bool fleet_sync_locked(void);
+
+/* Get the state and counters */
+void fleet_sync_get_stats(fleet_sync_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
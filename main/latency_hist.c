@@ -0,0 +1,89 @@
+/*
+ * Fixed bucket log2 histogram for latency measurements
+ */
+#include "latency_hist.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Index of the bucket counting a value */
+static int bucket_index(int64_t value) {
+  if (value <= 0) {
+    return 0;
+  }
+  int index = 64 - __builtin_clzll((uint64_t)value); // bits needed
+  return index < LATENCY_HIST_BUCKETS ? index : LATENCY_HIST_BUCKETS - 1;
+}
+
+/* Largest value counted by a bucket */
+static int64_t bucket_upper(int index) {
+  return index == 0 ? 0 : ((int64_t)1 << index) - 1;
+}
+
+void latency_hist_reset(latency_hist_t *hist) {
+  memset(hist, 0, sizeof(latency_hist_t));
+}
+
+void latency_hist_add(latency_hist_t *hist, int64_t value) {
+  if (hist->count == 0 || value < hist->min) {
+    hist->min = value;
+  }
+  if (hist->count == 0 || value > hist->max) {
+    hist->max = value;
+  }
+  hist->buckets[bucket_index(value)]++;
+  hist->sum += value;
+  hist->count++;
+}
+
+int64_t latency_hist_percentile(const latency_hist_t *hist, int percent) {
+  if (hist->count == 0) {
+    return 0;
+  }
+  // number of values that must be at or below the result
+  uint64_t target = ((uint64_t)hist->count * percent + 99) / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= target && seen > 0) {
+      int64_t upper = bucket_upper(i);
+      return upper < hist->max ? upper : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+int latency_hist_to_json(const latency_hist_t *hist, const char *unit,
+                         char *buf, size_t size) {
+  int len = snprintf(
+      buf, size,
+      "{\"unit\":\"%s\",\"count\":%lu,\"min\":%lld,\"avg\":%lld,"
+      "\"max\":%lld,\"p50\":%lld,\"p99\":%lld,\"buckets\":[",
+      unit, (unsigned long)hist->count, (long long)hist->min,
+      (long long)(hist->count ? hist->sum / hist->count : 0),
+      (long long)hist->max, (long long)latency_hist_percentile(hist, 50),
+      (long long)latency_hist_percentile(hist, 99));
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+
+  const char *sep = "";
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    if (hist->buckets[i] == 0) {
+      continue;
+    }
+    int n = snprintf(buf + len, size - len, "%s[%lld,%lu]", sep,
+                     (long long)bucket_upper(i),
+                     (unsigned long)hist->buckets[i]);
+    if (n < 0 || (size_t)(len + n) >= size) {
+      return -1;
+    }
+    len += n;
+    sep = ",";
+  }
+
+  int n = snprintf(buf + len, size - len, "]}");
+  if (n < 0 || (size_t)(len + n) >= size) {
+    return -1;
+  }
+  return len + n;
+}
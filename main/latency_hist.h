@@ -0,0 +1,46 @@
+/*
+ * Fixed bucket log2 histogram for latency measurements
+ *
+ * Bucket 0 counts values <= 0, bucket k counts values in
+ * [2^(k-1), 2^k - 1], the last bucket also counts everything above.
+ * Adding a value is a handful of instructions and never allocates,
+ * so it can be used on time critical paths. No locking is done here.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LATENCY_HIST_BUCKETS 32
+
+typedef struct {
+  uint32_t buckets[LATENCY_HIST_BUCKETS];
+  uint32_t count;
+  int64_t sum;
+  int64_t min;
+  int64_t max;
+} latency_hist_t;
+
+/* Clear all counts */
+void latency_hist_reset(latency_hist_t *hist);
+
+/* Count a value */
+void latency_hist_add(latency_hist_t *hist, int64_t value);
+
+/* Get the value below which the given percentage (0-100) of the counted
+ * values fall (upper bound of the bucket, 0 if empty) */
+int64_t latency_hist_percentile(const latency_hist_t *hist, int percent);
+
+/* Write the histogram as a JSON object, the buckets as [upper bound, count]
+ * pairs (non empty buckets only)
+ * Returns the number of chars written, or -1 if the buffer is too small */
+int latency_hist_to_json(const latency_hist_t *hist, const char *unit,
+                         char *buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,244 @@
+/*
+ * NTP server prober
+ */
+#include "ntp_probe.h"
+#include "clock_discipline.h"
+#include "esp_log.h"
+#include "esp_netif_sntp.h"
+#include "esp_sntp.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <string.h>
+#include <sys/time.h>
+
+// Timeout of a probe
+#define PROBE_TIMEOUT_MS 1000
+// Rounds of probes after start (or a server change) and their interval,
+// to fill the filters quickly
+#define BURST_ROUNDS 4
+#define BURST_INTERVAL_MS 2000
+// Longest interval between rounds, so failures are noticed in time even
+// when SNTP polls rarely
+#define MAX_INTERVAL_S 1024
+
+static const char *TAG = "ntp_probe";
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+static char s_hosts[NTP_SELECT_MAX_SERVERS][NTP_PROBE_HOST_LEN];
+static ntp_server_t s_servers[NTP_SELECT_MAX_SERVERS];
+static int s_selected = -1;
+static int s_backup = -1;
+static int s_burst; // rounds left in the burst
+
+// SNTP keeps pointers to the server names, the names are written to the
+// set it doesn't use before switching
+static char s_sntp_names[2][2][NTP_PROBE_HOST_LEN];
+static int s_sntp_set;
+
+static int64_t local_time_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/* Second best server, preferring truechimers, then reachable servers
+ * with the lowest root distance (called with the lock held) */
+static int find_backup(int selected, int64_t now_us) {
+  int backup = -1;
+  int64_t backup_distance = 0;
+  for (int i = 0; i < NTP_SELECT_MAX_SERVERS; i++) {
+    const ntp_server_t *server = &s_servers[i];
+    if (i == selected || s_hosts[i][0] == '\0' || server->reach == 0) {
+      continue;
+    }
+    int64_t distance = ntp_select_root_distance(server, now_us);
+    if (backup < 0 ||
+        server->truechimer > s_servers[backup].truechimer ||
+        (server->truechimer == s_servers[backup].truechimer &&
+         distance < backup_distance)) {
+      backup = i;
+      backup_distance = distance;
+    }
+  }
+  return backup;
+}
+
+/* Make the selected server the primary SNTP server (called with the lock
+ * held), returns true if the primary changed */
+static bool use_servers(int selected, int backup) {
+  if (selected == s_selected && backup == s_backup) {
+    return false;
+  }
+  bool changed = selected != s_selected;
+  s_selected = selected;
+  s_backup = backup;
+
+  s_sntp_set ^= 1;
+  char(*names)[NTP_PROBE_HOST_LEN] = s_sntp_names[s_sntp_set];
+  strcpy(names[0], s_hosts[selected]);
+  esp_sntp_setservername(0, names[0]);
+#if CONFIG_LWIP_SNTP_MAX_SERVERS > 1
+  // without a backup, the primary is used for both
+  strcpy(names[1], s_hosts[backup >= 0 ? backup : selected]);
+  esp_sntp_setservername(1, names[1]);
+#endif
+  return changed;
+}
+
+/* Probe all the servers once and update the selection */
+static void probe_round(bool stepped) {
+  for (int i = 0; i < NTP_SELECT_MAX_SERVERS; i++) {
+    char host[NTP_PROBE_HOST_LEN];
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    memcpy(host, s_hosts[i], sizeof(host));
+    if (stepped) {
+      // the offsets were measured against the old time
+      ntp_select_clear_samples(&s_servers[i]);
+    }
+    xSemaphoreGive(s_lock);
+    if (host[0] == '\0') {
+      continue;
+    }
+
+    ntp_sample_t sample;
+    int ret = ntp_select_query(host, PROBE_TIMEOUT_MS, &sample);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (strcmp(host, s_hosts[i]) == 0) { // unless it was replaced
+      if (ret == 0) {
+        ntp_select_add_sample(&s_servers[i], &sample);
+      } else {
+        ntp_select_add_timeout(&s_servers[i]);
+      }
+    }
+    xSemaphoreGive(s_lock);
+  }
+
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  int64_t now_us = local_time_us();
+  int previous = s_selected;
+  int selected = ntp_select_best(s_servers, NTP_SELECT_MAX_SERVERS,
+                                 s_selected, now_us);
+  bool changed = false;
+  if (selected >= 0) {
+    changed = use_servers(selected, find_backup(selected, now_us));
+  }
+  if (changed) {
+    ESP_LOGI(TAG, "Selected %s (was %s)", s_hosts[selected],
+             previous >= 0 ? s_hosts[previous] : "none");
+  }
+  xSemaphoreGive(s_lock);
+
+  if (changed) {
+    esp_netif_sntp_start(); // restart, so the new server is used now
+  } else if (selected < 0) {
+    ESP_LOGW(TAG, "No NTP server answers");
+  }
+}
+
+static void probe_task(void *pvParameters) {
+  (void)pvParameters;
+  uint32_t steps = 0;
+  for (;;) {
+    clock_discipline_stats_t discipline;
+    clock_discipline_get_stats(&discipline);
+    bool stepped = discipline.steps != steps;
+    steps = discipline.steps;
+
+    probe_round(stepped);
+
+    TickType_t delay;
+    if (s_burst > 0) {
+      s_burst--;
+      delay = pdMS_TO_TICKS(BURST_INTERVAL_MS);
+    } else {
+      uint32_t interval = discipline.poll_interval;
+      if (interval > MAX_INTERVAL_S) {
+        interval = MAX_INTERVAL_S;
+      }
+      delay = pdMS_TO_TICKS(interval * 1000);
+    }
+    // woken up early when the servers change
+    ulTaskNotifyTake(pdTRUE, delay);
+  }
+}
+
+/* Copy the server names, resetting the servers that changed (called with
+ * the lock held), returns true if any changed */
+static bool copy_hosts(const char *const *hosts, int count) {
+  bool changed = false;
+  for (int i = 0; i < NTP_SELECT_MAX_SERVERS; i++) {
+    const char *host = i < count && hosts[i] ? hosts[i] : "";
+    if (strncmp(s_hosts[i], host, NTP_PROBE_HOST_LEN - 1) != 0) {
+      strncpy(s_hosts[i], host, NTP_PROBE_HOST_LEN - 1);
+      s_hosts[i][NTP_PROBE_HOST_LEN - 1] = '\0';
+      ntp_select_reset(&s_servers[i]);
+      // the SNTP servers are set again after the next round
+      s_selected = -1;
+      s_backup = -1;
+      changed = true;
+    }
+  }
+  if (changed) {
+    s_burst = BURST_ROUNDS - 1;
+  }
+  return changed;
+}
+
+void ntp_probe_start(const char *const *hosts, int count) {
+  s_lock = xSemaphoreCreateMutex();
+  assert(s_lock && "Failed to create NTP probe lock");
+  copy_hosts(hosts, count);
+  xTaskCreate(&probe_task, "ntp_probe", 4096, NULL, 3, &s_task);
+}
+
+void ntp_probe_set_servers(const char *const *hosts, int count) {
+  if (!s_lock) {
+    return;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool changed = copy_hosts(hosts, count);
+  xSemaphoreGive(s_lock);
+  if (changed) {
+    xTaskNotifyGive(s_task);
+  }
+}
+
+int ntp_probe_get_stats(ntp_probe_stats_t *stats, int max) {
+  if (!s_lock) {
+    return 0;
+  }
+  int n = 0;
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  int64_t now_us = local_time_us();
+  for (int i = 0; i < NTP_SELECT_MAX_SERVERS && n < max; i++) {
+    if (s_hosts[i][0] == '\0') {
+      continue;
+    }
+    memcpy(stats[n].host, s_hosts[i], NTP_PROBE_HOST_LEN);
+    stats[n].server = s_servers[i];
+    stats[n].root_distance_us =
+        ntp_select_root_distance(&s_servers[i], now_us);
+    stats[n].selected = i == s_selected;
+    n++;
+  }
+  xSemaphoreGive(s_lock);
+  return n;
+}
+
+bool ntp_probe_get_selected(ntp_sample_t *best, int64_t *jitter_us) {
+  if (!s_lock) {
+    return false;
+  }
+  xSemaphoreTake(s_lock, portMAX_DELAY);
+  bool selected = s_selected >= 0;
+  if (selected) {
+    *best = s_servers[s_selected].best;
+    *jitter_us = s_servers[s_selected].jitter_us;
+  }
+  xSemaphoreGive(s_lock);
+  return selected;
+}
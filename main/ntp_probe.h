@@ -0,0 +1,46 @@
+/*
+ * NTP server prober
+ *
+ * A background task probes the configured NTP servers, selects the best
+ * one (see ntp_select.h) and makes it the primary SNTP server, with the
+ * next best one as the backup. The servers are probed in a burst after
+ * start, then at the SNTP poll interval (at most every 1024 s). When the
+ * primary server changes, SNTP is restarted to sync with the new one.
+ */
+#pragma once
+
+#include "ntp_select.h"
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum length of a server name, including the terminator
+#define NTP_PROBE_HOST_LEN 32
+
+typedef struct {
+  char host[NTP_PROBE_HOST_LEN];
+  ntp_server_t server;
+  int64_t root_distance_us;
+  bool selected;
+} ntp_probe_stats_t;
+
+/* Start probing the servers (up to NTP_SELECT_MAX_SERVERS, empty names
+ * are skipped), call after esp_netif_sntp_init */
+void ntp_probe_start(const char *const *hosts, int count);
+
+/* Replace the servers, the changed ones are probed again from scratch */
+void ntp_probe_set_servers(const char *const *hosts, int count);
+
+/* Get the state of the servers, returns the number written (up to max) */
+int ntp_probe_get_stats(ntp_probe_stats_t *stats, int max);
+
+/* Get the best sample and the jitter of the selected server (without the
+ * state of all the servers, e.g. on a small stack). Returns false if none
+ * is selected */
+bool ntp_probe_get_selected(ntp_sample_t *best, int64_t *jitter_us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,313 @@
+/*
+ * NTP server selection
+ */
+#include "ntp_select.h"
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define NTP_PORT "123"
+#define NTP_PACKET_SIZE 48
+// Seconds from 1900 (NTP era 0) to 1970
+#define NTP_UNIX_OFFSET 2208988800LL
+
+// Growth of the dispersion of a sample with its age (NTP's PHI, 15 ppm)
+#define DISPERSION_PPM 15
+// Dispersion of a fresh sample, the precision of the local clock
+#define MIN_DISPERSION_US 1000
+// Servers with a larger root distance aren't candidates (NTP's MAXDIST)
+#define MAX_DISTANCE_US 1500000LL
+// A server whose last probes weren't answered isn't a candidate
+#define REACH_MASK 0x07
+
+void ntp_select_reset(ntp_server_t *server) {
+  memset(server, 0, sizeof(*server));
+}
+
+void ntp_select_clear_samples(ntp_server_t *server) {
+  server->num_samples = 0;
+  server->next_sample = 0;
+  server->jitter_us = 0;
+  memset(&server->best, 0, sizeof(server->best));
+}
+
+/* Use the sample with the lowest delay, its offset is the least affected
+ * by asymmetric queuing */
+static void update_filter(ntp_server_t *server) {
+  const ntp_sample_t *best = &server->samples[0];
+  for (int i = 1; i < server->num_samples; i++) {
+    if (server->samples[i].delay_us < best->delay_us) {
+      best = &server->samples[i];
+    }
+  }
+  server->best = *best;
+
+  double sum = 0;
+  for (int i = 0; i < server->num_samples; i++) {
+    double diff = (double)(server->samples[i].offset_us - best->offset_us);
+    sum += diff * diff;
+  }
+  server->jitter_us =
+      server->num_samples > 1
+          ? (int64_t)sqrt(sum / (server->num_samples - 1))
+          : 0;
+}
+
+void ntp_select_add_sample(ntp_server_t *server, const ntp_sample_t *sample) {
+  server->sent++;
+  server->received++;
+  server->reach = server->reach << 1 | 1;
+  server->samples[server->next_sample] = *sample;
+  server->next_sample = (server->next_sample + 1) % NTP_SELECT_SAMPLES;
+  if (server->num_samples < NTP_SELECT_SAMPLES) {
+    server->num_samples++;
+  }
+  update_filter(server);
+}
+
+void ntp_select_add_timeout(ntp_server_t *server) {
+  server->sent++;
+  server->reach <<= 1;
+  if (server->reach == 0) {
+    ntp_select_clear_samples(server);
+  }
+}
+
+int64_t ntp_select_root_distance(const ntp_server_t *server, int64_t now_us) {
+  const ntp_sample_t *best = &server->best;
+  int64_t age_us = now_us - best->time_us;
+  if (age_us < 0) {
+    age_us = 0;
+  }
+  return (best->root_delay_us + best->delay_us) / 2 +
+         best->root_dispersion_us + MIN_DISPERSION_US +
+         age_us * DISPERSION_PPM / 1000000 + server->jitter_us;
+}
+
+static bool is_candidate(const ntp_server_t *server, int64_t distance_us) {
+  return server->num_samples > 0 && (server->reach & REACH_MASK) != 0 &&
+         server->best.stratum >= 1 && server->best.stratum <= 15 &&
+         distance_us < MAX_DISTANCE_US;
+}
+
+/* Edge of the correctness interval of a server, type -1 for the lower
+ * edge, 0 for the offset and 1 for the upper edge */
+typedef struct {
+  int64_t value;
+  int type;
+} endpoint_t;
+
+static int compare_endpoints(const void *a, const void *b) {
+  const endpoint_t *ea = a, *eb = b;
+  if (ea->value != eb->value) {
+    return ea->value < eb->value ? -1 : 1;
+  }
+  return ea->type - eb->type;
+}
+
+/* Find the intersection of the intervals that the most servers agree on,
+ * with less than half of them being falsetickers (RFC 5905 11.2.1).
+ * Returns false if there is no majority */
+static bool intersect(endpoint_t *endpoints, int n, int64_t *low,
+                      int64_t *high) {
+  qsort(endpoints, 3 * n, sizeof(endpoint_t), compare_endpoints);
+  for (int allow = 0; 2 * allow < n; allow++) {
+    // offsets outside of the intersection, more than allowed means that
+    // the intersection contains falsetickers
+    int found = 0;
+    int chime = 0;
+    *low = INT64_MAX;
+    *high = INT64_MIN;
+    for (int i = 0; i < 3 * n; i++) {
+      chime -= endpoints[i].type;
+      if (chime >= n - allow) {
+        *low = endpoints[i].value;
+        break;
+      }
+      if (endpoints[i].type == 0) {
+        found++;
+      }
+    }
+    chime = 0;
+    for (int i = 3 * n - 1; i >= 0; i--) {
+      chime += endpoints[i].type;
+      if (chime >= n - allow) {
+        *high = endpoints[i].value;
+        break;
+      }
+      if (endpoints[i].type == 0) {
+        found++;
+      }
+    }
+    if (found <= allow && *low <= *high) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int ntp_select_best(ntp_server_t *servers, int count, int current,
+                    int64_t now_us) {
+  endpoint_t endpoints[3 * NTP_SELECT_MAX_SERVERS];
+  int64_t distance[NTP_SELECT_MAX_SERVERS];
+  bool candidate[NTP_SELECT_MAX_SERVERS];
+  int n = 0;
+
+  if (count > NTP_SELECT_MAX_SERVERS) {
+    count = NTP_SELECT_MAX_SERVERS;
+  }
+  for (int i = 0; i < count; i++) {
+    servers[i].truechimer = false;
+    distance[i] = ntp_select_root_distance(&servers[i], now_us);
+    candidate[i] = is_candidate(&servers[i], distance[i]);
+    if (candidate[i]) {
+      int64_t offset = servers[i].best.offset_us;
+      endpoints[3 * n] = (endpoint_t){offset - distance[i], -1};
+      endpoints[3 * n + 1] = (endpoint_t){offset, 0};
+      endpoints[3 * n + 2] = (endpoint_t){offset + distance[i], 1};
+      n++;
+    }
+  }
+  if (n == 0) {
+    return -1;
+  }
+
+  // without a majority no server can be trusted more than another, all
+  // the candidates are kept but none is a truechimer
+  int64_t low = 0, high = 0;
+  bool agreed = intersect(endpoints, n, &low, &high);
+  for (int i = 0; i < count; i++) {
+    if (candidate[i] && agreed) {
+      int64_t offset = servers[i].best.offset_us;
+      servers[i].truechimer =
+          offset - distance[i] <= high && offset + distance[i] >= low;
+      candidate[i] = servers[i].truechimer;
+    }
+  }
+
+  // lowest stratum, then lowest root distance
+  int best = -1;
+  for (int i = 0; i < count; i++) {
+    if (candidate[i] &&
+        (best < 0 || servers[i].best.stratum < servers[best].best.stratum ||
+         (servers[i].best.stratum == servers[best].best.stratum &&
+          distance[i] < distance[best]))) {
+      best = i;
+    }
+  }
+
+  // keep the current server unless the best one is clearly better, so
+  // the selection doesn't flap between servers with similar distances
+  if (current >= 0 && current < count && current != best &&
+      candidate[current] &&
+      servers[current].best.stratum == servers[best].best.stratum &&
+      distance[current] - distance[best] < distance[best] / 4) {
+    best = current;
+  }
+  return best;
+}
+
+static int64_t local_time_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+/* NTP timestamp (seconds since 1900 and fraction) to unix time in us */
+static int64_t get_timestamp(const uint8_t *p) {
+  uint32_t seconds = get_u32(p);
+  uint32_t fraction = get_u32(p + 4);
+  int64_t unix_seconds = seconds;
+  if (!(seconds & 0x80000000)) {
+    unix_seconds += 1LL << 32; // era 1, from 2036
+  }
+  unix_seconds -= NTP_UNIX_OFFSET;
+  return unix_seconds * 1000000LL + (((uint64_t)fraction * 1000000) >> 32);
+}
+
+static void put_timestamp(uint8_t *p, int64_t us) {
+  put_u32(p, (uint32_t)(us / 1000000 + NTP_UNIX_OFFSET));
+  put_u32(p + 4, (uint32_t)(((uint64_t)(us % 1000000) << 32) / 1000000));
+}
+
+/* NTP short format (16.16 seconds) to us */
+static int64_t get_short(const uint8_t *p) {
+  return ((uint64_t)get_u32(p) * 1000000) >> 16;
+}
+
+int ntp_select_query(const char *host, int timeout_ms, ntp_sample_t *sample) {
+  return ntp_select_query_port(host, NTP_PORT, timeout_ms, sample);
+}
+
+int ntp_select_query_port(const char *host, const char *port, int timeout_ms,
+                          ntp_sample_t *sample) {
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+  struct addrinfo *res = NULL;
+  if (getaddrinfo(host, port, &hints, &res) != 0 || res == NULL) {
+    return -1;
+  }
+  int sock = socket(res->ai_family, res->ai_socktype, 0);
+  if (sock < 0) {
+    freeaddrinfo(res);
+    return -1;
+  }
+  struct timeval timeout = {.tv_sec = timeout_ms / 1000,
+                            .tv_usec = timeout_ms % 1000 * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // connected, so only the server's answers are received
+  int ret = connect(sock, res->ai_addr, res->ai_addrlen);
+  uint32_t address = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+  freeaddrinfo(res);
+
+  uint8_t packet[NTP_PACKET_SIZE] = {0};
+  uint8_t origin[8];
+  packet[0] = 0x23; // no leap warning, version 4, client mode
+  int64_t t1 = local_time_us();
+  put_timestamp(&packet[40], t1); // echoed back as the origin timestamp
+  memcpy(origin, &packet[40], sizeof(origin));
+  if (ret == 0 && send(sock, packet, sizeof(packet), 0) == sizeof(packet) &&
+      recv(sock, packet, sizeof(packet), 0) == sizeof(packet)) {
+    int64_t t4 = local_time_us();
+    uint8_t leap = packet[0] >> 6;
+    uint8_t mode = packet[0] & 0x07;
+    uint8_t stratum = packet[1];
+    // answer to this request from a synchronized server (stratum 0 is a
+    // kiss-o'-death)
+    if (mode == 4 && leap != 3 && stratum >= 1 && stratum <= 15 &&
+        memcmp(&packet[24], origin, sizeof(origin)) == 0) {
+      int64_t t2 = get_timestamp(&packet[32]); // server receive
+      int64_t t3 = get_timestamp(&packet[40]); // server transmit
+      int64_t delay_us = (t4 - t1) - (t3 - t2);
+      *sample = (ntp_sample_t){
+          .time_us = t4,
+          .offset_us = ((t2 - t1) + (t3 - t4)) / 2,
+          .delay_us = delay_us > 0 ? delay_us : 0,
+          .root_delay_us = get_short(&packet[4]),
+          .root_dispersion_us = get_short(&packet[8]),
+          .address = address,
+          .stratum = stratum,
+      };
+      close(sock);
+      return 0;
+    }
+  }
+  close(sock);
+  return -1;
+}
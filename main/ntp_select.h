@@ -0,0 +1,88 @@
+/*
+ * NTP server selection
+ *
+ * SNTP asks its servers in a fixed order, so a slow or distant first
+ * server sets the clock with a large error. Instead, all the servers are
+ * probed with NTP requests. Each one keeps its last samples (offset and
+ * round trip delay) and, like the NTP clock filter, uses the one with
+ * the lowest delay; the jitter is the RMS difference of the other
+ * offsets. The selection is a simplified NTP clock select: the
+ * intersection of the intervals offset +- root distance that most of the
+ * servers agree on (Marzullo's algorithm) rejects the falsetickers, and
+ * the truechimer with the lowest stratum and root distance is selected.
+ * Servers that stop answering aren't candidates anymore, so the selection
+ * fails over to the next best one.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of servers
+#define NTP_SELECT_MAX_SERVERS 4
+// Samples kept by the filter of each server
+#define NTP_SELECT_SAMPLES 8
+
+typedef struct {
+  int64_t time_us;            // local time of the sample
+  int64_t offset_us;          // server time - local time
+  int64_t delay_us;           // round trip, without the server processing
+  int64_t root_delay_us;      // of the server to its reference clock
+  int64_t root_dispersion_us; // of the server to its reference clock
+  uint32_t address;           // IPv4 address of the server (network order)
+  uint8_t stratum;
+} ntp_sample_t;
+
+typedef struct {
+  ntp_sample_t samples[NTP_SELECT_SAMPLES]; // ring buffer
+  uint8_t num_samples;
+  uint8_t next_sample;
+  uint8_t reach; // one bit per probe, 1 if answered, the last one in bit 0
+  uint32_t sent;
+  uint32_t received;
+  ntp_sample_t best; // sample with the lowest delay
+  int64_t jitter_us;
+  bool truechimer; // set by ntp_select_best
+} ntp_server_t;
+
+/* Clear the state of a server */
+void ntp_select_reset(ntp_server_t *server);
+
+/* Clear the samples of a server (e.g. after the local clock was stepped),
+ * keeping its reachability and counters */
+void ntp_select_clear_samples(ntp_server_t *server);
+
+/* Add the answer to a probe */
+void ntp_select_add_sample(ntp_server_t *server, const ntp_sample_t *sample);
+
+/* Count a probe without an answer */
+void ntp_select_add_timeout(ntp_server_t *server);
+
+/* Root distance of a server at a local time (half the round trip to the
+ * reference clock plus the dispersions and the jitter), the maximum
+ * error of its offset */
+int64_t ntp_select_root_distance(const ntp_server_t *server, int64_t now_us);
+
+/* Select the best of count servers at a local time and set the
+ * truechimer flags. The current selection (-1 if none) is kept unless
+ * another server is clearly better.
+ * Returns the index of the selected server or -1 if none answers */
+int ntp_select_best(ntp_server_t *servers, int count, int current,
+                    int64_t now_us);
+
+/* Send an NTP request to a server (host name or address) and wait up to
+ * timeout_ms for the answer. Returns 0 and sets the sample on success */
+int ntp_select_query(const char *host, int timeout_ms, ntp_sample_t *sample);
+
+/* Same as ntp_select_query on another port than 123 (e.g. the local stub
+ * servers of tools/ntp_stub) */
+int ntp_select_query_port(const char *host, const char *port, int timeout_ms,
+                          ntp_sample_t *sample);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,298 @@
+/*
+ * Time-of-day preset schedule
+ */
+#include "preset_schedule.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define DAY_SECONDS 86400
+#define ALL_DAYS 0x7f
+#define WEEKDAYS 0x3e // Monday to Friday
+#define WEEKENDS 0x41 // Saturday and Sunday
+
+// Offsets of the timeline are known up to this long after now, which
+// covers the local days searched for the next switch (the current one
+// and the 7 after it)
+#define HORIZON (9 * DAY_SECONDS)
+// POSIX TZ rules have at most two transitions a year and they are more
+// than a day apart (see tz_cache.c), so a few segments cover it
+#define MAX_SEGMENTS 4
+
+static const char *const day_names[7] = {"sun", "mon", "tue", "wed",
+                                         "thu", "fri", "sat"};
+
+/* A span of time with the same UTC offset */
+typedef struct {
+  time_t from; // until the from of the next segment
+  int32_t offset;
+} segment_t;
+
+/* The UTC offsets from now on, and the latest local time shown so far */
+typedef struct {
+  segment_t segments[MAX_SEGMENTS];
+  int count;
+  int64_t latest; // local time (seconds since 1970-01-01 00:00 local)
+} timeline_t;
+
+/* Get the latest local time shown up to now. That is the local time of
+ * now, unless DST ended (the clock was set back) within the last day */
+static int64_t latest_local(tz_cache_t *cache, time_t now) {
+  tz_cache_next_transition(cache, now);
+  int64_t latest = now + cache->offset;
+  tz_cache_t past = TZ_CACHE_INIT;
+  time_t last = tz_cache_next_transition(&past, now - DAY_SECONDS);
+  if (last <= now && last - 1 + past.offset > latest) {
+    latest = last - 1 + past.offset;
+  }
+  return latest;
+}
+
+static void timeline_init(timeline_t *timeline, tz_cache_t *cache,
+                          time_t now) {
+  timeline->latest = latest_local(cache, now);
+  time_t until = tz_cache_next_transition(cache, now);
+  timeline->segments[0] = (segment_t){now, cache->offset};
+  timeline->count = 1;
+  tz_cache_t next = TZ_CACHE_INIT;
+  while (until < now + HORIZON && timeline->count < MAX_SEGMENTS) {
+    time_t from = until;
+    until = tz_cache_next_transition(&next, from);
+    timeline->segments[timeline->count++] = (segment_t){from, next.offset};
+  }
+}
+
+/* Get the first instant (after now) the local time reaches local, which
+ * must be later than the latest local time shown */
+static time_t timeline_reach(const timeline_t *timeline, int64_t local) {
+  for (int i = 0; i < timeline->count - 1; i++) {
+    const segment_t *segment = &timeline->segments[i];
+    time_t t = local - segment->offset;
+    if (t < segment->from) {
+      t = segment->from; // skipped by a transition
+    }
+    if (t < timeline->segments[i + 1].from) {
+      return t;
+    }
+  }
+  const segment_t *last = &timeline->segments[timeline->count - 1];
+  time_t t = local - last->offset;
+  return t < last->from ? last->from : t;
+}
+
+/* Local time of a switch on a local day (days since 1970-01-01) */
+static int64_t entry_local(const preset_schedule_entry_t *entry,
+                           int64_t day) {
+  return day * DAY_SECONDS + entry->hour * 3600 + entry->minute * 60;
+}
+
+static bool entry_on(const preset_schedule_entry_t *entry, int64_t day) {
+  return entry->days & (1 << (int)((day + 4) % 7)); // 1970-01-01 is Thursday
+}
+
+time_t preset_schedule_next(const preset_schedule_entry_t *entries,
+                            tz_cache_t *cache, time_t now, uint8_t *preset) {
+  timeline_t timeline;
+  timeline_init(&timeline, cache, now);
+  int64_t today = timeline.latest / DAY_SECONDS;
+
+  // the earliest switch, if several happen at the same instant (skipped
+  // by DST or at the same time) the one of the latest local time, then
+  // the last in the table
+  time_t best = 0;
+  int64_t best_local = 0;
+  for (int64_t day = today; day <= today + 7; day++) {
+    for (int i = 0; i < PRESET_SCHEDULE_LEN; i++) {
+      const preset_schedule_entry_t *entry = &entries[i];
+      int64_t local = entry_local(entry, day);
+      if (!entry_on(entry, day) || local <= timeline.latest) {
+        continue;
+      }
+      time_t t = timeline_reach(&timeline, local);
+      if (best == 0 || t < best || (t == best && local >= best_local)) {
+        best = t;
+        best_local = local;
+        *preset = entry->preset;
+      }
+    }
+  }
+  return best;
+}
+
+uint8_t preset_schedule_current(const preset_schedule_entry_t *entries,
+                                tz_cache_t *cache, time_t now) {
+  int64_t latest = latest_local(cache, now);
+  int64_t today = latest / DAY_SECONDS;
+
+  uint8_t preset = 0;
+  int64_t best_local = 0;
+  for (int64_t day = today - 7; day <= today; day++) {
+    for (int i = 0; i < PRESET_SCHEDULE_LEN; i++) {
+      const preset_schedule_entry_t *entry = &entries[i];
+      int64_t local = entry_local(entry, day);
+      if (entry_on(entry, day) && local <= latest &&
+          (preset == 0 || local >= best_local)) {
+        best_local = local;
+        preset = entry->preset;
+      }
+    }
+  }
+  return preset;
+}
+
+static int day_index(const char *name, size_t len) {
+  for (int i = 0; i < 7 && len == 3; i++) {
+    if (strncasecmp(name, day_names[i], 3) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool parse_days(const char *text, uint8_t *days) {
+  if (strcasecmp(text, "daily") == 0 || strcmp(text, "*") == 0) {
+    *days = ALL_DAYS;
+    return true;
+  }
+  if (strcasecmp(text, "weekdays") == 0) {
+    *days = WEEKDAYS;
+    return true;
+  }
+  if (strcasecmp(text, "weekends") == 0) {
+    *days = WEEKENDS;
+    return true;
+  }
+
+  // days and ranges of days (which can wrap, e.g. fri-mon)
+  *days = 0;
+  const char *pos = text;
+  for (;;) {
+    size_t len = strcspn(pos, ",");
+    const char *dash = memchr(pos, '-', len);
+    int first = day_index(pos, dash ? (size_t)(dash - pos) : len);
+    int last = dash ? day_index(dash + 1, len - (dash - pos) - 1) : first;
+    if (first < 0 || last < 0) {
+      return false;
+    }
+    for (int day = first;; day = (day + 1) % 7) {
+      *days |= 1 << day;
+      if (day == last) {
+        break;
+      }
+    }
+    if (pos[len] == '\0') {
+      return true;
+    }
+    pos += len + 1;
+  }
+}
+
+static bool parse_entry(const char *text, size_t len,
+                        preset_schedule_entry_t *entry) {
+  char buf[64];
+  if (len >= sizeof(buf)) {
+    return false;
+  }
+  memcpy(buf, text, len);
+  buf[len] = '\0';
+
+  char days[32];
+  unsigned hour, minute, preset;
+  int end = 0;
+  if (sscanf(buf, " %31s %u:%u %u %n", days, &hour, &minute, &preset,
+             &end) != 4 ||
+      buf[end] != '\0' || hour > 23 || minute > 59 || preset < 1 ||
+      preset > UINT8_MAX) {
+    return false;
+  }
+  entry->hour = hour;
+  entry->minute = minute;
+  entry->preset = preset;
+  return parse_days(days, &entry->days);
+}
+
+bool preset_schedule_parse(preset_schedule_entry_t *entries,
+                           const char *text) {
+  preset_schedule_entry_t parsed[PRESET_SCHEDULE_LEN] = {0};
+  int count = 0;
+  const char *pos = text;
+  for (;;) {
+    size_t len = strcspn(pos, ";\n");
+    if (strspn(pos, " \t\r") < len) {
+      if (count == PRESET_SCHEDULE_LEN ||
+          !parse_entry(pos, len, &parsed[count++])) {
+        return false;
+      }
+    }
+    if (pos[len] == '\0') {
+      break;
+    }
+    pos += len + 1;
+  }
+  memcpy(entries, parsed, sizeof(parsed));
+  return true;
+}
+
+/* Text being written into a buffer, cut at its size */
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;
+} text_t;
+
+static void text_append(text_t *text, const char *str) {
+  size_t n = strlen(str);
+  if (text->len + n < text->size) {
+    memcpy(text->buf + text->len, str, n + 1);
+    text->len += n;
+  }
+}
+
+/* Write days as "daily" or runs of days from Monday, e.g. "mon-wed,sun" */
+static void format_days(text_t *text, uint8_t days) {
+  if (days == ALL_DAYS) {
+    text_append(text, "daily");
+    return;
+  }
+  bool first = true;
+  for (int k = 0; k < 7;) {
+    if (!(days & (1 << (k + 1) % 7))) {
+      k++;
+      continue;
+    }
+    int end = k;
+    while (end + 1 < 7 && (days & (1 << (end + 2) % 7))) {
+      end++;
+    }
+    text_append(text, first ? "" : ",");
+    text_append(text, day_names[(k + 1) % 7]);
+    if (end > k) {
+      // a run of 2 days is a list
+      text_append(text, end > k + 1 ? "-" : ",");
+      text_append(text, day_names[(end + 1) % 7]);
+    }
+    first = false;
+    k = end + 1;
+  }
+}
+
+int preset_schedule_format(const preset_schedule_entry_t *entries, char *buf,
+                           size_t size) {
+  text_t text = {.buf = buf, .size = size, .len = 0};
+  if (size > 0) {
+    buf[0] = '\0';
+  }
+  for (int i = 0; i < PRESET_SCHEDULE_LEN; i++) {
+    const preset_schedule_entry_t *entry = &entries[i];
+    if (entry->days == 0) {
+      continue;
+    }
+    char time_preset[16];
+    snprintf(time_preset, sizeof(time_preset), " %02u:%02u %u", entry->hour,
+             entry->minute, entry->preset);
+    text_append(&text, text.len > 0 ? "; " : "");
+    format_days(&text, entry->days);
+    text_append(&text, time_preset);
+  }
+  return text.len;
+}
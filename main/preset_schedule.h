@@ -0,0 +1,62 @@
+/*
+ * Time-of-day preset schedule
+ *
+ * A schedule is a table of switches, each one activating a preset at a
+ * local time on some days of the week, e.g. "mon-fri 22:00 2; daily
+ * 07:00 1". Instead of checking the table on every display refresh, the
+ * clock computes the instant of the next switch (with the UTC offsets of
+ * tz_cache.h) and arms a single timer for it.
+ *
+ * A switch happens at the first instant the local time reaches its time:
+ * when DST starts and skips it, at the end of the skipped hour, and when
+ * DST ends and repeats it, only the first time.
+ */
+#pragma once
+
+#include "tz_cache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Switches in a schedule */
+#define PRESET_SCHEDULE_LEN 8
+
+/* Length of the text of the longest schedule (with the terminator) */
+#define PRESET_SCHEDULE_TEXT_LEN 256
+
+typedef struct {
+  uint8_t days;   // bit n for tm_wday n (0 is Sunday), 0 if unused
+  uint8_t hour;   // local time
+  uint8_t minute;
+  uint8_t preset; // id of the preset to activate
+} preset_schedule_entry_t;
+
+/* Parse a schedule from its text: switches "<days> <HH:MM> <preset>"
+ * separated by ';' or new lines, where days are "daily", "weekdays",
+ * "weekends" or a list of days and ranges of days (e.g. "mon,wed-fri").
+ * Returns false (and leaves the schedule as it is) if it is invalid */
+bool preset_schedule_parse(preset_schedule_entry_t *entries,
+                           const char *text);
+
+/* Write the text of a schedule into buf, returns its length */
+int preset_schedule_format(const preset_schedule_entry_t *entries, char *buf,
+                           size_t size);
+
+/* Get the instant of the first switch after now and set its preset.
+ * Returns 0 if the schedule is empty */
+time_t preset_schedule_next(const preset_schedule_entry_t *entries,
+                            tz_cache_t *cache, time_t now, uint8_t *preset);
+
+/* Get the preset of the last switch at or before now (the one that is in
+ * effect), 0 if the schedule is empty */
+uint8_t preset_schedule_current(const preset_schedule_entry_t *entries,
+                                tz_cache_t *cache, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,333 @@
+/*
+ * Preset library in NVS
+ */
+#include "preset_store.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NVS_NAMESPACE "presets"
+#define INDEX_KEY "index"
+#define INDEX_VERSION 1
+#define RECORD_VERSION 1
+// Bytes before the ids of the index and the preset of a record
+#define HEADER_LEN 1
+
+// Before the library, the presets were part of the config (in the
+// "storage" namespace): the config store sections "cfg_preset<n>" (a
+// version byte and the preset), and before those the whole config blob,
+// which had them (40 bytes each) from byte 257 (see config_schema.c)
+#define LEGACY_NAMESPACE "storage"
+#define LEGACY_PRESETS 3
+#define LEGACY_SECTION_KEY "cfg_preset%d"
+#define LEGACY_BLOB_KEY "app_config"
+#define LEGACY_BLOB_OFFSET 257
+#define LEGACY_BLOB_PRESET_LEN 40
+
+static const char *TAG = "preset_store";
+
+static nvs_handle_t s_handle;
+static SemaphoreHandle_t s_mutex; // for NVS and s_count
+static int s_count;
+
+static void record_key(uint8_t id, char key[8]) {
+  snprintf(key, 8, "p%u", id);
+}
+
+/* Read up to size bytes of a blob (the start of it if it is longer, e.g.
+ * written by a newer firmware), len is set to the bytes read */
+static esp_err_t blob_read(nvs_handle_t handle, const char *key, uint8_t *buf,
+                           size_t size, size_t *len) {
+  esp_err_t err = nvs_get_blob(handle, key, NULL, len);
+  if (err != ESP_OK || *len <= size) {
+    return err == ESP_OK ? nvs_get_blob(handle, key, buf, len) : err;
+  }
+  uint8_t *blob = malloc(*len);
+  if (!blob) {
+    return ESP_ERR_NO_MEM;
+  }
+  err = nvs_get_blob(handle, key, blob, len);
+  memcpy(buf, blob, size);
+  *len = size;
+  free(blob);
+  return err;
+}
+
+/* Read the ids of the index, returns their number (0 if there is none) */
+static int index_read(uint8_t ids[PRESET_STORE_MAX]) {
+  uint8_t blob[HEADER_LEN + PRESET_STORE_MAX];
+  size_t len = 0;
+  esp_err_t err = blob_read(s_handle, INDEX_KEY, blob, sizeof(blob), &len);
+  if (err != ESP_OK || len < HEADER_LEN) {
+    if (err != ESP_ERR_NVS_NOT_FOUND) {
+      ESP_LOGE(TAG, "Failed to read the index (%s)", esp_err_to_name(err));
+    }
+    return 0;
+  }
+  memcpy(ids, &blob[HEADER_LEN], len - HEADER_LEN);
+  return len - HEADER_LEN;
+}
+
+static esp_err_t index_write(const uint8_t *ids, int count) {
+  uint8_t blob[HEADER_LEN + PRESET_STORE_MAX];
+  blob[0] = INDEX_VERSION;
+  memcpy(&blob[HEADER_LEN], ids, count);
+  return nvs_set_blob(s_handle, INDEX_KEY, blob, HEADER_LEN + count);
+}
+
+static int index_find(const uint8_t *ids, int count, uint8_t id) {
+  for (int i = 0; i < count; i++) {
+    if (ids[i] == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static esp_err_t record_write(uint8_t id, const preset_t *preset) {
+  uint8_t blob[HEADER_LEN + sizeof(preset_t)];
+  blob[0] = RECORD_VERSION;
+  memcpy(&blob[HEADER_LEN], preset, sizeof(preset_t));
+  char key[8];
+  record_key(id, key);
+  return nvs_set_blob(s_handle, key, blob, sizeof(blob));
+}
+
+/* Read the presets of the config of older versions, blank ones if it
+ * had none */
+static void legacy_read(preset_t presets[LEGACY_PRESETS]) {
+  memset(presets, 0, LEGACY_PRESETS * sizeof(preset_t));
+  nvs_handle_t handle;
+  if (nvs_open(LEGACY_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+  uint8_t blob[HEADER_LEN + sizeof(preset_t)];
+  int found = 0;
+  for (int i = 0; i < LEGACY_PRESETS; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), LEGACY_SECTION_KEY, i + 1);
+    size_t len = 0;
+    if (blob_read(handle, key, blob, sizeof(blob), &len) == ESP_OK &&
+        len > HEADER_LEN) {
+      memcpy(&presets[i], &blob[HEADER_LEN], len - HEADER_LEN);
+      found++;
+    }
+  }
+
+  size_t len = 0;
+  if (found == 0 &&
+      nvs_get_blob(handle, LEGACY_BLOB_KEY, NULL, &len) == ESP_OK &&
+      len > LEGACY_BLOB_OFFSET) {
+    // the config store migrates (and removes) the rest of it
+    uint8_t *config = malloc(len);
+    if (config &&
+        nvs_get_blob(handle, LEGACY_BLOB_KEY, config, &len) == ESP_OK) {
+      for (int i = 0; i < LEGACY_PRESETS; i++) {
+        size_t pos = LEGACY_BLOB_OFFSET + i * LEGACY_BLOB_PRESET_LEN;
+        if (pos + LEGACY_BLOB_PRESET_LEN <= len) {
+          memcpy(&presets[i], &config[pos], LEGACY_BLOB_PRESET_LEN);
+          found++;
+        }
+      }
+    }
+    free(config);
+  }
+  nvs_close(handle);
+  if (found > 0) {
+    ESP_LOGI(TAG, "Imported the presets of the config");
+  }
+}
+
+/* Remove the preset sections of the config of older versions, once the
+ * library has them */
+static void legacy_erase(void) {
+  nvs_handle_t handle;
+  if (nvs_open(LEGACY_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  for (int i = 0; i < LEGACY_PRESETS; i++) {
+    char key[16];
+    snprintf(key, sizeof(key), LEGACY_SECTION_KEY, i + 1);
+    nvs_erase_key(handle, key);
+  }
+  esp_err_t err = nvs_commit(handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to remove the presets of the config (%s)",
+             esp_err_to_name(err));
+  }
+  nvs_close(handle);
+}
+
+/* Create the library from the presets of the config */
+static esp_err_t create(void) {
+  preset_t presets[LEGACY_PRESETS];
+  legacy_read(presets);
+
+  uint8_t ids[LEGACY_PRESETS];
+  esp_err_t err = ESP_OK;
+  for (int i = 0; i < LEGACY_PRESETS && err == ESP_OK; i++) {
+    ids[i] = i + 1; // the active preset of the config stays the same
+    err = record_write(ids[i], &presets[i]);
+  }
+  if (err == ESP_OK) {
+    err = index_write(ids, LEGACY_PRESETS);
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(s_handle);
+  }
+  if (err == ESP_OK) {
+    // only now, so a failed write imports them again on the next boot
+    legacy_erase();
+  }
+  s_count = err == ESP_OK ? LEGACY_PRESETS : 0;
+  return err;
+}
+
+esp_err_t preset_store_init(void) {
+  s_mutex = xSemaphoreCreateMutex();
+  esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &s_handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to open NVS (%s)", esp_err_to_name(err));
+    return err;
+  }
+  size_t len = 0;
+  if (nvs_get_blob(s_handle, INDEX_KEY, NULL, &len) ==
+      ESP_ERR_NVS_NOT_FOUND) {
+    err = create();
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to create the library (%s)",
+               esp_err_to_name(err));
+    }
+  } else {
+    uint8_t ids[PRESET_STORE_MAX];
+    s_count = index_read(ids);
+  }
+  ESP_LOGI(TAG, "%d presets", s_count);
+  return err;
+}
+
+int preset_store_count(void) {
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  int count = s_count;
+  xSemaphoreGive(s_mutex);
+  return count;
+}
+
+int preset_store_list(int offset, uint8_t *ids, int max) {
+  uint8_t all[PRESET_STORE_MAX];
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  int count = index_read(all);
+  xSemaphoreGive(s_mutex);
+  int n = 0;
+  for (int i = offset; i >= 0 && i < count && n < max; i++) {
+    ids[n++] = all[i];
+  }
+  return n;
+}
+
+esp_err_t preset_store_get(uint8_t id, preset_t *preset) {
+  uint8_t blob[HEADER_LEN + sizeof(preset_t)];
+  char key[8];
+  record_key(id, key);
+  size_t len = 0;
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  esp_err_t err = blob_read(s_handle, key, blob, sizeof(blob), &len);
+  xSemaphoreGive(s_mutex);
+  if (err == ESP_ERR_NVS_NOT_FOUND || (err == ESP_OK && len < HEADER_LEN)) {
+    return ESP_ERR_NOT_FOUND;
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to read preset %u (%s)", id, esp_err_to_name(err));
+    return err;
+  }
+  // fields appended since it was written keep their default
+  memset(preset, 0, sizeof(preset_t));
+  memcpy(preset, &blob[HEADER_LEN], len - HEADER_LEN);
+  return ESP_OK;
+}
+
+esp_err_t preset_store_set(uint8_t *id, const preset_t *preset) {
+  uint8_t ids[PRESET_STORE_MAX];
+  esp_err_t err = ESP_OK;
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  int count = index_read(ids);
+  if (*id == 0) {
+    // the lowest id not in use
+    bool used[PRESET_STORE_MAX + 1] = {false};
+    for (int i = 0; i < count; i++) {
+      if (ids[i] <= PRESET_STORE_MAX) {
+        used[ids[i]] = true;
+      }
+    }
+    for (int i = 1; i <= PRESET_STORE_MAX && *id == 0; i++) {
+      *id = used[i] ? 0 : i;
+    }
+    if (*id == 0 || count == PRESET_STORE_MAX) {
+      err = ESP_ERR_NO_MEM;
+    } else {
+      ids[count++] = *id;
+      err = record_write(*id, preset);
+      if (err == ESP_OK) {
+        err = index_write(ids, count);
+      }
+    }
+  } else if (index_find(ids, count, *id) < 0) {
+    err = ESP_ERR_NOT_FOUND;
+  } else {
+    err = record_write(*id, preset);
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(s_handle);
+  }
+  if (err == ESP_OK) {
+    s_count = count;
+  }
+  xSemaphoreGive(s_mutex);
+  if (err != ESP_OK && err != ESP_ERR_NOT_FOUND) {
+    ESP_LOGE(TAG, "Failed to write preset %u (%s)", *id,
+             esp_err_to_name(err));
+  }
+  return err;
+}
+
+esp_err_t preset_store_delete(uint8_t id) {
+  uint8_t ids[PRESET_STORE_MAX];
+  esp_err_t err = ESP_ERR_NOT_FOUND;
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  int count = index_read(ids);
+  int pos = index_find(ids, count, id);
+  if (pos >= 0) {
+    memmove(&ids[pos], &ids[pos + 1], count - pos - 1);
+    count--;
+    // the index first, a record left behind is only overwritten later
+    err = index_write(ids, count);
+    if (err == ESP_OK) {
+      char key[8];
+      record_key(id, key);
+      nvs_erase_key(s_handle, key);
+      err = nvs_commit(s_handle);
+    }
+    if (err == ESP_OK) {
+      s_count = count;
+    }
+  }
+  xSemaphoreGive(s_mutex);
+  return err;
+}
+
+uint8_t preset_store_next(uint8_t id) {
+  uint8_t ids[PRESET_STORE_MAX];
+  xSemaphoreTake(s_mutex, portMAX_DELAY);
+  int count = index_read(ids);
+  xSemaphoreGive(s_mutex);
+  if (count == 0) {
+    return 0;
+  }
+  int pos = index_find(ids, count, id);
+  return ids[(pos + 1) % count];
+}
@@ -0,0 +1,64 @@
+/*
+ * Preset library in NVS
+ *
+ * Each preset is its own NVS record (key "p<id>": a version byte and the
+ * preset_t, whose fields are only appended), and an index record holds
+ * the ids in the order the presets are listed. Only the number of presets
+ * is kept in RAM: a preset is read when it is listed, edited or
+ * activated, and the display keeps the palette of the active one (see
+ * display.h), so the RAM used is the same with 3 presets or
+ * PRESET_STORE_MAX. Ids are from 1 to PRESET_STORE_MAX and the lowest free
+ * one is given to a new preset.
+ *
+ * The presets used to be part of the config, the library is created from
+ * them on the first boot (see preset_store_init()).
+ */
+#pragma once
+
+#include "display.h"
+#include "esp_err.h"
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef CONFIG_ELEVEN_BIT_CLOCK_MAX_PRESETS
+#define PRESET_STORE_MAX CONFIG_ELEVEN_BIT_CLOCK_MAX_PRESETS
+#else
+#define PRESET_STORE_MAX 100
+#endif
+
+/* Open the library, or create it from the presets of the config of older
+ * versions (or 3 blank presets). Call it before config_store_init(),
+ * which removes the legacy config blob */
+esp_err_t preset_store_init(void);
+
+/* Get the number of presets */
+int preset_store_count(void);
+
+/* Get the ids of up to max presets from position offset in the list.
+ * Returns the number of ids */
+int preset_store_list(int offset, uint8_t *ids, int max);
+
+/* Read a preset. Returns ESP_ERR_NOT_FOUND if there is no preset id */
+esp_err_t preset_store_get(uint8_t id, preset_t *preset);
+
+/* Write a preset, or add it at the end of the list if *id is 0 (and set
+ * *id). Returns ESP_ERR_NO_MEM if the library is full */
+esp_err_t preset_store_set(uint8_t *id, const preset_t *preset);
+
+/* Remove a preset from the library */
+esp_err_t preset_store_delete(uint8_t id);
+
+/* Get the id of the preset after a preset in the list (the first after
+ * the last, or if id isn't in the list), 0 if there are none */
+uint8_t preset_store_next(uint8_t id);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Time checkpoint kept across reboots
+ */
+#include "time_checkpoint.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rtc_time.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECKPOINT_MAGIC 0x54434b31 // "TCK1"
+// Minimum time between the two syncs used to measure the drift, so the
+// error of each sync (a few ms) is small compared to the drift
+#define DRIFT_MIN_INTERVAL_US (3600LL * 1000000LL)
+// Larger drift measurements are discarded (5%, the RTC clock is calibrated)
+#define DRIFT_MAX_PPB 50000000LL
+// Drift changes smaller than this aren't written to NVS
+#define DRIFT_SAVE_THRESHOLD_PPB 1000
+#define DRIFT_NVS_KEY "rtc_drift"
+
+static const char *TAG = "time_checkpoint";
+
+/* Checkpoint stored in RTC memory */
+typedef struct {
+  uint32_t magic;
+  int64_t wall_us;      // system time...
+  int64_t rtc_us;       // ...and RTC counter at the checkpoint
+  int64_t sync_wall_us; // time of the NTP sync the drift is measured from
+  int64_t sync_rtc_us;  // (0 if none yet)
+  uint32_t checksum;
+} checkpoint_t;
+
+static RTC_NOINIT_ATTR checkpoint_t s_checkpoint;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_time_known;  // time restored or synced since boot
+static bool s_provisional; // time restored and not synced since
+static int32_t s_drift_ppb;
+static int32_t s_saved_drift_ppb;
+static bool s_have_drift; // drift measured or loaded from NVS
+static bool s_drift_saved;
+
+/* FNV-1a of the checkpoint, except the checksum */
+static uint32_t checkpoint_checksum(const checkpoint_t *cp) {
+  const uint8_t *bytes = (const uint8_t *)cp;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(checkpoint_t, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int64_t timeval_us(const struct timeval *tv) {
+  return (int64_t)tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+/* Estimate the system time from a checkpoint and the RTC counter */
+static int64_t estimate_wall_us(const checkpoint_t *cp, int64_t rtc_us) {
+  int64_t elapsed_us = rtc_us - cp->rtc_us;
+  return cp->wall_us + elapsed_us + elapsed_us * s_drift_ppb / 1000000000LL;
+}
+
+static void write_checkpoint(const checkpoint_t *cp) {
+  checkpoint_t copy = *cp;
+  copy.magic = CHECKPOINT_MAGIC;
+  copy.checksum = checkpoint_checksum(&copy);
+  portENTER_CRITICAL(&s_lock);
+  s_checkpoint = copy;
+  portEXIT_CRITICAL(&s_lock);
+}
+
+/* Read the checkpoint, returns false if it isn't valid */
+static bool read_checkpoint(checkpoint_t *cp) {
+  portENTER_CRITICAL(&s_lock);
+  *cp = s_checkpoint;
+  portEXIT_CRITICAL(&s_lock);
+  return cp->magic == CHECKPOINT_MAGIC &&
+         cp->checksum == checkpoint_checksum(cp);
+}
+
+static void load_drift(void) {
+  nvs_handle_t handle;
+  if (nvs_open("storage", NVS_READONLY, &handle) != ESP_OK) {
+    return;
+  }
+  if (nvs_get_i32(handle, DRIFT_NVS_KEY, &s_drift_ppb) == ESP_OK) {
+    s_saved_drift_ppb = s_drift_ppb;
+    s_have_drift = true;
+    s_drift_saved = true;
+    ESP_LOGI(TAG, "RTC drift: %ld ppb", (long)s_drift_ppb);
+  }
+  nvs_close(handle);
+}
+
+void time_checkpoint_save_drift(void) {
+  portENTER_CRITICAL(&s_lock);
+  int32_t drift_ppb = s_drift_ppb;
+  bool have_drift = s_have_drift;
+  portEXIT_CRITICAL(&s_lock);
+  // limit flash writes, the estimate changes a little on every measurement
+  if (!have_drift ||
+      (s_drift_saved &&
+       abs(drift_ppb - s_saved_drift_ppb) < DRIFT_SAVE_THRESHOLD_PPB)) {
+    return;
+  }
+  nvs_handle_t handle;
+  esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
+  if (err == ESP_OK) {
+    err = nvs_set_i32(handle, DRIFT_NVS_KEY, drift_ppb);
+    if (err == ESP_OK) {
+      err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to save RTC drift (%s)", esp_err_to_name(err));
+    return;
+  }
+  s_saved_drift_ppb = drift_ppb;
+  s_drift_saved = true;
+}
+
+/* Update the drift estimate with the error of the RTC clock over an
+ * interval between two syncs (in memory, it's saved by
+ * time_checkpoint_save_drift() off the tcpip task) */
+static void update_drift(int64_t error_us, int64_t rtc_elapsed_us) {
+  int64_t rtc_elapsed_ms = rtc_elapsed_us / 1000;
+  if (llabs(error_us) > rtc_elapsed_ms * (DRIFT_MAX_PPB / 1000000LL)) {
+    // more than any RTC clock drifts, the time was changed by someone else
+    ESP_LOGW(TAG, "Ignoring drift measurement (%lld us off)", error_us);
+    return;
+  }
+  int64_t measured_ppb = error_us * 1000000LL / rtc_elapsed_ms;
+  // average the measurements to smooth out the sync errors
+  portENTER_CRITICAL(&s_lock);
+  s_drift_ppb = s_have_drift
+                    ? s_drift_ppb + ((int32_t)measured_ppb - s_drift_ppb) / 4
+                    : (int32_t)measured_ppb;
+  s_have_drift = true;
+  portEXIT_CRITICAL(&s_lock);
+  ESP_LOGI(TAG, "RTC drift: measured %lld ppb, estimate %ld ppb",
+           measured_ppb, (long)s_drift_ppb);
+}
+
+bool time_checkpoint_restore(void) {
+  load_drift();
+  esp_register_shutdown_handler(time_checkpoint_save);
+
+  checkpoint_t cp;
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT ||
+      !read_checkpoint(&cp)) {
+    // cold boot, RTC memory and counter were lost
+    s_checkpoint.magic = 0;
+    return false;
+  }
+
+  int64_t rtc_us = (int64_t)esp_rtc_get_time_us();
+  if (cp.wall_us <= 0 || rtc_us < cp.rtc_us) {
+    ESP_LOGW(TAG, "Ignoring inconsistent checkpoint");
+    return false;
+  }
+
+  int64_t wall_us = estimate_wall_us(&cp, rtc_us);
+  struct timeval tv = {.tv_sec = wall_us / 1000000LL,
+                       .tv_usec = wall_us % 1000000LL};
+  settimeofday(&tv, NULL);
+  s_time_known = true;
+  s_provisional = true;
+  ESP_LOGI(TAG, "Restored time from checkpoint %lld ms old (provisional)",
+           (rtc_us - cp.rtc_us) / 1000);
+  return true;
+}
+
+void time_checkpoint_save(void) {
+  if (!s_time_known) {
+    return;
+  }
+  checkpoint_t cp;
+  if (!read_checkpoint(&cp)) {
+    memset(&cp, 0, sizeof(cp));
+  }
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  cp.rtc_us = (int64_t)esp_rtc_get_time_us();
+  cp.wall_us = timeval_us(&tv);
+  write_checkpoint(&cp);
+}
+
+void time_checkpoint_synced(const struct timeval *tv) {
+  int64_t rtc_us = (int64_t)esp_rtc_get_time_us();
+  int64_t wall_us = timeval_us(tv);
+
+  checkpoint_t cp;
+  if (!read_checkpoint(&cp)) {
+    memset(&cp, 0, sizeof(cp));
+  } else if (s_provisional) {
+    ESP_LOGI(TAG, "Provisional time was off by %lld ms",
+             (wall_us - estimate_wall_us(&cp, rtc_us)) / 1000);
+  }
+
+  // measure the drift of the RTC clock between two syncs far enough
+  // apart, the RTC counter keeps running across warm boots
+  int64_t rtc_elapsed_us = rtc_us - cp.sync_rtc_us;
+  if (cp.sync_rtc_us != 0 && rtc_elapsed_us >= DRIFT_MIN_INTERVAL_US) {
+    update_drift((wall_us - cp.sync_wall_us) - rtc_elapsed_us, rtc_elapsed_us);
+  }
+  if (cp.sync_rtc_us == 0 || rtc_elapsed_us < 0 ||
+      rtc_elapsed_us >= DRIFT_MIN_INTERVAL_US) {
+    cp.sync_wall_us = wall_us;
+    cp.sync_rtc_us = rtc_us;
+  }
+
+  cp.wall_us = wall_us;
+  cp.rtc_us = rtc_us;
+  write_checkpoint(&cp);
+  s_time_known = true;
+  s_provisional = false;
+}
+
+bool time_checkpoint_is_provisional(void) { return s_provisional; }
+
+int32_t time_checkpoint_drift_ppb(void) { return s_drift_ppb; }
@@ -0,0 +1,48 @@
+/*
+ * Time checkpoint kept across reboots
+ *
+ * The system time is checkpointed in RTC memory (which survives
+ * esp_restart and crashes, but not a power cycle) together with the
+ * RTC counter, which keeps running through a reset. After a warm boot
+ * the time can be restored right away from the checkpoint and the time
+ * elapsed on the RTC counter, corrected with the drift rate of the RTC
+ * clock learned from successive NTP syncs (stored in NVS).
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Restore the system time from the checkpoint of the previous boot and
+ * load the drift rate. The restored time is provisional until the next
+ * NTP sync. Also registers a shutdown handler checkpointing the time on
+ * esp_restart.
+ * Returns true if the time was restored */
+bool time_checkpoint_restore(void);
+
+/* Checkpoint the system time (does nothing until the time is known) */
+void time_checkpoint_save(void);
+
+/* Call when NTP has set the time: reconciles the provisional time,
+ * updates the drift rate (in memory) and checkpoints the time */
+void time_checkpoint_synced(const struct timeval *tv);
+
+/* Save the drift rate to NVS if it changed enough since it was saved.
+ * Blocks on flash, call it from a background task, not the tcpip task */
+void time_checkpoint_save_drift(void);
+
+/* Returns true if the time was restored and not synced since */
+bool time_checkpoint_is_provisional(void);
+
+/* Drift rate of the RTC clock in parts per billion (positive if the RTC
+ * clock is slow) */
+int32_t time_checkpoint_drift_ppb(void);
+
+#ifdef __cplusplus
+}
+#endif
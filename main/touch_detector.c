@@ -0,0 +1,201 @@
+/*
+ * Touch detection on the ADC readings of the touch input
+ */
+#include "touch_detector.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Fractional bits of the filters and the baseline
+#define FRAC_BITS 4
+// Smoothing of the noise estimate (1/16 per frame)
+#define NOISE_SHIFT 4
+
+static int32_t median3(int32_t a, int32_t b, int32_t c) {
+  if (a > b) {
+    int32_t t = a;
+    a = b;
+    b = t;
+  }
+  // a <= b, the median is c clamped to [a, b]
+  return c < a ? a : c > b ? b : c;
+}
+
+static void filter_init(touch_channel_filter_t *filter, int32_t value) {
+  for (int i = 0; i < 3; i++) {
+    filter->history[i] = value;
+  }
+  filter->filtered = value << FRAC_BITS;
+}
+
+/* Median of 3, then IIR, returns the output with FRAC_BITS */
+static int32_t filter_add(touch_channel_filter_t *filter, int32_t value,
+                          uint8_t shift) {
+  filter->history[0] = filter->history[1];
+  filter->history[1] = filter->history[2];
+  filter->history[2] = value;
+  int32_t median =
+      median3(filter->history[0], filter->history[1], filter->history[2]);
+  filter->filtered += ((median << FRAC_BITS) - filter->filtered) >> shift;
+  return filter->filtered;
+}
+
+static void set_state(touch_detector_t *detector, touch_state_t state) {
+  detector->state = state;
+  detector->state_frames = 0;
+  if (state == TOUCH_STATE_IDLE) {
+    detector->onset_us = 0;
+  }
+}
+
+/* Pending touch: press once it lasted confirm_frames */
+static touch_event_t confirm(touch_detector_t *detector, int64_t time_us) {
+  if (detector->state_frames < detector->config.confirm_frames) {
+    return TOUCH_EVENT_NONE;
+  }
+  detector->stats.presses++;
+  if (detector->onset_us) {
+    latency_hist_add(&detector->stats.latency,
+                     time_us - detector->onset_us);
+  }
+  set_state(detector, TOUCH_STATE_TOUCHED);
+  return TOUCH_EVENT_PRESS;
+}
+
+bool touch_frame_average(const uint8_t *frame, uint32_t len,
+                         uint8_t touch_channel, uint8_t comp_channel,
+                         int32_t *touch, int32_t *comp, uint32_t *invalid) {
+  int32_t sum = 0, sum_comp = 0;
+  int count = 0, count_comp = 0;
+  for (uint32_t i = 0; i + TOUCH_FRAME_RESULT_BYTES <= len;
+       i += TOUCH_FRAME_RESULT_BYTES) {
+    uint32_t result = (uint32_t)frame[i] | (uint32_t)frame[i + 1] << 8 |
+                      (uint32_t)frame[i + 2] << 16;
+    uint32_t channel = (result >> 13) & 0x07;
+    if (channel == touch_channel) {
+      sum += result & 0xfff;
+      count++;
+    } else if (channel == comp_channel) {
+      sum_comp += result & 0xfff;
+      count_comp++;
+    } else {
+      (*invalid)++;
+    }
+  }
+  if (count == 0 || count_comp == 0) {
+    return false;
+  }
+  *touch = sum / count;
+  *comp = sum_comp / count_comp;
+  return true;
+}
+
+void touch_detector_init(touch_detector_t *detector,
+                         const touch_detector_config_t *config) {
+  memset(detector, 0, sizeof(*detector));
+  detector->config = *config;
+  detector->warmup_frames = config->warmup_frames;
+  latency_hist_reset(&detector->stats.latency);
+}
+
+void touch_detector_reset_stats(touch_detector_t *detector) {
+  touch_detector_stats_t *stats = &detector->stats;
+  stats->frames = 0;
+  stats->presses = 0;
+  stats->rejected = 0;
+  stats->recalibrations = 0;
+  latency_hist_reset(&stats->latency);
+}
+
+touch_event_t touch_detector_process(touch_detector_t *detector,
+                                     int32_t touch, int32_t comp,
+                                     int64_t time_us) {
+  const touch_detector_config_t *config = &detector->config;
+  touch_detector_stats_t *stats = &detector->stats;
+
+  stats->frames++;
+  if (detector->warmup_frames == detector->config.warmup_frames) {
+    filter_init(&detector->touch, touch);
+    filter_init(&detector->comp, comp);
+  }
+  // the sign of the difference depends on the wiring, a touch moves it
+  // away from zero
+  int32_t signal =
+      abs(filter_add(&detector->touch, touch, config->filter_shift) -
+          filter_add(&detector->comp, comp, config->filter_shift));
+  if (detector->warmup_frames > 0) {
+    detector->warmup_frames--;
+    detector->baseline = signal;
+    stats->baseline = signal >> FRAC_BITS;
+    return TOUCH_EVENT_NONE;
+  }
+
+  int32_t deviation = (signal - detector->baseline) >> FRAC_BITS;
+  // the unfiltered deviation only dates the start of a touch
+  int32_t raw_deviation =
+      abs(touch - comp) - (detector->baseline >> FRAC_BITS);
+  stats->deviation = deviation;
+  if (raw_deviation > config->press_threshold && detector->onset_us == 0) {
+    detector->onset_us = time_us;
+  }
+
+  touch_event_t event = TOUCH_EVENT_NONE;
+  detector->state_frames++;
+  switch (detector->state) {
+  case TOUCH_STATE_IDLE:
+    if (deviation > config->press_threshold) {
+      detector->state = TOUCH_STATE_PENDING;
+      detector->state_frames = 1;
+      event = confirm(detector, time_us);
+      break;
+    }
+    if (raw_deviation <= config->press_threshold && detector->onset_us) {
+      // a spike the filters removed
+      stats->rejected++;
+      detector->onset_us = 0;
+    }
+    detector->baseline +=
+        (signal - detector->baseline) >> config->baseline_shift;
+    detector->noise +=
+        ((abs(deviation) << FRAC_BITS) - detector->noise) >> NOISE_SHIFT;
+    break;
+
+  case TOUCH_STATE_PENDING:
+    if (deviation > config->press_threshold) {
+      event = confirm(detector, time_us);
+    } else {
+      stats->rejected++;
+      set_state(detector, TOUCH_STATE_IDLE);
+    }
+    break;
+
+  case TOUCH_STATE_TOUCHED:
+    if (deviation < config->release_threshold) {
+      set_state(detector, TOUCH_STATE_IDLE);
+      event = TOUCH_EVENT_RELEASE;
+    } else if (detector->state_frames > config->max_touch_frames) {
+      // not a touch but a step of the signal, follow it
+      stats->recalibrations++;
+      detector->baseline = signal;
+      set_state(detector, TOUCH_STATE_IDLE);
+      event = TOUCH_EVENT_RELEASE;
+    }
+    break;
+  }
+
+  stats->baseline = detector->baseline >> FRAC_BITS;
+  stats->noise = detector->noise >> FRAC_BITS;
+  return event;
+}
+
+bool touch_detector_pressed(const touch_detector_t *detector) {
+  return detector->state == TOUCH_STATE_TOUCHED;
+}
+
+bool touch_detector_idle(const touch_detector_t *detector) {
+  return detector->warmup_frames == 0 &&
+         detector->state == TOUCH_STATE_IDLE && detector->onset_us == 0;
+}
+
+int32_t touch_detector_touch_level(const touch_detector_t *detector) {
+  return detector->touch.filtered >> FRAC_BITS;
+}
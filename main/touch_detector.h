@@ -0,0 +1,131 @@
+/*
+ * Touch detection on the ADC readings of the touch input
+ *
+ * Each frame of ADC conversions gives the mean of the touch channel and
+ * of the comparator channel (same wiring, not connected to the touch
+ * plate). Both go through a median of 3 filter, which removes the single
+ * frame swings of the readings, then an integer IIR low pass. The
+ * comparator is subtracted from the touch channel to cancel the noise
+ * they share (mains hum, supply ripple), and the result is compared to a
+ * baseline that slowly tracks it while the input isn't touched, so drift
+ * (temperature, humidity) doesn't cause touches. A touch starts when the
+ * deviation from the baseline stays above the press threshold for
+ * confirm_frames frames and ends when it falls below the lower release
+ * threshold. A "touch" that lasts longer than max_touch_frames is taken
+ * as a step of the baseline, which is reset.
+ *
+ * Everything is integer math on the ADC counts, with 4 fractional bits
+ * for the filters and the baseline.
+ */
+#pragma once
+
+#include "latency_hist.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bytes per reading in the frames of touch_frame_average
+#define TOUCH_FRAME_RESULT_BYTES 4
+
+typedef enum {
+  TOUCH_EVENT_NONE,
+  TOUCH_EVENT_PRESS,
+  TOUCH_EVENT_RELEASE,
+} touch_event_t;
+
+typedef struct {
+  int32_t press_threshold;   // deviation that starts a touch (ADC counts)
+  int32_t release_threshold; // deviation below which a touch ends
+  uint8_t confirm_frames;    // frames above the press threshold
+  uint8_t filter_shift;      // IIR: y += (x - y) >> shift
+  uint8_t baseline_shift;    // baseline tracking, slower when larger
+  uint8_t warmup_frames;     // frames only used for the baseline at start
+  uint16_t max_touch_frames; // longer touches reset the baseline
+} touch_detector_config_t;
+
+// About 100 ms frames (2 channels at 620 Hz, 32 readings each)
+#define TOUCH_DETECTOR_CONFIG_DEFAULT()                                       \
+  {                                                                           \
+      .press_threshold = 320,                                                 \
+      .release_threshold = 160,                                               \
+      .confirm_frames = 2,                                                    \
+      .filter_shift = 1,                                                      \
+      .baseline_shift = 5,                                                    \
+      .warmup_frames = 8,                                                     \
+      .max_touch_frames = 300,                                                \
+  }
+
+typedef struct {
+  uint32_t frames;
+  uint32_t presses;
+  uint32_t rejected;       // crossings of the press threshold, not touches
+  uint32_t recalibrations; // baseline resets after too long touches
+  int32_t baseline;        // ADC counts
+  int32_t deviation;       // of the last frame from the baseline
+  int32_t noise;           // mean absolute deviation while untouched
+  latency_hist_t latency;  // first frame over the threshold to press (us)
+} touch_detector_stats_t;
+
+typedef struct {
+  int32_t history[3]; // last readings, for the median
+  int32_t filtered;   // IIR output (4 fractional bits)
+} touch_channel_filter_t;
+
+typedef enum {
+  TOUCH_STATE_IDLE,
+  TOUCH_STATE_PENDING, // above the press threshold, not confirmed yet
+  TOUCH_STATE_TOUCHED,
+} touch_state_t;
+
+typedef struct {
+  touch_detector_config_t config;
+  touch_channel_filter_t touch;
+  touch_channel_filter_t comp;
+  int32_t baseline;      // 4 fractional bits
+  int32_t noise;         // 4 fractional bits
+  uint8_t warmup_frames; // left before detecting
+  touch_state_t state;
+  uint16_t state_frames; // frames in the current state
+  int64_t onset_us;      // first unfiltered frame over the threshold, or 0
+  touch_detector_stats_t stats;
+} touch_detector_t;
+
+/* Average the readings of the touch and comparator channels in a frame of
+ * raw ADC conversions, as read from the ADC driver (4 byte readings in
+ * the ESP32-C3 format: little endian, data in bits 0-11, channel in bits
+ * 13-15). Readings of other channels are counted in invalid.
+ * Returns false if one of the channels has no readings */
+bool touch_frame_average(const uint8_t *frame, uint32_t len,
+                         uint8_t touch_channel, uint8_t comp_channel,
+                         int32_t *touch, int32_t *comp, uint32_t *invalid);
+
+/* Start detecting with a config (e.g. TOUCH_DETECTOR_CONFIG_DEFAULT()) */
+void touch_detector_init(touch_detector_t *detector,
+                         const touch_detector_config_t *config);
+
+/* Process the mean readings of the touch and comparator channels in a
+ * frame, read at time_us.
+ * Returns TOUCH_EVENT_PRESS or TOUCH_EVENT_RELEASE on a change */
+touch_event_t touch_detector_process(touch_detector_t *detector,
+                                     int32_t touch, int32_t comp,
+                                     int64_t time_us);
+
+/* Clear the counters and the latency histogram of the stats */
+void touch_detector_reset_stats(touch_detector_t *detector);
+
+/* Returns true while touched */
+bool touch_detector_pressed(const touch_detector_t *detector);
+
+/* Returns true when nothing is going on: warmed up, not touched and no
+ * frame over the press threshold waiting to be confirmed or rejected */
+bool touch_detector_idle(const touch_detector_t *detector);
+
+/* Get the filtered reading of the touch channel (ADC counts) */
+int32_t touch_detector_touch_level(const touch_detector_t *detector);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,87 @@
+/*
+ * Gestures of the touch input
+ */
+#include "touch_gesture.h"
+#include <string.h>
+
+void touch_gesture_init(touch_gesture_recognizer_t *recognizer,
+                        const touch_gesture_config_t *config) {
+  memset(recognizer, 0, sizeof(*recognizer));
+  recognizer->config = *config;
+}
+
+touch_gesture_t touch_gesture_process(touch_gesture_recognizer_t *recognizer,
+                                      touch_event_t event, int64_t time_us) {
+  const touch_gesture_config_t *config = &recognizer->config;
+
+  switch (recognizer->state) {
+  case TOUCH_GESTURE_STATE_IDLE:
+    if (event == TOUCH_EVENT_PRESS) {
+      recognizer->state = TOUCH_GESTURE_STATE_DOWN;
+      recognizer->press_us = time_us;
+    }
+    break;
+
+  case TOUCH_GESTURE_STATE_DOWN:
+    if (event == TOUCH_EVENT_RELEASE) {
+      recognizer->state = TOUCH_GESTURE_STATE_WAIT_SECOND;
+      recognizer->release_us = time_us;
+    } else if (time_us - recognizer->press_us >=
+               config->long_press_ms * 1000LL) {
+      recognizer->state = TOUCH_GESTURE_STATE_DONE;
+      return TOUCH_GESTURE_LONG_PRESS;
+    }
+    break;
+
+  case TOUCH_GESTURE_STATE_WAIT_SECOND:
+    if (event == TOUCH_EVENT_PRESS) {
+      recognizer->state = TOUCH_GESTURE_STATE_DONE;
+      return TOUCH_GESTURE_DOUBLE_TAP;
+    }
+    if (time_us - recognizer->release_us >= config->double_tap_ms * 1000LL) {
+      recognizer->state = TOUCH_GESTURE_STATE_IDLE;
+      return TOUCH_GESTURE_TAP;
+    }
+    break;
+
+  case TOUCH_GESTURE_STATE_DONE:
+    if (event == TOUCH_EVENT_RELEASE) {
+      recognizer->state = TOUCH_GESTURE_STATE_IDLE;
+    }
+    break;
+  }
+  return TOUCH_GESTURE_NONE;
+}
+
+bool touch_gesture_busy(const touch_gesture_recognizer_t *recognizer) {
+  return recognizer->state != TOUCH_GESTURE_STATE_IDLE;
+}
+
+int32_t touch_gesture_latency_bound_ms(const touch_gesture_config_t *config,
+                                       uint8_t confirm_frames,
+                                       int32_t frame_ms,
+                                       touch_gesture_t gesture) {
+  switch (gesture) {
+  case TOUCH_GESTURE_TAP:
+    return config->double_tap_ms + 4 * frame_ms;
+  case TOUCH_GESTURE_DOUBLE_TAP:
+    return (confirm_frames + 2) * frame_ms;
+  case TOUCH_GESTURE_LONG_PRESS:
+    return config->long_press_ms + (confirm_frames + 3) * frame_ms;
+  default:
+    return -1;
+  }
+}
+
+const char *touch_gesture_name(touch_gesture_t gesture) {
+  switch (gesture) {
+  case TOUCH_GESTURE_TAP:
+    return "tap";
+  case TOUCH_GESTURE_DOUBLE_TAP:
+    return "double_tap";
+  case TOUCH_GESTURE_LONG_PRESS:
+    return "long_press";
+  default:
+    return "none";
+  }
+}
@@ -0,0 +1,99 @@
+/*
+ * Gestures of the touch input
+ *
+ * Classifies the presses and releases of the touch detector (see
+ * touch_detector.h) into taps, double taps and long presses:
+ *   - a long press fires while still held, long_press_ms after the press
+ *   - a double tap fires on the second press, if it comes within
+ *     double_tap_ms of the release of a short first touch
+ *   - a tap fires double_tap_ms after the release of a short touch, once
+ *     it can't be the start of a double tap any more
+ * The detector runs once per frame of ADC readings and so does this, so
+ * every gesture is published by the first frame after it is known.
+ *
+ * Latency bound, from the user's finger to the gesture, with the frames
+ * of frame_ms (about 100 ms) and the detector confirming presses over
+ * confirm_frames frames: press detection takes at most confirm_frames + 2
+ * frames (the frame the touch starts in, the median filter delay and the
+ * confirmation) and release detection at most 3 frames. So a double tap
+ * is known at most confirm_frames + 2 frames after the second touch
+ * starts, a tap at most double_tap_ms + 4 frames after the finger lifts,
+ * and a long press at most long_press_ms + confirm_frames + 3 frames
+ * after the touch starts. touch_gesture_latency_bound_ms() computes these,
+ * tools/touch_replay checks them on labeled captures.
+ *
+ * The filters of the detector also set the shortest gestures: touches,
+ * and the gap between the taps of a double tap, must last about 3 frames
+ * (300 ms) to be seen. Shorter ones are smoothed out like noise.
+ */
+#pragma once
+
+#include "touch_detector.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  TOUCH_GESTURE_NONE,
+  TOUCH_GESTURE_TAP,
+  TOUCH_GESTURE_DOUBLE_TAP,
+  TOUCH_GESTURE_LONG_PRESS,
+  TOUCH_GESTURE_COUNT
+} touch_gesture_t;
+
+typedef struct {
+  uint16_t long_press_ms; // held this long, a touch is a long press
+  uint16_t double_tap_ms; // longest gap between the taps (as detected)
+} touch_gesture_config_t;
+
+#define TOUCH_GESTURE_CONFIG_DEFAULT()                                        \
+  {                                                                           \
+      .long_press_ms = 800,                                                   \
+      .double_tap_ms = 500,                                                   \
+  }
+
+typedef enum {
+  TOUCH_GESTURE_STATE_IDLE,
+  TOUCH_GESTURE_STATE_DOWN,        // first touch, could be anything
+  TOUCH_GESTURE_STATE_WAIT_SECOND, // short touch released, tap or double
+  TOUCH_GESTURE_STATE_DONE,        // gesture published, wait for release
+} touch_gesture_state_t;
+
+typedef struct {
+  touch_gesture_config_t config;
+  touch_gesture_state_t state;
+  int64_t press_us;   // press that started the current gesture
+  int64_t release_us; // release of a short first touch
+} touch_gesture_recognizer_t;
+
+/* Start classifying with a config (e.g. TOUCH_GESTURE_CONFIG_DEFAULT()) */
+void touch_gesture_init(touch_gesture_recognizer_t *recognizer,
+                        const touch_gesture_config_t *config);
+
+/* Process the event of the detector for a frame read at time_us, called
+ * for every frame (with TOUCH_EVENT_NONE too) to time the gestures out.
+ * Returns the gesture completed by this frame, if any. press_us of the
+ * recognizer is the press that started it */
+touch_gesture_t touch_gesture_process(touch_gesture_recognizer_t *recognizer,
+                                      touch_event_t event, int64_t time_us);
+
+/* Returns true while a gesture is in progress (frames are still needed) */
+bool touch_gesture_busy(const touch_gesture_recognizer_t *recognizer);
+
+/* Get the latency bound of a gesture (see above), counted from the start
+ * of the touch for double taps and long presses and from its end for taps.
+ * Returns -1 for TOUCH_GESTURE_NONE */
+int32_t touch_gesture_latency_bound_ms(const touch_gesture_config_t *config,
+                                       uint8_t confirm_frames,
+                                       int32_t frame_ms,
+                                       touch_gesture_t gesture);
+
+/* Get the name of a gesture ("tap", "double_tap", "long_press") */
+const char *touch_gesture_name(touch_gesture_t gesture);
+
+#ifdef __cplusplus
+}
+#endif
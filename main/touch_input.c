@@ -0,0 +1,566 @@
+/*
+ * Touch input
+ */
+#include "touch_input.h"
+#include "esp_adc/adc_continuous.h"
+#include "esp_attr.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/stream_buffer.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+#include "esp_adc/adc_monitor.h"
+#endif
+
+// ADC1 channel of the touch input (GPIO 4)
+#define TOUCH_ADC_CHANNEL 4
+// ADC1 channel of the touch input comparator (GPIO 3)
+#define TOUCH_COMP_CHANNEL 3
+
+#define TOUCH_ADC_UNIT ADC_UNIT_1
+#define TOUCH_ADC_CONV_MODE ADC_CONV_SINGLE_UNIT_1
+#define TOUCH_ADC_ATTEN ADC_ATTEN_DB_0
+#define TOUCH_ADC_BIT_WIDTH SOC_ADC_DIGI_MAX_BITWIDTH
+// Bytes of conversions per frame (64 readings, 32 per channel)
+#define TOUCH_READ_LEN 256
+// Lowest sample rate of the ESP32-C3 is 611 Hz
+#define TOUCH_SAMPLE_FREQ_HZ 620
+
+// Capture buffer, about 3 s of frames so a slow reader doesn't drop any
+#define CAPTURE_BUFFER_LEN 8192
+#define CAPTURE_HEADER_LEN 16
+#define CAPTURE_RECORD_HEADER_LEN 12
+#define CAPTURE_VERSION 1
+// Bytes per line of a capture printed to the console
+#define CAPTURE_LINE_BYTES 64
+
+// Gestures waiting for the subscribers
+#define GESTURE_QUEUE_LEN 8
+
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+// Idle frames processed before sleeping again (about 1 s), the window in
+// which a wakeup of the monitor must become a press
+#define TOUCH_CONFIRM_FRAMES 10
+#define TOUCH_MONITOR_MARGIN CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR_MARGIN
+#define TOUCH_REFRESH_MS (CONFIG_ELEVEN_BIT_CLOCK_TOUCH_REFRESH_S * 1000)
+// Largest ADC reading
+#define TOUCH_ADC_MAX 4095
+#endif
+
+static const char *TAG = "touch_input";
+
+static TaskHandle_t s_task;
+static touch_input_cb_t s_cb;
+static touch_detector_t s_detector;
+static touch_input_stats_t s_stats;
+static touch_gesture_recognizer_t s_gestures;
+static bool s_reset; // of the detector stats, on the next frame
+static bool s_capture_active;
+static int64_t s_capture_end_us;
+static int64_t s_sleep_start_us; // while the touch task sleeps, else 0
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED; // for the above
+
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+// Set by the touch task when it goes to sleep, cleared by what wakes it
+static volatile bool s_sleeping;
+static volatile bool s_monitor_fired;
+static adc_monitor_handle_t s_monitor;
+static int32_t s_monitor_level; // resting level the thresholds are around
+#endif
+
+// Gesture subscribers, only added, and the queue to their task
+typedef struct {
+  uint32_t gestures; // bit mask of touch_gesture_t
+  touch_gesture_cb_t cb;
+  void *arg;
+} subscriber_t;
+static subscriber_t s_subscribers[TOUCH_INPUT_MAX_SUBSCRIBERS];
+static int s_num_subscribers;
+static QueueHandle_t s_gesture_queue;
+
+// Capture of the raw frames, written by the touch task
+static StreamBufferHandle_t s_capture;
+static uint32_t s_capture_dropped;
+
+static bool IRAM_ATTR conv_done_cb(adc_continuous_handle_t handle,
+                                   const adc_continuous_evt_data_t *edata,
+                                   void *user_data) {
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+  if (s_sleeping) {
+    // the monitor watches the touch channel, the frames are dropped
+    return false;
+  }
+#endif
+  BaseType_t mustYield = pdFALSE;
+  // Notify that ADC continuous driver has done enough number of conversions
+  vTaskNotifyGiveFromISR(s_task, &mustYield);
+
+  return (mustYield == pdTRUE);
+}
+
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+static bool IRAM_ATTR monitor_cb(adc_monitor_handle_t handle,
+                                 const adc_monitor_evt_data_t *edata,
+                                 void *user_data) {
+  // fires for every reading past a threshold until the task disables it
+  if (!s_sleeping) {
+    return false;
+  }
+  s_sleeping = false;
+  s_monitor_fired = true;
+  BaseType_t mustYield = pdFALSE;
+  vTaskNotifyGiveFromISR(s_task, &mustYield);
+
+  return (mustYield == pdTRUE);
+}
+
+/* Stop processing frames and let the monitor wake the touch task when a
+ * reading of the touch channel moves away from its resting level. The
+ * monitor is only recreated, which needs the ADC stopped, when the level
+ * moved since the last time */
+static void sleep_start(adc_continuous_handle_t handle) {
+  int32_t level = touch_detector_touch_level(&s_detector);
+  bool restart = false;
+  if (!s_monitor || abs(level - s_monitor_level) > TOUCH_MONITOR_MARGIN / 4) {
+    ESP_ERROR_CHECK(adc_continuous_stop(handle));
+    if (s_monitor) {
+      ESP_ERROR_CHECK(adc_del_continuous_monitor(s_monitor));
+    }
+    // -1 disables a threshold out of the ADC range
+    adc_monitor_config_t config = {
+        .adc_unit = TOUCH_ADC_UNIT,
+        .channel = TOUCH_ADC_CHANNEL,
+        .h_threshold = level + TOUCH_MONITOR_MARGIN <= TOUCH_ADC_MAX
+                           ? level + TOUCH_MONITOR_MARGIN
+                           : -1,
+        .l_threshold =
+            level >= TOUCH_MONITOR_MARGIN ? level - TOUCH_MONITOR_MARGIN : -1,
+    };
+    ESP_ERROR_CHECK(adc_new_continuous_monitor(handle, &config, &s_monitor));
+    adc_monitor_evt_cbs_t cbs = {
+        .on_over_high_thresh = monitor_cb,
+        .on_below_low_thresh = monitor_cb,
+    };
+    ESP_ERROR_CHECK(
+        adc_continuous_monitor_register_event_callbacks(s_monitor, &cbs, NULL));
+    s_monitor_level = level;
+    restart = true;
+  }
+
+  portENTER_CRITICAL(&s_lock);
+  s_sleeping = true;
+  s_monitor_fired = false;
+  s_sleep_start_us = esp_timer_get_time();
+  portEXIT_CRITICAL(&s_lock);
+  // a frame completed before s_sleeping was set mustn't wake the task
+  ulTaskNotifyTake(pdTRUE, 0);
+  ESP_ERROR_CHECK(adc_continuous_monitor_enable(s_monitor));
+  if (restart) {
+    ESP_ERROR_CHECK(adc_continuous_start(handle));
+  }
+}
+
+/* Back to processing frames, after a wakeup or at the refresh interval.
+ * Returns true if the monitor woke the task */
+static bool sleep_end(adc_continuous_handle_t handle) {
+  ESP_ERROR_CHECK(adc_continuous_monitor_disable(s_monitor));
+  portENTER_CRITICAL(&s_lock);
+  bool monitor_fired = s_monitor_fired;
+  s_sleeping = false;
+  s_stats.idle_us += esp_timer_get_time() - s_sleep_start_us;
+  s_sleep_start_us = 0;
+  if (monitor_fired) {
+    s_stats.monitor_wakeups++;
+  } else {
+    s_stats.refreshes++;
+  }
+  portEXIT_CRITICAL(&s_lock);
+  // what is left in the pool is from when the sleep started
+  adc_continuous_flush_pool(handle);
+  return monitor_fired;
+}
+#endif
+
+static adc_continuous_handle_t continuous_adc_init(void) {
+  adc_continuous_handle_t handle = NULL;
+
+  adc_continuous_handle_cfg_t adc_config = {
+      .max_store_buf_size = 1024,
+      .conv_frame_size = TOUCH_READ_LEN,
+  };
+  ESP_ERROR_CHECK(adc_continuous_new_handle(&adc_config, &handle));
+
+  adc_continuous_config_t dig_cfg = {
+      .sample_freq_hz = TOUCH_SAMPLE_FREQ_HZ,
+      .conv_mode = TOUCH_ADC_CONV_MODE,
+  };
+
+  const adc_channel_t channels[] = {TOUCH_ADC_CHANNEL, TOUCH_COMP_CHANNEL};
+  adc_digi_pattern_config_t adc_pattern[SOC_ADC_PATT_LEN_MAX] = {0};
+  dig_cfg.pattern_num = sizeof(channels) / sizeof(channels[0]);
+  for (int i = 0; i < dig_cfg.pattern_num; i++) {
+    adc_pattern[i].atten = TOUCH_ADC_ATTEN;
+    adc_pattern[i].channel = channels[i] & 0x7;
+    adc_pattern[i].unit = TOUCH_ADC_UNIT;
+    adc_pattern[i].bit_width = TOUCH_ADC_BIT_WIDTH;
+  }
+  dig_cfg.adc_pattern = adc_pattern;
+  ESP_ERROR_CHECK(adc_continuous_config(handle, &dig_cfg));
+
+  adc_continuous_evt_cbs_t cbs = {
+      .on_conv_done = conv_done_cb,
+  };
+  ESP_ERROR_CHECK(adc_continuous_register_event_callbacks(handle, &cbs, NULL));
+  return handle;
+}
+
+/* Average the channels of a frame and run the detector on it */
+static touch_event_t process_frame(const uint8_t *frame, uint32_t len,
+                                   int64_t time_us) {
+  int32_t touch, comp;
+  uint32_t invalid = 0;
+  bool valid = touch_frame_average(frame, len, TOUCH_ADC_CHANNEL,
+                                   TOUCH_COMP_CHANNEL, &touch, &comp,
+                                   &invalid);
+  if (invalid) {
+    portENTER_CRITICAL(&s_lock);
+    s_stats.invalid += invalid;
+    portEXIT_CRITICAL(&s_lock);
+  }
+  if (!valid) {
+    return TOUCH_EVENT_NONE;
+  }
+  return touch_detector_process(&s_detector, touch, comp, time_us);
+}
+
+/* Queue a gesture for the subscribers */
+static void publish_gesture(touch_gesture_t gesture, int64_t time_us) {
+  touch_gesture_event_t event = {
+      .gesture = gesture,
+      .touch_us = s_gestures.press_us,
+      .detected_us = time_us,
+  };
+  bool queued = xQueueSend(s_gesture_queue, &event, 0) == pdTRUE;
+  portENTER_CRITICAL(&s_lock);
+  s_stats.gestures[gesture]++;
+  if (!queued) {
+    s_stats.gestures_dropped++;
+  }
+  portEXIT_CRITICAL(&s_lock);
+  ESP_LOGI(TAG, "Gesture: %s%s", touch_gesture_name(gesture),
+           queued ? "" : " (dropped, queue full)");
+}
+
+/*
+    Calls the subscribers of the gestures, so they can take their time
+    (e.g. write to NVS) without holding up the touch task
+*/
+static void gesture_task(void *pvParameters) {
+  (void)pvParameters;
+  touch_gesture_event_t event;
+  for (;;) {
+    xQueueReceive(s_gesture_queue, &event, portMAX_DELAY);
+    portENTER_CRITICAL(&s_lock);
+    latency_hist_add(&s_stats.dispatch,
+                     esp_timer_get_time() - event.detected_us);
+    int num_subscribers = s_num_subscribers;
+    portEXIT_CRITICAL(&s_lock);
+    for (int i = 0; i < num_subscribers; i++) {
+      const subscriber_t *subscriber = &s_subscribers[i];
+      if (subscriber->gestures & (1u << event.gesture)) {
+        subscriber->cb(&event, subscriber->arg);
+      }
+    }
+  }
+}
+
+/* Copy a frame to the capture, if one is running */
+static void capture_frame(const uint8_t *frame, uint32_t len,
+                          int64_t time_us) {
+  portENTER_CRITICAL(&s_lock);
+  bool active = s_capture_active;
+  if (active && time_us >= s_capture_end_us) {
+    s_capture_active = false;
+  }
+  portEXIT_CRITICAL(&s_lock);
+  if (!active) {
+    return;
+  }
+  if (time_us >= s_capture_end_us) {
+    ESP_LOGI(TAG, "Capture done, %lu frames dropped",
+             (unsigned long)s_capture_dropped);
+    return;
+  }
+
+  // a record is only written whole, so the reader never loses sync
+  uint8_t record[CAPTURE_RECORD_HEADER_LEN + TOUCH_READ_LEN];
+  memcpy(&record[0], &time_us, 8);
+  memcpy(&record[8], &len, 4);
+  memcpy(&record[CAPTURE_RECORD_HEADER_LEN], frame, len);
+  size_t record_len = CAPTURE_RECORD_HEADER_LEN + len;
+  if (xStreamBufferSpacesAvailable(s_capture) < record_len ||
+      xStreamBufferSend(s_capture, record, record_len, 0) != record_len) {
+    s_capture_dropped++;
+  }
+}
+
+/*
+    Processes the frames of conversions as the ADC driver completes them
+*/
+static void touch_task(void *pvParameters) {
+  adc_continuous_handle_t handle = pvParameters;
+  uint8_t frame[TOUCH_READ_LEN];
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+  bool asleep = false;
+  bool monitor_woke = false; // and no press since
+  int idle_frames = 0;
+#endif
+
+  for (;;) {
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+    if (asleep) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TOUCH_REFRESH_MS));
+      monitor_woke = sleep_end(handle);
+      asleep = false;
+      idle_frames = 0;
+    } else {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+#else
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+    portENTER_CRITICAL(&s_lock);
+    s_stats.wakeups++;
+    portEXIT_CRITICAL(&s_lock);
+
+    // read until there are no complete frames left
+    uint32_t len = 0;
+    while (adc_continuous_read(handle, frame, TOUCH_READ_LEN, &len, 0) ==
+           ESP_OK) {
+      int64_t time_us = esp_timer_get_time();
+      uint32_t start_cycles = esp_cpu_get_cycle_count();
+      touch_event_t event = process_frame(frame, len, time_us);
+      uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+      capture_frame(frame, len, time_us);
+
+      portENTER_CRITICAL(&s_lock);
+      if (s_reset) {
+        // the detector belongs to this task, its stats are reset here
+        touch_detector_reset_stats(&s_detector);
+        s_reset = false;
+      }
+      s_stats.detector = s_detector.stats;
+      latency_hist_add(&s_stats.cycles, cycles);
+      portEXIT_CRITICAL(&s_lock);
+
+      if (event != TOUCH_EVENT_NONE) {
+        ESP_LOGI(TAG, "%s (deviation %ld, baseline %ld)",
+                 event == TOUCH_EVENT_PRESS ? "Press" : "Release",
+                 (long)s_detector.stats.deviation,
+                 (long)s_detector.stats.baseline);
+        if (s_cb) {
+          s_cb(event);
+        }
+      }
+      touch_gesture_t gesture =
+          touch_gesture_process(&s_gestures, event, time_us);
+      if (gesture != TOUCH_GESTURE_NONE) {
+        publish_gesture(gesture, time_us);
+      }
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+      if (event == TOUCH_EVENT_PRESS) {
+        monitor_woke = false;
+      }
+      idle_frames = touch_detector_idle(&s_detector) ? idle_frames + 1 : 0;
+#endif
+    }
+
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+    // sleep once idle for the confirmation window (captures need frames)
+    portENTER_CRITICAL(&s_lock);
+    bool capturing = s_capture_active;
+    portEXIT_CRITICAL(&s_lock);
+    if (idle_frames >= TOUCH_CONFIRM_FRAMES && !capturing &&
+        !touch_gesture_busy(&s_gestures)) {
+      if (monitor_woke) {
+        portENTER_CRITICAL(&s_lock);
+        s_stats.false_wakeups++;
+        portEXIT_CRITICAL(&s_lock);
+        monitor_woke = false;
+      }
+      sleep_start(handle);
+      asleep = true;
+    }
+#endif
+  }
+}
+
+void touch_input_start(touch_input_cb_t cb) {
+  touch_detector_config_t config = TOUCH_DETECTOR_CONFIG_DEFAULT();
+  touch_detector_init(&s_detector, &config);
+  touch_gesture_config_t gesture_config = TOUCH_GESTURE_CONFIG_DEFAULT();
+  touch_gesture_init(&s_gestures, &gesture_config);
+  latency_hist_reset(&s_stats.cycles);
+  latency_hist_reset(&s_stats.dispatch);
+  s_stats.since_us = esp_timer_get_time();
+  s_cb = cb;
+
+  s_gesture_queue =
+      xQueueCreate(GESTURE_QUEUE_LEN, sizeof(touch_gesture_event_t));
+  xTaskCreate(&gesture_task, "touch_gesture", 3072, NULL, 4, NULL);
+  adc_continuous_handle_t handle = continuous_adc_init();
+  // above the web server, below the display
+  xTaskCreate(&touch_task, "touch", 3072, handle, 4, &s_task);
+  ESP_ERROR_CHECK(adc_continuous_start(handle));
+  ESP_LOGI(TAG, "Touch input started");
+}
+
+bool touch_input_subscribe(uint32_t gestures, touch_gesture_cb_t cb,
+                           void *arg) {
+  portENTER_CRITICAL(&s_lock);
+  bool added = s_num_subscribers < TOUCH_INPUT_MAX_SUBSCRIBERS;
+  if (added) {
+    s_subscribers[s_num_subscribers] = (subscriber_t){gestures, cb, arg};
+    s_num_subscribers++;
+  }
+  portEXIT_CRITICAL(&s_lock);
+  if (!added) {
+    ESP_LOGE(TAG, "Too many gesture subscribers");
+  }
+  return added;
+}
+
+void touch_input_get_stats(touch_input_stats_t *stats, bool reset) {
+  int64_t now = esp_timer_get_time();
+  portENTER_CRITICAL(&s_lock);
+  *stats = s_stats;
+  if (s_sleep_start_us) {
+    stats->idle_us += now - s_sleep_start_us;
+  }
+  if (reset) {
+    latency_hist_reset(&s_stats.cycles);
+    latency_hist_reset(&s_stats.dispatch);
+    memset(s_stats.gestures, 0, sizeof(s_stats.gestures));
+    s_stats.gestures_dropped = 0;
+    s_reset = true;
+    s_stats.wakeups = 0;
+    s_stats.invalid = 0;
+    s_stats.monitor_wakeups = 0;
+    s_stats.false_wakeups = 0;
+    s_stats.refreshes = 0;
+    s_stats.idle_us = 0;
+    s_stats.since_us = now;
+    if (s_sleep_start_us) {
+      s_sleep_start_us = now;
+    }
+  }
+  portEXIT_CRITICAL(&s_lock);
+}
+
+bool touch_input_capture_start(int seconds) {
+  if (!s_capture) {
+    s_capture = xStreamBufferCreate(CAPTURE_BUFFER_LEN, 1);
+    if (!s_capture) {
+      ESP_LOGE(TAG, "No memory for the capture buffer");
+      return false;
+    }
+  }
+  portENTER_CRITICAL(&s_lock);
+  bool busy = s_capture_active;
+  portEXIT_CRITICAL(&s_lock);
+  if (busy) {
+    return false;
+  }
+
+  // drop what is left of an aborted capture, then write the file header
+  xStreamBufferReset(s_capture);
+  s_capture_dropped = 0;
+  uint8_t header[CAPTURE_HEADER_LEN] = {'T', 'C', 'A', 'P'};
+  uint32_t freq = TOUCH_SAMPLE_FREQ_HZ;
+  uint32_t frame_len = TOUCH_READ_LEN;
+  header[4] = CAPTURE_VERSION;
+  header[5] = TOUCH_FRAME_RESULT_BYTES;
+  header[6] = TOUCH_ADC_CHANNEL;
+  header[7] = TOUCH_COMP_CHANNEL;
+  memcpy(&header[8], &freq, 4);
+  memcpy(&header[12], &frame_len, 4);
+  xStreamBufferSend(s_capture, header, sizeof(header), 0);
+
+  portENTER_CRITICAL(&s_lock);
+  s_capture_end_us = esp_timer_get_time() + seconds * 1000000LL;
+  s_capture_active = true;
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+  // the touch task stays awake until the capture is over
+  bool wake = s_sleeping;
+  s_sleeping = false;
+#endif
+  portEXIT_CRITICAL(&s_lock);
+#if CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR
+  if (wake) {
+    xTaskNotifyGive(s_task);
+  }
+#endif
+  ESP_LOGI(TAG, "Capturing %d s of frames", seconds);
+  return true;
+}
+
+int touch_input_capture_read(void *buf, size_t size, uint32_t timeout_ms) {
+  // no frames are written once the capture is over, so if it was over
+  // before reading and nothing is left, it is done
+  portENTER_CRITICAL(&s_lock);
+  bool active = s_capture_active;
+  portEXIT_CRITICAL(&s_lock);
+  size_t len =
+      xStreamBufferReceive(s_capture, buf, size, pdMS_TO_TICKS(timeout_ms));
+  if (len == 0 && !active) {
+    return -1;
+  }
+  return len;
+}
+
+/*
+    Prints the capture to the console as hex lines, for
+    touch_input_capture_serial
+*/
+static void capture_serial_task(void *pvParameters) {
+  (void)pvParameters;
+  uint8_t buf[CAPTURE_LINE_BYTES];
+  int len;
+  while ((len = touch_input_capture_read(buf, sizeof(buf), 1000)) >= 0) {
+    if (len == 0) {
+      continue;
+    }
+    char line[2 * CAPTURE_LINE_BYTES + 1];
+    for (int i = 0; i < len; i++) {
+      sprintf(&line[2 * i], "%02x", buf[i]);
+    }
+    printf("TCAP %s\n", line);
+  }
+  printf("TCAP END\n");
+  vTaskDelete(NULL);
+}
+
+bool touch_input_capture_serial(int seconds) {
+  if (!touch_input_capture_start(seconds)) {
+    return false;
+  }
+  if (xTaskCreate(&capture_serial_task, "touch_capture", 3072, NULL, 2,
+                  NULL) != pdPASS) {
+    touch_input_capture_stop();
+    return false;
+  }
+  return true;
+}
+
+void touch_input_capture_stop(void) {
+  portENTER_CRITICAL(&s_lock);
+  s_capture_active = false;
+  portEXIT_CRITICAL(&s_lock);
+}
@@ -0,0 +1,107 @@
+/*
+ * Touch input
+ *
+ * The touch plate and a comparator input are sampled by the ADC in
+ * continuous mode. A task wakes up when a frame of conversions is ready,
+ * averages each channel over the frame and runs the touch detector (see
+ * touch_detector.h) on it, then calls back on presses and releases. The
+ * presses and releases are classified into gestures (see touch_gesture.h)
+ * and put on a queue. Another task takes them from there and calls the
+ * subscribers of each gesture, so their actions never hold up the
+ * detection.
+ * The detector stats and the processing cost of each frame are kept for
+ * /debug/touch.
+ *
+ * With CONFIG_ELEVEN_BIT_CLOCK_TOUCH_MONITOR, the task sleeps while the
+ * input is idle: the frames are dropped and the ADC digital monitor
+ * interrupts when a reading of the touch channel moves away from its
+ * resting level. The task then processes the frames again, until they
+ * have been idle for about a second. It also wakes up at the refresh
+ * interval to keep the baseline and the resting level up to date. A
+ * touch is pressed at most one frame (about 100 ms) later than without
+ * sleeping, the frame that was in progress at the wakeup.
+ *
+ * The raw frames can be captured, to replay them through the detector
+ * on a host (tools/touch_replay). A capture is a 16 byte header: "TCAP",
+ * the version (1), the bytes per reading (4), the touch and comparator
+ * channels, the sample rate (Hz, uint32) and the frame length (bytes,
+ * uint32). Then for each frame: the esp_timer time it was read (us,
+ * int64), its length (uint32) and the frame as read from the ADC driver.
+ * All the numbers are little endian. On the console, the capture is
+ * printed as lines of "TCAP " and 64 bytes in hex, then "TCAP END".
+ */
+#pragma once
+
+#include "latency_hist.h"
+#include "touch_detector.h"
+#include "touch_gesture.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Most gesture subscribers
+#define TOUCH_INPUT_MAX_SUBSCRIBERS 4
+
+typedef struct {
+  touch_gesture_t gesture;
+  int64_t touch_us;    // esp_timer time of the press that started it
+  int64_t detected_us; // time of the frame that completed it
+} touch_gesture_event_t;
+
+typedef struct {
+  touch_detector_stats_t detector;
+  latency_hist_t cycles;     // CPU cycles to process a frame
+  latency_hist_t dispatch;   // from a gesture to its subscribers (us)
+  uint32_t gestures_dropped; // with the queue full
+  uint32_t wakeups;          // of the touch task
+  uint32_t invalid;          // readings with an invalid channel
+  uint32_t monitor_wakeups;  // by the ADC monitor
+  uint32_t false_wakeups;    // by the ADC monitor, without a press
+  uint32_t refreshes;        // wakeups to update the baseline
+  int64_t idle_us;           // time the touch task slept
+  int64_t since_us;          // esp_timer time the stats were reset
+  // gestures published, by touch_gesture_t
+  uint32_t gestures[TOUCH_GESTURE_COUNT];
+} touch_input_stats_t;
+
+/* Called from the touch task on presses and releases */
+typedef void (*touch_input_cb_t)(touch_event_t event);
+
+/* Called from the gesture task for the gestures subscribed to */
+typedef void (*touch_gesture_cb_t)(const touch_gesture_event_t *event,
+                                   void *arg);
+
+/* Start sampling the touch input, cb (can be NULL) gets the presses and
+ * releases */
+void touch_input_start(touch_input_cb_t cb);
+
+/* Call cb for the gestures in a mask of (1 << touch_gesture_t) bits.
+ * Returns false if there are already TOUCH_INPUT_MAX_SUBSCRIBERS */
+bool touch_input_subscribe(uint32_t gestures, touch_gesture_cb_t cb,
+                           void *arg);
+
+/* Get the stats, and with reset clear the counters and histograms in the
+ * same critical section (the detector state is kept) */
+void touch_input_get_stats(touch_input_stats_t *stats, bool reset);
+
+/* Start capturing the frames for the given time. Returns false if a
+ * capture is already running or there is no memory for the buffer */
+bool touch_input_capture_start(int seconds);
+
+/* Read the next bytes of the capture, waiting up to timeout_ms for them.
+ * Returns the number of bytes read, or -1 once the capture is over and
+ * everything was read */
+int touch_input_capture_read(void *buf, size_t size, uint32_t timeout_ms);
+
+/* Start capturing the frames for the given time and print them to the
+ * console. Returns false if the capture can't be started */
+bool touch_input_capture_serial(int seconds);
+
+/* Stop the capture early (e.g. when the reader went away) */
+void touch_input_capture_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
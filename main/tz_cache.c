@@ -0,0 +1,97 @@
+/*
+ * Cached UTC offset of the current timezone
+ */
+#include "tz_cache.h"
+
+// If nothing changes within a year (and a bit), the zone has no DST
+#define PROBE_HORIZON (400 * 86400)
+
+// Incremented when the timezone changes, caches of older versions are
+// recomputed
+static volatile uint32_t s_version = 1;
+
+/* Days since 1970-01-01 of a date of the proleptic Gregorian calendar */
+static int64_t days_from_civil(int64_t year, int month, int day) {
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t year_of_era = year - era * 400;
+  int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t day_of_era =
+      year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+/* Get the UTC offset and DST flag of the timezone at a time */
+static void probe(time_t t, int32_t *offset, int *is_dst) {
+  struct tm local;
+  localtime_r(&t, &local);
+  int64_t local_sec =
+      days_from_civil(local.tm_year + 1900LL, local.tm_mon + 1,
+                      local.tm_mday) *
+          86400 +
+      local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+  *offset = (int32_t)(local_sec - t);
+  *is_dst = local.tm_isdst;
+}
+
+static bool same_as(const tz_cache_t *cache, time_t t) {
+  int32_t offset;
+  int is_dst;
+  probe(t, &offset, &is_dst);
+  return offset == cache->offset && is_dst == cache->is_dst;
+}
+
+/* Compute the offset at now and find the next transition */
+static void compute(tz_cache_t *cache, time_t now) {
+  cache->version = s_version;
+  probe(now, &cache->offset, &cache->is_dst);
+  cache->from = now;
+
+  // find the first day with another offset...
+  time_t last_same = now;
+  time_t first_other = 0;
+  for (time_t t = now + TZ_CACHE_PROBE_STEP; t <= now + PROBE_HORIZON;
+       t += TZ_CACHE_PROBE_STEP) {
+    if (!same_as(cache, t)) {
+      first_other = t;
+      break;
+    }
+    last_same = t;
+  }
+  if (first_other == 0) {
+    cache->until = last_same;
+    return;
+  }
+
+  // ...and bisect to the second it changes
+  while (first_other - last_same > 1) {
+    time_t mid = last_same + (first_other - last_same) / 2;
+    if (same_as(cache, mid)) {
+      last_same = mid;
+    } else {
+      first_other = mid;
+    }
+  }
+  cache->until = first_other;
+}
+
+void tz_cache_invalidate(void) { s_version++; }
+
+static void update(tz_cache_t *cache, time_t now) {
+  if (cache->version != s_version || now < cache->from ||
+      now >= cache->until) {
+    compute(cache, now);
+  }
+}
+
+void tz_cache_localtime(tz_cache_t *cache, time_t now, struct tm *timeinfo) {
+  update(cache, now);
+  time_t local = now + cache->offset;
+  gmtime_r(&local, timeinfo);
+  timeinfo->tm_isdst = cache->is_dst;
+}
+
+time_t tz_cache_next_transition(tz_cache_t *cache, time_t now) {
+  update(cache, now);
+  return cache->until;
+}
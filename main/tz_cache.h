@@ -0,0 +1,50 @@
+/*
+ * Cached UTC offset of the current timezone
+ *
+ * localtime_r evaluates the POSIX TZ rule on every call. The cache keeps
+ * the UTC offset of the current timezone and the instant of the next
+ * transition (DST start or end), found by probing localtime_r once, so
+ * converting a time to local time is an add and gmtime_r until then.
+ * Each user keeps its own cache; they are all invalidated when the
+ * timezone changes.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  time_t from;      // the offset is valid from this time...
+  time_t until;     // ...until the next transition (excluded)
+  int32_t offset;   // seconds to add to UTC
+  int is_dst;       // tm_isdst of localtime_r
+  uint32_t version; // timezone version the cache was computed for
+} tz_cache_t;
+
+/* Step of the search for the next transition. POSIX TZ rules have at
+ * most two transitions a year and never less than a day apart, so probing
+ * once a day can't miss one (tools/tz_check asserts it for every zone of
+ * timezones.csv) */
+#define TZ_CACHE_PROBE_STEP 86400
+
+/* Zeroed cache, computed on first use */
+#define TZ_CACHE_INIT {0}
+
+/* Invalidate all caches, call after the timezone changed (tzset) */
+void tz_cache_invalidate(void);
+
+/* Convert a time to local time, same result as localtime_r */
+void tz_cache_localtime(tz_cache_t *cache, time_t now, struct tm *timeinfo);
+
+/* Get the time of the first transition after now (or a time far enough
+ * in the future if the timezone doesn't have any) */
+time_t tz_cache_next_transition(tz_cache_t *cache, time_t now);
+
+#ifdef __cplusplus
+}
+#endif
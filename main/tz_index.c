@@ -0,0 +1,223 @@
+/*
+ * Sorted index of the timezone list (timezones.csv)
+ */
+#include "tz_index.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* One zone, as offsets into the CSV */
+typedef struct {
+  uint16_t name_off;
+  uint8_t name_len;
+  uint8_t city_skip; // offset of the city in the name
+  uint16_t code_off;
+  uint8_t code_len;
+} tz_entry_t;
+
+static const char *s_csv;
+static tz_entry_t s_zones[TZ_INDEX_MAX_ZONES]; // sorted by name
+static uint16_t s_by_city[TZ_INDEX_MAX_ZONES]; // positions sorted by city
+static int s_count;
+
+/* Compare two strings of the given lengths, case insensitively */
+static int compare(const char *a, size_t a_len, const char *b, size_t b_len) {
+  size_t len = a_len < b_len ? a_len : b_len;
+  for (size_t i = 0; i < len; i++) {
+    int diff = tolower((unsigned char)a[i]) - tolower((unsigned char)b[i]);
+    if (diff != 0) {
+      return diff;
+    }
+  }
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+/* Compare the start of a string with a prefix (0 if it starts with it) */
+static int compare_prefix(const char *s, size_t s_len, const char *prefix,
+                          size_t prefix_len) {
+  return compare(s, s_len < prefix_len ? s_len : prefix_len, prefix,
+                 prefix_len);
+}
+
+static const char *entry_name(const tz_entry_t *e) {
+  return s_csv + e->name_off;
+}
+
+static const char *entry_city(const tz_entry_t *e, size_t *len) {
+  *len = e->name_len - e->city_skip;
+  return s_csv + e->name_off + e->city_skip;
+}
+
+static int compare_names(const void *a, const void *b) {
+  const tz_entry_t *ea = a, *eb = b;
+  return compare(entry_name(ea), ea->name_len, entry_name(eb), eb->name_len);
+}
+
+static int compare_cities(const void *a, const void *b) {
+  const tz_entry_t *ea = &s_zones[*(const uint16_t *)a];
+  const tz_entry_t *eb = &s_zones[*(const uint16_t *)b];
+  size_t a_len, b_len;
+  const char *a_city = entry_city(ea, &a_len);
+  const char *b_city = entry_city(eb, &b_len);
+  int diff = compare(a_city, a_len, b_city, b_len);
+  return diff ? diff : compare_names(ea, eb);
+}
+
+/* Parse a quoted value, returns a pointer past the closing quote or NULL */
+static const char *parse_value(const char *p, const char *end,
+                               const char **value, size_t *len) {
+  if (p >= end || *p != '"') {
+    return NULL;
+  }
+  *value = ++p;
+  while (p < end && *p != '"' && *p != '\n') {
+    p++;
+  }
+  if (p >= end || *p != '"') {
+    return NULL;
+  }
+  *len = p - *value;
+  return p + 1;
+}
+
+int tz_index_init(const char *csv, size_t csv_len) {
+  if (csv_len > UINT16_MAX) {
+    return -1;
+  }
+  s_csv = csv;
+  s_count = 0;
+
+  const char *end = csv + csv_len;
+  const char *p = csv;
+  while (p < end && s_count < TZ_INDEX_MAX_ZONES) {
+    const char *name, *code;
+    size_t name_len, code_len;
+    const char *q = parse_value(p, end, &name, &name_len);
+    if (q && q < end && *q == ',') {
+      q = parse_value(q + 1, end, &code, &code_len);
+    } else {
+      q = NULL;
+    }
+    if (q && name_len > 0 && name_len <= UINT8_MAX && code_len <= UINT8_MAX) {
+      const char *slash = memchr(name, '/', name_len);
+      size_t city_skip = 0;
+      for (; slash; slash = memchr(slash + 1, '/', name + name_len - slash - 1)) {
+        city_skip = slash + 1 - name;
+      }
+      s_zones[s_count++] = (tz_entry_t){
+          .name_off = name - csv,
+          .name_len = name_len,
+          .city_skip = city_skip,
+          .code_off = code - csv,
+          .code_len = code_len,
+      };
+    }
+    // next line (skips malformed ones)
+    while (p < end && *p != '\n') {
+      p++;
+    }
+    while (p < end && (*p == '\n' || *p == '\r')) {
+      p++;
+    }
+  }
+
+  qsort(s_zones, s_count, sizeof(tz_entry_t), compare_names);
+  for (int i = 0; i < s_count; i++) {
+    s_by_city[i] = i;
+  }
+  qsort(s_by_city, s_count, sizeof(uint16_t), compare_cities);
+  return s_count;
+}
+
+int tz_index_count(void) { return s_count; }
+
+int tz_index_find(const char *name) {
+  size_t len = strlen(name);
+  int lo = 0, hi = s_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const tz_entry_t *e = &s_zones[mid];
+    int diff = compare(entry_name(e), e->name_len, name, len);
+    if (diff == 0) {
+      return mid;
+    } else if (diff < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return -1;
+}
+
+const char *tz_index_name(int pos, size_t *len) {
+  *len = s_zones[pos].name_len;
+  return entry_name(&s_zones[pos]);
+}
+
+const char *tz_index_code(int pos, size_t *len) {
+  *len = s_zones[pos].code_len;
+  return s_csv + s_zones[pos].code_off;
+}
+
+/* Compare the name (or city) of the zone at a position with a prefix */
+static int compare_at(int pos, bool by_city, const char *prefix,
+                      size_t prefix_len) {
+  const tz_entry_t *e = &s_zones[by_city ? s_by_city[pos] : pos];
+  size_t len = e->name_len;
+  const char *s = by_city ? entry_city(e, &len) : entry_name(e);
+  return compare_prefix(s, len, prefix, prefix_len);
+}
+
+/* Find the range of positions starting with a prefix, returns the first
+ * position and sets the end */
+static int find_range(bool by_city, const char *prefix, size_t prefix_len,
+                      int *range_end) {
+  int lo = 0, hi = s_count;
+  while (lo < hi) { // first position >= prefix
+    int mid = lo + (hi - lo) / 2;
+    if (compare_at(mid, by_city, prefix, prefix_len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  int first = lo;
+  hi = s_count;
+  while (lo < hi) { // first position > prefix
+    int mid = lo + (hi - lo) / 2;
+    if (compare_at(mid, by_city, prefix, prefix_len) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *range_end = lo;
+  return first;
+}
+
+int tz_index_search(const char *prefix, int *positions, int max) {
+  size_t prefix_len = strlen(prefix);
+  int total = 0;
+
+  int end;
+  for (int i = find_range(false, prefix, prefix_len, &end); i < end; i++) {
+    if (total < max) {
+      positions[total] = i;
+    }
+    total++;
+  }
+
+  // cities, except zones already found by name (e.g. "UTC")
+  for (int i = find_range(true, prefix, prefix_len, &end); i < end; i++) {
+    const tz_entry_t *e = &s_zones[s_by_city[i]];
+    if (compare_prefix(entry_name(e), e->name_len, prefix, prefix_len) == 0) {
+      continue;
+    }
+    if (total < max) {
+      positions[total] = s_by_city[i];
+    }
+    total++;
+  }
+  return total;
+}
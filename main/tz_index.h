@@ -0,0 +1,43 @@
+/*
+ * Sorted index of the timezone list (timezones.csv)
+ *
+ * The CSV (pairs of "Region/City","POSIX TZ code") is embedded in flash
+ * and isn't sorted. The index keeps the offsets of the names and codes
+ * in two sorted orders, by full name and by city (the part after the
+ * last '/'), so lookups and prefix searches are binary searches.
+ * Names are compared case insensitively.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of zones in the index
+#define TZ_INDEX_MAX_ZONES 512
+
+/* Build the index of a CSV, which must stay in memory (less than 64 KB)
+ * Returns the number of zones, or -1 on error */
+int tz_index_init(const char *csv, size_t csv_len);
+
+/* Get the number of zones in the index */
+int tz_index_count(void);
+
+/* Find a zone by name, returns its position or -1 if not found */
+int tz_index_find(const char *name);
+
+/* Get the name and code of the zone at a position (not null terminated) */
+const char *tz_index_name(int pos, size_t *len);
+const char *tz_index_code(int pos, size_t *len);
+
+/* Find the zones whose name or city starts with a prefix, sorted by
+ * name, the name matches first. Up to max positions are written.
+ * Returns the total number of matches */
+int tz_index_search(const char *prefix, int *positions, int max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Connection to the access point
+ */
+#include "wifi_link.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CACHE_MAGIC 0x574c4331 // "WLC1"
+
+/* FNV-1a */
+static uint32_t hash_bytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t wifi_link_key(const char *ssid, const char *password) {
+  // with the terminators, so the split between the two counts
+  uint32_t hash = hash_bytes(2166136261u, ssid, strlen(ssid) + 1);
+  return hash_bytes(hash, password, strlen(password) + 1);
+}
+
+static uint32_t cache_checksum(const wifi_link_cache_t *cache) {
+  return hash_bytes(2166136261u, cache,
+                    offsetof(wifi_link_cache_t, checksum));
+}
+
+bool wifi_link_cache_valid(const wifi_link_cache_t *cache) {
+  return cache->magic == CACHE_MAGIC &&
+         cache->checksum == cache_checksum(cache) && cache->channel != 0;
+}
+
+void wifi_link_init(wifi_link_t *link, uint32_t key,
+                    const wifi_link_cache_t *cache) {
+  memset(link, 0, sizeof(*link));
+  link->key = key;
+  if (cache && wifi_link_cache_valid(cache) && cache->key == key) {
+    link->cache = *cache;
+    link->have_cache = true;
+  }
+}
+
+/* First attempt of a round: a fast connect if the cache is valid */
+static void first_attempt(wifi_link_t *link, wifi_link_attempt_t *attempt) {
+  link->assoc_us = 0;
+  link->fast = link->have_cache;
+  memset(attempt, 0, sizeof(*attempt));
+  if (link->fast) {
+    attempt->fast = true;
+    attempt->channel = link->cache.channel;
+    memcpy(attempt->bssid, link->cache.bssid, WIFI_LINK_BSSID_LEN);
+  }
+}
+
+void wifi_link_start(wifi_link_t *link, int64_t now_us,
+                     wifi_link_attempt_t *attempt) {
+  link->start_us = now_us;
+  link->connected = false;
+  link->reconnect = false;
+  link->failures = 0;
+  first_attempt(link, attempt);
+}
+
+/* Delay of the retry after a number of failed rounds */
+static int64_t backoff_us(int failures, uint32_t random) {
+  int64_t delay_us = WIFI_LINK_BACKOFF_MIN_US;
+  for (int i = 1; i < failures && delay_us < WIFI_LINK_BACKOFF_MAX_US; i++) {
+    delay_us *= 2;
+  }
+  if (delay_us > WIFI_LINK_BACKOFF_MAX_US) {
+    delay_us = WIFI_LINK_BACKOFF_MAX_US;
+  }
+  // half of it, and a random part of the other half
+  return delay_us / 2 + random % (delay_us / 2 + 1);
+}
+
+wifi_link_action_t wifi_link_failed(wifi_link_t *link,
+                                    wifi_link_failure_t failure,
+                                    int64_t now_us, uint32_t random,
+                                    wifi_link_attempt_t *attempt,
+                                    int64_t *delay_us) {
+  *delay_us = 0;
+  if (link->connected) {
+    // lost, reconnect at once (the time to it counts from now)
+    link->stats.losses++;
+    wifi_link_start(link, now_us, attempt);
+    link->reconnect = true;
+    return WIFI_LINK_CONNECT;
+  }
+
+  link->assoc_us = 0;
+  // credentials that connected before are right (an AP that reboots can
+  // reject them for a while), only ones that never did are given up on
+  bool never_connected = link->stats.connects == 0 && !link->have_cache;
+  if (failure == WIFI_LINK_FAILURE_CREDENTIALS && never_connected) {
+    if (++link->credential_failures >= WIFI_LINK_REJECT_FAILURES) {
+      memset(attempt, 0, sizeof(*attempt));
+      return WIFI_LINK_REJECTED;
+    }
+  } else {
+    link->credential_failures = 0;
+  }
+  if (link->fast) {
+    // the AP isn't where it was, scan for it
+    link->fast = false;
+    link->stats.fast_failures++;
+    memset(attempt, 0, sizeof(*attempt));
+    return WIFI_LINK_CONNECT;
+  }
+  link->failures++;
+  link->stats.retries++;
+  first_attempt(link, attempt);
+  *delay_us = backoff_us(link->failures, random);
+  return WIFI_LINK_WAIT;
+}
+
+wifi_link_failure_t wifi_link_reason_failure(uint8_t reason) {
+  switch (reason) {
+  case WIFI_LINK_REASON_AUTH_FAIL:
+  case WIFI_LINK_REASON_4WAY_HANDSHAKE_TIMEOUT:
+  case WIFI_LINK_REASON_HANDSHAKE_TIMEOUT:
+    return WIFI_LINK_FAILURE_CREDENTIALS;
+  default:
+    return WIFI_LINK_FAILURE_OTHER;
+  }
+}
+
+wifi_link_action_t wifi_link_disconnected(wifi_link_t *link, uint8_t reason,
+                                          bool setup_mode, int64_t now_us,
+                                          uint32_t random,
+                                          wifi_link_attempt_t *attempt,
+                                          int64_t *delay_us) {
+  if (setup_mode) {
+    memset(attempt, 0, sizeof(*attempt));
+    *delay_us = 0;
+    return WIFI_LINK_NONE;
+  }
+  wifi_link_action_t action =
+      wifi_link_failed(link, wifi_link_reason_failure(reason), now_us,
+                       random, attempt, delay_us);
+  if (action == WIFI_LINK_WAIT) {
+    link->delayed = *attempt;
+  }
+  return action;
+}
+
+bool wifi_link_retry(const wifi_link_t *link, bool setup_mode,
+                     wifi_link_attempt_t *attempt) {
+  if (setup_mode) {
+    return false;
+  }
+  *attempt = link->delayed;
+  return true;
+}
+
+void wifi_link_associated(wifi_link_t *link,
+                          const uint8_t bssid[WIFI_LINK_BSSID_LEN],
+                          uint8_t channel, int64_t now_us) {
+  link->assoc_us = now_us;
+  memcpy(link->bssid, bssid, WIFI_LINK_BSSID_LEN);
+  link->channel = channel;
+}
+
+bool wifi_link_got_ip(wifi_link_t *link, uint32_t ip, uint32_t netmask,
+                      uint32_t gateway, int64_t now_us) {
+  // again while connected if the lease changed, only the cache is updated
+  if (!link->connected) {
+    wifi_link_stats_t *stats = &link->stats;
+    // without the association event (it can't be missed, but if it were)
+    // DHCP counts from the start
+    int64_t assoc_us = link->assoc_us ? link->assoc_us : link->start_us;
+    stats->connects++;
+    stats->fast_connects += link->fast;
+    stats->last_fast = link->fast;
+    stats->last_reconnect = link->reconnect;
+    stats->last_connect_us = now_us - link->start_us;
+    stats->last_assoc_us = assoc_us - link->start_us;
+    stats->last_dhcp_us = now_us - assoc_us;
+    stats->last_ip_reused =
+        link->cache.key == link->key && link->cache.ip == ip;
+    stats->ip_reused += stats->last_ip_reused;
+    link->connected = true;
+    link->failures = 0;
+    link->credential_failures = 0;
+  }
+
+  wifi_link_cache_t cache = {
+      .magic = CACHE_MAGIC,
+      .key = link->key,
+      .channel = link->assoc_us ? link->channel : link->cache.channel,
+      .ip = ip,
+      .netmask = netmask,
+      .gateway = gateway,
+  };
+  memcpy(cache.bssid, link->assoc_us ? link->bssid : link->cache.bssid,
+         WIFI_LINK_BSSID_LEN);
+  cache.checksum = cache_checksum(&cache);
+  bool changed = memcmp(&cache, &link->cache, sizeof(cache)) != 0;
+  link->cache = cache;
+  link->have_cache = cache.channel != 0;
+  return changed;
+}
+
+int wifi_link_stats_to_json(const wifi_link_stats_t *stats, char *buf,
+                            size_t size) {
+  int len = snprintf(
+      buf, size,
+      "{\"connects\":%lu,\"fast_connects\":%lu,\"fast_failures\":%lu,"
+      "\"ip_reused\":%lu,\"losses\":%lu,\"retries\":%lu,"
+      "\"last_fast\":%s,\"last_ip_reused\":%s,\"last_reconnect\":%s,"
+      "\"last_connect_us\":%lld,\"last_assoc_us\":%lld,"
+      "\"last_dhcp_us\":%lld}",
+      (unsigned long)stats->connects, (unsigned long)stats->fast_connects,
+      (unsigned long)stats->fast_failures, (unsigned long)stats->ip_reused,
+      (unsigned long)stats->losses, (unsigned long)stats->retries,
+      stats->last_fast ? "true" : "false",
+      stats->last_ip_reused ? "true" : "false",
+      stats->last_reconnect ? "true" : "false",
+      (long long)stats->last_connect_us, (long long)stats->last_assoc_us,
+      (long long)stats->last_dhcp_us);
+  if (len < 0 || (size_t)len >= size) {
+    return -1;
+  }
+  return len;
+}
@@ -0,0 +1,187 @@
+/*
+ * Connection to the access point
+ *
+ * The AP of the last connection (BSSID and channel) and the DHCP lease it
+ * gave are cached (in RTC memory and NVS, by the caller). The next
+ * connection with the same credentials first tries a fast connect: only
+ * the cached channel is scanned and the cached BSSID joined, instead of
+ * scanning every channel for the SSID. If that attempt fails (the AP
+ * moved to another channel or was replaced) it falls back to a full scan
+ * at once. The DHCP client asks for the cached address again (lwIP's
+ * INIT-REBOOT, see sdkconfig.defaults), the stats tell if it got it.
+ *
+ * A connection is retried until it's made, also when it's lost: after
+ * each failed round (the fast connect and the full scan) the next one
+ * waits for a delay that doubles from WIFI_LINK_BACKOFF_MIN_US up to
+ * WIFI_LINK_BACKOFF_MAX_US, with a random half of it so the clocks that
+ * lost the same AP don't all retry at once. Only the AP rejecting
+ * credentials that never connected (not this boot and with no cache)
+ * WIFI_LINK_REJECT_FAILURES times in a row stops it (the caller opens the
+ * setup mode then): an AP that can't be found, or that rejects
+ * credentials it took before (e.g. while the router reboots), is waited
+ * for.
+ *
+ * The driver's events are mapped to what to do here too (the event
+ * handler of clock.c only makes the calls). Times are from a monotonic
+ * clock (esp_timer on the device) and nothing here calls the Wi-Fi
+ * driver, so it also runs on the host (see tools/wifi_sim).
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WIFI_LINK_BSSID_LEN 6
+
+// Delay before the first retry, doubled after each failed one
+#define WIFI_LINK_BACKOFF_MIN_US 1000000LL
+// Longest delay between retries (so the worst case to reconnect once the
+// AP is back)
+#define WIFI_LINK_BACKOFF_MAX_US 30000000LL
+// Credential failures in a row after which credentials that never
+// connected are wrong
+#define WIFI_LINK_REJECT_FAILURES 3
+
+// Disconnection reasons of the driver (wifi_err_reason_t, clock.c checks
+// they match) for the AP rejecting the credentials
+#define WIFI_LINK_REASON_4WAY_HANDSHAKE_TIMEOUT 15
+#define WIFI_LINK_REASON_AUTH_FAIL 202
+#define WIFI_LINK_REASON_HANDSHAKE_TIMEOUT 204
+
+/* The last successful connection */
+typedef struct {
+  uint32_t magic;
+  uint32_t key; // of the credentials it was made with, see wifi_link_key()
+  uint8_t bssid[WIFI_LINK_BSSID_LEN];
+  uint8_t channel;
+  uint8_t reserved; // 0 (no padding, the struct is hashed)
+  uint32_t ip;      // DHCP lease (network byte order)
+  uint32_t netmask;
+  uint32_t gateway;
+  uint32_t checksum;
+} wifi_link_cache_t;
+
+/* How to make a connection attempt */
+typedef struct {
+  bool fast; // join bssid on channel, else scan all the channels
+  uint8_t channel;
+  uint8_t bssid[WIFI_LINK_BSSID_LEN];
+} wifi_link_attempt_t;
+
+/* Why an attempt failed or a connection was lost */
+typedef enum {
+  WIFI_LINK_FAILURE_OTHER,       // AP not found or lost, ...
+  WIFI_LINK_FAILURE_CREDENTIALS, // authentication or handshake failed
+} wifi_link_failure_t;
+
+/* What to do after a failure */
+typedef enum {
+  WIFI_LINK_NONE,     // nothing (in setup mode)
+  WIFI_LINK_CONNECT,  // make the attempt now
+  WIFI_LINK_WAIT,     // make the attempt after the delay
+  WIFI_LINK_REJECTED, // the credentials are wrong, stop
+} wifi_link_action_t;
+
+typedef struct {
+  uint32_t connects;       // connections made
+  uint32_t fast_connects;  // of which with a fast connect
+  uint32_t fast_failures;  // fast connects fallen back to a full scan
+  uint32_t ip_reused;      // connections given the cached address again
+  uint32_t losses;         // connections lost
+  uint32_t retries;        // attempts made after a delay
+  bool last_fast;          // the last connection was a fast connect
+  bool last_ip_reused;     // and was given the cached address again
+  bool last_reconnect;     // and replaced a lost one
+  int64_t last_connect_us; // from the start (or the loss) to the address
+  int64_t last_assoc_us;   // of which to the association
+  int64_t last_dhcp_us;    // and from there to the address
+} wifi_link_stats_t;
+
+typedef struct {
+  wifi_link_cache_t cache;
+  bool have_cache; // cache is valid for the credentials
+  uint32_t key;
+  bool connected;
+  bool reconnect;          // the connection in progress replaces a lost one
+  bool fast;               // the current attempt is a fast connect
+  int failures;            // failed rounds of the connection in progress
+  int credential_failures; // in a row
+  int64_t start_us;
+  int64_t assoc_us;
+  uint8_t bssid[WIFI_LINK_BSSID_LEN]; // of the current association
+  uint8_t channel;
+  wifi_link_attempt_t delayed; // to make after the delay (WIFI_LINK_WAIT)
+  wifi_link_stats_t stats;
+} wifi_link_t;
+
+/* Key of the credentials a cache is valid for (a hash, so they aren't
+ * stored again) */
+uint32_t wifi_link_key(const char *ssid, const char *password);
+
+/* Returns true if a stored cache is intact (magic and checksum) */
+bool wifi_link_cache_valid(const wifi_link_cache_t *cache);
+
+/* Start with the credentials of key and the stored cache (NULL or
+ * invalid if none) */
+void wifi_link_init(wifi_link_t *link, uint32_t key,
+                    const wifi_link_cache_t *cache);
+
+/* A connection starts at now_us, get its first attempt */
+void wifi_link_start(wifi_link_t *link, int64_t now_us,
+                     wifi_link_attempt_t *attempt);
+
+/* The current attempt failed, or the connection was lost, at now_us
+ * (disconnected, for the reason failure). Gets the next attempt and when
+ * to make it: at once after a loss or a failed fast connect (the full
+ * scan), else after a delay (in delay_us) drawn with random (any random
+ * number). Returns WIFI_LINK_REJECTED, and no attempt, once credentials
+ * that never connected are rejected */
+wifi_link_action_t wifi_link_failed(wifi_link_t *link,
+                                    wifi_link_failure_t failure,
+                                    int64_t now_us, uint32_t random,
+                                    wifi_link_attempt_t *attempt,
+                                    int64_t *delay_us);
+
+/* Classify a disconnection reason of the driver: the AP rejecting the
+ * credentials (the password is wrong), or anything else (e.g. the AP
+ * can't be found or was lost), which is retried */
+wifi_link_failure_t wifi_link_reason_failure(uint8_t reason);
+
+/* The station was disconnected for reason (of the driver) at now_us. In
+ * setup mode (the station is stopped) there is nothing to do, else it's
+ * a failure as in wifi_link_failed(). The attempt to make after a
+ * WIFI_LINK_WAIT is also kept for wifi_link_retry() */
+wifi_link_action_t wifi_link_disconnected(wifi_link_t *link, uint8_t reason,
+                                          bool setup_mode, int64_t now_us,
+                                          uint32_t random,
+                                          wifi_link_attempt_t *attempt,
+                                          int64_t *delay_us);
+
+/* The delay of a WIFI_LINK_WAIT is over, get the attempt to make. Returns
+ * false (nothing to do) in setup mode */
+bool wifi_link_retry(const wifi_link_t *link, bool setup_mode,
+                     wifi_link_attempt_t *attempt);
+
+/* Associated to the AP bssid on channel at now_us */
+void wifi_link_associated(wifi_link_t *link,
+                          const uint8_t bssid[WIFI_LINK_BSSID_LEN],
+                          uint8_t channel, int64_t now_us);
+
+/* Got the address at now_us, which completes the connection. Returns
+ * true if the cache changed and must be stored (it's sealed) */
+bool wifi_link_got_ip(wifi_link_t *link, uint32_t ip, uint32_t netmask,
+                      uint32_t gateway, int64_t now_us);
+
+/* Serialize stats as a JSON object into buf. Returns the length written,
+ * or -1 if it doesn't fit */
+int wifi_link_stats_to_json(const wifi_link_stats_t *stats, char *buf,
+                            size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Host check of the boot profile JSON
+ *
+ * Builds a boot profile with main/boot_profile.c in virtual time (stub
+ * ESP-IDF headers in stub/) in three stages: just started, part way
+ * through (phases not run or not ended, milestones not reached) and a
+ * complete warm boot with long times. For each it serializes the
+ * profile with a large buffer, checks the JSON is well formed, then
+ * serializes it again into a buffer of every size from 0 to past its
+ * length and checks that:
+ *   - it returns -1 while the JSON doesn't fit, and its length once it
+ *     does, with the same text
+ *   - nothing is written past the size given (the rest of the buffer is
+ *     a canary)
+ *   - a truncated buffer is still terminated within its size
+ * The exit status is 1 if any check fails.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain -Itools/boot_check/stub tools/boot_check/boot_check.c \
+ *       main/boot_profile.c -o boot_check
+ *
+ * Usage:
+ *   boot_check [-v]
+ *     -v  print the JSON of each profile
+ */
+#include "boot_profile.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_JSON 2048
+#define CANARY 0xa5
+
+static int64_t s_now_us;
+static bool s_verbose;
+
+int64_t esp_timer_get_time(void) { return s_now_us; }
+
+esp_reset_reason_t esp_reset_reason(void) { return ESP_RST_POWERON; }
+
+/* Check that text is a JSON object of objects, strings and integers,
+ * returns false if it isn't */
+static bool well_formed(const char *text) {
+  int depth = 0;
+  bool in_string = false;
+  for (const char *p = text; *p; p++) {
+    if (in_string) {
+      in_string = *p != '"';
+    } else if (*p == '"') {
+      in_string = true;
+    } else if (*p == '{') {
+      depth++;
+    } else if (*p == '}') {
+      if (--depth < 0) {
+        return false;
+      }
+    } else if (!strchr(":,-0123456789", *p)) {
+      return false;
+    }
+    if (depth == 0 && p[1] != '\0') {
+      return false; // after the object
+    }
+  }
+  return text[0] == '{' && depth == 0 && !in_string;
+}
+
+/* Check the JSON of the profile at every buffer size, returns the number
+ * of failures */
+static int check_profile(const char *name) {
+  static char full[MAX_JSON];
+  int full_len = boot_profile_to_json(full, sizeof(full));
+  if (full_len < 0) {
+    printf("%s: doesn't fit in %d bytes\n", name, MAX_JSON);
+    return 1;
+  }
+  if (s_verbose) {
+    printf("%s\n", full);
+  }
+  int failures = 0;
+  if ((size_t)full_len != strlen(full) || !well_formed(full)) {
+    printf("%s: malformed JSON: %s\n", name, full);
+    failures++;
+  }
+
+  static char buf[MAX_JSON + 16];
+  for (int size = 0; size <= full_len + 8; size++) {
+    memset(buf, CANARY, sizeof(buf));
+    int len = boot_profile_to_json(buf, size);
+    bool fits = size > full_len;
+    bool ok = fits ? len == full_len && strcmp(buf, full) == 0 : len == -1;
+    for (size_t i = size; i < sizeof(buf); i++) {
+      ok &= (unsigned char)buf[i] == CANARY;
+    }
+    if (size > 0) {
+      ok &= memchr(buf, '\0', size) != NULL;
+    }
+    if (!ok) {
+      if (failures < 10) {
+        printf("%s: wrong result with %d bytes (returned %d)\n", name, size,
+               len);
+      }
+      failures++;
+    }
+  }
+  printf("%-30s%6d bytes  %s\n", name, full_len,
+         failures == 0 ? "ok" : "FAIL");
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    switch (opt) {
+    case 'v':
+      s_verbose = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  int failures = 0;
+  // a cold boot that just started
+  s_now_us = 12000;
+  boot_profile_init();
+  failures += check_profile("started");
+
+  // part way: every other phase run, some of them not ended
+  for (int i = 0; i < BOOT_PHASE_COUNT; i += 2) {
+    s_now_us += 3000;
+    boot_profile_begin(i);
+    if (i % 4 == 0) {
+      s_now_us += 150000;
+      boot_profile_end(i);
+    }
+  }
+  failures += check_profile("part way");
+
+  // every phase (run again) and milestone of a warm boot, with times long
+  // enough to need every digit of the fields
+  boot_profile_set_warm(true);
+  s_now_us = 1000000000000LL;
+  for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+    boot_profile_begin(i);
+    s_now_us += 987654321;
+    boot_profile_end(i);
+  }
+  for (int i = 0; i < BOOT_MILESTONE_COUNT; i++) {
+    s_now_us += 123456789;
+    boot_profile_milestone(i);
+  }
+  failures += check_profile("complete warm boot");
+  return failures == 0 ? 0 : 1;
+}
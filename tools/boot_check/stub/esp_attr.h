@@ -0,0 +1,4 @@
+/* Host stub of esp_attr.h for tools/boot_check */
+#pragma once
+
+#define RTC_NOINIT_ATTR
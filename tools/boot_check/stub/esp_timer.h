@@ -0,0 +1,7 @@
+/* Host stub of esp_timer.h for tools/boot_check */
+#pragma once
+
+#include <stdint.h>
+
+/* Virtual time, defined by the test */
+int64_t esp_timer_get_time(void);
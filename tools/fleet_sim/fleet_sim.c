@@ -0,0 +1,325 @@
+/*
+ * Host simulation of fleet sync (minute flips in step across clocks)
+ *
+ * Simulates a leader and follower clocks on a LAN, each with its own
+ * oscillator drift, NTP error and network delays, and runs the follower
+ * estimator (main/fleet_clock.c) on the beacons and delay requests they
+ * would receive. For each minute boundary it computes when each clock
+ * flips and reports the skew (latest - earliest flip) when:
+ *   poll   each clock shows its own NTP time and polls it every 500 ms
+ *          (the display task before the boundary timer)
+ *   ntp    each clock shows its own NTP time, woken on the boundary
+ *   fleet  the followers show the leader's time, woken on the boundary
+ *
+ * The leader's clock can be stepped (its NTP time jumps, as when
+ * clock_discipline steps it), 10 s before a minute boundary. The beacons
+ * carry its step count, so the followers start over from the beacons
+ * after the step; the skew of the flips of the minutes after it is
+ * reported, and with -u for beacons without the count (the followers
+ * keep the offset from before the step as long as the samples and round
+ * trips from before it are the best ones).
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/fleet_sim/fleet_sim.c main/fleet_clock.c \
+ *       -lm -o fleet_sim
+ *
+ * Usage:
+ *   fleet_sim [-n clocks] [-m minutes] [-e ms] [-p probability] [-k minute]
+ *             [-j minute] [-J ms] [-u] [-s seed]
+ *     -n  number of clocks, leader included (default 8)
+ *     -m  minutes to simulate (default 120)
+ *     -e  NTP error of each clock, uniform within +- ms (default 20)
+ *     -p  probability that a beacon is held by the access point until
+ *         the next DTIM beacon (up to 102.4 ms later, default 0.5)
+ *     -k  stop the leader at this minute (default never)
+ *     -j  step the leader's clock 10 s before this minute (default never)
+ *     -J  size of the step (default -500, back)
+ *     -u  beacons without the step count (a leader of older firmware)
+ *     -s  random seed (default 1)
+ */
+#include "fleet_clock.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CLOCKS 64
+// Period of the beacons and of the old display polling
+#define BEACON_PERIOD_US 1000000LL
+#define POLL_PERIOD_US 500000LL
+// Delay requests are sent after each beacon until there are this many
+// round trips, then every DELAY_REQUEST_PERIOD beacons
+#define DELAY_REQUEST_BURST 4
+#define DELAY_REQUEST_PERIOD 4
+// Time the leader takes to answer a delay request
+#define LEADER_TURNAROUND_US 200
+// Maximum delay of a frame held until the next DTIM beacon
+#define DTIM_INTERVAL_US 102400
+// Maximum latency of the wake up on the boundary (timer, task switch)
+#define WAKE_LATENCY_US 1000
+// Maximum latency of the receive timestamp of a packet
+#define RX_LATENCY_US 300
+// Time of the leader's step before the boundary of its minute
+#define STEP_BEFORE_US 10000000LL
+// Minutes after the step whose flips are reported
+#define STEP_MINUTES 3
+
+typedef struct {
+  double drift;     // oscillator error (fraction)
+  double phase_us;  // local clock at true time 0
+  double ntp_error_us;
+  double base_delay_us; // one-way network delay without queuing
+  double poll_phase_us;
+  fleet_clock_t fleet;
+  uint32_t beacons;
+} sim_clock_t;
+
+static uint64_t s_rng = 1;
+
+/* Uniform in [0, 1) */
+static double rnd(void) {
+  s_rng ^= s_rng << 13;
+  s_rng ^= s_rng >> 7;
+  s_rng ^= s_rng << 17;
+  return (s_rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double uniform(double lo, double hi) { return lo + (hi - lo) * rnd(); }
+
+/* Exponential with the given mean */
+static double exponential(double mean) { return -log(1 - rnd()) * mean; }
+
+/* Local (monotonic) clock of a simulated clock at a true time */
+static int64_t local_time(const sim_clock_t *c, double t_us) {
+  return (int64_t)(t_us * (1 + c->drift) + c->phase_us);
+}
+
+/* True time at which the local clock reads local_us */
+static double true_time(const sim_clock_t *c, double local_us) {
+  return (local_us - c->phase_us) / (1 + c->drift);
+}
+
+static double unicast_delay(const sim_clock_t *c) {
+  return c->base_delay_us + exponential(500);
+}
+
+typedef struct {
+  double *values;
+  int count;
+} samples_t;
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static void print_stats(const char *name, samples_t *s) {
+  if (s->count == 0) {
+    printf("  %-6s no samples\n", name);
+    return;
+  }
+  qsort(s->values, s->count, sizeof(double), compare_doubles);
+  printf("  %-6s p50 %7.2f ms  p99 %7.2f ms  max %7.2f ms\n", name,
+         s->values[s->count / 2] / 1000,
+         s->values[(int)(s->count * 0.99)] / 1000,
+         s->values[s->count - 1] / 1000);
+}
+
+int main(int argc, char *argv[]) {
+  int num_clocks = 8;
+  int minutes = 120;
+  double ntp_error_ms = 20;
+  double power_save = 0.5;
+  int kill_minute = -1;
+  int step_minute = -1;
+  double step_ms = -500;
+  bool step_count = true;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:e:p:k:j:J:us:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_clocks = atoi(optarg);
+      break;
+    case 'm':
+      minutes = atoi(optarg);
+      break;
+    case 'e':
+      ntp_error_ms = atof(optarg);
+      break;
+    case 'p':
+      power_save = atof(optarg);
+      break;
+    case 'k':
+      kill_minute = atoi(optarg);
+      break;
+    case 'j':
+      step_minute = atoi(optarg);
+      break;
+    case 'J':
+      step_ms = atof(optarg);
+      break;
+    case 'u':
+      step_count = false;
+      break;
+    case 's':
+      s_rng = strtoull(optarg, NULL, 10) * 2654435761ULL + 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n clocks] [-m minutes] [-e ms] "
+                      "[-p probability] [-k minute] [-j minute] [-J ms] "
+                      "[-u] [-s seed]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (num_clocks < 2 || num_clocks > MAX_CLOCKS || minutes < 1) {
+    fprintf(stderr, "2 to %d clocks and at least a minute\n", MAX_CLOCKS);
+    return 1;
+  }
+
+  sim_clock_t clocks[MAX_CLOCKS];
+  for (int i = 0; i < num_clocks; i++) {
+    sim_clock_t *c = &clocks[i];
+    c->drift = uniform(-20e-6, 20e-6);
+    c->phase_us = uniform(0, 1e9);
+    c->ntp_error_us = uniform(-ntp_error_ms, ntp_error_ms) * 1000;
+    c->base_delay_us = uniform(500, 3000);
+    c->poll_phase_us = uniform(0, POLL_PERIOD_US);
+    fleet_clock_reset(&c->fleet);
+    c->beacons = 0;
+  }
+  // the leader's time is its NTP time
+  sim_clock_t *leader = &clocks[0];
+  uint8_t leader_steps = 0;
+
+  samples_t poll = {calloc(minutes, sizeof(double)), 0};
+  samples_t ntp = {calloc(minutes, sizeof(double)), 0};
+  samples_t fleet = {calloc(minutes, sizeof(double)), 0};
+  samples_t alone = {calloc(minutes, sizeof(double)), 0}; // leader gone
+  samples_t stepped = {calloc(minutes, sizeof(double)), 0}; // after a step
+  int locked_flips = 0, follower_flips = 0;
+
+  // true time 0 is 1000 s after the leader's boundary 0, so the estimator
+  // is warm before the first minute that counts
+  int64_t step_second =
+      (int64_t)(step_minute + 1000 / 60) * 60 - STEP_BEFORE_US / 1000000;
+  for (int64_t second = 0; second < (int64_t)minutes * 60 + 1000; second++) {
+    int minute = (int)(second / 60) - 1000 / 60;
+    bool leader_alive = kill_minute < 0 || minute < kill_minute;
+
+    // minute boundaries (in leader time), before the beacon of the second
+    if (second % 60 == 0 && minute >= 0 && minute < minutes) {
+      double boundary_us = second * 1e6;
+      double poll_min = 1e300, poll_max = -1e300;
+      double ntp_min = 1e300, ntp_max = -1e300;
+      double fleet_min = 1e300, fleet_max = -1e300;
+      for (int i = 0; i < num_clocks; i++) {
+        sim_clock_t *c = &clocks[i];
+        double wake = uniform(0, WAKE_LATENCY_US);
+        // own NTP time crosses the boundary
+        double cross = boundary_us - c->ntp_error_us;
+        double polled = c->poll_phase_us +
+                        POLL_PERIOD_US *
+                            (double)(int64_t)((cross - c->poll_phase_us) /
+                                                  POLL_PERIOD_US +
+                                              1);
+        double flip_ntp = cross + wake;
+        double flip_fleet = flip_ntp;
+        if (i > 0) {
+          follower_flips++;
+          int64_t now = local_time(c, cross);
+          if (fleet_clock_update(&c->fleet, now)) {
+            locked_flips++;
+            flip_fleet =
+                true_time(c, boundary_us - c->fleet.offset_us) + wake;
+          }
+        }
+        polled += wake;
+        if (polled < poll_min) poll_min = polled;
+        if (polled > poll_max) poll_max = polled;
+        if (flip_ntp < ntp_min) ntp_min = flip_ntp;
+        if (flip_ntp > ntp_max) ntp_max = flip_ntp;
+        if (flip_fleet < fleet_min) fleet_min = flip_fleet;
+        if (flip_fleet > fleet_max) fleet_max = flip_fleet;
+      }
+      poll.values[poll.count++] = poll_max - poll_min;
+      ntp.values[ntp.count++] = ntp_max - ntp_min;
+      if (step_minute >= 0 && minute >= step_minute &&
+          minute < step_minute + STEP_MINUTES) {
+        stepped.values[stepped.count++] = fleet_max - fleet_min;
+      } else if (leader_alive) {
+        fleet.values[fleet.count++] = fleet_max - fleet_min;
+      } else {
+        alone.values[alone.count++] = fleet_max - fleet_min;
+      }
+    }
+    if (!leader_alive) {
+      continue;
+    }
+    if (step_minute >= 0 && second == step_second) {
+      leader->ntp_error_us += step_ms * 1000;
+      leader_steps++;
+    }
+
+    // beacon, sent half way through the second of the leader
+    double sent = (second * 1e6 + 500000) - leader->ntp_error_us;
+    int64_t leader_sent_us = (int64_t)(second * 1e6 + 500000);
+    for (int i = 1; i < num_clocks; i++) {
+      sim_clock_t *c = &clocks[i];
+      double received = sent + c->base_delay_us + exponential(500);
+      if (rnd() < power_save) {
+        received += uniform(0, DTIM_INTERVAL_US);
+      }
+      int64_t local_rx =
+          local_time(c, received) + (int64_t)uniform(0, RX_LATENCY_US);
+      fleet_clock_update(&c->fleet, local_rx);
+      fleet_clock_add_beacon(&c->fleet, leader_sent_us, local_rx,
+                             step_count ? leader_steps : 0);
+      c->beacons++;
+
+      // delay request right after the beacon
+      if (c->fleet.num_round_trips < DELAY_REQUEST_BURST ||
+          c->beacons % DELAY_REQUEST_PERIOD == 0) {
+        double request = received + 1000;
+        double at_leader = request + unicast_delay(c);
+        double answered = at_leader + LEADER_TURNAROUND_US;
+        double answer_rx = answered + unicast_delay(c);
+        if (rnd() < power_save / 5) {
+          answer_rx += uniform(0, DTIM_INTERVAL_US);
+        }
+        fleet_clock_add_round_trip(
+            &c->fleet, local_time(c, request),
+            (int64_t)(at_leader + leader->ntp_error_us),
+            (int64_t)(answered + leader->ntp_error_us),
+            local_time(c, answer_rx) + (int64_t)uniform(0, RX_LATENCY_US));
+      }
+    }
+  }
+
+  printf("%d clocks, %d minutes, NTP error +-%.0f ms, power save %.2f\n",
+         num_clocks, minutes, ntp_error_ms, power_save);
+  printf("flip skew (latest - earliest clock) per minute:\n");
+  print_stats("poll", &poll);
+  print_stats("ntp", &ntp);
+  print_stats("fleet", &fleet);
+  if (kill_minute >= 0) {
+    printf("after the leader stopped:\n");
+    print_stats("fleet", &alone);
+  }
+  if (step_minute >= 0) {
+    printf("%d minutes after the leader's step of %.0f ms (%s):\n",
+           STEP_MINUTES, step_ms,
+           step_count ? "with the step count" : "without the step count");
+    print_stats("fleet", &stepped);
+  }
+  printf("followers locked at %.1f%% of the flips\n",
+         follower_flips ? 100.0 * locked_flips / follower_flips : 0);
+  free(poll.values);
+  free(ntp.values);
+  free(fleet.values);
+  free(alone.values);
+  free(stepped.values);
+  return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * HTTP load test for the clock web server
+ *
+ * Runs concurrent clients that GET a page of the clock in a loop while
+ * another client posts the settings form at a fixed interval, and reports
+ * the latency percentiles of both. The web server of the clock handles
+ * one request at a time, so whatever a handler blocks on (e.g. applying
+ * and writing the config) shows up in the p99 of the other requests. Run
+ * it against a firmware before and after a change to compare, and see
+ * /debug/config for the time spent on the clock.
+ *
+ * Build from the repository root:
+ *   gcc -O2 tools/http_load/http_load.c -lpthread -o http_load
+ *
+ * Usage:
+ *   http_load [-c clients] [-n requests] [-g path] [-f form] [-i ms]
+ *             [-p port] host
+ *     -c  clients sending GET requests at the same time (default 4)
+ *     -n  GET requests per client (default 100)
+ *     -g  path to GET (default /debug/time)
+ *     -f  file with the urlencoded settings form to POST to / (it must
+ *         include the clock password as p=...), default no POSTs
+ *     -i  interval between the POSTs in ms (default 500)
+ *     -p  port (default 80)
+ */
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 64
+// Requests taking longer than this count as errors
+#define TIMEOUT_S 10
+
+typedef struct {
+  int64_t *samples_us;
+  int count;
+  int capacity;
+  int errors;
+} samples_t;
+
+static const char *s_host;
+static const char *s_port = "80";
+static const char *s_path = "/debug/time";
+static char *s_form;
+static int s_interval_ms = 500;
+static int s_requests = 100;
+static volatile bool s_done;
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *samples, int64_t value) {
+  if (samples->count == samples->capacity) {
+    samples->capacity = samples->capacity ? samples->capacity * 2 : 256;
+    samples->samples_us = realloc(samples->samples_us,
+                                  samples->capacity * sizeof(int64_t));
+  }
+  samples->samples_us[samples->count++] = value;
+}
+
+/* Send a request and read the response until the server closes the
+ * connection. Returns true if the status is 200 */
+static bool request(const char *method, const char *path, const char *body) {
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *addr;
+  if (getaddrinfo(s_host, s_port, &hints, &addr) != 0) {
+    return false;
+  }
+  int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  struct timeval timeout = {.tv_sec = TIMEOUT_S};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  bool ok = sock >= 0 && connect(sock, addr->ai_addr, addr->ai_addrlen) == 0;
+  freeaddrinfo(addr);
+
+  char buf[2048];
+  if (ok) {
+    int len = snprintf(buf, sizeof(buf),
+                       "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n",
+                       method, path, s_host);
+    if (body) {
+      len += snprintf(buf + len, sizeof(buf) - len,
+                      "Content-Type: application/x-www-form-urlencoded\r\n"
+                      "Content-Length: %zu\r\n",
+                      strlen(body));
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+    ok = send(sock, buf, len, 0) == len &&
+         (!body ||
+          send(sock, body, strlen(body), 0) == (ssize_t)strlen(body));
+  }
+  int total = 0;
+  char status[16] = "";
+  while (ok) {
+    ssize_t n = recv(sock, buf, sizeof(buf), 0);
+    if (n < 0) {
+      ok = false;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (total < (int)sizeof(status) - 1) {
+      int room = sizeof(status) - 1 - total;
+      int copy = n < room ? n : room;
+      memcpy(status + total, buf, copy);
+      status[total + copy] = '\0';
+    }
+    total += n;
+  }
+  if (sock >= 0) {
+    close(sock);
+  }
+  return ok && strncmp(status + 8, " 200", 4) == 0;
+}
+
+static void *get_client(void *arg) {
+  samples_t *samples = arg;
+  for (int i = 0; i < s_requests; i++) {
+    int64_t start_us = now_us();
+    if (request("GET", s_path, NULL)) {
+      samples_add(samples, now_us() - start_us);
+    } else {
+      samples->errors++;
+    }
+  }
+  return NULL;
+}
+
+static void *post_client(void *arg) {
+  samples_t *samples = arg;
+  while (!s_done) {
+    int64_t start_us = now_us();
+    if (request("POST", "/", s_form)) {
+      samples_add(samples, now_us() - start_us);
+    } else {
+      samples->errors++;
+    }
+    int64_t wait_us = s_interval_ms * 1000LL - (now_us() - start_us);
+    if (wait_us > 0) {
+      usleep(wait_us);
+    }
+  }
+  return NULL;
+}
+
+static int compare_samples(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_samples(const char *name, samples_t *samples) {
+  if (samples->count == 0) {
+    printf("%-5s %6d requests %4d errors\n", name, 0, samples->errors);
+    return;
+  }
+  qsort(samples->samples_us, samples->count, sizeof(int64_t),
+        compare_samples);
+  int64_t *s = samples->samples_us;
+  int n = samples->count;
+  printf("%-5s %6d requests %4d errors  p50 %7.1f ms  p99 %7.1f ms  "
+         "max %7.1f ms\n",
+         name, n, samples->errors, s[n / 2] / 1000.0,
+         s[(n * 99 - 1) / 100] / 1000.0, s[n - 1] / 1000.0);
+}
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *data = malloc(size + 1);
+  size = fread(data, 1, size, f);
+  fclose(f);
+  // no trailing newline in the form
+  while (size > 0 && (data[size - 1] == '\n' || data[size - 1] == '\r')) {
+    size--;
+  }
+  data[size] = '\0';
+  return data;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: http_load [-c clients] [-n requests] [-g path] "
+                  "[-f form] [-i ms] [-p port] host\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int clients = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:g:f:i:p:")) != -1) {
+    switch (opt) {
+    case 'c':
+      clients = atoi(optarg);
+      break;
+    case 'n':
+      s_requests = atoi(optarg);
+      break;
+    case 'g':
+      s_path = optarg;
+      break;
+    case 'f':
+      s_form = read_file(optarg);
+      if (!s_form) {
+        fprintf(stderr, "can't read %s\n", optarg);
+        return 2;
+      }
+      break;
+    case 'i':
+      s_interval_ms = atoi(optarg);
+      break;
+    case 'p':
+      s_port = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1 || clients < 1 || clients > MAX_CLIENTS) {
+    usage();
+  }
+  s_host = argv[optind];
+
+  pthread_t get_threads[MAX_CLIENTS];
+  samples_t get_samples[MAX_CLIENTS] = {0};
+  pthread_t post_thread;
+  samples_t post_samples = {0};
+  if (s_form) {
+    pthread_create(&post_thread, NULL, post_client, &post_samples);
+  }
+  for (int i = 0; i < clients; i++) {
+    pthread_create(&get_threads[i], NULL, get_client, &get_samples[i]);
+  }
+
+  samples_t get_all = {0};
+  for (int i = 0; i < clients; i++) {
+    pthread_join(get_threads[i], NULL);
+    for (int j = 0; j < get_samples[i].count; j++) {
+      samples_add(&get_all, get_samples[i].samples_us[j]);
+    }
+    get_all.errors += get_samples[i].errors;
+    free(get_samples[i].samples_us);
+  }
+  s_done = true;
+  if (s_form) {
+    pthread_join(post_thread, NULL);
+  }
+
+  print_samples("GET", &get_all);
+  if (s_form) {
+    print_samples("POST", &post_samples);
+  }
+  return get_all.errors > 0 || post_samples.errors > 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Host check of the NTP server selection against local stub servers
+ *
+ * Starts stub NTP servers on local UDP ports, each with its own clock
+ * offset, injected round trip delay (half before its receive timestamp,
+ * half after its transmit timestamp, so the offset measured stays
+ * unbiased), stratum and root delay and dispersion, and answering only
+ * some of the probes to model unreachable or failing servers. Then it
+ * probes them the way the probe task does on the device (main/
+ * ntp_probe.c): rounds of one query to each server with the real query
+ * code (ntp_select_query_port), the samples or timeouts added to the
+ * filters and ntp_select_best called with the current selection.
+ *
+ * Each case checks which server is selected after given rounds, and
+ * which servers are rejected as falsetickers: the lowest delay wins
+ * among equal servers, a lower stratum wins first, a server far off the
+ * others is rejected even with a lower stratum, an unreachable server is
+ * skipped, the selection fails over when the selected server stops
+ * answering, and it doesn't flap to a server only slightly better but
+ * switches to one clearly better. The exit status is 1 if any check
+ * fails.
+ *
+ * The delays are real (the case takes a few seconds), so a busy host
+ * can add a few ms to a probe; the cases keep their servers further
+ * apart than that.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/ntp_stub/ntp_stub.c main/ntp_select.c -lm \
+ *       -lpthread -o ntp_stub
+ *
+ * Usage:
+ *   ntp_stub [-v]
+ *     -v  print the state of the servers after each case
+ */
+#include "ntp_select.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define NTP_PACKET_SIZE 48
+#define NTP_UNIX_OFFSET 2208988800LL
+// Timeout of a probe (1000 ms on the device)
+#define PROBE_TIMEOUT_MS 300
+#define MAX_ROUNDS 8
+#define MAX_CHECKS 4
+
+// A stratum 2 server on time with a round trip of delay ms, and a stratum
+// 1 one (no root delay) offset ms off; more fields (e.g. .last = -1) can
+// follow
+#define STRATUM_2(delay, ...)                                                  \
+  {.delay_ms = (delay), .stratum = 2, .root_delay_ms = 10,                     \
+   .root_dispersion_ms = 5, __VA_ARGS__}
+#define STRATUM_1(delay, offset, ...)                                          \
+  {.delay_ms = (delay), .offset_ms = (offset), .stratum = 1,                   \
+   .root_dispersion_ms = 1, __VA_ARGS__}
+
+/* A stub server and its state */
+typedef struct {
+  int delay_ms;  // round trip added to each answer
+  int offset_ms; // server clock - local clock
+  uint8_t stratum;
+  int root_delay_ms;
+  int root_dispersion_ms;
+  int first; // first probe answered (1-based, 0 for the first)
+  int last;  // last probe answered (0 for all, -1 for none)
+
+  int sock;
+  char port[8];
+  pthread_t thread;
+  int probes; // received
+} stub_server_t;
+
+/* Selection expected after a round */
+typedef struct {
+  int round; // 1-based, 0 ends the list
+  int selected;
+} stub_check_t;
+
+typedef struct {
+  const char *name;
+  int count;
+  stub_server_t servers[NTP_SELECT_MAX_SERVERS];
+  int rounds;
+  stub_check_t checks[MAX_CHECKS];
+  unsigned falsetickers; // bit of each server rejected after the rounds
+} stub_case_t;
+
+static volatile bool s_stop;
+static bool s_verbose;
+
+static int64_t local_time_us(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+static void put_timestamp(uint8_t *p, int64_t us) {
+  put_u32(p, (uint32_t)(us / 1000000 + NTP_UNIX_OFFSET));
+  put_u32(p + 4, (uint32_t)(((uint64_t)(us % 1000000) << 32) / 1000000));
+}
+
+/* NTP short format (16.16 seconds) of a time in ms */
+static uint32_t short_format(int ms) {
+  return (uint32_t)(((uint64_t)ms << 16) / 1000);
+}
+
+static bool answers(const stub_server_t *server, int probe) {
+  int first = server->first > 0 ? server->first : 1;
+  return server->last >= 0 && probe >= first &&
+         (server->last == 0 || probe <= server->last);
+}
+
+static void *server_thread(void *arg) {
+  stub_server_t *server = arg;
+  while (!s_stop) {
+    uint8_t packet[NTP_PACKET_SIZE];
+    struct sockaddr_in client;
+    socklen_t client_len = sizeof(client);
+    ssize_t len = recvfrom(server->sock, packet, sizeof(packet), 0,
+                           (struct sockaddr *)&client, &client_len);
+    if (len != NTP_PACKET_SIZE || (packet[0] & 0x07) != 3) {
+      continue; // timeout (to check s_stop) or not a client request
+    }
+    if (!answers(server, ++server->probes)) {
+      continue;
+    }
+    usleep(server->delay_ms * 500);
+    int64_t offset_us = server->offset_ms * 1000LL;
+    uint8_t reply[NTP_PACKET_SIZE] = {0};
+    reply[0] = 0x24; // no leap warning, version 4, server mode
+    reply[1] = server->stratum;
+    reply[2] = packet[2]; // poll
+    reply[3] = 0xec;      // precision, about 60 ns
+    put_u32(&reply[4], short_format(server->root_delay_ms));
+    put_u32(&reply[8], short_format(server->root_dispersion_ms));
+    memcpy(&reply[12], "STUB", 4);
+    memcpy(&reply[24], &packet[40], 8); // origin: the client transmit
+    put_timestamp(&reply[16], local_time_us() + offset_us - 16000000);
+    put_timestamp(&reply[32], local_time_us() + offset_us); // receive
+    put_timestamp(&reply[40], local_time_us() + offset_us); // transmit
+    usleep(server->delay_ms * 500);
+    sendto(server->sock, reply, sizeof(reply), 0, (struct sockaddr *)&client,
+           client_len);
+  }
+  return NULL;
+}
+
+/* Start a stub server on a free local port, returns false on failure */
+static bool server_start(stub_server_t *server) {
+  server->probes = 0;
+  server->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (server->sock < 0) {
+    return false;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addr_len = sizeof(addr);
+  struct timeval timeout = {.tv_usec = 50000};
+  setsockopt(server->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+             sizeof(timeout));
+  if (bind(server->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(server->sock, (struct sockaddr *)&addr, &addr_len) != 0) {
+    close(server->sock);
+    return false;
+  }
+  snprintf(server->port, sizeof(server->port), "%u", ntohs(addr.sin_port));
+  return pthread_create(&server->thread, NULL, server_thread, server) == 0;
+}
+
+static void print_servers(const stub_case_t *c, const ntp_server_t *servers,
+                          int selected) {
+  int64_t now_us = local_time_us();
+  printf("      server  reach  delay ms  offset ms  jitter ms  dist ms\n");
+  for (int i = 0; i < c->count; i++) {
+    const ntp_server_t *server = &servers[i];
+    printf("    %c %-6d  0x%02x %9.1f %10.1f %10.1f %8.1f%s\n",
+           i == selected ? '*' : ' ', i, server->reach,
+           server->best.delay_us / 1000.0, server->best.offset_us / 1000.0,
+           server->jitter_us / 1000.0,
+           ntp_select_root_distance(server, now_us) / 1000.0,
+           server->truechimer ? "" : "  (not a truechimer)");
+  }
+}
+
+/* Run a case, returns true if every check passed */
+static bool run_case(stub_case_t *c) {
+  s_stop = false;
+  for (int i = 0; i < c->count; i++) {
+    if (!server_start(&c->servers[i])) {
+      fprintf(stderr, "failed to start a stub server\n");
+      exit(2);
+    }
+  }
+
+  ntp_server_t servers[NTP_SELECT_MAX_SERVERS];
+  for (int i = 0; i < c->count; i++) {
+    ntp_select_reset(&servers[i]);
+  }
+  int selected = -1;
+  bool ok = true;
+  const stub_check_t *check = c->checks;
+  char result[64] = "";
+  int len = 0;
+  for (int round = 1; round <= c->rounds; round++) {
+    // one probe to each server in turn, as probe_round() does
+    for (int i = 0; i < c->count; i++) {
+      ntp_sample_t sample;
+      if (ntp_select_query_port("127.0.0.1", c->servers[i].port,
+                                PROBE_TIMEOUT_MS, &sample) == 0) {
+        ntp_select_add_sample(&servers[i], &sample);
+      } else {
+        ntp_select_add_timeout(&servers[i]);
+      }
+    }
+    selected = ntp_select_best(servers, c->count, selected, local_time_us());
+    if (check->round == round) {
+      bool passed = selected == check->selected;
+      ok &= passed;
+      len += snprintf(result + len, sizeof(result) - len, " %d:%d%s", round,
+                      selected, passed ? "" : "!");
+      check++;
+    }
+  }
+  for (int i = 0; i < c->count; i++) {
+    // answering, but rejected by the intersection
+    bool rejected = (servers[i].reach & 1) && !servers[i].truechimer;
+    ok &= rejected == ((c->falsetickers >> i & 1) != 0);
+  }
+
+  s_stop = true;
+  for (int i = 0; i < c->count; i++) {
+    pthread_join(c->servers[i].thread, NULL);
+    close(c->servers[i].sock);
+  }
+
+  printf("%-34s%-16s %s\n", c->name, result, ok ? "ok" : "FAIL");
+  if (s_verbose || !ok) {
+    print_servers(c, servers, selected);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "v")) != -1) {
+    switch (opt) {
+    case 'v':
+      s_verbose = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  stub_case_t cases[] = {
+      {.name = "lowest delay among equals",
+       .count = 4,
+       .servers = {STRATUM_2(80), STRATUM_2(40), STRATUM_2(5),
+                   STRATUM_2(150)},
+       .rounds = 4,
+       .checks = {{1, 2}, {4, 2}}},
+      {.name = "lower stratum first",
+       .count = 3,
+       .servers = {STRATUM_2(5), STRATUM_1(60, 0), STRATUM_2(20)},
+       .rounds = 4,
+       .checks = {{4, 1}}},
+      {.name = "stratum 1 500 ms off rejected",
+       .count = 4,
+       .servers = {STRATUM_1(5, 500), STRATUM_2(20), STRATUM_2(30),
+                   STRATUM_2(40)},
+       .rounds = 4,
+       .checks = {{4, 1}},
+       .falsetickers = 1 << 0},
+      {.name = "unreachable server skipped",
+       .count = 3,
+       .servers = {STRATUM_2(2, .last = -1), STRATUM_2(40), STRATUM_2(20)},
+       .rounds = 4,
+       .checks = {{1, 2}, {4, 2}}},
+      {.name = "fails over when it stops",
+       .count = 3,
+       .servers = {STRATUM_2(5, .last = 4), STRATUM_2(30), STRATUM_2(60)},
+       .rounds = 8,
+       // out after 3 probes without an answer (REACH_MASK)
+       .checks = {{4, 0}, {6, 0}, {7, 1}, {8, 1}}},
+      {.name = "keeps a slightly worse server",
+       .count = 2,
+       .servers = {STRATUM_2(24), STRATUM_2(20, .first = 3)},
+       .rounds = 6,
+       .checks = {{2, 0}, {6, 0}}},
+      {.name = "switches to a clearly better one",
+       .count = 2,
+       .servers = {STRATUM_2(24), STRATUM_2(2, .first = 3)},
+       .rounds = 6,
+       .checks = {{2, 0}, {6, 1}}},
+  };
+
+  printf("%-34s%-16s\n", "case", "round:selected");
+  bool ok = true;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ok &= run_case(&cases[i]);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/*
+ * Host benchmark for the clock display rendering
+ *
+ * Runs the display code (main/display.c) against virtual time the
+ * same way display_time_task does on the device: wake up every 500 ms,
+ * render the frame and only send it to the strip if it changed. Sent
+ * frames go to a simulated strip that can record them to a capture
+ * file (see components/led_strip_sim) or print them as ANSI colors.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain -Icomponents/led_strip_sim/include \
+ *       tools/render_bench/render_bench.c main/display.c main/tz_cache.c \
+ *       components/led_strip_sim/led_strip_sim_capture.c -o render_bench
+ * Add -DCONFIG_ELEVEN_BIT_CLOCK_LAYOUT_<24H|SECONDS|DUAL>=1 to benchmark
+ * another layout, or -DCONFIG_ELEVEN_BIT_CLOCK_LED_MODEL_WS2812=1 for RGB.
+ *
+ * Usage:
+ *   render_bench [-d days] [-p preset] [-z tz] [-o capture] [-c capture] [-a] [-l]
+ *   render_bench -g dir
+ *     -d  days of virtual time to render (default 7, 1 with -g)
+ *     -p  preset to render with, 1-3 (default 1)
+ *     -z  POSIX TZ string (default UTC0)
+ *     -o  record sent frames to a capture file
+ *     -c  compare sent frames with a previously recorded capture
+ *     -g  compare each preset with dir/preset<N>.lsc
+ *     -a  print sent frames as ANSI colors
+ *     -l  convert with localtime_r instead of the timezone cache
+ *
+ * The golden captures of the presets (one day in UTC, default layout and
+ * LED model) are in tools/render_bench/golden, checked with:
+ *   render_bench -g tools/render_bench/golden
+ * After an intended change of the rendering, record them again with:
+ *   render_bench -d 1 -p <N> -o tools/render_bench/golden/preset<N>.lsc
+ * The exit status is 1 if any frame differs from a golden capture.
+ */
+#include "display.h"
+#include "led_strip_sim_capture.h"
+#include "tz_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Wake up period of display_time_task
+#define WAKE_PERIOD_US 500000LL
+// Start of the virtual time (2025-01-01 00:00:00 UTC)
+#define VIRTUAL_EPOCH 1735689600LL
+
+// Presets used for rendering (the device defaults are all black)
+static const preset_t presets[] = {
+    {"Day",
+     {0, 0, 0, 40},
+     {0, 0, 40, 0},
+     {2, 2, 2, 0},
+     {60, 20, 0, 0},
+     {2, 2, 2, 0},
+     {0, 60, 20, 0}},
+    {"Night",
+     {0, 0, 0, 2},
+     {0, 0, 2, 0},
+     {0, 0, 0, 0},
+     {4, 0, 0, 0},
+     {0, 0, 0, 0},
+     {0, 4, 0, 0}},
+    {"Mono",
+     {0, 0, 0, 255},
+     {0, 0, 0, 255},
+     {0, 0, 0, 0},
+     {0, 0, 0, 255},
+     {0, 0, 0, 0},
+     {0, 0, 0, 255}},
+};
+
+static int64_t cpu_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void frame_to_pixels(const color_t *frame, uint8_t *pixels) {
+  for (int i = 0; i < DISPLAY_PIXEL_COUNT; i++) {
+    pixels[i * 4 + 0] = frame[i].r;
+    pixels[i * 4 + 1] = frame[i].g;
+    pixels[i * 4 + 2] = frame[i].b;
+    pixels[i * 4 + 3] = frame[i].w;
+  }
+}
+
+static int days = 7;
+static int ansi_preview = 0;
+static int use_localtime = 0;
+
+/* Render days of virtual time with a preset, recording the sent frames
+ * to output_path and comparing them with compare_path (either NULL).
+ * Returns 0 if there was no mismatch */
+static int bench(int preset_num, const char *output_path,
+                 const char *compare_path) {
+  tz_cache_invalidate();
+  tz_cache_t tz_cache = TZ_CACHE_INIT;
+
+  led_strip_sim_capture_t output = {0};
+  if (output_path && led_strip_sim_capture_create(&output, output_path,
+                                                  DISPLAY_PIXEL_COUNT) != 0) {
+    fprintf(stderr, "failed to create %s\n", output_path);
+    return 1;
+  }
+  led_strip_sim_capture_t golden = {0};
+  if (compare_path) {
+    if (led_strip_sim_capture_open(&golden, compare_path) != 0 ||
+        golden.led_count != DISPLAY_PIXEL_COUNT) {
+      fprintf(stderr, "failed to open %s\n", compare_path);
+      return 1;
+    }
+  }
+
+  const preset_t *preset = &presets[preset_num - 1];
+  display_palette_t palette;
+  display_palette_init(&palette, preset);
+  color_t frame[DISPLAY_PIXEL_COUNT];
+  color_t last_frame[DISPLAY_PIXEL_COUNT];
+  int have_last_frame = 0;
+  uint8_t pixels[DISPLAY_PIXEL_COUNT * LED_STRIP_SIM_CAPTURE_PIXEL_LEN];
+  uint8_t golden_pixels[DISPLAY_PIXEL_COUNT * LED_STRIP_SIM_CAPTURE_PIXEL_LEN];
+
+  uint64_t rendered = 0;
+  uint64_t sent = 0;
+  uint64_t mismatches = 0;
+  int64_t render_ns = 0;
+  int64_t end_us = (int64_t)days * 86400LL * 1000000LL;
+  int64_t bench_start = cpu_time_ns();
+
+  for (int64_t t_us = 0; t_us < end_us; t_us += WAKE_PERIOD_US) {
+    time_t now = (time_t)(VIRTUAL_EPOCH + t_us / 1000000LL);
+    struct tm timeinfo;
+
+    int64_t start = cpu_time_ns();
+    if (use_localtime) {
+      localtime_r(&now, &timeinfo);
+    } else {
+      tz_cache_localtime(&tz_cache, now, &timeinfo);
+    }
+    display_render_time(&timeinfo, &palette, frame);
+    render_ns += cpu_time_ns() - start;
+    rendered++;
+
+    if (have_last_frame && display_frame_equal(frame, last_frame)) {
+      continue;
+    }
+    memcpy(last_frame, frame, sizeof(frame));
+    have_last_frame = 1;
+    sent++;
+
+    int64_t timestamp_us = VIRTUAL_EPOCH * 1000000LL + t_us;
+    frame_to_pixels(frame, pixels);
+    if (output.file &&
+        led_strip_sim_capture_write(&output, timestamp_us, pixels) != 0) {
+      fprintf(stderr, "failed to write %s\n", output_path);
+      return 1;
+    }
+    if (ansi_preview) {
+      led_strip_sim_ansi_preview(stdout, timestamp_us, pixels,
+                                 DISPLAY_PIXEL_COUNT);
+    }
+    if (golden.file) {
+      int64_t golden_us = 0;
+      if (led_strip_sim_capture_read(&golden, &golden_us, golden_pixels) != 1 ||
+          golden_us != timestamp_us ||
+          memcmp(golden_pixels, pixels, sizeof(pixels)) != 0) {
+        if (mismatches == 0) {
+          fprintf(stderr, "first mismatch at frame %llu (t=%lld us)\n",
+                  (unsigned long long)sent, (long long)timestamp_us);
+        }
+        mismatches++;
+      }
+    }
+  }
+  int64_t bench_ns = cpu_time_ns() - bench_start;
+
+  if (golden.file) {
+    int64_t golden_us;
+    while (led_strip_sim_capture_read(&golden, &golden_us, golden_pixels) ==
+           1) {
+      mismatches++; // frames left in the golden capture
+    }
+    led_strip_sim_capture_close(&golden);
+  }
+  led_strip_sim_capture_close(&output);
+
+  double minutes = (double)end_us / 60e6;
+  printf("preset:            %d (%s)\n", preset_num, preset->name);
+  printf("local time:        %s\n",
+         use_localtime ? "localtime_r" : "timezone cache");
+  printf("virtual time:      %d days (%.0f minutes)\n", days, minutes);
+  printf("frames rendered:   %llu\n", (unsigned long long)rendered);
+  printf("frames sent:       %llu\n", (unsigned long long)sent);
+  printf("sent per minute:   %.3f\n", (double)sent / minutes);
+  printf("render rate:       %.0f frames/s\n",
+         bench_ns > 0 ? (double)rendered * 1e9 / (double)bench_ns : 0.0);
+  printf("cpu per frame:     %.1f ns\n", (double)render_ns / (double)rendered);
+  if (compare_path) {
+    printf("golden mismatches: %llu\n", (unsigned long long)mismatches);
+  }
+  return mismatches == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  int preset_num = 1;
+  const char *tz = "UTC0";
+  const char *output_path = NULL;
+  const char *compare_path = NULL;
+  const char *golden_dir = NULL;
+  bool days_set = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:p:z:o:c:g:al")) != -1) {
+    switch (opt) {
+    case 'd':
+      days = atoi(optarg);
+      days_set = true;
+      break;
+    case 'p':
+      preset_num = atoi(optarg);
+      break;
+    case 'z':
+      tz = optarg;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'c':
+      compare_path = optarg;
+      break;
+    case 'g':
+      golden_dir = optarg;
+      break;
+    case 'a':
+      ansi_preview = 1;
+      break;
+    case 'l':
+      use_localtime = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-d days] [-p preset] [-z tz] [-o capture] "
+              "[-c capture] [-g dir] [-a] [-l]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (golden_dir && !days_set) {
+    days = 1; // the length of the golden captures
+  }
+  if (days < 1 || preset_num < 1 || preset_num > 3) {
+    fprintf(stderr, "invalid days or preset\n");
+    return 2;
+  }
+  setenv("TZ", tz, 1);
+  tzset();
+
+  if (!golden_dir) {
+    return bench(preset_num, output_path, compare_path);
+  }
+  int failed = 0;
+  for (int i = 1; i <= (int)(sizeof(presets) / sizeof(presets[0])); i++) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/preset%d.lsc", golden_dir, i);
+    failed |= bench(i, NULL, path);
+  }
+  return failed;
+}
@@ -0,0 +1,264 @@
+/*
+ * Host check of the preset schedule across DST transitions
+ *
+ * Runs schedules (main/preset_schedule.c) over a year in virtual time in
+ * zones whose DST transitions skip and repeat local times differently:
+ * US Eastern and Central European (an hour at 2:00 and 3:00), Lord Howe
+ * (half an hour) and Sydney (DST over the new year). The reference is
+ * brute force: the local time of every minute from localtime_r, and a
+ * switch happens at the first minute whose local time is at or after its
+ * time and later than any local time shown before, so a switch skipped
+ * when DST starts happens at the end of the skipped time and one in the
+ * time repeated when DST ends happens once. Switches at the same minute
+ * leave the preset of the latest local time, then the last in the table.
+ *
+ * Against the reference it checks:
+ *   - preset_schedule_current() at every minute of the year
+ *   - preset_schedule_next() at every minute of the year (instant and
+ *     preset)
+ *   - the clock driven the way the config writer does it: a timer armed
+ *     for preset_schedule_next() activates its preset when it fires and
+ *     is armed again, which must switch at the minutes and to the presets
+ *     of the reference, and only then
+ * which covers the latest local time shown (latest_local()) and the
+ * instant a local time is reached (timeline_reach()) around every
+ * transition. Mismatches are printed with the zone, the schedule and the
+ * time. The exit status is 1 if any check fails.
+ *
+ * Checking every minute of the year takes a few minutes, -s 15 checks
+ * current and next every 15 minutes (the timer still runs through every
+ * switch) in a few seconds.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/schedule_sim/schedule_sim.c \
+ *       main/preset_schedule.c main/tz_cache.c -o schedule_sim
+ *
+ * Usage:
+ *   schedule_sim [-y year] [-s minutes]
+ *     -y  year to run (default 2024)
+ *     -s  check current and next every that many minutes (default 1)
+ */
+#include "preset_schedule.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DAY_SECONDS 86400
+// Minutes run before the year, so the preset in effect at its start is
+// known (a switch happens at least once a week)
+#define LEAD_DAYS 8
+// Minutes run after the year, so the next switch of its end is known
+#define TRAIL_DAYS 8
+#define MAX_REPORTED 10 // mismatches printed per zone and schedule
+
+typedef struct {
+  const char *name;
+  const char *tz;
+} zone_t;
+
+static const zone_t zones[] = {
+    {"America/New_York", "EST5EDT,M3.2.0,M11.1.0"},
+    {"Europe/Berlin", "CET-1CEST,M3.5.0,M10.5.0/3"},
+    {"Australia/Lord_Howe", "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0"},
+    {"Australia/Sydney", "AEST-10AEDT,M10.1.0,M4.1.0/3"},
+};
+
+static const char *const schedules[] = {
+    // before, in, at the ends of and after the skipped or repeated time
+    "daily 01:59 1; daily 02:00 2; daily 02:15 3; daily 02:30 4; "
+    "daily 02:59 5; daily 03:00 6; daily 03:30 7; daily 12:00 8",
+    // weekly, the preset in effect can be from 6 days before
+    "sun 02:30 1; sat 23:59 2; mon,wed 00:00 3",
+    // at the same time (the last one wins) and on the transition days
+    "weekdays 08:00 1; weekends 09:00 2; sun 02:00 3; sun 02:00 4; "
+    "fri 22:00 5",
+};
+
+/* A switch of the reference */
+typedef struct {
+  time_t at;
+  uint8_t preset;
+} event_t;
+
+typedef struct {
+  const char *zone;
+  int schedule; // 1-based
+  int failures;
+} run_t;
+
+/* Start of a year in UTC */
+static time_t year_start(int year) {
+  struct tm tm = {.tm_year = year - 1900, .tm_mday = 1};
+  return timegm(&tm);
+}
+
+/* Local time of t (seconds since 1970-01-01 00:00 local) */
+static int64_t local_seconds(time_t t) {
+  struct tm local;
+  localtime_r(&t, &local);
+  return timegm(&local);
+}
+
+static void fail(run_t *run, const char *what, time_t t, long long expected,
+                 long long actual) {
+  if (run->failures++ >= MAX_REPORTED) {
+    return;
+  }
+  struct tm utc;
+  gmtime_r(&t, &utc);
+  printf("%s schedule %d: %s at %04d-%02d-%02d %02d:%02d UTC: expected "
+         "%lld, got %lld\n",
+         run->zone, run->schedule, what, utc.tm_year + 1900, utc.tm_mon + 1,
+         utc.tm_mday, utc.tm_hour, utc.tm_min, expected, actual);
+}
+
+/* Find the switches of the reference in [from, to), returns their
+ * number */
+static int find_events(const preset_schedule_entry_t *entries, time_t from,
+                       time_t to, event_t *events, int max) {
+  int count = 0;
+  int64_t latest = local_seconds(from);
+  for (time_t t = from + 60; t < to; t += 60) {
+    int64_t local = local_seconds(t);
+    if (local <= latest) {
+      continue; // repeated after DST ended
+    }
+    // the switches shown for the first time, the latest wins
+    int64_t best_local = 0;
+    uint8_t preset = 0;
+    for (int64_t day = latest / DAY_SECONDS; day <= local / DAY_SECONDS;
+         day++) {
+      int wday = (int)((day + 4) % 7); // 1970-01-01 is Thursday
+      for (int i = 0; i < PRESET_SCHEDULE_LEN; i++) {
+        const preset_schedule_entry_t *entry = &entries[i];
+        int64_t at =
+            day * DAY_SECONDS + entry->hour * 3600 + entry->minute * 60;
+        if ((entry->days & (1 << wday)) && at > latest && at <= local &&
+            (preset == 0 || at >= best_local)) {
+          best_local = at;
+          preset = entry->preset;
+        }
+      }
+    }
+    latest = local;
+    if (preset != 0 && count < max) {
+      events[count++] = (event_t){t, preset};
+    }
+  }
+  return count;
+}
+
+/* Run a schedule over [from, to) against the reference */
+static void run_schedule(run_t *run, const preset_schedule_entry_t *entries,
+                         time_t from, time_t to, int step, int *num_events,
+                         long *num_checks) {
+  static event_t events[8 * 400];
+  int max = sizeof(events) / sizeof(events[0]);
+  int count = find_events(entries, from - LEAD_DAYS * DAY_SECONDS,
+                          to + TRAIL_DAYS * DAY_SECONDS, events, max);
+  if (count == max) {
+    printf("%s schedule %d: too many switches\n", run->zone, run->schedule);
+    run->failures++;
+    return;
+  }
+
+  // current and next at every step, each with a cache moving forward
+  tz_cache_t current_cache = TZ_CACHE_INIT;
+  tz_cache_t next_cache = TZ_CACHE_INIT;
+  int next = 0; // first switch after t
+  for (time_t t = from; t < to; t += step * 60) {
+    while (events[next].at <= t) {
+      next++;
+    }
+    uint8_t in_effect = next > 0 ? events[next - 1].preset : 0;
+    uint8_t preset = preset_schedule_current(entries, &current_cache, t);
+    if (preset != in_effect) {
+      fail(run, "current preset", t, in_effect, preset);
+    }
+    time_t at = preset_schedule_next(entries, &next_cache, t, &preset);
+    if (at != events[next].at) {
+      fail(run, "next switch", t, events[next].at, at);
+    } else if (preset != events[next].preset) {
+      fail(run, "next preset", t, events[next].preset, preset);
+    }
+    *num_checks += 2;
+  }
+
+  // the timer of the config writer, from the start of the span
+  tz_cache_t timer_cache = TZ_CACHE_INIT;
+  int expected = 0;
+  while (events[expected].at <= from) {
+    expected++;
+  }
+  uint8_t preset;
+  time_t timer = preset_schedule_next(entries, &timer_cache, from, &preset);
+  while (timer < to) {
+    if (timer != events[expected].at) {
+      fail(run, "timer fired", timer, events[expected].at, timer);
+      break;
+    }
+    if (preset != events[expected].preset) {
+      fail(run, "timer preset", timer, events[expected].preset, preset);
+    }
+    expected++;
+    (*num_events)++;
+    (*num_checks)++;
+    timer = preset_schedule_next(entries, &timer_cache, timer, &preset);
+  }
+  if (timer >= to && events[expected].at < to) {
+    fail(run, "timer missed a switch", events[expected].at,
+         events[expected].at, timer);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int year = 2024;
+  int step = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "y:s:")) != -1) {
+    switch (opt) {
+    case 'y':
+      year = atoi(optarg);
+      break;
+    case 's':
+      step = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-y year] [-s minutes]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (step < 1) {
+    fprintf(stderr, "the step must be at least a minute\n");
+    return 2;
+  }
+
+  time_t from = year_start(year);
+  time_t to = year_start(year + 1);
+  int num_schedules = sizeof(schedules) / sizeof(schedules[0]);
+  int failed = 0;
+  printf("%-22s%-10s%-10s%-12s%s\n", "zone", "schedule", "switches",
+         "checks", "result");
+  for (size_t z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+    setenv("TZ", zones[z].tz, 1);
+    tzset();
+    tz_cache_invalidate();
+    for (int s = 0; s < num_schedules; s++) {
+      preset_schedule_entry_t entries[PRESET_SCHEDULE_LEN];
+      if (!preset_schedule_parse(entries, schedules[s])) {
+        fprintf(stderr, "invalid schedule: %s\n", schedules[s]);
+        return 2;
+      }
+      run_t run = {zones[z].name, s + 1, 0};
+      int num_events = 0;
+      long num_checks = 0;
+      run_schedule(&run, entries, from, to, step, &num_events, &num_checks);
+      printf("%-22s%-10d%-10d%-12ld%s\n", zones[z].name, s + 1, num_events,
+             num_checks, run.failures == 0 ? "ok" : "FAIL");
+      failed += run.failures > 0;
+    }
+  }
+  return failed == 0 ? 0 : 1;
+}
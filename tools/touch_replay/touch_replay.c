@@ -0,0 +1,667 @@
+/*
+ * Host replay of touch input captures through the touch detector
+ *
+ * Feeds the raw ADC frames of captures (from /debug/touch/capture, see
+ * main/touch_input.h) to the touch detector (main/touch_detector.c) the
+ * same way the touch task does on the device, and checks the presses
+ * against labeled touch windows. For each capture it reports the
+ * detections, the missed touches, the false positives (presses outside
+ * the windows), the latency from the start of the labeled touch to the
+ * press and the processing time per frame.
+ *
+ * The presses and releases also go through the gesture recognizer
+ * (main/touch_gesture.c). A label can name the gesture its touch should
+ * complete ("tap", "double_tap" on the second touch of a double tap or
+ * "long_press"). The latency of each such gesture, from the end of the
+ * touch for taps and from its start for the others, is checked against
+ * the bound documented in main/touch_gesture.h.
+ *
+ * Captures are the binary files sent over HTTP, or console logs with the
+ * "TCAP" lines of a serial capture (other lines are skipped). The labels
+ * of capture.tcap are read from capture.labels: one touch per line, its
+ * start and end in seconds from the first frame ("12.3 13.1"), optionally
+ * followed by a gesture, and '#' comments. A capture without labels is
+ * taken as having no touches.
+ *
+ * With a directory of captures of real touches and noise (and their
+ * labels) this is a regression test: the exit status is 1 if a touch is
+ * missed, a false positive is detected, or a labeled gesture is missed,
+ * misclassified or late in any of them.
+ *
+ * A synthetic corpus is in tools/touch_replay/corpus: touches of 0.2 to
+ * 2.5 s, weak to strong, a minute without touches but with noise,
+ * common mode drift and one-frame spikes, and taps, double taps and long
+ * presses labeled with their gestures, in frames of 4 readings per
+ * channel every 100 ms. It is checked with the default config, from the
+ * corpus directory, with:
+ *   touch_replay *.tcap
+ * which must exit with 0. After an intended change of the synthetic
+ * signals, write the corpus again with:
+ *   touch_replay -w tools/touch_replay/corpus
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/touch_replay/touch_replay.c main/touch_detector.c \
+ *       main/touch_gesture.c main/latency_hist.c -o touch_replay
+ *
+ * Usage:
+ *   touch_replay [-t threshold] [-r threshold] [-c frames] [-f shift]
+ *                [-b shift] [-l ms] [-d ms] [-g ms] [-v] capture...
+ *     -t  press threshold (default from TOUCH_DETECTOR_CONFIG_DEFAULT)
+ *     -r  release threshold
+ *     -c  frames to confirm a press
+ *     -f  shift of the channel filters
+ *     -b  shift of the baseline tracking
+ *     -l  long press time (default from TOUCH_GESTURE_CONFIG_DEFAULT)
+ *     -d  double tap gap
+ *     -g  grace period after the end of a labeled touch during which a
+ *         press still counts as its detection (default 500 ms)
+ *     -v  print every press, release and gesture
+ *   touch_replay -w dir
+ *     -w  write the synthetic corpus (captures and labels) to dir
+ */
+#include "touch_detector.h"
+#include "touch_gesture.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAPTURE_HEADER_LEN 16
+#define CAPTURE_RECORD_HEADER_LEN 12
+#define CAPTURE_VERSION 1
+#define MAX_FRAME_LEN 4096
+#define MAX_LABELS 1024
+
+typedef struct {
+  double start_s;
+  double end_s;
+  bool detected;
+  touch_gesture_t gesture; // expected, or TOUCH_GESTURE_NONE
+  touch_gesture_t seen;    // first gesture completed in the touch
+  double gesture_latency_s;
+} label_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+} buffer_t;
+
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static int64_t get_i64(const uint8_t *p) {
+  return (int64_t)((uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32);
+}
+
+static void append(buffer_t *buffer, const void *data, size_t len) {
+  buffer->data = realloc(buffer->data, buffer->len + len);
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+}
+
+static int hex_digit(int c) {
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* Read a capture, binary or from a console log. Returns false on error */
+static bool read_capture(const char *path, buffer_t *capture) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t magic[5] = {0};
+  size_t n = fread(magic, 1, sizeof(magic), f);
+  rewind(f);
+  if (n == sizeof(magic) && memcmp(magic, "TCAP", 4) == 0 &&
+      magic[4] == CAPTURE_VERSION) {
+    uint8_t chunk[4096];
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+      append(capture, chunk, n);
+    }
+  } else {
+    // console log, the hex after "TCAP " (the log may prefix the lines)
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+      char *hex = strstr(line, "TCAP ");
+      if (!hex) {
+        continue;
+      }
+      hex += 5;
+      if (strncmp(hex, "END", 3) == 0) {
+        break;
+      }
+      for (; isxdigit((unsigned char)hex[0]) &&
+             isxdigit((unsigned char)hex[1]);
+           hex += 2) {
+        uint8_t byte = hex_digit(hex[0]) << 4 | hex_digit(hex[1]);
+        append(capture, &byte, 1);
+      }
+    }
+  }
+  fclose(f);
+  if (capture->len < CAPTURE_HEADER_LEN ||
+      memcmp(capture->data, "TCAP", 4) != 0 ||
+      capture->data[4] != CAPTURE_VERSION) {
+    fprintf(stderr, "%s: not a touch capture\n", path);
+    return false;
+  }
+  return true;
+}
+
+/* Read the labels of a capture (none if there is no labels file) */
+static int read_labels(const char *capture_path, label_t *labels) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s", capture_path);
+  char *dot = strrchr(path, '.');
+  char *slash = strrchr(path, '/');
+  if (dot && (!slash || dot > slash)) {
+    *dot = '\0';
+  }
+  strncat(path, ".labels", sizeof(path) - strlen(path) - 1);
+
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    return 0;
+  }
+  int count = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f) && count < MAX_LABELS) {
+    label_t *label = &labels[count];
+    char gesture[16] = "";
+    if (line[0] == '#' || sscanf(line, "%lf %lf %15s", &label->start_s,
+                                 &label->end_s, gesture) < 2) {
+      continue;
+    }
+    label->detected = false;
+    label->gesture = TOUCH_GESTURE_NONE;
+    label->seen = TOUCH_GESTURE_NONE;
+    for (touch_gesture_t g = TOUCH_GESTURE_NONE + 1; g < TOUCH_GESTURE_COUNT;
+       g++) {
+      if (strcmp(gesture, touch_gesture_name(g)) == 0) {
+        label->gesture = g;
+      }
+    }
+    count++;
+  }
+  fclose(f);
+  return count;
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+/* Find the label of a touch at t, or within the grace period after it if
+ * t isn't in a touch (the second touch of a double tap starts within the
+ * grace period of the first) */
+static label_t *find_label(label_t *labels, int num_labels, double t,
+                           double grace_s) {
+  label_t *after = NULL;
+  for (int i = 0; i < num_labels; i++) {
+    if (t >= labels[i].start_s && t <= labels[i].end_s) {
+      return &labels[i];
+    }
+    if (!after && t >= labels[i].start_s &&
+        t <= labels[i].end_s + grace_s) {
+      after = &labels[i];
+    }
+  }
+  return after;
+}
+
+/* Check the gestures of the labels against the latency bound, returns the
+ * number of failures */
+static int check_gestures(const label_t *labels, int num_labels,
+                          const touch_gesture_config_t *config,
+                          uint8_t confirm_frames, int32_t frame_ms) {
+  int failures = 0;
+  for (touch_gesture_t g = TOUCH_GESTURE_NONE + 1; g < TOUCH_GESTURE_COUNT;
+       g++) {
+    static double latencies[MAX_LABELS];
+    int count = 0, wrong = 0, late = 0;
+    int32_t bound_ms =
+        touch_gesture_latency_bound_ms(config, confirm_frames, frame_ms, g);
+    for (int i = 0; i < num_labels; i++) {
+      const label_t *label = &labels[i];
+      if (label->gesture != g) {
+        continue;
+      }
+      if (label->seen != g) {
+        wrong++;
+        continue;
+      }
+      latencies[count++] = label->gesture_latency_s;
+      if (label->gesture_latency_s * 1000 > bound_ms) {
+        late++;
+      }
+    }
+    if (count + wrong == 0) {
+      continue;
+    }
+    printf("  %s: %d, missed or misclassified %d, late %d",
+           touch_gesture_name(g), count + wrong, wrong, late);
+    if (count > 0) {
+      qsort(latencies, count, sizeof(double), compare_doubles);
+      printf(", latency p50 %.0f ms, max %.0f ms (bound %ld ms)",
+             latencies[count / 2] * 1000, latencies[count - 1] * 1000,
+             (long)bound_ms);
+    }
+    printf("\n");
+    failures += wrong + late;
+  }
+  return failures;
+}
+
+/* Replay a capture, returns the number of failures (misses and false
+ * positives), or -1 if it can't be read */
+static int replay(const char *path, const touch_detector_config_t *config,
+                  const touch_gesture_config_t *gesture_config,
+                  double grace_s, bool verbose) {
+  buffer_t capture = {NULL, 0};
+  if (!read_capture(path, &capture)) {
+    free(capture.data);
+    return -1;
+  }
+  static label_t labels[MAX_LABELS];
+  int num_labels = read_labels(path, labels);
+
+  const uint8_t *header = capture.data;
+  uint8_t touch_channel = header[6];
+  uint8_t comp_channel = header[7];
+  if (header[5] != TOUCH_FRAME_RESULT_BYTES) {
+    fprintf(stderr, "%s: %u bytes per reading not supported\n", path,
+            header[5]);
+    free(capture.data);
+    return -1;
+  }
+
+  // frames of readings of both channels, at the sample rate
+  uint32_t freq = get_u32(&header[8]);
+  uint32_t frame_len = get_u32(&header[12]);
+  int32_t frame_ms =
+      freq ? frame_len / TOUCH_FRAME_RESULT_BYTES * 1000 / freq : 0;
+
+  touch_detector_t detector;
+  touch_detector_init(&detector, config);
+  touch_gesture_recognizer_t gestures;
+  touch_gesture_init(&gestures, gesture_config);
+  static double latencies[MAX_LABELS];
+  int num_latencies = 0;
+  int false_positives = 0;
+  uint32_t invalid = 0;
+  int64_t first_us = 0, last_us = 0;
+  int64_t total_ns = 0, max_ns = 0;
+  uint32_t frames = 0;
+
+  size_t pos = CAPTURE_HEADER_LEN;
+  while (pos + CAPTURE_RECORD_HEADER_LEN <= capture.len) {
+    int64_t time_us = get_i64(&capture.data[pos]);
+    uint32_t len = get_u32(&capture.data[pos + 8]);
+    pos += CAPTURE_RECORD_HEADER_LEN;
+    if (len > MAX_FRAME_LEN || pos + len > capture.len) {
+      fprintf(stderr, "%s: truncated at frame %u\n", path, frames);
+      break;
+    }
+    const uint8_t *frame = &capture.data[pos];
+    pos += len;
+    if (frames++ == 0) {
+      first_us = time_us;
+    }
+    last_us = time_us;
+    double t = (time_us - first_us) / 1e6;
+
+    // same processing as process_frame in main/touch_input.c
+    int64_t start_ns = now_ns();
+    int32_t touch, comp;
+    touch_event_t event = TOUCH_EVENT_NONE;
+    if (touch_frame_average(frame, len, touch_channel, comp_channel, &touch,
+                            &comp, &invalid)) {
+      event = touch_detector_process(&detector, touch, comp, time_us);
+    }
+    int64_t elapsed_ns = now_ns() - start_ns;
+    total_ns += elapsed_ns;
+    if (elapsed_ns > max_ns) {
+      max_ns = elapsed_ns;
+    }
+
+    touch_gesture_t gesture = touch_gesture_process(&gestures, event, time_us);
+    if (gesture != TOUCH_GESTURE_NONE) {
+      // taps and long presses belong to the touch they started with, double
+      // taps to their second touch
+      double touch_t = gesture == TOUCH_GESTURE_DOUBLE_TAP
+                           ? t
+                           : (gestures.press_us - first_us) / 1e6;
+      label_t *label = find_label(labels, num_labels, touch_t, grace_s);
+      if (label && label->seen == TOUCH_GESTURE_NONE) {
+        label->seen = gesture;
+        label->gesture_latency_s = gesture == TOUCH_GESTURE_TAP
+                                       ? t - label->end_s
+                                       : t - label->start_s;
+      }
+      if (verbose) {
+        printf("  %9.3f s  %s\n", t, touch_gesture_name(gesture));
+      }
+    }
+
+    if (event == TOUCH_EVENT_NONE) {
+      continue;
+    }
+    if (verbose) {
+      printf("  %9.3f s  %s (deviation %d, baseline %d)\n", t,
+             event == TOUCH_EVENT_PRESS ? "press  " : "release",
+             detector.stats.deviation, detector.stats.baseline);
+    }
+    if (event != TOUCH_EVENT_PRESS) {
+      continue;
+    }
+    label_t *label = find_label(labels, num_labels, t, grace_s);
+    if (!label) {
+      false_positives++;
+      if (verbose) {
+        printf("  %9.3f s  false positive\n", t);
+      }
+    } else if (!label->detected) {
+      label->detected = true;
+      latencies[num_latencies++] = t - label->start_s;
+    }
+  }
+
+  int missed = num_labels - num_latencies;
+  double hours = (last_us - first_us) / 3600e6;
+  printf("%s: %u frames, %.1f min\n", path, frames,
+         (last_us - first_us) / 60e6);
+  printf("  touches %d, detected %d, missed %d, false positives %d "
+         "(%.2f per hour)\n",
+         num_labels, num_latencies, missed, false_positives,
+         hours > 0 ? false_positives / hours : 0.0);
+  if (num_latencies > 0) {
+    qsort(latencies, num_latencies, sizeof(double), compare_doubles);
+    printf("  latency from the labeled start: p50 %.0f ms, max %.0f ms\n",
+           latencies[num_latencies / 2] * 1000,
+           latencies[num_latencies - 1] * 1000);
+  }
+  if (detector.stats.latency.count > 0) {
+    printf("  latency from the first frame over the threshold: p50 %lld "
+           "ms, max %lld ms\n",
+           (long long)latency_hist_percentile(&detector.stats.latency, 50) /
+               1000,
+           (long long)detector.stats.latency.max / 1000);
+  }
+  printf("  rejected crossings %u, recalibrations %u, noise %d, invalid "
+         "readings %u\n",
+         detector.stats.rejected, detector.stats.recalibrations,
+         detector.stats.noise, invalid);
+  int gesture_failures = check_gestures(labels, num_labels, gesture_config,
+                                        config->confirm_frames, frame_ms);
+  printf("  processing: avg %.0f ns, max %lld ns per frame\n",
+         frames ? (double)total_ns / frames : 0.0, (long long)max_ns);
+  free(capture.data);
+  return missed + false_positives + gesture_failures;
+}
+
+/* A touch of a synthetic capture */
+typedef struct {
+  double start_s;
+  double end_s;
+  int32_t amplitude; // added to the touch channel (ADC counts)
+  const char *gesture; // of the label, or NULL
+} synth_touch_t;
+
+/* A synthetic capture of the corpus */
+typedef struct {
+  const char *name;
+  const char *comment; // first line of the labels
+  double seconds;
+  int32_t noise; // peak noise of each reading
+  // frames whose touch readings are all off by spike counts, e.g. ESD
+  const double *spikes_s;
+  int num_spikes;
+  int32_t spike;
+  const synth_touch_t *touches;
+  int num_touches;
+} synth_capture_t;
+
+#define SYNTH_TOUCH_CHANNEL 2
+#define SYNTH_COMP_CHANNEL 3
+#define SYNTH_FRAME_READINGS 8 // of both channels
+#define SYNTH_FRAME_US 100000
+#define SYNTH_TOUCH_LEVEL 1800
+#define SYNTH_COMP_LEVEL 1500
+#define SYNTH_DRIFT 120          // common mode, peak (ADC counts)
+#define SYNTH_DRIFT_PERIOD_S 40  // of the triangle wave
+#define SYNTH_START_US 4200000LL // esp_timer time of the first frame
+#define SYNTH_LEN(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+// Touches of 0.2 to 2.5 s, weak to strong, some close together
+static const synth_touch_t synth_touches[] = {
+    {2.0, 2.3, 700, NULL},   {5.0, 5.3, 520, NULL},
+    {8.13, 9.0, 900, NULL},  {11.0, 13.5, 650, NULL},
+    {15.55, 15.9, 560, NULL}, {18.0, 18.4, 800, NULL},
+    {20.0, 20.6, 600, NULL}, {24.27, 25.1, 750, NULL},
+    {28.0, 28.3, 540, NULL}, {31.0, 32.9, 880, NULL},
+    {36.42, 36.7, 620, NULL}, {40.0, 41.0, 700, NULL},
+};
+
+// Spikes the filters must reject
+static const double synth_spikes_s[] = {3.5, 7.05, 13.9, 22.25, 33.6, 44.1,
+                                        51.75};
+
+// Taps, double taps (the first touch has no gesture of its own) and long
+// presses, with the gaps of a hand
+static const synth_touch_t synth_gestures[] = {
+    {2.0, 2.25, 700, "tap"},
+    {5.0, 5.25, 650, NULL},
+    {5.5, 5.75, 650, "double_tap"},
+    {9.0, 10.6, 750, "long_press"},
+    {13.0, 13.3, 600, "tap"},
+    {16.0, 16.3, 800, NULL},
+    {16.6, 16.85, 800, "double_tap"},
+    {20.0, 22.5, 680, "long_press"},
+    {25.0, 25.2, 720, "tap"},
+    {28.03, 28.28, 560, NULL},
+    {28.58, 28.83, 560, "double_tap"},
+    {32.0, 33.2, 900, "long_press"},
+};
+
+static const synth_capture_t synth_corpus[] = {
+    {"touches", "# synthetic: touches of 0.2 to 2.5 s, weak to strong", 45,
+     40, NULL, 0, 0, synth_touches, SYNTH_LEN(synth_touches)},
+    {"noise", "# synthetic: no touches, noise, drift and spikes", 60, 60,
+     synth_spikes_s, SYNTH_LEN(synth_spikes_s), 500, NULL, 0},
+    {"gestures", "# synthetic: taps, double taps and long presses", 36, 40,
+     NULL, 0, 0, synth_gestures, SYNTH_LEN(synth_gestures)},
+};
+
+static uint32_t synth_random(uint32_t *state) {
+  *state = *state * 1103515245 + 12345;
+  return *state >> 16;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+/* Reading of the touch channel at t (seconds from the first frame) */
+static int32_t synth_touch_level(const synth_capture_t *capture, double t) {
+  int32_t level = SYNTH_TOUCH_LEVEL;
+  for (int i = 0; i < capture->num_touches; i++) {
+    if (t >= capture->touches[i].start_s && t < capture->touches[i].end_s) {
+      level += capture->touches[i].amplitude;
+    }
+  }
+  return level;
+}
+
+/* Write a synthetic capture and its labels to dir, returns false on
+ * error */
+static bool write_synth(const char *dir, const synth_capture_t *capture) {
+  char path[1024];
+  snprintf(path, sizeof(path), "%s/%s.tcap", dir, capture->name);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t header[CAPTURE_HEADER_LEN] = {'T', 'C', 'A', 'P', CAPTURE_VERSION,
+                                        TOUCH_FRAME_RESULT_BYTES,
+                                        SYNTH_TOUCH_CHANNEL,
+                                        SYNTH_COMP_CHANNEL};
+  uint32_t frame_len = SYNTH_FRAME_READINGS * TOUCH_FRAME_RESULT_BYTES;
+  put_u32(&header[8], SYNTH_FRAME_READINGS * 1000000 / SYNTH_FRAME_US);
+  put_u32(&header[12], frame_len);
+  fwrite(header, 1, sizeof(header), f);
+
+  uint32_t state = 1;
+  int frames = (int)(capture->seconds * 1000000 / SYNTH_FRAME_US);
+  for (int n = 0; n < frames; n++) {
+    uint8_t record[CAPTURE_RECORD_HEADER_LEN + SYNTH_FRAME_READINGS *
+                                                   TOUCH_FRAME_RESULT_BYTES];
+    int64_t time_us = SYNTH_START_US + (int64_t)n * SYNTH_FRAME_US;
+    put_u32(&record[0], (uint32_t)time_us);
+    put_u32(&record[4], (uint32_t)((uint64_t)time_us >> 32));
+    put_u32(&record[8], frame_len);
+    double frame_s = (double)n * SYNTH_FRAME_US / 1e6;
+    int32_t spike = 0;
+    for (int i = 0; i < capture->num_spikes; i++) {
+      if (capture->spikes_s[i] >= frame_s &&
+          capture->spikes_s[i] < frame_s + SYNTH_FRAME_US / 1e6) {
+        spike = capture->spike;
+      }
+    }
+    // the readings alternate between the channels through the frame
+    for (int i = 0; i < SYNTH_FRAME_READINGS; i++) {
+      double t = frame_s + (double)i * SYNTH_FRAME_US / 1e6 /
+                               SYNTH_FRAME_READINGS;
+      int32_t phase = (int32_t)(t * 1000) % (SYNTH_DRIFT_PERIOD_S * 1000);
+      int32_t drift = abs(phase - SYNTH_DRIFT_PERIOD_S * 500) *
+                          (4 * SYNTH_DRIFT) / (SYNTH_DRIFT_PERIOD_S * 1000) -
+                      SYNTH_DRIFT;
+      bool touch = i % 2 == 0;
+      int32_t level = touch ? synth_touch_level(capture, t) + spike
+                            : SYNTH_COMP_LEVEL;
+      int32_t noise = (int32_t)(synth_random(&state) %
+                                (2 * capture->noise + 1)) -
+                      capture->noise;
+      int32_t value = level + drift + noise;
+      value = value < 0 ? 0 : value > 0xfff ? 0xfff : value;
+      uint32_t channel = touch ? SYNTH_TOUCH_CHANNEL : SYNTH_COMP_CHANNEL;
+      put_u32(&record[CAPTURE_RECORD_HEADER_LEN +
+                      i * TOUCH_FRAME_RESULT_BYTES],
+              channel << 13 | (uint32_t)value);
+    }
+    fwrite(record, 1, sizeof(record), f);
+  }
+  bool ok = fclose(f) == 0;
+
+  snprintf(path, sizeof(path), "%s/%s.labels", dir, capture->name);
+  f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  fprintf(f, "%s\n", capture->comment);
+  for (int i = 0; i < capture->num_touches; i++) {
+    const synth_touch_t *touch = &capture->touches[i];
+    fprintf(f, "%.2f %.2f%s%s\n", touch->start_s, touch->end_s,
+            touch->gesture ? " " : "", touch->gesture ? touch->gesture : "");
+  }
+  ok &= fclose(f) == 0;
+  if (!ok) {
+    fprintf(stderr, "%s: write failed\n", capture->name);
+  }
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  touch_detector_config_t config = TOUCH_DETECTOR_CONFIG_DEFAULT();
+  touch_gesture_config_t gesture_config = TOUCH_GESTURE_CONFIG_DEFAULT();
+  double grace_ms = 500;
+  bool verbose = false;
+  const char *synth_dir = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:r:c:f:b:l:d:g:vw:")) != -1) {
+    switch (opt) {
+    case 't':
+      config.press_threshold = atoi(optarg);
+      break;
+    case 'r':
+      config.release_threshold = atoi(optarg);
+      break;
+    case 'c':
+      config.confirm_frames = atoi(optarg);
+      break;
+    case 'f':
+      config.filter_shift = atoi(optarg);
+      break;
+    case 'b':
+      config.baseline_shift = atoi(optarg);
+      break;
+    case 'l':
+      gesture_config.long_press_ms = atoi(optarg);
+      break;
+    case 'd':
+      gesture_config.double_tap_ms = atoi(optarg);
+      break;
+    case 'g':
+      grace_ms = atof(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'w':
+      synth_dir = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  }
+  if (synth_dir) {
+    for (int i = 0; i < SYNTH_LEN(synth_corpus); i++) {
+      if (!write_synth(synth_dir, &synth_corpus[i])) {
+        return 2;
+      }
+    }
+    return 0;
+  }
+  if (optind >= argc) {
+    fprintf(stderr,
+            "usage: %s [-t threshold] [-r threshold] [-c frames] "
+            "[-f shift] [-b shift] [-l ms] [-d ms] [-g ms] [-v] "
+            "capture...\n"
+            "       %s -w dir\n",
+            argv[0], argv[0]);
+    return 2;
+  }
+
+  int failures = 0;
+  bool error = false;
+  for (int i = optind; i < argc; i++) {
+    int ret =
+        replay(argv[i], &config, &gesture_config, grace_ms / 1000, verbose);
+    if (ret < 0) {
+      error = true;
+    } else {
+      failures += ret;
+    }
+  }
+  if (argc - optind > 1) {
+    printf("%d captures, %d failures\n", argc - optind, failures);
+  }
+  return error ? 2 : failures > 0 ? 1 : 0;
+}
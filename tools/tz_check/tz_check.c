@@ -0,0 +1,276 @@
+/*
+ * Host check of the timezone cache against localtime_r
+ *
+ * For every zone of a timezones.csv (name and POSIX TZ string per line),
+ * sets the zone and finds its transitions over a span of years with
+ * localtime_r alone: a scan every SCAN_STEP seconds, bisected to the
+ * second where the UTC offset or the DST flag changes. Then it checks
+ * the timezone cache (main/tz_cache.c) against localtime_r:
+ *   - every SCAN_STEP over the span, converted the way the display task
+ *     does (one cache, the time moving forward), including the next
+ *     transition the cache reports
+ *   - every second from 2 s before to 2 s after each transition
+ *   - that transitions are at least TZ_CACHE_PROBE_STEP apart, which the
+ *     cache's search for the next transition relies on
+ * Mismatches are printed with the zone and the time. The exit status is
+ * 1 if any check fails.
+ *
+ * The reference scan itself would miss two transitions less than
+ * SCAN_STEP apart, which POSIX TZ rules (a start and an end of DST a
+ * year) can't express.
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/tz_check/tz_check.c main/tz_cache.c -o tz_check
+ *
+ * Usage:
+ *   tz_check [-f year] [-l year] [-v] [timezones.csv]
+ *     -f  first year to check (default 2024)
+ *     -l  last year to check (default 2031)
+ *     -v  print the transitions of each zone
+ *   The zones are read from main/timezones.csv by default.
+ */
+#include "tz_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SCAN_STEP 3600
+#define MAX_TRANSITIONS 64 // per zone over the span
+// Seconds checked on each side of a transition
+#define TRANSITION_MARGIN 2
+#define MAX_REPORTED 10 // mismatches printed per zone
+
+typedef struct {
+  long offset; // tm_gmtoff
+  int is_dst;
+} zone_state_t;
+
+static bool s_verbose;
+static unsigned long s_checks;
+
+static zone_state_t state_at(time_t t) {
+  struct tm local;
+  localtime_r(&t, &local);
+  return (zone_state_t){local.tm_gmtoff, local.tm_isdst};
+}
+
+static bool same_state(zone_state_t a, zone_state_t b) {
+  return a.offset == b.offset && a.is_dst == b.is_dst;
+}
+
+/* Find the transitions in [from, to) with localtime_r, returns their
+ * number (or -1 if there are more than max) */
+static int find_transitions(time_t from, time_t to, time_t *transitions,
+                            int max) {
+  int count = 0;
+  zone_state_t last = state_at(from);
+  for (time_t t = from + SCAN_STEP; t < to; t += SCAN_STEP) {
+    zone_state_t state = state_at(t);
+    if (same_state(state, last)) {
+      continue;
+    }
+    time_t same = t - SCAN_STEP;
+    time_t other = t;
+    while (other - same > 1) {
+      time_t mid = same + (other - same) / 2;
+      if (same_state(state_at(mid), last)) {
+        same = mid;
+      } else {
+        other = mid;
+      }
+    }
+    if (count == max) {
+      return -1;
+    }
+    transitions[count++] = other;
+    last = state;
+  }
+  return count;
+}
+
+/* Start of a year in UTC */
+static time_t year_start(int year) {
+  struct tm tm = {.tm_year = year - 1900, .tm_mday = 1};
+  return timegm(&tm);
+}
+
+static bool same_tm(const struct tm *a, const struct tm *b) {
+  return a->tm_year == b->tm_year && a->tm_mon == b->tm_mon &&
+         a->tm_mday == b->tm_mday && a->tm_hour == b->tm_hour &&
+         a->tm_min == b->tm_min && a->tm_sec == b->tm_sec &&
+         a->tm_wday == b->tm_wday && a->tm_yday == b->tm_yday &&
+         a->tm_isdst == b->tm_isdst;
+}
+
+/* Compare the cache with localtime_r at t, returns true if they agree */
+static bool check_at(tz_cache_t *cache, time_t t) {
+  struct tm expected, actual;
+  localtime_r(&t, &expected);
+  tz_cache_localtime(cache, t, &actual);
+  s_checks++;
+  return same_tm(&expected, &actual);
+}
+
+static void print_at(const char *name, const char *what, time_t t) {
+  struct tm utc;
+  gmtime_r(&t, &utc);
+  printf("%s: %s at %04d-%02d-%02d %02d:%02d:%02d UTC (%lld)\n", name, what,
+         utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour,
+         utc.tm_min, utc.tm_sec, (long long)t);
+}
+
+/* Print a failed check, up to MAX_REPORTED per zone */
+static void print_mismatch(const char *name, const char *what, time_t t,
+                           int *reported) {
+  if ((*reported)++ < MAX_REPORTED) {
+    print_at(name, what, t);
+  }
+}
+
+/* Check a zone over [from, to), returns the number of failed checks */
+static int check_zone(const char *name, const char *tz, time_t from,
+                      time_t to, int *num_transitions, time_t *min_gap) {
+  setenv("TZ", tz, 1);
+  tzset();
+  tz_cache_invalidate();
+
+  time_t transitions[MAX_TRANSITIONS];
+  int count = find_transitions(from, to, transitions, MAX_TRANSITIONS);
+  if (count < 0) {
+    printf("%s: more than %d transitions\n", name, MAX_TRANSITIONS);
+    return 1;
+  }
+  *num_transitions = count;
+  int failures = 0;
+  int reported = 0;
+  for (int i = 0; i < count; i++) {
+    if (s_verbose) {
+      print_at(name, "transition", transitions[i]);
+    }
+    time_t gap = i > 0 ? transitions[i] - transitions[i - 1] : 0;
+    if (i > 0 && gap < *min_gap) {
+      *min_gap = gap;
+    }
+    if (i > 0 && gap < TZ_CACHE_PROBE_STEP) {
+      print_mismatch(name, "transitions less than a probe step apart",
+                     transitions[i], &reported);
+      failures++;
+    }
+  }
+
+  // forward over the span, as the display task converts the time
+  tz_cache_t cache = TZ_CACHE_INIT;
+  int next = 0; // first transition after t
+  for (time_t t = from; t < to; t += SCAN_STEP) {
+    if (!check_at(&cache, t)) {
+      print_mismatch(name, "local time differs", t, &reported);
+      failures++;
+    }
+    while (next < count && transitions[next] <= t) {
+      next++;
+    }
+    if (next < count) {
+      // only known if it's in the span
+      s_checks++;
+      if (tz_cache_next_transition(&cache, t) != transitions[next]) {
+        print_mismatch(name, "next transition differs", t, &reported);
+        failures++;
+      }
+    }
+  }
+
+  // around each transition, with a cache computed before it
+  for (int i = 0; i < count; i++) {
+    tz_cache_t around = TZ_CACHE_INIT;
+    for (time_t t = transitions[i] - TRANSITION_MARGIN;
+         t <= transitions[i] + TRANSITION_MARGIN; t++) {
+      if (!check_at(&around, t)) {
+        print_mismatch(name, "local time differs", t, &reported);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+/* Parse a "name","tz" line of timezones.csv, returns false if it isn't
+ * one */
+static bool parse_line(char *line, char **name, char **tz) {
+  char *fields[2];
+  char *p = line;
+  for (int i = 0; i < 2; i++) {
+    p = strchr(p, '"');
+    if (!p) {
+      return false;
+    }
+    fields[i] = ++p;
+    p = strchr(p, '"');
+    if (!p) {
+      return false;
+    }
+    *p++ = '\0';
+  }
+  *name = fields[0];
+  *tz = fields[1];
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  int first_year = 2024;
+  int last_year = 2031;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:l:v")) != -1) {
+    switch (opt) {
+    case 'f':
+      first_year = atoi(optarg);
+      break;
+    case 'l':
+      last_year = atoi(optarg);
+      break;
+    case 'v':
+      s_verbose = true;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-f year] [-l year] [-v] [timezones.csv]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (last_year < first_year) {
+    fprintf(stderr, "last year is before the first\n");
+    return 2;
+  }
+  const char *path = optind < argc ? argv[optind] : "main/timezones.csv";
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return 2;
+  }
+
+  time_t from = year_start(first_year);
+  time_t to = year_start(last_year + 1);
+  int zones = 0, failed_zones = 0, total_transitions = 0;
+  time_t min_gap = to - from;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    char *name, *tz;
+    if (!parse_line(line, &name, &tz)) {
+      continue;
+    }
+    int transitions = 0;
+    int failures = check_zone(name, tz, from, to, &transitions, &min_gap);
+    zones++;
+    total_transitions += transitions;
+    failed_zones += failures > 0;
+  }
+  fclose(file);
+
+  printf("zones:             %d (%d-%d)\n", zones, first_year, last_year);
+  printf("transitions:       %d\n", total_transitions);
+  printf("closest two:       %.1f days apart\n", min_gap / 86400.0);
+  printf("checks:            %lu\n", s_checks);
+  printf("zones failed:      %d\n", failed_zones);
+  return zones > 0 && failed_zones == 0 ? 0 : 1;
+}
@@ -0,0 +1,626 @@
+/*
+ * Host simulation of the connection to the access point
+ *
+ * Runs the connection logic (main/wifi_link.c) against a mocked Wi-Fi
+ * driver and DHCP server in virtual time, the way clock.c drives it on
+ * the device: the event handler below makes the wifi_link calls of the
+ * one of clock.c (which decide what to do), the mocked
+ * esp_wifi_set_config() and esp_wifi_connect() scan for the APs of the
+ * simulated network and post the connected, disconnected and got IP
+ * events, and the reconnect timer is a virtual one. The device state kept
+ * across boots (the cache in RTC memory and in NVS, and the address lwIP
+ * asks for again) is simulated too.
+ *
+ * A series of boots goes through the cases of the cache: first boot,
+ * restart, power cycle (RTC memory lost), AP moved to another channel,
+ * AP replaced, lease lost, credentials changed and RTC memory corrupted.
+ * For each boot it reports how the connection was made, the time to the
+ * association and to the address, whether the address was reused and
+ * whether NVS was written, and checks them against the expected ones.
+ *
+ * Then the cases of a connection that can't be made: a wrong password
+ * was entered (credentials that never connected, setup must open), the
+ * password was changed on the router (the credentials connected before,
+ * the clock must keep retrying without opening setup), the AP is off at
+ * boot and the AP rejects the password while it reboots (the clock must
+ * connect once it's back or accepts it, without opening setup).
+ *
+ * Then a fleet of connected clocks loses the AP for outages of several
+ * lengths (the router reboots or is unplugged), with the reconnection
+ * with backoff and with the old policy (CONFIG_ESP_MAXIMUM_STA_RETRY
+ * attempts at once, then give up). For each it reports how many clocks
+ * lost the connection and got it back, and the time to recover from the
+ * AP being back to the address (median, 95th percentile and maximum) and
+ * the attempts each clock made. With the backoff every clock must
+ * recover within WIFI_LINK_BACKOFF_MAX_US and a full scan of the AP
+ * being back, and none may open setup. The exit status is 1 if any check
+ * fails.
+ *
+ * The times come from a model of the driver and the network, not from
+ * a device: a scan dwells on each channel (13 for a full scan, the
+ * cached one for a fast connect), the association and 4-way handshake
+ * take a fixed time, a DHCP exchange takes a round trip, and a new lease
+ * is followed by lwIP's ARP check of the address (500 ms). Asking for
+ * the previous address (INIT-REBOOT) is a single exchange and has no
+ * ARP check. A connection is lost when the beacons of the AP have been
+ * missing for 6 s (the driver's beacon timeout).
+ *
+ * Build from the repository root:
+ *   gcc -O2 -Imain tools/wifi_sim/wifi_sim.c main/wifi_link.c -o wifi_sim
+ *
+ * Usage:
+ *   wifi_sim [-s ms] [-a ms] [-r ms] [-n clocks] [-S seed] [-v]
+ *     -s  scan time per channel (default 120, the active scan maximum)
+ *     -a  association and handshake time (default 200)
+ *     -r  DHCP round trip (default 30)
+ *     -n  number of clocks losing the AP (default 20)
+ *     -S  random seed of the backoff (default 1)
+ *     -v  print every event of the boots
+ */
+#include "wifi_link.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NUM_CHANNELS 13
+#define MAX_APS 4
+#define MAX_CLOCKS 256
+#define OLD_MAX_RETRY 5 // CONFIG_ESP_MAXIMUM_STA_RETRY
+#define ARP_CHECK_US 500000LL
+#define BEACON_TIMEOUT_US 6000000LL
+// Other disconnection reasons of the driver (wifi_err_reason_t)
+#define REASON_BEACON_TIMEOUT 200
+#define REASON_NO_AP_FOUND 201
+// When the AP goes down in the outage runs, and how long they go on after
+// it's back
+#define OUTAGE_AT_US 60000000LL
+#define OUTAGE_RUN_US 300000000LL
+
+/* An access point of the simulated network */
+typedef struct {
+  uint8_t bssid[WIFI_LINK_BSSID_LEN];
+  uint8_t channel;
+  const char *ssid;
+  const char *password;
+} sim_ap_t;
+
+/* The simulated network: the APs and the DHCP server */
+typedef struct {
+  sim_ap_t aps[MAX_APS];
+  int num_aps;
+  uint32_t lease_ip; // address the server gives the device
+  int64_t down_us;   // the APs are off from down_us to up_us (both 0 if
+  int64_t up_us;     // they never are)
+  int64_t reject_until_us; // the APs reject every password until then
+} sim_network_t;
+
+/* State of the device kept across boots */
+typedef struct {
+  wifi_link_cache_t rtc; // lost on a power cycle
+  wifi_link_cache_t nvs;
+  bool nvs_written; // this boot
+  uint32_t lwip_ip; // address lwIP asks for again, in NVS
+  const char *ssid; // config
+  const char *password;
+} sim_device_t;
+
+/* Mocked driver config (the wifi_sta_config_t fields clock.c sets) */
+typedef struct {
+  bool all_channels; // WIFI_ALL_CHANNEL_SCAN, else WIFI_FAST_SCAN
+  uint8_t channel;   // 0 for all
+  bool bssid_set;
+  uint8_t bssid[WIFI_LINK_BSSID_LEN];
+} sim_sta_config_t;
+
+typedef enum {
+  EVENT_NONE,
+  EVENT_STA_CONNECTED,
+  EVENT_STA_DISCONNECTED,
+  EVENT_GOT_IP,
+  EVENT_RECONNECT_TIMER,
+} sim_event_id_t;
+
+/* Events of the attempt in progress (one at most of each) */
+typedef struct {
+  int64_t connected_us; // 0 if not posted
+  int64_t disconnected_us;
+  int64_t got_ip_us;
+  uint8_t reason; // of the disconnection (of the driver)
+  const sim_ap_t *ap;
+  uint32_t ip;
+} sim_events_t;
+
+static int64_t s_scan_us = 120000;
+static int64_t s_assoc_us = 200000;
+static int64_t s_rtt_us = 30000;
+static bool s_verbose;
+static uint64_t s_rng = 1;
+
+static int64_t s_now_us;
+static sim_network_t *s_network;
+static sim_device_t *s_device;
+static sim_sta_config_t s_sta_config;
+static sim_events_t s_events;
+static int64_t s_timer_us; // reconnect timer, 0 if stopped
+static int s_attempts;     // esp_wifi_connect() calls
+static bool s_old_policy;
+static int s_retry_num; // of the old policy
+static bool s_gave_up;
+
+// the clock.c state
+static wifi_link_t s_wifi_link;
+static bool s_connected;
+static bool s_setup; // setup mode
+
+/* xorshift64, the esp_random() of the simulation */
+static uint32_t esp_random(void) {
+  s_rng ^= s_rng << 13;
+  s_rng ^= s_rng >> 7;
+  s_rng ^= s_rng << 17;
+  return (uint32_t)(s_rng >> 32);
+}
+
+static bool ap_on(int64_t t) {
+  return t < s_network->down_us || t >= s_network->up_us;
+}
+
+/* Mocked esp_wifi_set_config() */
+static void esp_wifi_set_config(const sim_sta_config_t *config) {
+  s_sta_config = *config;
+}
+
+/* Mocked DHCP client and server: get the address at now_us, returns the
+ * time it's bound */
+static int64_t dhcp_bind(int64_t now_us) {
+  uint32_t ip = s_network->lease_ip;
+  if (s_device->lwip_ip != 0) {
+    // INIT-REBOOT: request the previous address
+    if (s_device->lwip_ip == ip) {
+      return now_us + s_rtt_us;
+    }
+    now_us += s_rtt_us; // NAK
+  }
+  // discover, offer, request, ack, then the ARP check of the address
+  return now_us + 2 * s_rtt_us + ARP_CHECK_US;
+}
+
+/* Mocked esp_wifi_connect(): scan, associate and get an address, posting
+ * the events of the outcome (and of the loss of the connection if the
+ * APs go off after it) */
+static void esp_wifi_connect(void) {
+  memset(&s_events, 0, sizeof(s_events));
+  s_attempts++;
+  const sim_sta_config_t *config = &s_sta_config;
+  int64_t t = s_now_us;
+  const sim_ap_t *found = NULL;
+  for (int channel = 1; channel <= NUM_CHANNELS && !found; channel++) {
+    if (config->channel != 0 && channel != config->channel) {
+      continue;
+    }
+    t += s_scan_us;
+    for (int i = 0; i < s_network->num_aps && ap_on(t); i++) {
+      const sim_ap_t *ap = &s_network->aps[i];
+      if (ap->channel == channel && strcmp(ap->ssid, s_device->ssid) == 0 &&
+          (!config->bssid_set ||
+           memcmp(ap->bssid, config->bssid, WIFI_LINK_BSSID_LEN) == 0)) {
+        found = ap;
+        break;
+      }
+    }
+    if (found && config->all_channels) {
+      // a full scan finishes the channels to pick the best AP
+      t += (NUM_CHANNELS - channel) * s_scan_us;
+    }
+  }
+  if (!found) {
+    s_events.disconnected_us = t;
+    s_events.reason = REASON_NO_AP_FOUND;
+    return;
+  }
+  t += s_assoc_us;
+  if (strcmp(found->password, s_device->password) != 0 ||
+      t < s_network->reject_until_us) {
+    s_events.disconnected_us = t;
+    s_events.reason = WIFI_LINK_REASON_4WAY_HANDSHAKE_TIMEOUT;
+    return;
+  }
+  s_events.connected_us = t;
+  s_events.ap = found;
+  s_events.got_ip_us = dhcp_bind(t);
+  s_events.ip = s_network->lease_ip;
+  int64_t lost_us = s_network->down_us + BEACON_TIMEOUT_US;
+  if (s_network->down_us > s_events.got_ip_us && lost_us < s_network->up_us) {
+    s_events.disconnected_us = lost_us;
+    s_events.reason = REASON_BEACON_TIMEOUT;
+  }
+}
+
+/* wifi_sta_set_config() of clock.c */
+static void wifi_sta_set_config(const wifi_link_attempt_t *attempt) {
+  sim_sta_config_t config = {.all_channels = true};
+  if (attempt->fast) {
+    config.all_channels = false;
+    config.channel = attempt->channel;
+    config.bssid_set = true;
+    memcpy(config.bssid, attempt->bssid, WIFI_LINK_BSSID_LEN);
+  }
+  esp_wifi_set_config(&config);
+}
+
+static bool cache_load(wifi_link_cache_t *cache) {
+  if (wifi_link_cache_valid(&s_device->rtc)) {
+    *cache = s_device->rtc;
+    return true;
+  }
+  *cache = s_device->nvs;
+  if (!wifi_link_cache_valid(cache)) {
+    return false;
+  }
+  s_device->rtc = *cache;
+  return true;
+}
+
+static void cache_save(const wifi_link_cache_t *cache) {
+  s_device->rtc = *cache;
+  s_device->nvs = *cache;
+  s_device->nvs_written = true;
+}
+
+/* The disconnection handling before the backoff: retry at once up to
+ * OLD_MAX_RETRY times, then give up (and open setup at boot) */
+static void old_policy_disconnected(void) {
+  if (s_retry_num < OLD_MAX_RETRY) {
+    esp_wifi_connect();
+    s_retry_num++;
+  } else {
+    s_gave_up = true;
+  }
+}
+
+/* reconnect_timer_cb() of clock.c */
+static void reconnect_timer_cb(void) {
+  wifi_link_attempt_t attempt;
+  if (wifi_link_retry(&s_wifi_link, s_setup, &attempt)) {
+    wifi_sta_set_config(&attempt);
+    esp_wifi_connect();
+  }
+}
+
+/* wifi_event_handler() of clock.c */
+static void wifi_event_handler(sim_event_id_t event_id) {
+  if (event_id == EVENT_STA_CONNECTED) {
+    wifi_link_associated(&s_wifi_link, s_events.ap->bssid,
+                         s_events.ap->channel, s_now_us);
+  } else if (event_id == EVENT_STA_DISCONNECTED) {
+    s_connected = false;
+    if (s_old_policy) {
+      old_policy_disconnected();
+      return;
+    }
+    wifi_link_attempt_t attempt;
+    int64_t delay_us;
+    wifi_link_action_t action =
+        wifi_link_disconnected(&s_wifi_link, s_events.reason, s_setup,
+                               s_now_us, esp_random(), &attempt, &delay_us);
+    if (action == WIFI_LINK_CONNECT) {
+      wifi_sta_set_config(&attempt);
+      esp_wifi_connect();
+    } else if (action == WIFI_LINK_WAIT) {
+      s_timer_us = s_now_us + delay_us;
+    } else if (action == WIFI_LINK_REJECTED) {
+      s_setup = true; // app_main opens it
+    }
+  } else if (event_id == EVENT_GOT_IP) {
+    s_retry_num = 0;
+    s_device->lwip_ip = s_events.ip;
+    if (wifi_link_got_ip(&s_wifi_link, s_events.ip, 0x00ffffff,
+                         0x0100a8c0, s_now_us)) {
+      cache_save(&s_wifi_link.cache);
+    }
+    s_connected = true;
+  } else if (event_id == EVENT_RECONNECT_TIMER) {
+    reconnect_timer_cb();
+  }
+}
+
+/* Post the next event if it's due by until_us, returns false if there is
+ * none */
+static bool dispatch_event(int64_t until_us) {
+  static const char *const names[] = {"", "connected", "disconnected",
+                                      "got ip", "retry"};
+  struct {
+    sim_event_id_t id;
+    int64_t *at;
+  } pending[] = {
+      {EVENT_STA_CONNECTED, &s_events.connected_us},
+      {EVENT_STA_DISCONNECTED, &s_events.disconnected_us},
+      {EVENT_GOT_IP, &s_events.got_ip_us},
+      {EVENT_RECONNECT_TIMER, &s_timer_us},
+  };
+  sim_event_id_t event_id = EVENT_NONE;
+  int64_t *at = NULL;
+  for (size_t i = 0; i < sizeof(pending) / sizeof(pending[0]); i++) {
+    if (*pending[i].at && (!at || *pending[i].at < *at)) {
+      event_id = pending[i].id;
+      at = pending[i].at;
+    }
+  }
+  if (!at || *at > until_us) {
+    return false;
+  }
+  s_now_us = *at;
+  *at = 0;
+  if (s_verbose) {
+    printf("    %7.1f ms  %s (%s)\n", s_now_us / 1000.0, names[event_id],
+           s_sta_config.all_channels ? "full scan" : "fast connect");
+  }
+  wifi_event_handler(event_id);
+  return true;
+}
+
+/* Start the device (wifi_init_sta() and esp_wifi_start() of clock.c) */
+static void start(void) {
+  s_now_us = 0;
+  s_timer_us = 0;
+  s_attempts = 0;
+  s_retry_num = 0;
+  s_connected = false;
+  s_setup = false;
+  s_gave_up = false;
+  s_device->nvs_written = false;
+
+  wifi_link_cache_t cache;
+  bool cached = !s_old_policy && cache_load(&cache);
+  wifi_link_attempt_t attempt;
+  wifi_link_init(&s_wifi_link,
+                 wifi_link_key(s_device->ssid, s_device->password),
+                 cached ? &cache : NULL);
+  wifi_link_start(&s_wifi_link, s_now_us, &attempt);
+  wifi_sta_set_config(&attempt);
+  esp_wifi_connect(); // on WIFI_EVENT_STA_START
+}
+
+/* Run until connected or setup opens */
+static void run_to_connected(void) {
+  while (!s_connected && !s_setup && !s_gave_up &&
+         dispatch_event(INT64_MAX)) {
+  }
+}
+
+typedef struct {
+  const char *name;
+  bool fast;      // expected fast connect
+  bool fell_back; // expected fall back to a full scan
+  bool ip_reused; // expected same address
+  bool nvs_write; // expected NVS write
+} sim_case_t;
+
+/* Boot the device and connect, returns true if it went as expected */
+static bool boot(const sim_case_t *c) {
+  start();
+  uint32_t fast_failures = s_wifi_link.stats.fast_failures;
+  run_to_connected();
+
+  const wifi_link_stats_t *stats = &s_wifi_link.stats;
+  bool fell_back = stats->fast_failures != fast_failures;
+  bool ok = s_connected && stats->last_fast == c->fast &&
+            fell_back == c->fell_back &&
+            stats->last_ip_reused == c->ip_reused &&
+            s_device->nvs_written == c->nvs_write;
+  printf("%-22s %-5s %-9s %7.0f %7.0f %7.0f  %-6s %-5s %s\n", c->name,
+         stats->last_fast ? "fast" : "scan", fell_back ? "fell back" : "",
+         stats->last_assoc_us / 1000.0, stats->last_dhcp_us / 1000.0,
+         stats->last_connect_us / 1000.0,
+         stats->last_ip_reused ? "same" : "new",
+         s_device->nvs_written ? "yes" : "no", ok ? "ok" : "FAIL");
+  return ok;
+}
+
+/* Boot with a wrong password entered in setup, returns true if setup
+ * opens again after WIFI_LINK_REJECT_FAILURES attempts */
+static bool boot_wrong_password(void) {
+  const char *password = s_device->password;
+  s_device->password = "typo";
+  start();
+  run_to_connected();
+  bool ok = s_setup && s_attempts == WIFI_LINK_REJECT_FAILURES;
+  printf("%-22s setup opens at %.1f s after %d attempts  %s\n",
+         "wrong password", s_now_us / 1e6, s_attempts, ok ? "ok" : "FAIL");
+  s_device->password = password;
+  return ok;
+}
+
+/* Boot with the password changed on the router, returns true if the
+ * clock keeps retrying for run_us without opening setup (it takes a long
+ * press) */
+static bool boot_password_changed(int64_t run_us) {
+  start();
+  while (!s_connected && !s_setup && dispatch_event(run_us)) {
+  }
+  bool ok = !s_connected && !s_setup &&
+            s_attempts > WIFI_LINK_REJECT_FAILURES;
+  printf("%-22s no setup in %.0f s, %d attempts  %s\n",
+         "password changed", run_us / 1e6, s_attempts, ok ? "ok" : "FAIL");
+  return ok;
+}
+
+/* Boot with the AP rejecting the password for reject_us (while it
+ * reboots), returns true if the clock connects once it accepts it
+ * (within the longest backoff and a full scan), without opening setup */
+static bool boot_ap_rejecting(int64_t reject_us) {
+  s_network->reject_until_us = reject_us;
+  start();
+  run_to_connected();
+  int64_t late_us = s_now_us - reject_us;
+  bool ok = s_connected && !s_setup &&
+            late_us <= WIFI_LINK_BACKOFF_MAX_US + 2 * NUM_CHANNELS * s_scan_us;
+  printf("%-22s connected %.1f s after it accepts, %d attempts  %s\n",
+         "AP rejecting", late_us / 1e6, s_attempts, ok ? "ok" : "FAIL");
+  s_network->reject_until_us = 0;
+  return ok;
+}
+
+/* Boot with the AP off for off_us, returns true if the clock connects
+ * once it's back (within the longest backoff and a full scan), without
+ * opening setup */
+static bool boot_ap_off(int64_t off_us) {
+  s_network->down_us = 0;
+  s_network->up_us = off_us;
+  start();
+  run_to_connected();
+  int64_t late_us = s_now_us - off_us;
+  bool ok = s_connected &&
+            late_us <= WIFI_LINK_BACKOFF_MAX_US + 2 * NUM_CHANNELS * s_scan_us;
+  printf("%-22s connected %.1f s after it's back, %d attempts  %s\n",
+         "AP off at boot", late_us / 1e6, s_attempts, ok ? "ok" : "FAIL");
+  s_network->down_us = s_network->up_us = 0;
+  return ok;
+}
+
+static int compare_us(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* A fleet of clocks loses the AP for outage_us, returns true if every
+ * clock that lost it got it back in time without opening setup (always
+ * with the old policy, which isn't checked) */
+static bool outage(int clocks, int64_t outage_us, bool old_policy) {
+  static int64_t recover_us[MAX_CLOCKS];
+  int lost = 0, back = 0, setup = 0, attempts = 0;
+  s_network->down_us = OUTAGE_AT_US;
+  s_network->up_us = OUTAGE_AT_US + outage_us;
+  s_old_policy = old_policy;
+  for (int i = 0; i < clocks; i++) {
+    sim_device_t device = *s_device; // each from the same first boot
+    sim_device_t *saved = s_device;
+    s_device = &device;
+    start();
+    run_to_connected();
+    int start_attempts = s_attempts;
+    while (dispatch_event(s_network->up_us + OUTAGE_RUN_US) && !s_setup) {
+    }
+    s_device = saved;
+    attempts += s_attempts - start_attempts;
+    if (s_setup) {
+      setup++;
+    }
+    if (s_attempts == start_attempts) {
+      continue; // the AP was back before the beacon timeout
+    }
+    lost++;
+    if (s_connected) {
+      recover_us[back++] = s_now_us - s_network->up_us;
+    }
+  }
+  s_old_policy = false;
+  s_network->down_us = s_network->up_us = 0;
+
+  qsort(recover_us, back, sizeof(recover_us[0]), compare_us);
+  bool ok = old_policy ||
+            (setup == 0 && back == lost &&
+             (back == 0 || recover_us[back - 1] <=
+                               WIFI_LINK_BACKOFF_MAX_US +
+                                   2 * NUM_CHANNELS * s_scan_us));
+  printf("%6.0f s  %-8s %5d %5d %6d", outage_us / 1e6,
+         old_policy ? "old" : "backoff", lost, back, setup);
+  if (back > 0) {
+    printf("  %7.1f %7.1f %7.1f", recover_us[back / 2] / 1e6,
+           recover_us[(back * 95 - 1) / 100] / 1e6,
+           recover_us[back - 1] / 1e6);
+  } else {
+    printf("  %7s %7s %7s", "-", "-", "-");
+  }
+  printf("  %8.1f  %s\n", (double)attempts / clocks,
+         old_policy ? "" : ok ? "ok" : "FAIL");
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  int clocks = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:a:r:n:S:v")) != -1) {
+    switch (opt) {
+    case 's':
+      s_scan_us = atoll(optarg) * 1000;
+      break;
+    case 'a':
+      s_assoc_us = atoll(optarg) * 1000;
+      break;
+    case 'r':
+      s_rtt_us = atoll(optarg) * 1000;
+      break;
+    case 'n':
+      clocks = atoi(optarg);
+      break;
+    case 'S':
+      s_rng = strtoull(optarg, NULL, 10) * 2654435761ULL + 1;
+      break;
+    case 'v':
+      s_verbose = true;
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [-s ms] [-a ms] [-r ms] [-n clocks] [-S seed] "
+              "[-v]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+  if (clocks < 1 || clocks > MAX_CLOCKS) {
+    fprintf(stderr, "clocks must be 1 to %d\n", MAX_CLOCKS);
+    return 2;
+  }
+
+  sim_network_t network = {
+      .aps = {{{0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01}, 6, "home", "secret1"},
+              {{0x24, 0x0a, 0xc4, 0x00, 0x00, 0x02}, 11, "neighbor",
+               "other"}},
+      .num_aps = 2,
+      .lease_ip = 0x2a00a8c0, // 192.168.0.42
+  };
+  sim_device_t device = {.ssid = "home", .password = "secret1"};
+  s_network = &network;
+  s_device = &device;
+
+  printf("%-22s %-5s %-9s %7s %7s %7s  %-6s %-5s\n", "boot", "mode", "",
+         "assoc", "dhcp", "total", "addr", "nvs");
+  bool ok = true;
+  // (name, fast, fell back, same address, NVS written)
+  ok &= boot(&(sim_case_t){"first boot", false, false, false, true});
+  ok &= boot(&(sim_case_t){"restart", true, false, true, false});
+  memset(&device.rtc, 0, sizeof(device.rtc));
+  ok &= boot(&(sim_case_t){"power cycle", true, false, true, false});
+  network.aps[0].channel = 1;
+  ok &= boot(&(sim_case_t){"AP moved to channel 1", false, true, true,
+                           true});
+  ok &= boot(&(sim_case_t){"restart", true, false, true, false});
+  network.aps[0].bssid[5] = 0x03;
+  ok &= boot(&(sim_case_t){"AP replaced", false, true, true, true});
+  network.lease_ip = 0x3000a8c0; // 192.168.0.48
+  ok &= boot(&(sim_case_t){"lease lost", true, false, false, true});
+  network.aps[0].password = device.password = "secret2";
+  ok &= boot(&(sim_case_t){"new password", false, false, false, true});
+  device.rtc.bssid[0] ^= 0x80;
+  ok &= boot(&(sim_case_t){"RTC memory corrupted", true, false, true,
+                           false});
+
+  s_verbose = false;
+  printf("\n");
+  ok &= boot_wrong_password();
+  network.aps[0].password = "secret3";
+  ok &= boot_password_changed(300000000LL);
+  network.aps[0].password = "secret2";
+  ok &= boot_ap_off(120000000LL);
+  ok &= boot_ap_rejecting(40000000LL);
+
+  printf("\n%-7s  %-8s %5s %5s %6s  %-23s  %8s\n", "outage", "policy",
+         "lost", "back", "setup", "recovery s (p50 p95 max)", "attempts");
+  static const int64_t outages_s[] = {5, 20, 60, 180, 600};
+  for (size_t i = 0; i < sizeof(outages_s) / sizeof(outages_s[0]); i++) {
+    ok &= outage(clocks, outages_s[i] * 1000000LL, false);
+    outage(clocks, outages_s[i] * 1000000LL, true);
+  }
+  return ok ? 0 : 1;
+}